@@ -19,9 +19,14 @@
 package com.viper.simplert;
 
 public class Native {
-    static native void start(int tun_fd, int acc_fd);
+    // Blocks until an address is leased by DHCP on bridged links; returns
+    // "ADDRESS PREFIX GATEWAY DNS", or null
+    static native String configure(int acc_fd, String options);
+    static native void start(int tun_fd, int acc_fd, String options);
     static native void stop();
     static native boolean is_running();
+    // { packets, bytes, errors, max burst, filtered } up (to the host), then down
+    static native long[] get_stats();
 
     static {
         System.loadLibrary("simplertjni");
@@ -26,6 +26,8 @@ import android.content.IntentFilter;
 import android.hardware.usb.UsbAccessory;
 import android.hardware.usb.UsbManager;
 import android.net.VpnService;
+import android.os.Handler;
+import android.os.Looper;
 import android.os.ParcelFileDescriptor;
 import android.util.Log;
 import android.widget.Toast;
@@ -76,13 +78,7 @@ public class TetherService extends VpnService {
         filter.addAction(UsbManager.ACTION_USB_ACCESSORY_DETACHED);
         registerReceiver(mUsbReceiver, filter);
 
-        Builder builder = new Builder();
-        builder.setMtu(1500);
-        builder.setSession(getString(R.string.app_name));
-        // Use the serial field to receive the IP address to use :)
-        builder.addAddress(accessory.getSerial(), 30);
-        builder.addRoute("0.0.0.0", 0);
-        builder.addDnsServer("8.8.8.8");
+        final String linkOptions = getLinkOptions(accessory);
 
         final ParcelFileDescriptor accessoryFd = ((UsbManager) getSystemService(Context.USB_SERVICE)).openAccessory(accessory);
         if (accessoryFd == null) {
@@ -91,17 +87,86 @@ public class TetherService extends VpnService {
             return START_NOT_STICKY;
         }
 
+        // Bridged into the host LAN: the address comes from its DHCP server,
+        // which may take a while, so ask for it out of the main thread
+        if (getLinkOption(linkOptions, "l2") != null) {
+            final Handler handler = new Handler(Looper.getMainLooper());
+            new Thread(new Runnable() {
+                public void run() {
+                    final String lease = Native.configure(accessoryFd.getFd(), linkOptions);
+                    handler.post(new Runnable() {
+                        public void run() {
+                            if (lease == null) {
+                                showErrorDialog(getString(R.string.accessory_error));
+                                stopSelf();
+                                return;
+                            }
+                            // ADDRESS PREFIX GATEWAY DNS
+                            String[] fields = lease.split(" ");
+                            connect(accessoryFd, linkOptions, fields[0], Integer.parseInt(fields[1]), fields[3]);
+                        }
+                    });
+                }
+            }).start();
+            return START_NOT_STICKY;
+        }
+
+        // Use the serial field to receive the IP address to use :)
+        // Prefer the DNS forwarder in the host, if it runs one
+        String dnsServer = getLinkOption(linkOptions, "dns");
+        connect(accessoryFd, linkOptions, accessory.getSerial(), 30, dnsServer != null ? dnsServer : "8.8.8.8");
+
+        return START_NOT_STICKY;
+    }
+
+    private void connect(ParcelFileDescriptor accessoryFd, String linkOptions,
+                         String address, int prefix, String dnsServer) {
+        Builder builder = new Builder();
+        builder.setMtu(1500);
+        builder.setSession(getString(R.string.app_name));
+        builder.addAddress(address, prefix);
+        builder.addRoute("0.0.0.0", 0);
+        builder.addDnsServer(dnsServer);
+
         final ParcelFileDescriptor tunFd = builder.establish();
         if (tunFd == null) {
             showErrorDialog(getString(R.string.tun_error));
             stopSelf();
-            return START_NOT_STICKY;
+            return;
         }
 
-        Toast.makeText(this, "SimpleRT Connected! (" + accessory.getSerial() + ")", Toast.LENGTH_SHORT).show();
-        Native.start(tunFd.detachFd(), accessoryFd.detachFd());
+        Toast.makeText(this, "SimpleRT Connected! (" + address + ")", Toast.LENGTH_SHORT).show();
+        Native.start(tunFd.detachFd(), accessoryFd.detachFd(), linkOptions);
+    }
+
+    // Link options are given by the host at the end of the description, as
+    // " [key=value ...]"
+    private static String getLinkOptions(UsbAccessory accessory) {
+        String description = accessory.getDescription();
+        if (description == null) {
+            return null;
+        }
 
-        return START_NOT_STICKY;
+        int start = description.lastIndexOf('[');
+        int end = description.lastIndexOf(']');
+        if (start < 0 || end < start) {
+            return null;
+        }
+
+        return description.substring(start + 1, end);
+    }
+
+    private static String getLinkOption(String options, String key) {
+        if (options == null) {
+            return null;
+        }
+
+        for (String option : options.split(" ")) {
+            if (option.startsWith(key + "=")) {
+                return option.substring(key.length() + 1);
+            }
+        }
+        return null;
     }
 
     private void showErrorDialog(String err) {
@@ -0,0 +1,180 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "ackfilter.h"
+#include "link.h"
+
+/* Flows tracked per batch; ACKs of any other flow are just kept */
+#define MAX_TRACKED_FLOWS 32
+
+/* Frames marked for removal */
+#define FRAME_DROPPED 0x00
+
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+#define TCP_OPT_EOL       0
+#define TCP_OPT_NOP       1
+#define TCP_OPT_TIMESTAMP 8
+
+struct pure_ack {
+    uint8_t addrs[32]; /* source and destination */
+    size_t addrs_len;
+    uint32_t ports;
+    uint32_t ack;
+    size_t frame_offset;
+};
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool parse_pure_ack(const uint8_t *pkt, size_t len, struct pure_ack *ack)
+{
+    const uint8_t *tcp;
+    size_t total_len, tcp_len, header_len, i;
+
+    if (len < 1)
+        return false;
+
+    switch (pkt[0] >> 4) {
+    case 4:
+        if (len < 20)
+            return false;
+        total_len = (pkt[2] << 8) | pkt[3];
+        /* No IP options, no fragments, no congestion mark */
+        if ((pkt[0] & 0x0F) != 5 || total_len > len || pkt[9] != IPPROTO_TCP ||
+            (pkt[6] & 0x3F) || pkt[7] || (pkt[1] & 0x03) == 0x03)
+            return false;
+        memcpy(ack->addrs, &pkt[12], 8);
+        ack->addrs_len = 8;
+        tcp = &pkt[20];
+        tcp_len = total_len - 20;
+        break;
+    case 6:
+        if (len < 40)
+            return false;
+        total_len = 40 + ((pkt[4] << 8) | pkt[5]);
+        /* No extension headers, no congestion mark */
+        if (total_len > len || pkt[6] != IPPROTO_TCP || ((pkt[1] >> 4) & 0x03) == 0x03)
+            return false;
+        memcpy(ack->addrs, &pkt[8], 32);
+        ack->addrs_len = 32;
+        tcp = &pkt[40];
+        tcp_len = total_len - 40;
+        break;
+    default:
+        return false;
+    }
+
+    /* No payload */
+    if (tcp_len < 20)
+        return false;
+    header_len = (tcp[12] >> 4) * 4;
+    if (header_len != tcp_len)
+        return false;
+
+    /* ACK and maybe PSH, nothing else (SYN, FIN, RST, URG, ECE, CWR) */
+    if ((tcp[13] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+        return false;
+
+    /* Timestamps are fine to lose, SACK blocks or anything else aren't */
+    for (i = 20; i < header_len;) {
+        if (tcp[i] == TCP_OPT_EOL)
+            break;
+        if (tcp[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (tcp[i] != TCP_OPT_TIMESTAMP || i + 10 > header_len || tcp[i + 1] != 10)
+            return false;
+        i += 10;
+    }
+
+    ack->ports = get32(tcp);
+    ack->ack = get32(&tcp[8]);
+    return true;
+}
+
+static bool same_flow(const struct pure_ack *a, const struct pure_ack *b)
+{
+    return a->ports == b->ports &&
+           a->addrs_len == b->addrs_len &&
+           memcmp(a->addrs, b->addrs, a->addrs_len) == 0;
+}
+
+size_t ack_filter_run(uint8_t *batch, size_t len, unsigned int *n_dropped)
+{
+    struct pure_ack flows[MAX_TRACKED_FLOWS];
+    unsigned int n_flows = 0;
+    const uint8_t *p = batch;
+    size_t remaining = len;
+    struct link_frame frame;
+    size_t out_len = 0;
+
+    *n_dropped = 0;
+
+    while (link_frame_next(&p, &remaining, &frame)) {
+        struct pure_ack ack;
+        unsigned int i;
+
+        if (frame.type != LINK_FRAME_PACKET || !parse_pure_ack(frame.payload, frame.payload_len, &ack))
+            continue;
+        ack.frame_offset = (frame.payload - LINK_FRAME_HEADER_SIZE) - batch;
+
+        for (i = 0; i < n_flows && !same_flow(&flows[i], &ack); i++)
+            ;
+        if (i == n_flows) {
+            if (n_flows < MAX_TRACKED_FLOWS)
+                flows[n_flows++] = ack;
+            continue;
+        }
+
+        /* Only when strictly newer: duplicate ACKs signal loss to the
+         * sender, and must all go through */
+        if ((int32_t) (ack.ack - flows[i].ack) > 0) {
+            batch[flows[i].frame_offset] = FRAME_DROPPED;
+            (*n_dropped)++;
+        }
+        flows[i] = ack;
+    }
+
+    if (*n_dropped == 0)
+        return len;
+
+    /* Compact the batch, keeping the order of the remaining frames */
+    p = batch;
+    remaining = len;
+    while (link_frame_next(&p, &remaining, &frame)) {
+        const uint8_t *start = frame.payload - LINK_FRAME_HEADER_SIZE;
+        size_t frame_len = LINK_FRAME_HEADER_SIZE + frame.payload_len;
+
+        if (start[0] == FRAME_DROPPED)
+            continue;
+        if (&batch[out_len] != start)
+            memmove(&batch[out_len], start, frame_len);
+        out_len += frame_len;
+    }
+
+    return out_len;
+}
@@ -0,0 +1,35 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACKFILTER_H
+#define ACKFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Drops pure TCP ACKs made redundant by a newer ACK of the same flow queued
+ * later in the same batch of PACKET frames. Only plain cumulative ACKs are
+ * dropped: anything with payload, flags other than ACK/PSH, ECN marks or TCP
+ * options other than timestamps (e.g. SACK blocks) is always kept.
+ *
+ * Works in place; returns the new batch length and sets n_dropped.
+ */
+size_t ack_filter_run(uint8_t *batch, size_t len, unsigned int *n_dropped);
+
+#endif /* ACKFILTER_H */
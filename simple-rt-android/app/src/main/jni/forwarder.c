@@ -0,0 +1,814 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "forwarder.h"
+#include "link.h"
+#include "ackfilter.h"
+
+/* f_accessory never completes a read larger than this */
+#define ACC_BUF_SIZE    16384
+#define TUN_MTU         1500
+/* Accessory transfers queued between the reader and the TUN writer */
+#define DOWN_RING_SLOTS 8
+/* Accessory writes queued to the writer */
+#define UP_RING_SLOTS   8
+/* How often DHCP renewals are checked for, when bridged */
+#define L2_CHECK_MS     1000
+
+/*
+ * The accessory fd (f_accessory) supports neither poll() nor O_NONBLOCK, so
+ * accessory I/O stays in two dedicated blocking threads. The reader only
+ * moves transfers into a ring, so that a new read is issued right away; the
+ * down thread drains that ring into the non-blocking TUN fd. The up thread
+ * polls the TUN fd and batches packets into another ring, which the writer
+ * drains into the accessory.
+ *
+ * The up and down threads only ever wait in poll loops that also watch the
+ * stop eventfd, so forwarder_stop() returns at once. The reader and the
+ * writer can't be woken up while blocked in read() or write() (e.g. while
+ * the host isn't reading), so they're not joined: each holds its own
+ * reference to the forwarder and drops it once its call returns, which
+ * happens at the latest when the accessory is detached.
+ */
+
+struct ring_slot {
+    size_t len;
+    uint8_t data[ACC_BUF_SIZE];
+};
+
+/* Each direction is only updated by its own thread, atomics are just there
+ * so that they can be read at any time */
+struct direction_stats {
+    atomic_uint_fast64_t packets;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t max_burst;
+    atomic_uint_fast64_t filtered;
+};
+
+struct forwarder {
+    atomic_int refs;
+    atomic_bool running;
+
+    int tun_fd;
+    int acc_fd;
+    int stop_fd;
+    struct link_options options;
+    struct l2 *l2;
+
+    pthread_t up_thread;
+    pthread_t down_thread;
+    pthread_t reader_thread;
+    pthread_t writer_thread;
+
+    /* Single producer (reader), single consumer (down thread) */
+    struct ring_slot *ring;
+    atomic_uint ring_head;
+    atomic_uint ring_tail;
+    int ring_data_fd;
+    int ring_space_fd;
+
+    /* Producers (batches from the up thread, probe replies from the reader,
+     * ARP replies from the down thread) are serialized by the lock; single
+     * consumer (writer) */
+    pthread_mutex_t acc_write_lock;
+    struct ring_slot *up_ring;
+    atomic_uint up_ring_head;
+    atomic_uint up_ring_tail;
+    int up_ring_data_fd;
+    int up_ring_space_fd;
+
+    struct direction_stats stats[FORWARDER_N_DIRECTIONS];
+};
+
+static forwarder_log_func log_func;
+
+void forwarder_set_log_func(forwarder_log_func func)
+{
+    log_func = func;
+}
+
+static void fwd_log(enum forwarder_log_level level, const char *fmt, ...)
+{
+    char message[256];
+    va_list args;
+
+    if (!log_func)
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    log_func(level, message);
+}
+
+static void stats_add(struct forwarder *fwd, enum forwarder_direction dir, uint64_t packets, uint64_t bytes)
+{
+    struct direction_stats *stats = &fwd->stats[dir];
+
+    atomic_fetch_add_explicit(&stats->packets, packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->bytes, bytes, memory_order_relaxed);
+    if (packets > atomic_load_explicit(&stats->max_burst, memory_order_relaxed))
+        atomic_store_explicit(&stats->max_burst, packets, memory_order_relaxed);
+}
+
+static void stats_filtered(struct forwarder *fwd, enum forwarder_direction dir, uint64_t n)
+{
+    atomic_fetch_add_explicit(&fwd->stats[dir].filtered, n, memory_order_relaxed);
+}
+
+static void stats_error(struct forwarder *fwd, enum forwarder_direction dir)
+{
+    atomic_fetch_add_explicit(&fwd->stats[dir].errors, 1, memory_order_relaxed);
+}
+
+static void forwarder_unref(struct forwarder *fwd)
+{
+    if (atomic_fetch_sub(&fwd->refs, 1) != 1)
+        return;
+
+    close(fwd->acc_fd);
+    close(fwd->stop_fd);
+    close(fwd->ring_data_fd);
+    close(fwd->ring_space_fd);
+    close(fwd->up_ring_data_fd);
+    close(fwd->up_ring_space_fd);
+    pthread_mutex_destroy(&fwd->acc_write_lock);
+    if (fwd->l2)
+        l2_free(fwd->l2);
+    free(fwd->ring);
+    free(fwd->up_ring);
+    free(fwd);
+}
+
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+
+    write(fd, &one, sizeof(one));
+}
+
+static void eventfd_clear(int fd)
+{
+    uint64_t val;
+
+    read(fd, &val, sizeof(val));
+}
+
+static void forwarder_halt(struct forwarder *fwd)
+{
+    if (atomic_exchange(&fwd->running, false))
+        eventfd_signal(fwd->stop_fd);
+}
+
+/* Waits until fd is ready for the given events, for at most timeout ms (-1
+ * for no limit). Returns 1 if ready, 0 on timeout and -1 if stopped. */
+static int wait_fd_timeout(struct forwarder *fwd, int fd, short events, int timeout)
+{
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = events },
+        { .fd = fwd->stop_fd, .events = POLLIN },
+    };
+
+    while (atomic_load(&fwd->running)) {
+        int ret = poll(pfd, 2, timeout);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            return 0;
+        if (pfd[1].revents)
+            return -1;
+        if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            return -1;
+        if (pfd[0].revents & events)
+            return 1;
+    }
+    return -1;
+}
+
+/* Waits until fd is ready for the given events; false if stopped */
+static bool wait_fd(struct forwarder *fwd, int fd, short events)
+{
+    return wait_fd_timeout(fwd, fd, events, -1) > 0;
+}
+
+/* Writes a whole buffer, going on after partial writes and EAGAIN */
+static bool write_all(struct forwarder *fwd, int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t wr = write(fd, buf, len);
+
+        if (wr < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_fd(fwd, fd, POLLOUT))
+                continue;
+            if (atomic_load(&fwd->running))
+                fwd_log(FORWARDER_LOG_WARNING, "write failed: %s", strerror(errno));
+            return false;
+        }
+        buf += wr;
+        len -= wr;
+    }
+    return true;
+}
+
+/* Queues a write for the writer thread, waiting for room if needed; false
+ * if stopped */
+static bool write_acc(struct forwarder *fwd, const uint8_t *buf, size_t len)
+{
+    struct ring_slot *slot;
+    unsigned int head;
+
+    if (len > sizeof(slot->data))
+        return false;
+
+    pthread_mutex_lock(&fwd->acc_write_lock);
+    while ((head = atomic_load(&fwd->up_ring_head)) -
+           atomic_load_explicit(&fwd->up_ring_tail, memory_order_acquire) == UP_RING_SLOTS) {
+        pthread_mutex_unlock(&fwd->acc_write_lock);
+        if (!wait_fd(fwd, fwd->up_ring_space_fd, POLLIN))
+            return false;
+        eventfd_clear(fwd->up_ring_space_fd);
+        pthread_mutex_lock(&fwd->acc_write_lock);
+    }
+
+    slot = &fwd->up_ring[head % UP_RING_SLOTS];
+    memcpy(slot->data, buf, len);
+    slot->len = len;
+    atomic_store(&fwd->up_ring_head, head + 1);
+
+    /* Only wake up the writer if it had already emptied the ring; it checks
+     * the head again after moving the tail */
+    if (atomic_load(&fwd->up_ring_tail) == head)
+        eventfd_signal(fwd->up_ring_data_fd);
+    pthread_mutex_unlock(&fwd->acc_write_lock);
+    return true;
+}
+
+/******************************************************************************/
+/* TUN -> accessory */
+
+/* Reads all the packets queued in the TUN device while there's room for a
+ * full one, each stored as a PACKET frame if framing is used, or as an
+ * ETHERNET frame when bridged. Returns the amount of data read, 0 if nothing
+ * was available or -1 on error. */
+static ssize_t read_tun_batch(struct forwarder *fwd, uint8_t *buf, size_t size, bool framed,
+                              uint64_t *n_packets)
+{
+    size_t header = framed ? LINK_FRAME_HEADER_SIZE : 0;
+    size_t l2_header = fwd->l2 ? L2_HEADER_SIZE : 0;
+    size_t len = 0;
+
+    *n_packets = 0;
+    do {
+        ssize_t rd = read(fwd->tun_fd, &buf[len + header + l2_header], size - len - header - l2_header);
+
+        if (rd < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            return len > 0 ? (ssize_t) len : -1;
+        }
+        if (rd == 0)
+            return len > 0 ? (ssize_t) len : -1;
+
+        /* Packets to unresolved next hops are replaced by ARP requests */
+        if (fwd->l2 && (rd = l2_output(fwd->l2, &buf[len + header], rd)) == 0)
+            continue;
+
+        if (framed)
+            link_frame_put(&buf[len], size - len, fwd->l2 ? LINK_FRAME_ETHERNET : LINK_FRAME_PACKET, NULL, rd);
+        len += header + rd;
+        (*n_packets)++;
+    } while (framed && size - len >= header + l2_header + TUN_MTU);
+
+    return len;
+}
+
+static void *up_thread_proc(void *arg)
+{
+    struct forwarder *fwd = arg;
+    uint8_t buf[ACC_BUF_SIZE];
+    uint8_t lz4_buf[ACC_BUF_SIZE];
+    struct link_compressor compressor;
+    size_t batch = fwd->options.batch < sizeof(buf) ? fwd->options.batch : sizeof(buf);
+    bool compress = (fwd->options.caps & LINK_CAP_LZ4);
+    int ready;
+
+    link_compressor_init(&compressor, fwd->options.rate);
+
+    /* Announce framing support to hosts that asked for it. Probes are
+     * always echoed, so that any host may use them. */
+    if (batch > 0) {
+        size_t len = link_hello_put(buf, sizeof(buf),
+                                    (fwd->options.caps & LINK_CAP_LZ4) | LINK_CAP_PROBE |
+                                    (fwd->l2 ? LINK_CAP_ETHERNET : 0),
+                                    ACC_BUF_SIZE);
+
+        if (!write_acc(fwd, buf, len))
+            goto out;
+    }
+
+    while ((ready = wait_fd_timeout(fwd, fwd->tun_fd, POLLIN, fwd->l2 ? L2_CHECK_MS : -1)) >= 0) {
+        uint64_t n_packets;
+        size_t lz4_len = 0;
+        size_t dhcp_len;
+        ssize_t rd;
+
+        /* DHCP renewals go alone */
+        if (fwd->l2 &&
+            (dhcp_len = l2_dhcp_put(fwd->l2, &buf[LINK_FRAME_HEADER_SIZE], sizeof(buf) - LINK_FRAME_HEADER_SIZE)) > 0 &&
+            !write_acc(fwd, buf, link_frame_put(buf, sizeof(buf), LINK_FRAME_ETHERNET, NULL, dhcp_len))) {
+            stats_error(fwd, FORWARDER_UP);
+            break;
+        }
+
+        if (!ready)
+            continue;
+
+        rd = read_tun_batch(fwd, buf, batch ? batch : sizeof(buf), batch > 0, &n_packets);
+        if (rd < 0) {
+            fwd_log(FORWARDER_LOG_ERROR, "TUN read failed: %s", strerror(errno));
+            stats_error(fwd, FORWARDER_UP);
+            break;
+        }
+        if (rd == 0)
+            continue;
+
+        /* Pure ACKs pile up in the TUN queue while the link is busy */
+        if (batch > 0 && fwd->options.ack_filter) {
+            unsigned int n_dropped;
+
+            rd = ack_filter_run(buf, rd, &n_dropped);
+            if (n_dropped > 0) {
+                n_packets -= n_dropped;
+                stats_filtered(fwd, FORWARDER_UP, n_dropped);
+            }
+        }
+
+        if (compress)
+            lz4_len = link_compressor_run(&compressor, buf, rd, lz4_buf, batch);
+
+        if (!(lz4_len > 0 ?
+              write_acc(fwd, lz4_buf, lz4_len) :
+              write_acc(fwd, buf, rd))) {
+            stats_error(fwd, FORWARDER_UP);
+            break;
+        }
+
+        stats_add(fwd, FORWARDER_UP, n_packets, rd - (batch > 0 ? n_packets * LINK_FRAME_HEADER_SIZE : 0));
+    }
+
+out:
+    forwarder_halt(fwd);
+    return NULL;
+}
+
+static void *writer_thread_proc(void *arg)
+{
+    struct forwarder *fwd = arg;
+
+    while (wait_fd(fwd, fwd->up_ring_data_fd, POLLIN)) {
+        unsigned int tail;
+
+        eventfd_clear(fwd->up_ring_data_fd);
+
+        for (tail = atomic_load(&fwd->up_ring_tail);
+             tail != atomic_load(&fwd->up_ring_head);
+             tail++) {
+            struct ring_slot *slot = &fwd->up_ring[tail % UP_RING_SLOTS];
+            bool ok;
+
+            ok = write_all(fwd, fwd->acc_fd, slot->data, slot->len);
+
+            /* Producers only wait for room when the ring is full */
+            atomic_store(&fwd->up_ring_tail, tail + 1);
+            if (atomic_load(&fwd->up_ring_head) - tail == UP_RING_SLOTS)
+                eventfd_signal(fwd->up_ring_space_fd);
+
+            if (!ok) {
+                stats_error(fwd, FORWARDER_UP);
+                goto out;
+            }
+        }
+    }
+
+out:
+    forwarder_halt(fwd);
+    forwarder_unref(fwd);
+    return NULL;
+}
+
+/******************************************************************************/
+/* Accessory -> TUN */
+
+/* Returns false if the frame couldn't be handled and forwarding must stop */
+static bool write_tun_ethernet(struct forwarder *fwd, const struct link_frame *frame,
+                               uint64_t *n_packets, uint64_t *n_bytes)
+{
+    uint8_t reply[LINK_FRAME_HEADER_SIZE + L2_MAX_CONTROL_FRAME];
+    const uint8_t *packet;
+    size_t packet_len;
+    size_t reply_len;
+
+    if (!fwd->l2)
+        return true;
+
+    switch (l2_input(fwd->l2, frame->payload, frame->payload_len, &packet, &packet_len,
+                     &reply[LINK_FRAME_HEADER_SIZE], &reply_len)) {
+    case L2_INPUT_PACKET:
+        if (!write_all(fwd, fwd->tun_fd, packet, packet_len))
+            return false;
+        (*n_packets)++;
+        *n_bytes += packet_len;
+        return true;
+    case L2_INPUT_REPLY:
+        return write_acc(fwd, reply, link_frame_put(reply, sizeof(reply), LINK_FRAME_ETHERNET, NULL, reply_len));
+    default:
+        return true;
+    }
+}
+
+static bool write_tun_frames(struct forwarder *fwd, const uint8_t *buf, size_t len,
+                             uint8_t *scratch, size_t scratch_size,
+                             uint64_t *n_packets, uint64_t *n_bytes)
+{
+    struct link_frame frame;
+    int raw_len;
+
+    while (link_frame_next(&buf, &len, &frame)) {
+        switch (frame.type) {
+        case LINK_FRAME_PACKET:
+            if (!write_all(fwd, fwd->tun_fd, frame.payload, frame.payload_len))
+                return false;
+            (*n_packets)++;
+            *n_bytes += frame.payload_len;
+            break;
+        case LINK_FRAME_ETHERNET:
+            if (!write_tun_ethernet(fwd, &frame, n_packets, n_bytes))
+                return false;
+            break;
+        case LINK_FRAME_LZ4:
+            /* Compressed frames only carry PACKET or ETHERNET frames */
+            if (!scratch || (raw_len = link_decompress(&frame, scratch, scratch_size)) < 0) {
+                fwd_log(FORWARDER_LOG_WARNING, "invalid compressed frame received");
+                stats_error(fwd, FORWARDER_DOWN);
+                break;
+            }
+            if (!write_tun_frames(fwd, scratch, raw_len, NULL, 0, n_packets, n_bytes))
+                return false;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+static void *down_thread_proc(void *arg)
+{
+    struct forwarder *fwd = arg;
+    uint8_t lz4_buf[ACC_BUF_SIZE];
+
+    while (wait_fd(fwd, fwd->ring_data_fd, POLLIN)) {
+        unsigned int tail;
+
+        eventfd_clear(fwd->ring_data_fd);
+
+        for (tail = atomic_load(&fwd->ring_tail);
+             tail != atomic_load_explicit(&fwd->ring_head, memory_order_acquire);
+             tail++) {
+            struct ring_slot *slot = &fwd->ring[tail % DOWN_RING_SLOTS];
+            uint64_t n_packets = 0;
+            uint64_t n_bytes = 0;
+            bool ok;
+
+            if (link_is_framed(slot->data, slot->len))
+                ok = write_tun_frames(fwd, slot->data, slot->len, lz4_buf, sizeof(lz4_buf), &n_packets, &n_bytes);
+            else {
+                ok = write_all(fwd, fwd->tun_fd, slot->data, slot->len);
+                n_packets = 1;
+                n_bytes = slot->len;
+            }
+
+            atomic_store_explicit(&fwd->ring_tail, tail + 1, memory_order_release);
+            eventfd_signal(fwd->ring_space_fd);
+
+            if (!ok) {
+                stats_error(fwd, FORWARDER_DOWN);
+                goto out;
+            }
+            stats_add(fwd, FORWARDER_DOWN, n_packets, n_bytes);
+        }
+    }
+
+out:
+    forwarder_halt(fwd);
+    return NULL;
+}
+
+static void *reader_thread_proc(void *arg)
+{
+    struct forwarder *fwd = arg;
+
+    while (atomic_load(&fwd->running)) {
+        unsigned int head = atomic_load(&fwd->ring_head);
+        struct ring_slot *slot;
+        ssize_t rd;
+
+        /* Ring full: wait for the TUN writer */
+        if (head - atomic_load_explicit(&fwd->ring_tail, memory_order_acquire) == DOWN_RING_SLOTS) {
+            if (!wait_fd(fwd, fwd->ring_space_fd, POLLIN))
+                break;
+            eventfd_clear(fwd->ring_space_fd);
+            continue;
+        }
+
+        slot = &fwd->ring[head % DOWN_RING_SLOTS];
+        rd = read(fwd->acc_fd, slot->data, sizeof(slot->data));
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd <= 0) {
+            if (atomic_load(&fwd->running)) {
+                fwd_log(FORWARDER_LOG_INFO, "accessory read finished: %s", rd < 0 ? strerror(errno) : "EOF");
+                if (rd < 0)
+                    stats_error(fwd, FORWARDER_DOWN);
+            }
+            break;
+        }
+
+        /* Echoed right away, so that the host measures the link and not
+         * the TUN queue; the slot is reused for the next read */
+        if (link_probe_reply(slot->data, rd)) {
+            if (!write_acc(fwd, slot->data, rd)) {
+                stats_error(fwd, FORWARDER_UP);
+                break;
+            }
+            continue;
+        }
+
+        slot->len = rd;
+        atomic_store_explicit(&fwd->ring_head, head + 1, memory_order_release);
+        eventfd_signal(fwd->ring_data_fd);
+    }
+
+    forwarder_halt(fwd);
+    forwarder_unref(fwd);
+    return NULL;
+}
+
+/******************************************************************************/
+/* Bridged hosts */
+
+struct l2_setup {
+    int acc_fd;
+    struct l2 *l2;
+    atomic_bool done;
+};
+
+/* Sends the DHCP messages while forwarder_l2_setup() reads the replies */
+static void *l2_setup_thread_proc(void *arg)
+{
+    struct l2_setup *setup = arg;
+    uint8_t buf[LINK_FRAME_HEADER_SIZE + L2_MAX_CONTROL_FRAME];
+
+    while (!atomic_load(&setup->done)) {
+        size_t len = l2_dhcp_put(setup->l2, &buf[LINK_FRAME_HEADER_SIZE], sizeof(buf) - LINK_FRAME_HEADER_SIZE);
+
+        if (len > 0 &&
+            write(setup->acc_fd, buf, link_frame_put(buf, sizeof(buf), LINK_FRAME_ETHERNET, NULL, len)) < 0) {
+            fwd_log(FORWARDER_LOG_WARNING, "couldn't send DHCP request: %s", strerror(errno));
+            break;
+        }
+        usleep(100000);
+    }
+    return NULL;
+}
+
+struct l2 *forwarder_l2_setup(int acc_fd, const char *options, struct l2_lease *lease)
+{
+    struct link_options link_options;
+    struct l2_setup setup;
+    pthread_t thread;
+    uint8_t buf[ACC_BUF_SIZE];
+    size_t len;
+    bool bound = false;
+    char address[INET_ADDRSTRLEN], gateway[INET_ADDRSTRLEN];
+
+    link_options_parse(options, &link_options);
+    if (!link_options.l2 || !link_options.batch)
+        return NULL;
+
+    setup.acc_fd = acc_fd;
+    setup.l2 = l2_new(link_options.l2_mac);
+    atomic_init(&setup.done, false);
+    if (!setup.l2)
+        return NULL;
+
+    /* The host only sends frames once framing is announced; everything else
+     * is announced once forwarding */
+    len = link_hello_put(buf, sizeof(buf), LINK_CAP_ETHERNET, ACC_BUF_SIZE);
+    if (write(acc_fd, buf, len) < 0) {
+        fwd_log(FORWARDER_LOG_ERROR, "couldn't announce framing: %s", strerror(errno));
+        l2_free(setup.l2);
+        return NULL;
+    }
+
+    fwd_log(FORWARDER_LOG_INFO, "bridged, requesting an address by DHCP");
+    pthread_create(&thread, NULL, l2_setup_thread_proc, &setup);
+
+    /* Anything but DHCP is dropped until bound */
+    while (!(bound = l2_get_lease(setup.l2, lease))) {
+        const uint8_t *next = buf;
+        struct link_frame frame;
+        const uint8_t *packet;
+        size_t packet_len, reply_len;
+        uint8_t reply[L2_MAX_CONTROL_FRAME];
+        ssize_t rd;
+
+        rd = read(acc_fd, buf, sizeof(buf));
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd <= 0) {
+            fwd_log(FORWARDER_LOG_INFO, "accessory read finished: %s", rd < 0 ? strerror(errno) : "EOF");
+            break;
+        }
+
+        len = rd;
+        while (link_is_framed(buf, rd) && link_frame_next(&next, &len, &frame)) {
+            if (frame.type == LINK_FRAME_ETHERNET)
+                l2_input(setup.l2, frame.payload, frame.payload_len, &packet, &packet_len, reply, &reply_len);
+        }
+    }
+
+    atomic_store(&setup.done, true);
+    pthread_join(thread, NULL);
+
+    if (!bound) {
+        l2_free(setup.l2);
+        return NULL;
+    }
+
+    inet_ntop(AF_INET, &lease->address, address, sizeof(address));
+    inet_ntop(AF_INET, &lease->gateway, gateway, sizeof(gateway));
+    fwd_log(FORWARDER_LOG_INFO, "got address %s, gateway %s, lease %us", address, gateway, lease->lease_time);
+    return setup.l2;
+}
+
+/******************************************************************************/
+
+struct forwarder *forwarder_start(int tun_fd, int acc_fd, const char *options, struct l2 *l2)
+{
+    struct forwarder *fwd;
+    bool up_started = false;
+    bool down_started = false;
+    bool writer_started = false;
+    int flags;
+    int ret;
+
+    fwd = calloc(1, sizeof(*fwd));
+    if (!fwd) {
+        fwd_log(FORWARDER_LOG_ERROR, "couldn't allocate forwarder");
+        close(tun_fd);
+        close(acc_fd);
+        if (l2)
+            l2_free(l2);
+        return NULL;
+    }
+    pthread_mutex_init(&fwd->acc_write_lock, NULL);
+
+    fwd->ring = calloc(DOWN_RING_SLOTS, sizeof(struct ring_slot));
+    fwd->up_ring = calloc(UP_RING_SLOTS, sizeof(struct ring_slot));
+    fwd->l2 = l2;
+    fwd->tun_fd = tun_fd;
+    fwd->acc_fd = acc_fd;
+    fwd->stop_fd = eventfd(0, EFD_NONBLOCK);
+    fwd->ring_data_fd = eventfd(0, EFD_NONBLOCK);
+    fwd->ring_space_fd = eventfd(0, EFD_NONBLOCK);
+    fwd->up_ring_data_fd = eventfd(0, EFD_NONBLOCK);
+    fwd->up_ring_space_fd = eventfd(0, EFD_NONBLOCK);
+    if (!fwd->ring || !fwd->up_ring || fwd->stop_fd < 0 ||
+        fwd->ring_data_fd < 0 || fwd->ring_space_fd < 0 ||
+        fwd->up_ring_data_fd < 0 || fwd->up_ring_space_fd < 0) {
+        fwd_log(FORWARDER_LOG_ERROR, "couldn't allocate forwarder: %s", strerror(errno));
+        atomic_init(&fwd->refs, 1);
+        close(tun_fd);
+        forwarder_unref(fwd);
+        return NULL;
+    }
+
+    atomic_init(&fwd->refs, 3); /* caller, reader and writer threads */
+    atomic_init(&fwd->running, true);
+    atomic_init(&fwd->ring_head, 0);
+    atomic_init(&fwd->ring_tail, 0);
+    atomic_init(&fwd->up_ring_head, 0);
+    atomic_init(&fwd->up_ring_tail, 0);
+
+    link_options_parse(options, &fwd->options);
+    fwd_log(FORWARDER_LOG_INFO, "link options: batch %zu, caps 0x%x, ACK filter %s",
+            fwd->options.batch, fwd->options.caps, fwd->options.ack_filter ? "on" : "off");
+
+    /* TUN is polled; the accessory doesn't support non-blocking I/O */
+    flags = fcntl(tun_fd, F_GETFL, 0);
+    fcntl(tun_fd, F_SETFL, flags | O_NONBLOCK);
+
+    flags = fcntl(acc_fd, F_GETFL, 0);
+    fcntl(acc_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    if ((ret = pthread_create(&fwd->up_thread, NULL, up_thread_proc, fwd)) != 0)
+        goto fail;
+    up_started = true;
+    if ((ret = pthread_create(&fwd->down_thread, NULL, down_thread_proc, fwd)) != 0)
+        goto fail;
+    down_started = true;
+    if ((ret = pthread_create(&fwd->writer_thread, NULL, writer_thread_proc, fwd)) != 0)
+        goto fail;
+    writer_started = true;
+    pthread_detach(fwd->writer_thread);
+    if ((ret = pthread_create(&fwd->reader_thread, NULL, reader_thread_proc, fwd)) != 0)
+        goto fail;
+    pthread_detach(fwd->reader_thread);
+
+    return fwd;
+
+fail:
+    fwd_log(FORWARDER_LOG_ERROR, "couldn't start forwarder threads: %s", strerror(ret));
+    forwarder_halt(fwd);
+    if (up_started)
+        pthread_join(fwd->up_thread, NULL);
+    if (down_started)
+        pthread_join(fwd->down_thread, NULL);
+    /* References of the threads not started, then the caller's */
+    if (!writer_started)
+        forwarder_unref(fwd);
+    forwarder_unref(fwd);
+    close(tun_fd);
+    forwarder_unref(fwd);
+    return NULL;
+}
+
+void forwarder_stop(struct forwarder *fwd)
+{
+    forwarder_halt(fwd);
+
+    /* Never blocked on the accessory */
+    pthread_join(fwd->up_thread, NULL);
+    pthread_join(fwd->down_thread, NULL);
+
+    /* Brings the VPN interface down right away; the accessory fd is closed
+     * once the reader and the writer are done with it */
+    close(fwd->tun_fd);
+    forwarder_unref(fwd);
+}
+
+bool forwarder_is_running(struct forwarder *fwd)
+{
+    return atomic_load(&fwd->running);
+}
+
+void forwarder_get_stats(struct forwarder *fwd, struct forwarder_stats stats[FORWARDER_N_DIRECTIONS])
+{
+    int i;
+
+    for (i = 0; i < FORWARDER_N_DIRECTIONS; i++) {
+        stats[i].packets = atomic_load_explicit(&fwd->stats[i].packets, memory_order_relaxed);
+        stats[i].bytes = atomic_load_explicit(&fwd->stats[i].bytes, memory_order_relaxed);
+        stats[i].errors = atomic_load_explicit(&fwd->stats[i].errors, memory_order_relaxed);
+        stats[i].max_burst = atomic_load_explicit(&fwd->stats[i].max_burst, memory_order_relaxed);
+        stats[i].filtered = atomic_load_explicit(&fwd->stats[i].filtered, memory_order_relaxed);
+    }
+}
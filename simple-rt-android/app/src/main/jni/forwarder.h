@@ -0,0 +1,73 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FORWARDER_H
+#define FORWARDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "l2.h"
+
+/*
+ * Phone side forwarding core: moves packets between the VPN TUN fd and the
+ * accessory fd. Plain C and POSIX only, so that it can also be built and
+ * benchmarked on a Linux host (see bench/).
+ */
+
+enum forwarder_log_level {
+    FORWARDER_LOG_DEBUG,
+    FORWARDER_LOG_INFO,
+    FORWARDER_LOG_WARNING,
+    FORWARDER_LOG_ERROR,
+};
+
+typedef void (*forwarder_log_func)(enum forwarder_log_level level, const char *message);
+
+enum forwarder_direction {
+    FORWARDER_UP,   /* TUN -> accessory */
+    FORWARDER_DOWN, /* accessory -> TUN */
+    FORWARDER_N_DIRECTIONS,
+};
+
+struct forwarder_stats {
+    uint64_t packets;
+    uint64_t bytes;     /* IP packet bytes, before framing or compression */
+    uint64_t errors;
+    uint64_t max_burst; /* most packets moved in a single transfer */
+    uint64_t filtered;  /* pure TCP ACKs dropped by the ACK filter */
+};
+
+struct forwarder;
+
+void forwarder_set_log_func(forwarder_log_func func);
+
+/* When the host bridges the phone (l2 link option), gets an address by DHCP
+ * over the accessory, before the VPN interface exists. Blocks until bound,
+ * or until the accessory is gone (NULL). */
+struct l2 *forwarder_l2_setup(int acc_fd, const char *options, struct l2_lease *lease);
+
+/* Takes ownership of both fds, and of l2 (from forwarder_l2_setup(), or NULL
+ * if not bridged). The options are the ones given by the host in the
+ * accessory description, or NULL. */
+struct forwarder *forwarder_start(int tun_fd, int acc_fd, const char *options, struct l2 *l2);
+void forwarder_stop(struct forwarder *fwd);
+bool forwarder_is_running(struct forwarder *fwd);
+void forwarder_get_stats(struct forwarder *fwd, struct forwarder_stats stats[FORWARDER_N_DIRECTIONS]);
+
+#endif /* FORWARDER_H */
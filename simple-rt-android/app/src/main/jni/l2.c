@@ -0,0 +1,545 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "l2.h"
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP  0x0806
+
+#define ARP_CACHE_SIZE      16
+#define ARP_REQUEST_RETRY   1000   /* ms between requests for a next hop */
+
+#define DHCP_CLIENT_PORT    68
+#define DHCP_SERVER_PORT    67
+#define DHCP_MIN_SIZE       300    /* BOOTP message, padded */
+#define DHCP_OPTIONS_OFFSET 240    /* after the magic cookie */
+#define DHCP_RETRY          2000   /* ms, while getting a lease */
+#define DHCP_RENEW_RETRY    30000  /* ms, while renewing */
+
+#define DHCP_DISCOVER 1
+#define DHCP_OFFER    2
+#define DHCP_REQUEST  3
+#define DHCP_ACK      5
+#define DHCP_NAK      6
+
+#define DHCP_OPT_NETMASK      1
+#define DHCP_OPT_ROUTER       3
+#define DHCP_OPT_DNS          6
+#define DHCP_OPT_REQUESTED_IP 50
+#define DHCP_OPT_LEASE_TIME   51
+#define DHCP_OPT_MSG_TYPE     53
+#define DHCP_OPT_SERVER_ID    54
+#define DHCP_OPT_PARAMS       55
+#define DHCP_OPT_END          255
+
+enum dhcp_state {
+    DHCP_SELECTING,  /* DISCOVER sent, waiting for an OFFER */
+    DHCP_REQUESTING, /* REQUEST sent, waiting for the ACK */
+    DHCP_BOUND,
+    DHCP_RENEWING,   /* lease half gone, REQUEST sent */
+};
+
+struct arp_entry {
+    uint32_t address;
+    uint8_t mac[6];
+};
+
+struct l2 {
+    pthread_mutex_t lock;
+    uint8_t mac[6];
+
+    enum dhcp_state state;
+    uint32_t xid;
+    int64_t next_dhcp;  /* ms */
+    int64_t renew_time; /* ms */
+    struct l2_lease offer;
+    struct l2_lease lease;
+
+    struct arp_entry arp[ARP_CACHE_SIZE];
+    unsigned int arp_next;
+    uint32_t arp_pending;
+    int64_t arp_pending_time;
+};
+
+static const uint8_t broadcast_mac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static uint16_t ip_checksum(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += get_u16(&p[i]);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+static void eth_header_put(uint8_t *frame, const uint8_t *dst, const uint8_t *src, uint16_t type)
+{
+    memcpy(frame, dst, 6);
+    memcpy(&frame[6], src, 6);
+    put_u16(&frame[12], type);
+}
+
+struct l2 *l2_new(const uint8_t mac[6])
+{
+    struct l2 *l2;
+
+    l2 = calloc(1, sizeof(*l2));
+    if (!l2)
+        return NULL;
+
+    pthread_mutex_init(&l2->lock, NULL);
+    memcpy(l2->mac, mac, sizeof(l2->mac));
+    /* Only needs to tell our replies apart from other clients' */
+    l2->xid = (mac[2] << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    l2->xid ^= (uint32_t) now_ms();
+    l2->state = DHCP_SELECTING;
+    return l2;
+}
+
+void l2_free(struct l2 *l2)
+{
+    pthread_mutex_destroy(&l2->lock);
+    free(l2);
+}
+
+/******************************************************************************/
+/* ARP */
+
+static const uint8_t *arp_lookup(struct l2 *l2, uint32_t address)
+{
+    unsigned int i;
+
+    /* Unused entries are all zeros */
+    if (address == 0)
+        return NULL;
+
+    for (i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (l2->arp[i].address == address)
+            return l2->arp[i].mac;
+    }
+    return NULL;
+}
+
+static void arp_learn(struct l2 *l2, uint32_t address, const uint8_t *mac)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (l2->arp[i].address == address) {
+            memcpy(l2->arp[i].mac, mac, 6);
+            return;
+        }
+    }
+
+    l2->arp[l2->arp_next].address = address;
+    memcpy(l2->arp[l2->arp_next].mac, mac, 6);
+    l2->arp_next = (l2->arp_next + 1) % ARP_CACHE_SIZE;
+}
+
+static size_t arp_put(struct l2 *l2, uint8_t *frame, uint16_t op,
+                      const uint8_t *target_mac, uint32_t target_address)
+{
+    uint8_t *arp = &frame[L2_HEADER_SIZE];
+
+    eth_header_put(frame, op == 1 ? broadcast_mac : target_mac, l2->mac, ETHERTYPE_ARP);
+    put_u16(&arp[0], 1);              /* Ethernet */
+    put_u16(&arp[2], ETHERTYPE_IPV4);
+    arp[4] = 6;
+    arp[5] = 4;
+    put_u16(&arp[6], op);
+    memcpy(&arp[8], l2->mac, 6);
+    memcpy(&arp[14], &l2->lease.address, 4);
+    if (op == 1)
+        memset(&arp[18], 0, 6);
+    else
+        memcpy(&arp[18], target_mac, 6);
+    memcpy(&arp[24], &target_address, 4);
+
+    return L2_HEADER_SIZE + 28;
+}
+
+/* Learns the sender if it's in our network, and answers requests for our
+ * address. Returns the reply length, or 0. */
+static size_t arp_input(struct l2 *l2, const uint8_t *arp, size_t len, uint8_t *reply)
+{
+    uint32_t sender, target;
+
+    if (len < 28 || get_u16(&arp[0]) != 1 || get_u16(&arp[2]) != ETHERTYPE_IPV4 ||
+        arp[4] != 6 || arp[5] != 4 || l2->lease.address == 0)
+        return 0;
+
+    memcpy(&sender, &arp[14], 4);
+    memcpy(&target, &arp[24], 4);
+
+    if (sender != 0 && (sender & l2->lease.netmask) == (l2->lease.address & l2->lease.netmask))
+        arp_learn(l2, sender, &arp[8]);
+
+    if (get_u16(&arp[6]) == 1 && target == l2->lease.address)
+        return arp_put(l2, reply, 2, &arp[8], sender);
+    return 0;
+}
+
+/******************************************************************************/
+/* DHCP */
+
+static size_t dhcp_put(struct l2 *l2, uint8_t *frame, uint8_t type)
+{
+    uint8_t *ip = &frame[L2_HEADER_SIZE];
+    uint8_t *udp = &ip[20];
+    uint8_t *dhcp = &udp[8];
+    uint8_t *opt = &dhcp[DHCP_OPTIONS_OFFSET];
+    bool renewing = (l2->state == DHCP_RENEWING);
+    uint32_t xid = htonl(l2->xid);
+    size_t len;
+
+    memset(ip, 0, 20 + 8 + DHCP_MIN_SIZE);
+
+    dhcp[0] = 1; /* BOOTREQUEST */
+    dhcp[1] = 1; /* Ethernet */
+    dhcp[2] = 6;
+    memcpy(&dhcp[4], &xid, 4);
+    /* Replies broadcast, until we have an address */
+    if (renewing)
+        memcpy(&dhcp[12], &l2->lease.address, 4);
+    else
+        put_u16(&dhcp[10], 0x8000);
+    memcpy(&dhcp[28], l2->mac, 6);
+    dhcp[236] = 99;
+    dhcp[237] = 130;
+    dhcp[238] = 83;
+    dhcp[239] = 99;
+
+    *opt++ = DHCP_OPT_MSG_TYPE;
+    *opt++ = 1;
+    *opt++ = type;
+    if (type == DHCP_REQUEST && !renewing) {
+        *opt++ = DHCP_OPT_REQUESTED_IP;
+        *opt++ = 4;
+        memcpy(opt, &l2->offer.address, 4);
+        opt += 4;
+        *opt++ = DHCP_OPT_SERVER_ID;
+        *opt++ = 4;
+        memcpy(opt, &l2->offer.server, 4);
+        opt += 4;
+    }
+    *opt++ = DHCP_OPT_PARAMS;
+    *opt++ = 4;
+    *opt++ = DHCP_OPT_NETMASK;
+    *opt++ = DHCP_OPT_ROUTER;
+    *opt++ = DHCP_OPT_DNS;
+    *opt++ = DHCP_OPT_LEASE_TIME;
+    *opt++ = DHCP_OPT_END;
+
+    len = opt - dhcp;
+    if (len < DHCP_MIN_SIZE)
+        len = DHCP_MIN_SIZE;
+
+    /* Renewals would go unicast to the server; broadcast (as when
+     * rebinding) saves resolving it, and any server accepts it */
+    put_u16(&udp[0], DHCP_CLIENT_PORT);
+    put_u16(&udp[2], DHCP_SERVER_PORT);
+    put_u16(&udp[4], 8 + len);
+
+    ip[0] = 0x45;
+    put_u16(&ip[2], 20 + 8 + len);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    if (renewing)
+        memcpy(&ip[12], &l2->lease.address, 4);
+    memset(&ip[16], 0xFF, 4);
+    put_u16(&ip[10], ip_checksum(ip, 20));
+
+    eth_header_put(frame, broadcast_mac, l2->mac, ETHERTYPE_IPV4);
+    return L2_HEADER_SIZE + 20 + 8 + len;
+}
+
+static void dhcp_parse_options(const uint8_t *opt, size_t len, uint8_t *type, struct l2_lease *lease)
+{
+    size_t i = 0;
+
+    while (i < len && opt[i] != DHCP_OPT_END) {
+        uint8_t code = opt[i];
+        uint8_t opt_len;
+
+        /* Pad */
+        if (code == 0) {
+            i++;
+            continue;
+        }
+        if (i + 2 > len || i + 2 + opt[i + 1] > len)
+            break;
+        opt_len = opt[i + 1];
+
+        switch (code) {
+        case DHCP_OPT_MSG_TYPE:
+            if (opt_len >= 1)
+                *type = opt[i + 2];
+            break;
+        case DHCP_OPT_NETMASK:
+            if (opt_len >= 4)
+                memcpy(&lease->netmask, &opt[i + 2], 4);
+            break;
+        case DHCP_OPT_ROUTER:
+            if (opt_len >= 4)
+                memcpy(&lease->gateway, &opt[i + 2], 4);
+            break;
+        case DHCP_OPT_DNS:
+            if (opt_len >= 4)
+                memcpy(&lease->dns, &opt[i + 2], 4);
+            break;
+        case DHCP_OPT_SERVER_ID:
+            if (opt_len >= 4)
+                memcpy(&lease->server, &opt[i + 2], 4);
+            break;
+        case DHCP_OPT_LEASE_TIME:
+            if (opt_len >= 4)
+                lease->lease_time = (opt[i + 2] << 24) | (opt[i + 3] << 16) | (opt[i + 4] << 8) | opt[i + 5];
+            break;
+        default:
+            break;
+        }
+        i += 2 + opt_len;
+    }
+}
+
+static void dhcp_input(struct l2 *l2, const uint8_t *dhcp, size_t len)
+{
+    struct l2_lease lease;
+    uint8_t type = 0;
+    uint32_t xid;
+    int64_t now;
+
+    if (len < DHCP_OPTIONS_OFFSET || dhcp[0] != 2 || memcmp(&dhcp[28], l2->mac, 6) != 0 ||
+        dhcp[236] != 99 || dhcp[237] != 130 || dhcp[238] != 83 || dhcp[239] != 99)
+        return;
+    memcpy(&xid, &dhcp[4], 4);
+    if (ntohl(xid) != l2->xid)
+        return;
+
+    memset(&lease, 0, sizeof(lease));
+    memcpy(&lease.address, &dhcp[16], 4);
+    lease.lease_time = 0xFFFFFFFF;
+    dhcp_parse_options(&dhcp[DHCP_OPTIONS_OFFSET], len - DHCP_OPTIONS_OFFSET, &type, &lease);
+
+    now = now_ms();
+    switch (type) {
+    case DHCP_OFFER:
+        if (l2->state != DHCP_SELECTING || lease.address == 0 || lease.server == 0)
+            return;
+        l2->offer = lease;
+        l2->state = DHCP_REQUESTING;
+        l2->next_dhcp = now;
+        break;
+    case DHCP_ACK:
+        if (l2->state == DHCP_REQUESTING && lease.address != l2->offer.address)
+            return;
+        /* The address of the VPN interface can't change any more */
+        if (l2->state == DHCP_RENEWING && lease.address != l2->lease.address)
+            return;
+        if (l2->state != DHCP_REQUESTING && l2->state != DHCP_RENEWING)
+            return;
+        if (lease.netmask == 0)
+            lease.netmask = htonl(0xFFFFFF00);
+        l2->lease = lease;
+        l2->state = DHCP_BOUND;
+        l2->renew_time = lease.lease_time == 0xFFFFFFFF ? INT64_MAX : now + lease.lease_time * 500LL;
+        l2->xid++;
+        break;
+    case DHCP_NAK:
+        /* Start over, unless bound already: then keep renewing, until the
+         * lease runs out there's nothing better to do */
+        if (l2->state == DHCP_REQUESTING) {
+            l2->state = DHCP_SELECTING;
+            l2->next_dhcp = now + DHCP_RETRY;
+            l2->xid++;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+size_t l2_dhcp_put(struct l2 *l2, uint8_t *buf, size_t size)
+{
+    int64_t now = now_ms();
+    size_t len = 0;
+
+    if (size < L2_MAX_CONTROL_FRAME)
+        return 0;
+
+    pthread_mutex_lock(&l2->lock);
+
+    if (l2->state == DHCP_BOUND && now >= l2->renew_time) {
+        l2->state = DHCP_RENEWING;
+        l2->next_dhcp = now;
+    }
+
+    if (l2->state != DHCP_BOUND && now >= l2->next_dhcp) {
+        len = dhcp_put(l2, buf, l2->state == DHCP_SELECTING ? DHCP_DISCOVER : DHCP_REQUEST);
+        l2->next_dhcp = now + (l2->state == DHCP_RENEWING ? DHCP_RENEW_RETRY : DHCP_RETRY);
+    }
+
+    pthread_mutex_unlock(&l2->lock);
+    return len;
+}
+
+bool l2_get_lease(struct l2 *l2, struct l2_lease *lease)
+{
+    bool bound;
+
+    pthread_mutex_lock(&l2->lock);
+    bound = (l2->lease.address != 0);
+    *lease = l2->lease;
+    pthread_mutex_unlock(&l2->lock);
+    return bound;
+}
+
+/******************************************************************************/
+
+enum l2_input_result l2_input(struct l2 *l2, const uint8_t *frame, size_t len,
+                              const uint8_t **packet, size_t *packet_len,
+                              uint8_t *reply, size_t *reply_len)
+{
+    enum l2_input_result result = L2_INPUT_DROP;
+    const uint8_t *ip = &frame[L2_HEADER_SIZE];
+    size_t ip_len;
+
+    /* Ours, broadcast or multicast */
+    if (len < L2_HEADER_SIZE || (memcmp(frame, l2->mac, 6) != 0 && !(frame[0] & 0x01)))
+        return L2_INPUT_DROP;
+    ip_len = len - L2_HEADER_SIZE;
+
+    pthread_mutex_lock(&l2->lock);
+
+    switch (get_u16(&frame[12])) {
+    case ETHERTYPE_ARP:
+        if ((*reply_len = arp_input(l2, ip, ip_len, reply)) > 0)
+            result = L2_INPUT_REPLY;
+        break;
+    case ETHERTYPE_IPV4: {
+        size_t header_len;
+
+        if (ip_len < 20 || (ip[0] >> 4) != 4)
+            break;
+        header_len = (ip[0] & 0x0F) * 4;
+
+        /* DHCP replies are ours */
+        if (ip[9] == IPPROTO_UDP && ip_len >= header_len + 8 &&
+            get_u16(&ip[header_len + 2]) == DHCP_CLIENT_PORT) {
+            dhcp_input(l2, &ip[header_len + 8], ip_len - header_len - 8);
+            break;
+        }
+
+        if (l2->lease.address == 0)
+            break;
+        /* Ethernet padding isn't part of the packet */
+        if (get_u16(&ip[2]) < ip_len)
+            ip_len = get_u16(&ip[2]);
+        *packet = ip;
+        *packet_len = ip_len;
+        result = L2_INPUT_PACKET;
+        break;
+    }
+    default:
+        /* IPv6 isn't configured in the VPN interface */
+        break;
+    }
+
+    pthread_mutex_unlock(&l2->lock);
+    return result;
+}
+
+size_t l2_output(struct l2 *l2, uint8_t *frame, size_t packet_len)
+{
+    const uint8_t *ip = &frame[L2_HEADER_SIZE];
+    const uint8_t *mac;
+    uint8_t multicast_mac[6];
+    uint32_t dst, next_hop;
+    size_t len = 0;
+
+    if (packet_len < 20 || (ip[0] >> 4) != 4)
+        return 0;
+    memcpy(&dst, &ip[16], 4);
+
+    pthread_mutex_lock(&l2->lock);
+
+    if (l2->lease.address == 0)
+        goto out;
+
+    next_hop = ((dst & l2->lease.netmask) == (l2->lease.address & l2->lease.netmask)) ? dst : l2->lease.gateway;
+
+    if (dst == 0xFFFFFFFF || dst == (l2->lease.address | ~l2->lease.netmask))
+        mac = broadcast_mac;
+    else if ((ntohl(dst) >> 28) == 0xE) {
+        multicast_mac[0] = 0x01;
+        multicast_mac[1] = 0x00;
+        multicast_mac[2] = 0x5E;
+        multicast_mac[3] = ip[17] & 0x7F;
+        multicast_mac[4] = ip[18];
+        multicast_mac[5] = ip[19];
+        mac = multicast_mac;
+    } else if (next_hop == 0) {
+        /* Off-link, and the lease has no gateway */
+        goto out;
+    } else if (!(mac = arp_lookup(l2, next_hop))) {
+        int64_t now = now_ms();
+
+        /* The packet is lost, TCP will retry once the next hop answers */
+        if (next_hop != l2->arp_pending || now - l2->arp_pending_time >= ARP_REQUEST_RETRY) {
+            l2->arp_pending = next_hop;
+            l2->arp_pending_time = now;
+            len = arp_put(l2, frame, 1, NULL, next_hop);
+        }
+        goto out;
+    }
+
+    eth_header_put(frame, mac, l2->mac, ETHERTYPE_IPV4);
+    len = L2_HEADER_SIZE + packet_len;
+
+out:
+    pthread_mutex_unlock(&l2->lock);
+    return len;
+}
@@ -0,0 +1,80 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef L2_H
+#define L2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Ethernet adaptation, used when the host bridges the phone into its LAN
+ * instead of routing it. The phone is then a LAN station of its own, with
+ * the MAC address given by the host: it gets its IPv4 address by DHCP,
+ * answers ARP requests for it, and resolves the next hop of the packets it
+ * sends. The VPN interface keeps seeing plain IP packets.
+ *
+ * Safe to use from several threads.
+ */
+
+#define L2_HEADER_SIZE 14
+/* Largest frame written by l2_output() besides the packet given */
+#define L2_MAX_CONTROL_FRAME 342
+
+/* Addresses in network byte order */
+struct l2_lease {
+    uint32_t address;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint32_t dns;
+    uint32_t server;
+    uint32_t lease_time; /* seconds, 0xFFFFFFFF if infinite */
+};
+
+enum l2_input_result {
+    L2_INPUT_DROP,   /* not for the phone, or consumed (e.g. DHCP) */
+    L2_INPUT_PACKET, /* IP packet for the VPN interface */
+    L2_INPUT_REPLY,  /* a frame to send back to the host (e.g. ARP reply) */
+};
+
+struct l2;
+
+struct l2 *l2_new(const uint8_t mac[6]);
+void l2_free(struct l2 *l2);
+
+/* Frames from the host. For L2_INPUT_PACKET, packet points into the frame;
+ * for L2_INPUT_REPLY, the reply is written to reply (of size
+ * L2_MAX_CONTROL_FRAME at least). */
+enum l2_input_result l2_input(struct l2 *l2, const uint8_t *frame, size_t len,
+                              const uint8_t **packet, size_t *packet_len,
+                              uint8_t *reply, size_t *reply_len);
+
+/* Packets to the host: the packet is at frame + L2_HEADER_SIZE. Writes the
+ * Ethernet header in front of it, or, while the next hop isn't resolved, an
+ * ARP request in place of the whole frame (so the frame must have room for
+ * L2_MAX_CONTROL_FRAME). Returns the frame length, 0 if the packet must be
+ * dropped. */
+size_t l2_output(struct l2 *l2, uint8_t *frame, size_t packet_len);
+
+/* DHCP. Writes the next DHCP message to send to buf (DISCOVER, REQUEST or
+ * renewal), if one is due; returns its length or 0. */
+size_t l2_dhcp_put(struct l2 *l2, uint8_t *buf, size_t size);
+bool l2_get_lease(struct l2 *l2, struct l2_lease *lease);
+
+#endif /* L2_H */
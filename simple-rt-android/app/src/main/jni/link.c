@@ -0,0 +1,226 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "link.h"
+#include "lz4block.h"
+
+/* Same policy as the host: see g-simple-rt-link.c */
+#define COMPRESS_MIN_BATCH   128
+#define COMPRESS_MAX_RATIO   0.9
+#define COMPRESS_MAX_BACKOFF 64
+#define COMPRESS_EWMA_WEIGHT 0.125
+
+void link_options_parse(const char *str, struct link_options *options)
+{
+    char *copy, *token, *saveptr = NULL;
+
+    memset(options, 0, sizeof(*options));
+    if (!str)
+        return;
+
+    copy = strdup(str);
+    for (token = strtok_r(copy, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+        char *value = strchr(token, '=');
+
+        if (!value)
+            continue;
+        *value++ = '\0';
+
+        if (strcmp(token, "batch") == 0)
+            options->batch = strtoul(value, NULL, 10);
+        else if (strcmp(token, "rate") == 0)
+            options->rate = strtoull(value, NULL, 10);
+        else if (strcmp(token, "ackfilter") == 0)
+            options->ack_filter = (strcmp(value, "1") == 0);
+        else if (strcmp(token, "l2") == 0) {
+            unsigned int mac[6];
+            int i;
+
+            if (sscanf(value, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6) {
+                for (i = 0; i < 6; i++)
+                    options->l2_mac[i] = mac[i];
+                options->l2 = true;
+            }
+        }
+        else if (strcmp(token, "caps") == 0) {
+            if (strstr(value, "lz4"))
+                options->caps |= LINK_CAP_LZ4;
+        }
+    }
+    free(copy);
+}
+
+bool link_is_framed(const uint8_t *buf, size_t len)
+{
+    return len >= LINK_FRAME_HEADER_SIZE && (buf[0] & 0xF0) == 0;
+}
+
+size_t link_frame_put(uint8_t *buf, size_t size, enum link_frame_type type,
+                      const uint8_t *payload, size_t payload_len)
+{
+    if (payload_len > 0xFFFF || size < LINK_FRAME_HEADER_SIZE + payload_len)
+        return 0;
+
+    buf[0] = (uint8_t) type;
+    buf[1] = 0;
+    buf[2] = (payload_len >> 8) & 0xFF;
+    buf[3] = payload_len & 0xFF;
+    if (payload && payload != &buf[LINK_FRAME_HEADER_SIZE])
+        memmove(&buf[LINK_FRAME_HEADER_SIZE], payload, payload_len);
+
+    return LINK_FRAME_HEADER_SIZE + payload_len;
+}
+
+bool link_frame_next(const uint8_t **buf, size_t *len, struct link_frame *frame)
+{
+    size_t payload_len;
+
+    if (*len < LINK_FRAME_HEADER_SIZE)
+        return false;
+
+    payload_len = ((*buf)[2] << 8) | (*buf)[3];
+    if (*len < LINK_FRAME_HEADER_SIZE + payload_len)
+        return false;
+
+    frame->type = (enum link_frame_type) (*buf)[0];
+    frame->payload = *buf + LINK_FRAME_HEADER_SIZE;
+    frame->payload_len = payload_len;
+
+    *buf += LINK_FRAME_HEADER_SIZE + payload_len;
+    *len -= LINK_FRAME_HEADER_SIZE + payload_len;
+    return true;
+}
+
+size_t link_hello_put(uint8_t *buf, size_t size, uint32_t caps, uint16_t max_rx)
+{
+    uint8_t payload[6];
+
+    payload[0] = (caps >> 24) & 0xFF;
+    payload[1] = (caps >> 16) & 0xFF;
+    payload[2] = (caps >> 8) & 0xFF;
+    payload[3] = caps & 0xFF;
+    payload[4] = (max_rx >> 8) & 0xFF;
+    payload[5] = max_rx & 0xFF;
+
+    return link_frame_put(buf, size, LINK_FRAME_HELLO, payload, sizeof(payload));
+}
+
+bool link_probe_reply(uint8_t *buf, size_t len)
+{
+    const uint8_t *next = buf;
+    struct link_frame frame;
+
+    if (!link_is_framed(buf, len) || buf[0] != LINK_FRAME_PROBE ||
+        !link_frame_next(&next, &len, &frame) || len != 0)
+        return false;
+
+    buf[0] = LINK_FRAME_REPLY;
+    return true;
+}
+
+void link_compressor_init(struct link_compressor *compressor, uint64_t rate)
+{
+    memset(compressor, 0, sizeof(*compressor));
+    /* Assume high speed if the host didn't tell */
+    compressor->rate = rate ? rate : 40000000;
+    compressor->ratio = 0.5;
+}
+
+static void compressor_update(struct link_compressor *compressor,
+                              size_t raw_len, size_t compressed_len, int64_t elapsed_ns)
+{
+    double ratio = (double) compressed_len / (double) raw_len;
+    double ns_per_byte = (double) elapsed_ns / (double) raw_len;
+    double saved_ns;
+
+    compressor->ratio += COMPRESS_EWMA_WEIGHT * (ratio - compressor->ratio);
+    compressor->ns_per_byte += COMPRESS_EWMA_WEIGHT * (ns_per_byte - compressor->ns_per_byte);
+
+    /* A loss if it doesn't shrink enough, or if compressing takes longer
+     * than sending the bytes it saves */
+    saved_ns = (1.0 - compressor->ratio) * 1e9 / (double) compressor->rate;
+    if (compressor->ratio > COMPRESS_MAX_RATIO || compressor->ns_per_byte > saved_ns) {
+        compressor->backoff = compressor->backoff ? compressor->backoff * 2 : 1;
+        if (compressor->backoff > COMPRESS_MAX_BACKOFF)
+            compressor->backoff = COMPRESS_MAX_BACKOFF;
+        compressor->skip = compressor->backoff;
+    } else
+        compressor->backoff = 0;
+}
+
+size_t link_compressor_run(struct link_compressor *compressor,
+                           const uint8_t *batch, size_t batch_len,
+                           uint8_t *out, size_t out_size)
+{
+    struct timespec start, end;
+    size_t max_len;
+    int compressed_len;
+
+    if (batch_len < COMPRESS_MIN_BATCH || batch_len > 0xFFFF)
+        return 0;
+
+    if (compressor->skip > 0) {
+        compressor->skip--;
+        return 0;
+    }
+
+    /* Never produce a frame bigger than the uncompressed batch */
+    max_len = out_size < batch_len ? out_size : batch_len;
+    if (max_len <= LINK_FRAME_HEADER_SIZE + 2)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    compressed_len = lz4block_compress(batch, (int) batch_len,
+                                       &out[LINK_FRAME_HEADER_SIZE + 2],
+                                       (int) (max_len - LINK_FRAME_HEADER_SIZE - 2));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    compressor_update(compressor, batch_len,
+                      compressed_len > 0 ? (size_t) compressed_len : batch_len,
+                      (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+
+    if (compressed_len <= 0)
+        return 0;
+
+    out[LINK_FRAME_HEADER_SIZE] = (batch_len >> 8) & 0xFF;
+    out[LINK_FRAME_HEADER_SIZE + 1] = batch_len & 0xFF;
+    return link_frame_put(out, out_size, LINK_FRAME_LZ4, NULL, compressed_len + 2);
+}
+
+int link_decompress(const struct link_frame *frame, uint8_t *out, size_t out_size)
+{
+    size_t raw_len;
+    int ret;
+
+    if (frame->type != LINK_FRAME_LZ4 || frame->payload_len < 2)
+        return -1;
+
+    raw_len = (frame->payload[0] << 8) | frame->payload[1];
+    if (raw_len > out_size)
+        return -1;
+
+    ret = lz4block_decompress(&frame->payload[2], (int) frame->payload_len - 2, out, (int) raw_len);
+    if (ret < 0 || (size_t) ret != raw_len)
+        return -1;
+    return ret;
+}
@@ -0,0 +1,92 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Accessory link framing, see g-simple-rt-link.h in the host tool.
+ *
+ * A transfer either carries a single raw IP packet, or a sequence of frames
+ * with a 4-byte header: type (< 0x10), flags (0) and big endian payload
+ * length. Frames are only sent when the host asked for them in the
+ * accessory description options.
+ */
+
+#define LINK_FRAME_HEADER_SIZE 4
+
+enum link_frame_type {
+    LINK_FRAME_HELLO    = 0x01, /* payload: caps (u32 BE), max rx transfer (u16 BE) */
+    LINK_FRAME_PACKET   = 0x02, /* payload: one IP packet */
+    LINK_FRAME_LZ4      = 0x03, /* payload: raw size (u16 BE), LZ4 block of PACKET or ETHERNET frames */
+    LINK_FRAME_PROBE    = 0x04, /* payload: opaque, echoed back in a REPLY frame */
+    LINK_FRAME_REPLY    = 0x05,
+    LINK_FRAME_ETHERNET = 0x06, /* payload: one Ethernet frame, when bridged */
+};
+
+#define LINK_CAP_LZ4      (1 << 0)
+#define LINK_CAP_PROBE    (1 << 1)
+#define LINK_CAP_ETHERNET (1 << 2)
+
+struct link_frame {
+    enum link_frame_type type;
+    const uint8_t *payload;
+    size_t payload_len;
+};
+
+/* Options given by the host, as "key=value" pairs in the description */
+struct link_options {
+    size_t batch;       /* max transfer size the host reads, 0 if no framing */
+    uint32_t caps;      /* capabilities enabled by the host */
+    uint64_t rate;      /* estimated link rate, bytes per second */
+    bool ack_filter;    /* drop pure TCP ACKs superseded by newer ones */
+    bool l2;            /* bridged: Ethernet frames, with this MAC address */
+    uint8_t l2_mac[6];
+};
+
+void link_options_parse(const char *str, struct link_options *options);
+
+bool link_is_framed(const uint8_t *buf, size_t len);
+size_t link_frame_put(uint8_t *buf, size_t size, enum link_frame_type type,
+                      const uint8_t *payload, size_t payload_len);
+bool link_frame_next(const uint8_t **buf, size_t *len, struct link_frame *frame);
+size_t link_hello_put(uint8_t *buf, size_t size, uint32_t caps, uint16_t max_rx);
+/* If the transfer is a single PROBE frame, turns it into its REPLY in place */
+bool link_probe_reply(uint8_t *buf, size_t len);
+
+struct link_compressor {
+    uint64_t rate;
+    double ratio;
+    double ns_per_byte;
+    unsigned int skip;
+    unsigned int backoff;
+};
+
+void link_compressor_init(struct link_compressor *compressor, uint64_t rate);
+/* Returns the size of the LZ4 frame written to out, or 0 if the batch
+ * should be sent uncompressed */
+size_t link_compressor_run(struct link_compressor *compressor,
+                           const uint8_t *batch, size_t batch_len,
+                           uint8_t *out, size_t out_size);
+int link_decompress(const struct link_frame *frame, uint8_t *out, size_t out_size);
+
+#endif /* LINK_H */
@@ -0,0 +1,205 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4block.h"
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5  /* the last 5 bytes are always literals */
+#define MF_LIMIT      12 /* the last match must start 12 bytes before the end */
+#define MAX_OFFSET    65535
+#define HASH_LOG      12
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Writes the extra length bytes for a literal or match length >= 15 */
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, int len)
+{
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend,
+                                   const unsigned char *literals, int literal_len,
+                                   int offset, int match_len)
+{
+    unsigned char *token;
+
+    if (op >= oend)
+        return NULL;
+
+    token = op++;
+    *token = (unsigned char) ((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15 && !(op = put_length(op, oend, literal_len)))
+        return NULL;
+
+    if (oend - op < literal_len)
+        return NULL;
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    /* Last sequence: literals only */
+    if (!match_len)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = (offset >> 8) & 0xFF;
+
+    match_len -= MIN_MATCH;
+    *token |= (unsigned char) (match_len < 15 ? match_len : 15);
+    if (match_len >= 15 && !(op = put_length(op, oend, match_len)))
+        return NULL;
+
+    return op;
+}
+
+int lz4block_compress(const unsigned char *src, int src_size,
+                      unsigned char *dst, int dst_size)
+{
+    uint32_t table[1 << HASH_LOG];
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + src_size;
+    const unsigned char *mf_limit = end - MF_LIMIT;
+    const unsigned char *match_limit = end - LAST_LITERALS;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dst_size;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_size > MF_LIMIT) {
+        while (ip < mf_limit) {
+            uint32_t h = hash32(read32(ip));
+            const unsigned char *ref = src + table[h];
+            int match_len;
+
+            table[h] = (uint32_t) (ip - src);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            match_len = MIN_MATCH;
+            while (ip + match_len < match_limit && ref[match_len] == ip[match_len])
+                match_len++;
+
+            op = put_sequence(op, oend, anchor, (int) (ip - anchor), (int) (ip - ref), match_len);
+            if (!op)
+                return 0;
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (int) (end - anchor), 0, 0);
+    if (!op)
+        return 0;
+
+    return (int) (op - dst);
+}
+
+/* Reads the extra length bytes of a literal or match length */
+static int get_length(const unsigned char **ip, const unsigned char *iend, int len)
+{
+    unsigned char b;
+
+    if (len != 15)
+        return len;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
+
+int lz4block_decompress(const unsigned char *src, int src_size,
+                        unsigned char *dst, int dst_size)
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + src_size;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dst_size;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        int literal_len;
+        int match_len;
+        int offset;
+
+        literal_len = get_length(&ip, iend, token >> 4);
+        if (literal_len < 0 || iend - ip < literal_len || oend - op < literal_len)
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        /* Last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+
+        match_len = get_length(&ip, iend, token & 0x0F);
+        if (match_len < 0)
+            return -1;
+        match_len += MIN_MATCH;
+        if (oend - op < match_len)
+            return -1;
+
+        /* Byte by byte, as the match may overlap the output */
+        while (match_len--) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+
+    return (int) (op - dst);
+}
@@ -0,0 +1,39 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <stddef.h>
+
+/*
+ * Minimal LZ4 block format codec, wire compatible with liblz4's
+ * LZ4_compress_default() and LZ4_decompress_safe(), which the host uses.
+ * The NDK doesn't ship liblz4, and the link only needs the block format.
+ */
+
+/* Returns the compressed size, or 0 if it doesn't fit in dst_size */
+int lz4block_compress(const unsigned char *src, int src_size,
+                      unsigned char *dst, int dst_size);
+
+/* Returns the decompressed size, or -1 if the input is malformed or doesn't
+ * fit in dst_size */
+int lz4block_decompress(const unsigned char *src, int src_size,
+                        unsigned char *dst, int dst_size);
+
+#endif /* LZ4BLOCK_H */
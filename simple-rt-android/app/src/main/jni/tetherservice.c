@@ -20,10 +20,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <arpa/inet.h>
 #include <android/log.h>
 
+#include "forwarder.h"
+
 #define LOG_TAG "SIMPLE_RT_JNI"
 
 #define DPRINTF(level, fmt, args...) \
@@ -37,98 +40,158 @@
 #define LOGW(fmt, args...) DPRINTF(ANDROID_LOG_WARN, fmt, ##args)
 #define LOGE(fmt, args...) DPRINTF(ANDROID_LOG_ERROR, fmt, ##args)
 
-static struct {
-    pthread_t tun_thread;
-    pthread_t acc_thread;
-    int tun_fd;
-    int acc_fd;
-    volatile bool is_started;
-} module;
+/* Values per direction returned by get_stats() */
+#define N_STATS 5
 
-enum ThreadType {
-    TUN_THREAD = 0,
-    ACC_THREAD = 1,
-};
+static pthread_mutex_t forwarder_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct forwarder *current;
+/* Bridged link configured by configure(), waiting for start() */
+static struct l2 *pending_l2;
 
-#define ACC_BUF_SIZE 4096
+static void log_func(enum forwarder_log_level level, const char *message)
+{
+    static const int priorities[] = {
+        [FORWARDER_LOG_DEBUG] = ANDROID_LOG_DEBUG,
+        [FORWARDER_LOG_INFO] = ANDROID_LOG_INFO,
+        [FORWARDER_LOG_WARNING] = ANDROID_LOG_WARN,
+        [FORWARDER_LOG_ERROR] = ANDROID_LOG_ERROR,
+    };
+
+    DPRINTF(priorities[level], "%s", message);
+}
 
 jint JNI_OnLoad(JavaVM *jvm, void *reserved)
 {
     LOGV(__func__);
 
-    module.is_started = false;
+    forwarder_set_log_func(log_func);
     return JNI_VERSION_1_6;
 }
 
-void *thread_proc(void *arg)
+/* Gets an address by DHCP when the host bridges the phone. Blocks; returns
+ * "ADDRESS PREFIX GATEWAY DNS", or null on failure. The accessory fd is only
+ * borrowed. */
+JNIEXPORT jstring JNICALL
+Java_com_viper_simplert_Native_configure(JNIEnv *env, jclass type, jint acc_fd, jstring options)
 {
-    char buf[ACC_BUF_SIZE] = { 0 };
-    ssize_t rd;
-    int in_fd, out_fd;
-
-    enum ThreadType thread_type = (enum ThreadType) arg;
-
-    if (thread_type == TUN_THREAD) {
-        in_fd = module.tun_fd;
-        out_fd = module.acc_fd;
-    } else {
-        in_fd = module.acc_fd;
-        out_fd = module.tun_fd;
-    }
-
-    while (module.is_started) {
-        if ((rd = read(in_fd, buf, sizeof(buf))) > 0) {
-            write(out_fd, buf, rd);
-        } else {
-            /* FIXME */
-            break;
-        }
-    }
-
-    module.is_started = false;
-    close(in_fd);
-
-    return NULL;
+    const char *options_str;
+    struct l2_lease lease;
+    struct l2 *l2;
+    char address[INET_ADDRSTRLEN], gateway[INET_ADDRSTRLEN], dns[INET_ADDRSTRLEN];
+    char result[4 * INET_ADDRSTRLEN];
+    int prefix;
+
+    LOGV("%s: acc_fd = %d", __func__, acc_fd);
+
+    options_str = options ? (*env)->GetStringUTFChars(env, options, NULL) : NULL;
+    l2 = forwarder_l2_setup(acc_fd, options_str, &lease);
+    if (options_str)
+        (*env)->ReleaseStringUTFChars(env, options, options_str);
+    if (!l2)
+        return NULL;
+
+    pthread_mutex_lock(&forwarder_lock);
+    if (pending_l2)
+        l2_free(pending_l2);
+    pending_l2 = l2;
+    pthread_mutex_unlock(&forwarder_lock);
+
+    prefix = __builtin_popcount(lease.netmask);
+    inet_ntop(AF_INET, &lease.address, address, sizeof(address));
+    inet_ntop(AF_INET, &lease.gateway, gateway, sizeof(gateway));
+    inet_ntop(AF_INET, lease.dns ? &lease.dns : &lease.gateway, dns, sizeof(dns));
+    snprintf(result, sizeof(result), "%s %d %s %s", address, prefix, gateway, dns);
+    return (*env)->NewStringUTF(env, result);
 }
 
 JNIEXPORT void JNICALL
-Java_com_viper_simplert_Native_start(JNIEnv *env, jclass type, jint tun_fd, jint acc_fd)
+Java_com_viper_simplert_Native_start(JNIEnv *env, jclass type, jint tun_fd, jint acc_fd, jstring options)
 {
-    LOGV("%s: tun_fd = %d, acc_fd = %d", __func__, tun_fd, acc_fd);
+    const char *options_str;
 
-    if (module.is_started) {
-        LOGE("Native threads already started!");
-        return;
-    }
+    LOGV("%s: tun_fd = %d, acc_fd = %d", __func__, tun_fd, acc_fd);
 
-    module.is_started = true;
-    module.tun_fd = tun_fd;
-    module.acc_fd = acc_fd;
+    pthread_mutex_lock(&forwarder_lock);
 
-    int flags = fcntl(tun_fd, F_GETFL, 0);
-    fcntl(tun_fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (current) {
+        if (forwarder_is_running(current)) {
+            LOGE("Native threads already started!");
+            goto out;
+        }
+        /* Finished on its own, e.g. after an I/O error */
+        forwarder_stop(current);
+        current = NULL;
+    }
 
-    flags = fcntl(acc_fd, F_GETFL, 0);
-    fcntl(acc_fd, F_SETFL, flags & ~O_NONBLOCK);
+    options_str = options ? (*env)->GetStringUTFChars(env, options, NULL) : NULL;
+    current = forwarder_start(tun_fd, acc_fd, options_str, pending_l2);
+    pending_l2 = NULL;
+    if (options_str)
+        (*env)->ReleaseStringUTFChars(env, options, options_str);
 
-    pthread_create(&module.tun_thread, NULL, thread_proc, TUN_THREAD);
-    pthread_create(&module.acc_thread, NULL, thread_proc, ACC_THREAD);
+out:
+    pthread_mutex_unlock(&forwarder_lock);
 }
 
 JNIEXPORT void JNICALL
 Java_com_viper_simplert_Native_stop(JNIEnv *env, jclass type)
 {
+    struct forwarder *fwd;
+
     LOGV(__func__);
 
-    module.is_started = false;
+    pthread_mutex_lock(&forwarder_lock);
+    fwd = current;
+    current = NULL;
+    pthread_mutex_unlock(&forwarder_lock);
 
-    pthread_join(module.tun_thread, NULL);
-    pthread_join(module.acc_thread, NULL);
+    if (fwd)
+        forwarder_stop(fwd);
 }
 
 JNIEXPORT jboolean JNICALL
 Java_com_viper_simplert_Native_is_1running(JNIEnv *env, jclass type)
 {
+    jboolean running;
+
     LOGV(__func__);
-    return module.is_started;
+
+    pthread_mutex_lock(&forwarder_lock);
+    running = current && forwarder_is_running(current);
+    pthread_mutex_unlock(&forwarder_lock);
+
+    return running;
+}
+
+/* Returns { packets, bytes, errors, max burst, filtered } for the up (TUN
+ * to accessory) direction followed by the same for the down direction, or
+ * null if not running */
+JNIEXPORT jlongArray JNICALL
+Java_com_viper_simplert_Native_get_1stats(JNIEnv *env, jclass type)
+{
+    struct forwarder_stats stats[FORWARDER_N_DIRECTIONS];
+    jlong values[N_STATS * FORWARDER_N_DIRECTIONS];
+    jlongArray array;
+    int i;
+
+    pthread_mutex_lock(&forwarder_lock);
+    if (!current) {
+        pthread_mutex_unlock(&forwarder_lock);
+        return NULL;
+    }
+    forwarder_get_stats(current, stats);
+    pthread_mutex_unlock(&forwarder_lock);
+
+    for (i = 0; i < FORWARDER_N_DIRECTIONS; i++) {
+        values[N_STATS * i] = stats[i].packets;
+        values[N_STATS * i + 1] = stats[i].bytes;
+        values[N_STATS * i + 2] = stats[i].errors;
+        values[N_STATS * i + 3] = stats[i].max_burst;
+        values[N_STATS * i + 4] = stats[i].filtered;
+    }
+
+    array = (*env)->NewLongArray(env, N_STATS * FORWARDER_N_DIRECTIONS);
+    if (array)
+        (*env)->SetLongArrayRegion(env, array, 0, N_STATS * FORWARDER_N_DIRECTIONS, values);
+    return array;
 }
@@ -0,0 +1,445 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the phone side forwarder on a Linux host, between a TUN device and a
+ * socketpair standing in for the accessory fd, and reports its throughput.
+ *
+ *  up:   UDP socket -> TUN -> forwarder -> socketpair -> bench
+ *  down: bench -> socketpair -> forwarder -> TUN -> UDP socket
+ *
+ * Needs CAP_NET_ADMIN to create the TUN device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+#include "forwarder.h"
+#include "link.h"
+
+#define TUN_NAME     "srtbench0"
+#define LOCAL_ADDR   "10.99.0.1"
+#define REMOTE_ADDR  "10.99.0.2"
+#define BENCH_PORT   9999
+#define ACC_BUF_SIZE 16384
+
+static int duration = 5;
+static int payload_size = 1400;
+static const char *mode = "both";
+static const char *options;
+static bool verbose;
+
+static atomic_bool done;
+
+/******************************************************************************/
+
+static void log_func(enum forwarder_log_level level, const char *message)
+{
+    static const char *names[] = { "debug", "info", "warning", "error" };
+
+    if (verbose || level >= FORWARDER_LOG_WARNING)
+        fprintf(stderr, "forwarder %s: %s\n", names[level], message);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int tun_create(void)
+{
+    struct ifreq ifr;
+    struct sockaddr_in *addr = (struct sockaddr_in *) &ifr.ifr_addr;
+    int fd, sock;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "error: couldn't open /dev/net/tun: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, TUN_NAME, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "error: couldn't create TUN device: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, LOCAL_ADDR, &addr->sin_addr);
+    if (ioctl(sock, SIOCSIFADDR, &ifr) < 0)
+        goto err;
+
+    inet_pton(AF_INET, "255.255.255.0", &addr->sin_addr);
+    if (ioctl(sock, SIOCSIFNETMASK, &ifr) < 0)
+        goto err;
+
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+        goto err;
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0)
+        goto err;
+
+    close(sock);
+    return fd;
+
+err:
+    fprintf(stderr, "error: couldn't configure TUN device: %s\n", strerror(errno));
+    close(sock);
+    close(fd);
+    return -1;
+}
+
+static uint16_t ip_checksum(const uint8_t *buf, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+/* IPv4/UDP packet from the remote end to the local bench port, without UDP
+ * checksum */
+static size_t build_udp_packet(uint8_t *buf)
+{
+    size_t len = 20 + 8 + payload_size;
+    uint16_t checksum;
+
+    memset(buf, 0, len);
+    buf[0] = 0x45;
+    buf[2] = len >> 8;
+    buf[3] = len & 0xFF;
+    buf[8] = 64;
+    buf[9] = IPPROTO_UDP;
+    inet_pton(AF_INET, REMOTE_ADDR, &buf[12]);
+    inet_pton(AF_INET, LOCAL_ADDR, &buf[16]);
+    checksum = ip_checksum(buf, 20);
+    buf[10] = checksum >> 8;
+    buf[11] = checksum & 0xFF;
+
+    buf[20] = BENCH_PORT >> 8;
+    buf[21] = BENCH_PORT & 0xFF;
+    buf[22] = BENCH_PORT >> 8;
+    buf[23] = BENCH_PORT & 0xFF;
+    buf[24] = (8 + payload_size) >> 8;
+    buf[25] = (8 + payload_size) & 0xFF;
+
+    return len;
+}
+
+/******************************************************************************/
+/* Up: UDP socket -> TUN -> forwarder -> accessory */
+
+static void *up_sender_proc(void *arg)
+{
+    struct sockaddr_in dest = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BENCH_PORT),
+    };
+    char *payload = calloc(1, payload_size);
+    int sock;
+
+    inet_pton(AF_INET, REMOTE_ADDR, &dest.sin_addr);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    while (!atomic_load(&done)) {
+        if (sendto(sock, payload, payload_size, 0, (struct sockaddr *) &dest, sizeof(dest)) < 0 &&
+            errno != ENOBUFS && errno != EAGAIN) {
+            fprintf(stderr, "error: couldn't send: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    close(sock);
+    free(payload);
+    return NULL;
+}
+
+/* Counts IP packets in the transfers written by the forwarder */
+static void *up_receiver_proc(void *arg)
+{
+    int fd = *(int *) arg;
+    uint64_t *packets = calloc(1, sizeof(uint64_t));
+    uint8_t buf[ACC_BUF_SIZE];
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!atomic_load(&done)) {
+        ssize_t rd = recv(fd, buf, sizeof(buf), 0);
+
+        if (rd <= 0)
+            continue;
+
+        if (link_is_framed(buf, rd)) {
+            const uint8_t *p = buf;
+            size_t len = rd;
+            struct link_frame frame;
+
+            while (link_frame_next(&p, &len, &frame)) {
+                if (frame.type == LINK_FRAME_PACKET)
+                    (*packets)++;
+                else if (frame.type == LINK_FRAME_LZ4) {
+                    uint8_t raw[ACC_BUF_SIZE];
+                    int raw_len = link_decompress(&frame, raw, sizeof(raw));
+                    const uint8_t *q = raw;
+                    size_t qlen = raw_len > 0 ? raw_len : 0;
+                    struct link_frame inner;
+
+                    while (link_frame_next(&q, &qlen, &inner))
+                        (*packets)++;
+                }
+            }
+        } else
+            (*packets)++;
+    }
+
+    return packets;
+}
+
+/******************************************************************************/
+/* Down: accessory -> forwarder -> TUN -> UDP socket */
+
+static void *down_sender_proc(void *arg)
+{
+    int fd = *(int *) arg;
+    struct link_options link;
+    uint8_t packet[ACC_BUF_SIZE];
+    uint8_t buf[ACC_BUF_SIZE];
+    size_t packet_len, len = 0;
+
+    link_options_parse(options, &link);
+    packet_len = build_udp_packet(packet);
+
+    /* Same transfers the host would send: batches of PACKET frames up to the
+     * negotiated size if framing is used, single packets otherwise */
+    if (link.batch > 0) {
+        size_t batch = link.batch < sizeof(buf) ? link.batch : sizeof(buf);
+
+        while (len + LINK_FRAME_HEADER_SIZE + packet_len <= batch)
+            len += link_frame_put(&buf[len], sizeof(buf) - len, LINK_FRAME_PACKET, packet, packet_len);
+    }
+    if (len == 0) {
+        memcpy(buf, packet, packet_len);
+        len = packet_len;
+    }
+
+    while (!atomic_load(&done)) {
+        if (send(fd, buf, len, 0) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *down_receiver_proc(void *arg)
+{
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    uint64_t *packets = calloc(1, sizeof(uint64_t));
+    char buf[ACC_BUF_SIZE];
+    int sock = *(int *) arg;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!atomic_load(&done)) {
+        if (recv(sock, buf, sizeof(buf), 0) > 0)
+            (*packets)++;
+    }
+    return packets;
+}
+
+/******************************************************************************/
+
+static void print_stats(struct forwarder *fwd, double elapsed, uint64_t up_received, uint64_t down_received)
+{
+    static const char *names[] = { "up", "down" };
+    struct forwarder_stats stats[FORWARDER_N_DIRECTIONS];
+    uint64_t received[] = { up_received, down_received };
+    int i;
+
+    forwarder_get_stats(fwd, stats);
+
+    printf("%-5s %12s %12s %10s %8s %10s %10s\n",
+           "dir", "packets", "received", "Mbps", "errors", "max burst", "filtered");
+    for (i = 0; i < FORWARDER_N_DIRECTIONS; i++)
+        printf("%-5s %12llu %12llu %10.1f %8llu %10llu %10llu\n",
+               names[i],
+               (unsigned long long) stats[i].packets,
+               (unsigned long long) received[i],
+               stats[i].bytes * 8 / elapsed / 1e6,
+               (unsigned long long) stats[i].errors,
+               (unsigned long long) stats[i].max_burst,
+               (unsigned long long) stats[i].filtered);
+}
+
+static void print_help(const char *name)
+{
+    printf("Usage: %s [OPTIONS]\n"
+           "\n"
+           "  -d, --duration=SECONDS   test duration (default 5)\n"
+           "  -s, --size=BYTES         UDP payload size (default 1400)\n"
+           "  -m, --mode=MODE          up, down or both (default both)\n"
+           "  -o, --options=OPTIONS    link options, as given by the host, e.g.\n"
+           "                           \"batch=4096 caps=lz4 rate=40000000\"\n"
+           "  -v, --verbose            show forwarder logs\n"
+           "  -h, --help               show this help\n",
+           name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "duration", required_argument, NULL, 'd' },
+        { "size",     required_argument, NULL, 's' },
+        { "mode",     required_argument, NULL, 'm' },
+        { "options",  required_argument, NULL, 'o' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BENCH_PORT),
+    };
+    pthread_t up_sender, up_receiver, down_sender, down_receiver;
+    bool up, down;
+    struct forwarder *fwd;
+    uint64_t *up_received = NULL, *down_received = NULL;
+    int fds[2], tun_fd, udp_sock;
+    double start, elapsed;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:s:m:o:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            payload_size = atoi(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'o':
+            options = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+            print_help(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            print_help(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    up = strcmp(mode, "up") == 0 || strcmp(mode, "both") == 0;
+    down = strcmp(mode, "down") == 0 || strcmp(mode, "both") == 0;
+    if ((!up && !down) || duration <= 0 || payload_size <= 0 || payload_size > 1472) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    forwarder_set_log_func(log_func);
+
+    tun_fd = tun_create();
+    if (tun_fd < 0)
+        return EXIT_FAILURE;
+
+    /* Message boundaries are kept, as with the accessory */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        fprintf(stderr, "error: couldn't create socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    inet_pton(AF_INET, LOCAL_ADDR, &local.sin_addr);
+    if (bind(udp_sock, (struct sockaddr *) &local, sizeof(local)) < 0) {
+        fprintf(stderr, "error: couldn't bind UDP socket: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    fwd = forwarder_start(tun_fd, fds[0], options, NULL);
+    if (!fwd)
+        return EXIT_FAILURE;
+
+    start = now();
+    if (up) {
+        pthread_create(&up_receiver, NULL, up_receiver_proc, &fds[1]);
+        pthread_create(&up_sender, NULL, up_sender_proc, NULL);
+    }
+    if (down) {
+        pthread_create(&down_receiver, NULL, down_receiver_proc, &udp_sock);
+        pthread_create(&down_sender, NULL, down_sender_proc, &fds[1]);
+    }
+
+    sleep(duration);
+    atomic_store(&done, true);
+    elapsed = now() - start;
+
+    if (up) {
+        pthread_join(up_sender, NULL);
+        pthread_join(up_receiver, (void **) &up_received);
+    }
+    if (down) {
+        pthread_join(down_sender, NULL);
+        pthread_join(down_receiver, (void **) &down_received);
+    }
+
+    print_stats(fwd, elapsed, up_received ? *up_received : 0, down_received ? *down_received : 0);
+
+    /* Stopping doesn't wait for the accessory; closing our end then ends the
+     * reads and writes still blocked on it */
+    forwarder_stop(fwd);
+    close(fds[1]);
+    close(udp_sock);
+
+    free(up_received);
+    free(down_received);
+    return EXIT_SUCCESS;
+}
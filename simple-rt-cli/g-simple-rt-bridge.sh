@@ -0,0 +1,52 @@
+#!/bin/bash
+# SimpleRT: Reverse tethering utility for Android
+# Copyright (C) 2016-2017 Konstantin Menyaev
+# Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Enslaves a TAP device to the given bridge, so that the phone behind it sits
+# directly in the bridged LAN.
+
+#params from simple-rt-cli
+
+[ $# -ge 3 ] || {
+    echo "error: missing arguments"
+    exit 1
+}
+
+PLATFORM=$1
+TAP_DEV=$2
+BRIDGE=$3
+
+LOGGER="$(which logger)"
+[ -n "${LOGGER}" ] || exit 1
+
+IPROUTE2="$(which ip)"
+[ -n "${IPROUTE2}" ] || exit 1
+
+# Only allow Linux platform here
+[ "$PLATFORM" = "linux" ] || exit 2
+
+${IPROUTE2} link show dev ${BRIDGE} type bridge > /dev/null 2>&1 || {
+    ${LOGGER} -s -t "g-simple-rt" "error: ${BRIDGE} is not a bridge"
+    exit 3
+}
+
+${IPROUTE2} link set dev ${TAP_DEV} master ${BRIDGE} || exit 4
+${IPROUTE2} link set dev ${TAP_DEV} up || exit 4
+
+${LOGGER} -s -t "g-simple-rt" "bridged ${TAP_DEV} into ${BRIDGE}"
+
+exit 0
@@ -0,0 +1,340 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-capture.h"
+
+#define CAPTURE_MAX_RECORDS (1 << 20)
+
+/* Two cache lines per record */
+typedef struct {
+    volatile gint seq; /* odd while being written */
+    guint8        direction;
+    guint8        drop;
+    guint16       caplen;
+    guint32       len;
+    guint32       reserved;
+    gint64        tun_time;
+    gint64        usb_time;
+    guint8        data[CAPTURE_SNAPLEN];
+} CaptureRecord;
+
+G_STATIC_ASSERT (sizeof (CaptureRecord) == 128);
+
+struct _CaptureRing {
+    CaptureRecord *records;
+    gsize          mapped_size;
+    guint          n_records; /* power of 2 */
+    volatile gint  head;      /* records ever added */
+};
+
+/******************************************************************************/
+
+gint64
+capture_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+void
+capture_ring_add (CaptureRing      *ring,
+                  CaptureDirection  direction,
+                  const guint8     *packet,
+                  gsize             packet_len,
+                  gint64            tun_time,
+                  gint64            usb_time,
+                  CaptureDrop       drop)
+{
+    CaptureRecord *record;
+    guint          pos;
+
+    pos = (guint) g_atomic_int_add (&ring->head, 1);
+    record = &ring->records[pos & (ring->n_records - 1)];
+
+    /* Readers skip the record until the sequence is even again */
+    g_atomic_int_set (&record->seq, (gint) (pos * 2 + 1));
+    record->direction = direction;
+    record->drop = drop;
+    record->caplen = MIN (packet_len, CAPTURE_SNAPLEN);
+    record->len = packet_len;
+    record->tun_time = tun_time;
+    record->usb_time = usb_time;
+    memcpy (record->data, packet, record->caplen);
+    g_atomic_int_set (&record->seq, (gint) (pos * 2 + 2));
+}
+
+/******************************************************************************/
+/* pcapng output */
+
+#define PCAPNG_BLOCK_SHB 0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_EPB 0x00000006
+
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_COMMENT  1
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME      2
+#define PCAPNG_IF_TSRESOL   9
+#define PCAPNG_EPB_FLAGS    2
+
+#define PCAPNG_EPB_FLAG_INBOUND  1
+#define PCAPNG_EPB_FLAG_OUTBOUND 2
+
+/* Raw IPv4/IPv6, as read from the TUN device */
+#define PCAPNG_LINKTYPE_RAW 101
+
+#define PAD4(len) (((len) + 3) & ~3)
+
+static void
+put_u16 (GByteArray *array,
+         guint16     value)
+{
+    g_byte_array_append (array, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+put_u32 (GByteArray *array,
+         guint32     value)
+{
+    g_byte_array_append (array, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+put_padded (GByteArray   *array,
+            const guint8 *data,
+            gsize         len)
+{
+    static const guint8 zero[3];
+
+    g_byte_array_append (array, data, len);
+    g_byte_array_append (array, zero, PAD4 (len) - len);
+}
+
+static void
+put_option (GByteArray  *array,
+            guint16      code,
+            const void  *value,
+            gsize        len)
+{
+    put_u16 (array, code);
+    put_u16 (array, len);
+    put_padded (array, value, len);
+}
+
+/* Wraps the body in a block, all in host byte order */
+static void
+put_block (GByteArray *out,
+           guint32     type,
+           GByteArray *body)
+{
+    guint32 total_len = 12 + body->len;
+
+    put_u32 (out, type);
+    put_u32 (out, total_len);
+    g_byte_array_append (out, body->data, body->len);
+    put_u32 (out, total_len);
+    g_byte_array_set_size (body, 0);
+}
+
+static const gchar *
+drop_to_string (CaptureDrop drop)
+{
+    switch (drop) {
+    case CAPTURE_DROP_USB_TIMEOUT:
+        return "usb-timeout";
+    case CAPTURE_DROP_USB_ERROR:
+        return "usb-error";
+    case CAPTURE_DROP_TUN_ERROR:
+        return "tun-error";
+    case CAPTURE_DROP_INVALID:
+        return "invalid";
+    case CAPTURE_DROP_NONE:
+    default:
+        return NULL;
+    }
+}
+
+static void
+put_record (GByteArray          *out,
+            GByteArray          *body,
+            const CaptureRecord *record)
+{
+    gint64       first;
+    gint64       second;
+    const gchar *drop;
+    gchar        comment[128];
+    gint         comment_len;
+
+    /* Stamped when the packet entered the daemon */
+    if (record->direction == CAPTURE_DIRECTION_OUT) {
+        first = record->tun_time;
+        second = record->usb_time;
+    } else {
+        first = record->usb_time;
+        second = record->tun_time;
+    }
+    if (!first)
+        first = second;
+
+    put_u32 (body, 0);
+    put_u32 (body, (guint64) first >> 32);
+    put_u32 (body, (guint64) first & 0xFFFFFFFF);
+    put_u32 (body, record->caplen);
+    put_u32 (body, record->len);
+    put_padded (body, record->data, record->caplen);
+
+    put_u16 (body, PCAPNG_EPB_FLAGS);
+    put_u16 (body, 4);
+    put_u32 (body, record->direction == CAPTURE_DIRECTION_OUT ? PCAPNG_EPB_FLAG_OUTBOUND : PCAPNG_EPB_FLAG_INBOUND);
+
+    drop = drop_to_string (record->drop);
+    if (second && second != first)
+        comment_len = g_snprintf (comment, sizeof (comment), "%s %+.1f us%s%s",
+                                  record->direction == CAPTURE_DIRECTION_OUT ? "usb" : "tun",
+                                  (second - first) / 1000.0,
+                                  drop ? ", dropped: " : "", drop ? drop : "");
+    else
+        comment_len = g_snprintf (comment, sizeof (comment), "%s%s",
+                                  drop ? "dropped: " : "", drop ? drop : "");
+    if (comment_len > 0)
+        put_option (body, PCAPNG_OPT_COMMENT, comment, MIN ((gsize) comment_len, sizeof (comment) - 1));
+
+    put_option (body, PCAPNG_OPT_END, NULL, 0);
+    put_block (out, PCAPNG_BLOCK_EPB, body);
+}
+
+gboolean
+capture_ring_dump (CaptureRing  *ring,
+                   const gchar  *path,
+                   const gchar  *interface_name,
+                   GError      **error)
+{
+    GByteArray    *out;
+    GByteArray    *body;
+    guint          head;
+    guint          pos;
+    guint8         tsresol = 9; /* nanoseconds */
+    gboolean       ret;
+    static const gchar userappl[] = "g-simple-rt " PACKAGE_VERSION;
+
+    out = g_byte_array_new ();
+    body = g_byte_array_new ();
+
+    /* Section header, of unknown length */
+    put_u32 (body, 0x1A2B3C4D);
+    put_u16 (body, 1);
+    put_u16 (body, 0);
+    put_u32 (body, 0xFFFFFFFF);
+    put_u32 (body, 0xFFFFFFFF);
+    put_option (body, PCAPNG_SHB_USERAPPL, userappl, strlen (userappl));
+    put_option (body, PCAPNG_OPT_END, NULL, 0);
+    put_block (out, PCAPNG_BLOCK_SHB, body);
+
+    put_u16 (body, PCAPNG_LINKTYPE_RAW);
+    put_u16 (body, 0);
+    put_u32 (body, CAPTURE_SNAPLEN);
+    put_option (body, PCAPNG_IF_NAME, interface_name, strlen (interface_name));
+    put_option (body, PCAPNG_IF_TSRESOL, &tsresol, 1);
+    put_option (body, PCAPNG_OPT_END, NULL, 0);
+    put_block (out, PCAPNG_BLOCK_IDB, body);
+
+    head = (guint) g_atomic_int_get (&ring->head);
+    for (pos = head - MIN (head, ring->n_records); pos != head; pos++) {
+        CaptureRecord *record;
+        CaptureRecord  copy;
+        gint           seq;
+
+        /* Skip records being written, or already overwritten */
+        record = &ring->records[pos & (ring->n_records - 1)];
+        seq = g_atomic_int_get (&record->seq);
+        if (seq != (gint) (pos * 2 + 2))
+            continue;
+        memcpy (&copy, record, sizeof (copy));
+        if (g_atomic_int_get (&record->seq) != seq)
+            continue;
+
+        put_record (out, body, &copy);
+    }
+
+    ret = g_file_set_contents (path, (const gchar *) out->data, out->len, error);
+
+    g_byte_array_unref (body);
+    g_byte_array_unref (out);
+    return ret;
+}
+
+/******************************************************************************/
+
+guint
+capture_ring_get_size (CaptureRing *ring)
+{
+    return ring->n_records;
+}
+
+CaptureRing *
+capture_ring_new (guint    n_records,
+                  GError **error)
+{
+    CaptureRing *ring;
+    guint        n = 1;
+
+    if (n_records == 0 || n_records > CAPTURE_MAX_RECORDS) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                     "invalid number of capture records: %u (1-%u)", n_records, CAPTURE_MAX_RECORDS);
+        return NULL;
+    }
+    while (n < n_records)
+        n <<= 1;
+
+    ring = g_slice_new0 (CaptureRing);
+    ring->n_records = n;
+    ring->mapped_size = n * sizeof (CaptureRecord);
+
+    /* Populated upfront, so that capturing never waits on page faults */
+    ring->records = mmap (NULL, ring->mapped_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring->records == MAP_FAILED) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't map capture ring: %s", g_strerror (errno));
+        g_slice_free (CaptureRing, ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void
+capture_ring_free (CaptureRing *ring)
+{
+    munmap (ring->records, ring->mapped_size);
+    g_slice_free (CaptureRing, ring);
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_CAPTURE_H
+#define G_SIMPLE_RT_CAPTURE_H
+
+#include <glib.h>
+
+/*
+ * Packet capture ring.
+ *
+ * Keeps the headers of the last packets forwarded, with the time they went
+ * through the TUN device and through the USB link and whether they were
+ * dropped, in a fixed size memory mapped ring. Old records are overwritten.
+ *
+ * Records may be added from any thread without locking; the ring may be
+ * dumped as pcapng at any time, skipping the records being written.
+ */
+
+/* Bytes kept of each packet, enough for IP and TCP headers with options */
+#define CAPTURE_SNAPLEN 96
+
+#define CAPTURE_DEFAULT_RECORDS 65536
+
+typedef enum {
+    CAPTURE_DIRECTION_OUT, /* to the phone: TUN read, then USB */
+    CAPTURE_DIRECTION_IN,  /* from the phone: USB, then TUN write */
+} CaptureDirection;
+
+typedef enum {
+    CAPTURE_DROP_NONE,
+    CAPTURE_DROP_USB_TIMEOUT,
+    CAPTURE_DROP_USB_ERROR,
+    CAPTURE_DROP_TUN_ERROR,
+    CAPTURE_DROP_INVALID,
+} CaptureDrop;
+
+typedef struct _CaptureRing CaptureRing;
+
+CaptureRing *capture_ring_new       (guint              n_records,
+                                     GError           **error);
+void         capture_ring_free      (CaptureRing       *ring);
+guint        capture_ring_get_size  (CaptureRing       *ring);
+
+/* Realtime clock, in nanoseconds */
+gint64       capture_now            (void);
+
+void         capture_ring_add       (CaptureRing       *ring,
+                                     CaptureDirection   direction,
+                                     const guint8      *packet,
+                                     gsize              packet_len,
+                                     gint64             tun_time,
+                                     gint64             usb_time,
+                                     CaptureDrop        drop);
+
+gboolean     capture_ring_dump      (CaptureRing       *ring,
+                                     const gchar       *path,
+                                     const gchar       *interface_name,
+                                     GError           **error);
+
+#endif /* G_SIMPLE_RT_CAPTURE_H */
@@ -0,0 +1,283 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-control.h"
+
+#define CONTROL_MAX_LINE    4096
+#define CONTROL_MAX_CLIENTS 16
+
+typedef struct {
+    ControlServer *server;
+    gint           fd;
+    guint          source_id;
+    GIOCondition   condition;
+    GString       *in;
+    GString       *out;
+} Client;
+
+struct _ControlServer {
+    gchar              *path;
+    gint                fd;
+    gboolean            bound; /* the socket file is ours to remove */
+    guint               source_id;
+    ControlCommandFunc  func;
+    gpointer            user_data;
+    GList              *clients;
+};
+
+static void
+client_free (Client *client)
+{
+    client->server->clients = g_list_remove (client->server->clients, client);
+    if (client->source_id)
+        g_source_remove (client->source_id);
+    close (client->fd);
+    g_string_free (client->in, TRUE);
+    g_string_free (client->out, TRUE);
+    g_slice_free (Client, client);
+}
+
+static gboolean client_cb (gint fd, GIOCondition condition, Client *client);
+
+static void
+client_watch (Client       *client,
+              GIOCondition  condition)
+{
+    if (client->source_id) {
+        if (client->condition == condition)
+            return;
+        g_source_remove (client->source_id);
+    }
+    client->condition = condition;
+    client->source_id = g_unix_fd_add (client->fd, condition, (GUnixFDSourceFunc) client_cb, client);
+}
+
+/* Returns FALSE if the client is gone */
+static gboolean
+client_flush (Client *client)
+{
+    while (client->out->len > 0) {
+        gssize sent;
+
+        sent = send (client->fd, client->out->str, client->out->len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return FALSE;
+        }
+        g_string_erase (client->out, 0, sent);
+    }
+
+    /* Stop reading commands until the replies are out */
+    client_watch (client, client->out->len > 0 ? G_IO_OUT : G_IO_IN);
+    return TRUE;
+}
+
+static void
+client_run_command (Client      *client,
+                    const gchar *line)
+{
+    gchar   **argv = NULL;
+    gint      argc = 0;
+    GError   *error = NULL;
+
+    if (!g_shell_parse_argv (line, &argc, &argv, &error)) {
+        /* Empty lines are fine, just ignored */
+        if (g_error_matches (error, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING)) {
+            g_error_free (error);
+            return;
+        }
+    } else if (client->server->func (argv, client->out, client->server->user_data, &error)) {
+        g_string_append (client->out, "OK\n");
+        g_strfreev (argv);
+        return;
+    }
+
+    g_string_append_printf (client->out, "ERROR %s\n", error->message);
+    g_error_free (error);
+    g_strfreev (argv);
+}
+
+static gboolean
+client_cb (gint          fd,
+           GIOCondition  condition,
+           Client       *client)
+{
+    gchar  buffer[1024];
+    gssize nread;
+    gchar *eol;
+
+    if (condition & G_IO_OUT) {
+        if (!client_flush (client))
+            goto out;
+        return G_SOURCE_CONTINUE;
+    }
+
+    nread = recv (fd, buffer, sizeof (buffer), 0);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return G_SOURCE_CONTINUE;
+    if (nread <= 0)
+        goto out;
+
+    g_string_append_len (client->in, buffer, nread);
+    while ((eol = memchr (client->in->str, '\n', client->in->len)) != NULL) {
+        *eol = '\0';
+        g_strchomp (client->in->str);
+        client_run_command (client, client->in->str);
+        g_string_erase (client->in, 0, eol - client->in->str + 1);
+    }
+    if (client->in->len > CONTROL_MAX_LINE) {
+        g_warning ("control: line too long, dropping client");
+        goto out;
+    }
+
+    if (client->out->len > 0 && !client_flush (client))
+        goto out;
+    return G_SOURCE_CONTINUE;
+
+ out:
+    /* The source is removed when returning */
+    client->source_id = 0;
+    client_free (client);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+accept_cb (gint           fd,
+           GIOCondition   condition,
+           ControlServer *server)
+{
+    Client *client;
+    gint    client_fd;
+
+    client_fd = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+        if (errno != EINTR && errno != EAGAIN)
+            g_warning ("control: couldn't accept connection: %s", g_strerror (errno));
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (g_list_length (server->clients) >= CONTROL_MAX_CLIENTS) {
+        g_warning ("control: too many clients");
+        close (client_fd);
+        return G_SOURCE_CONTINUE;
+    }
+
+    client = g_slice_new0 (Client);
+    client->server = server;
+    client->fd = client_fd;
+    client->in = g_string_new (NULL);
+    client->out = g_string_new (NULL);
+    client_watch (client, G_IO_IN);
+    server->clients = g_list_prepend (server->clients, client);
+
+    return G_SOURCE_CONTINUE;
+}
+
+ControlServer *
+control_server_new (const gchar         *path,
+                    ControlCommandFunc   func,
+                    gpointer             user_data,
+                    GError             **error)
+{
+    ControlServer      *server;
+    struct sockaddr_un  addr;
+    struct stat         st;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "socket path too long: %s", path);
+        return NULL;
+    }
+
+    server = g_slice_new0 (ControlServer);
+    server->func = func;
+    server->user_data = user_data;
+    server->path = g_strdup (path);
+
+    if ((server->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create socket: %s", g_strerror (errno));
+        goto error;
+    }
+
+    /* Left behind by a previous run; anything else is never removed */
+    if (lstat (path, &st) == 0) {
+        if (!S_ISSOCK (st.st_mode)) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS, "%s exists and is not a socket", path);
+            goto error;
+        }
+        unlink (path);
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    if (bind (server->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't listen in %s: %s", path, g_strerror (errno));
+        goto error;
+    }
+    server->bound = TRUE;
+
+    if (chmod (path, S_IRUSR | S_IWUSR) < 0 ||
+        listen (server->fd, CONTROL_MAX_CLIENTS) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't listen in %s: %s", path, g_strerror (errno));
+        goto error;
+    }
+
+    server->source_id = g_unix_fd_add (server->fd, G_IO_IN, (GUnixFDSourceFunc) accept_cb, server);
+    return server;
+
+ error:
+    control_server_free (server);
+    return NULL;
+}
+
+void
+control_server_free (ControlServer *server)
+{
+    while (server->clients)
+        client_free (server->clients->data);
+    if (server->source_id)
+        g_source_remove (server->source_id);
+    if (server->fd >= 0)
+        close (server->fd);
+    if (server->bound)
+        unlink (server->path);
+    g_free (server->path);
+    g_slice_free (ControlServer, server);
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_CONTROL_H
+#define G_SIMPLE_RT_CONTROL_H
+
+#include <glib.h>
+
+/*
+ * Local control socket.
+ *
+ * Clients connected to a unix stream socket send one command per line, split
+ * in words as in a shell. Each command gets the reply lines written by the
+ * handler, followed by "OK" or by "ERROR <message>".
+ *
+ * Runs in the main loop; not thread-safe.
+ */
+
+typedef struct _ControlServer ControlServer;
+
+/* Appends the reply lines to reply, or returns FALSE and sets error */
+typedef gboolean (* ControlCommandFunc) (gchar    **argv,
+                                         GString   *reply,
+                                         gpointer   user_data,
+                                         GError   **error);
+
+ControlServer *control_server_new  (const gchar         *path,
+                                    ControlCommandFunc   func,
+                                    gpointer             user_data,
+                                    GError             **error);
+void           control_server_free (ControlServer       *server);
+
+#endif /* G_SIMPLE_RT_CONTROL_H */
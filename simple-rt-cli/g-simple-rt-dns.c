@@ -0,0 +1,722 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-dns.h"
+
+#define DNS_PORT              53
+#define DNS_HEADER_SIZE       12
+#define DNS_MAX_MESSAGE       4096
+#define DNS_TYPE_OPT          41
+#define DNS_RCODE_NOERROR     0
+#define DNS_RCODE_NXDOMAIN    3
+
+#define DNS_DEFAULT_UPSTREAM  "8.8.8.8"
+#define DNS_RESOLV_CONF       "/etc/resolv.conf"
+
+#define DNS_CACHE_MAX_ENTRIES 4096
+#define DNS_CACHE_MAX_TTL     86400
+#define DNS_MAX_PENDING       256 /* one socket each */
+#define DNS_QUERY_TIMEOUT_S   5
+
+typedef struct {
+    gchar  *key;
+    guint8 *response;
+    gsize   response_len;
+    gint64  stored;  /* monotonic, seconds */
+    gint64  expires; /* monotonic, seconds */
+    GList  *lru_link;
+} CacheEntry;
+
+typedef struct {
+    DnsForwarder *forwarder;
+    gchar        *address;
+    gint          fd;
+    guint         source_id;
+} Listener;
+
+/* Each query goes upstream from a socket of its own, connected to the
+ * server, so that a spoofed response needs to guess the random source port
+ * chosen by the kernel along with the random ID */
+typedef struct {
+    DnsForwarder       *forwarder;
+    Listener           *listener;
+    struct sockaddr_in  client;
+    guint16             client_id;
+    guint16             id;
+    gchar              *key; /* NULL if not cacheable */
+    gint64              sent;
+    gint                fd;
+    guint               source_id;
+} PendingQuery;
+
+struct _DnsForwarder {
+    gchar              *upstream_str;
+    struct sockaddr_in  upstream;
+    guint               timeout_id;
+
+    GHashTable *listeners; /* address -> Listener */
+    GHashTable *pending;   /* PendingQuery set */
+    GHashTable *cache;     /* key -> CacheEntry */
+    GQueue      lru;       /* CacheEntry, most recently used first */
+
+    guint64 n_hits;
+    guint64 n_misses;
+};
+
+static gint64
+now_seconds (void)
+{
+    return g_get_monotonic_time () / G_USEC_PER_SEC;
+}
+
+/******************************************************************************/
+/* Message parsing */
+
+static guint16
+get16 (const guint8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static guint32
+get32 (const guint8 *p)
+{
+    return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+put16 (guint8  *p,
+       guint16  val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xFF;
+}
+
+static void
+put32 (guint8  *p,
+       guint32  val)
+{
+    p[0] = val >> 24;
+    p[1] = (val >> 16) & 0xFF;
+    p[2] = (val >> 8) & 0xFF;
+    p[3] = val & 0xFF;
+}
+
+/* Returns the offset right after the name at the given offset, 0 if invalid */
+static gsize
+skip_name (const guint8 *msg,
+           gsize         len,
+           gsize         offset)
+{
+    while (offset < len) {
+        guint8 label = msg[offset];
+
+        if (label == 0)
+            return offset + 1;
+        if ((label & 0xC0) == 0xC0)
+            return (offset + 2 <= len) ? offset + 2 : 0;
+        if (label & 0xC0)
+            return 0;
+        offset += 1 + label;
+    }
+    return 0;
+}
+
+/* Reads the single question of a message as "name/type/class". Returns NULL
+ * if it can't be parsed; question_end is set to the offset after it. */
+static GString *
+parse_question (const guint8 *msg,
+                gsize         len,
+                gsize        *question_end)
+{
+    GString *str;
+    gsize    offset = DNS_HEADER_SIZE;
+
+    if (len < DNS_HEADER_SIZE || get16 (&msg[4]) != 1)
+        return NULL;
+
+    str = g_string_new (NULL);
+    while (offset < len && msg[offset] != 0) {
+        guint8 label = msg[offset];
+        guint  i;
+
+        /* No compression expected in the question */
+        if ((label & 0xC0) || offset + 1 + label > len)
+            goto err;
+
+        for (i = 0; i < label; i++) {
+            guint8 c = msg[offset + 1 + i];
+
+            if (c == '\0' || c == '.' || c == '/')
+                goto err;
+            g_string_append_c (str, g_ascii_tolower (c));
+        }
+        g_string_append_c (str, '.');
+        offset += 1 + label;
+    }
+
+    if (offset + 5 > len)
+        goto err;
+    offset++;
+
+    g_string_append_printf (str, "/%u/%u", get16 (&msg[offset]), get16 (&msg[offset + 2]));
+    *question_end = offset + 4;
+    return str;
+
+err:
+    g_string_free (str, TRUE);
+    return NULL;
+}
+
+/* Cache key of a standard query. Queries with and without EDNS, or with the
+ * DNSSEC OK bit, get different answers, so they are cached separately.
+ * Returns NULL if the query isn't cacheable. */
+static gchar *
+build_query_key (const guint8 *msg,
+                 gsize         len,
+                 gsize        *question_end)
+{
+    GString *key;
+    gsize    offset;
+    guint    n_additional;
+    guint    i;
+    gboolean edns = FALSE;
+    gboolean dnssec_ok = FALSE;
+
+    /* QR=0, opcode QUERY, not truncated; nothing but additional records */
+    if (len < DNS_HEADER_SIZE || (msg[2] & 0xFA) != 0 || get16 (&msg[6]) != 0 || get16 (&msg[8]) != 0)
+        return NULL;
+
+    if ((key = parse_question (msg, len, question_end)) == NULL)
+        return NULL;
+
+    offset = *question_end;
+    n_additional = get16 (&msg[10]);
+    for (i = 0; i < n_additional; i++) {
+        offset = skip_name (msg, len, offset);
+        if (!offset || offset + 10 > len) {
+            g_string_free (key, TRUE);
+            return NULL;
+        }
+        if (get16 (&msg[offset]) == DNS_TYPE_OPT) {
+            edns = TRUE;
+            dnssec_ok = !!(msg[offset + 6] & 0x80);
+        }
+        offset += 10 + get16 (&msg[offset + 8]);
+    }
+
+    g_string_append (key, edns ? (dnssec_ok ? "/do" : "/edns") : "/");
+    return g_string_free (key, FALSE);
+}
+
+/* Goes over all resource records of a response, except for OPT ones, and
+ * returns how many there are and their minimum TTL. If age is given, it's
+ * first subtracted from each TTL, in place. Returns -1 if malformed. */
+static gint
+process_ttls (guint8  *msg,
+              gsize    len,
+              guint32  age,
+              guint32 *min_ttl)
+{
+    gsize offset = DNS_HEADER_SIZE;
+    guint n_questions;
+    guint n_records;
+    guint i;
+    gint  n = 0;
+
+    if (len < DNS_HEADER_SIZE)
+        return -1;
+
+    n_questions = get16 (&msg[4]);
+    n_records = get16 (&msg[6]) + get16 (&msg[8]) + get16 (&msg[10]);
+
+    for (i = 0; i < n_questions; i++) {
+        offset = skip_name (msg, len, offset);
+        if (!offset || offset + 4 > len)
+            return -1;
+        offset += 4;
+    }
+
+    *min_ttl = G_MAXUINT32;
+    for (i = 0; i < n_records; i++) {
+        offset = skip_name (msg, len, offset);
+        if (!offset || offset + 10 > len)
+            return -1;
+
+        if (get16 (&msg[offset]) != DNS_TYPE_OPT) {
+            guint32 ttl = get32 (&msg[offset + 4]);
+
+            if (age) {
+                ttl = ttl > age ? ttl - age : 0;
+                put32 (&msg[offset + 4], ttl);
+            }
+            *min_ttl = MIN (*min_ttl, ttl);
+            n++;
+        }
+
+        offset += 10 + get16 (&msg[offset + 8]);
+        if (offset > len)
+            return -1;
+    }
+
+    return n;
+}
+
+/******************************************************************************/
+/* LRU cache */
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+    g_free (entry->key);
+    g_free (entry->response);
+    g_slice_free (CacheEntry, entry);
+}
+
+static void
+cache_remove (DnsForwarder *forwarder,
+              CacheEntry   *entry)
+{
+    g_queue_delete_link (&forwarder->lru, entry->lru_link);
+    g_hash_table_remove (forwarder->cache, entry->key);
+}
+
+static CacheEntry *
+cache_lookup (DnsForwarder *forwarder,
+              const gchar  *key)
+{
+    CacheEntry *entry;
+
+    entry = g_hash_table_lookup (forwarder->cache, key);
+    if (!entry)
+        return NULL;
+
+    if (now_seconds () >= entry->expires) {
+        cache_remove (forwarder, entry);
+        return NULL;
+    }
+
+    g_queue_unlink (&forwarder->lru, entry->lru_link);
+    g_queue_push_head_link (&forwarder->lru, entry->lru_link);
+    return entry;
+}
+
+static void
+cache_store (DnsForwarder *forwarder,
+             const gchar  *key,
+             const guint8 *response,
+             gsize         response_len,
+             guint32       ttl)
+{
+    CacheEntry *entry;
+
+    if ((entry = g_hash_table_lookup (forwarder->cache, key)) != NULL)
+        cache_remove (forwarder, entry);
+    else if (g_hash_table_size (forwarder->cache) >= DNS_CACHE_MAX_ENTRIES)
+        cache_remove (forwarder, g_queue_peek_tail (&forwarder->lru));
+
+    entry = g_slice_new0 (CacheEntry);
+    entry->key = g_strdup (key);
+    entry->response = g_malloc (response_len);
+    memcpy (entry->response, response, response_len);
+    entry->response_len = response_len;
+    entry->stored = now_seconds ();
+    entry->expires = entry->stored + MIN (ttl, DNS_CACHE_MAX_TTL);
+
+    g_queue_push_head (&forwarder->lru, entry);
+    entry->lru_link = g_queue_peek_head_link (&forwarder->lru);
+    g_hash_table_insert (forwarder->cache, entry->key, entry);
+}
+
+/******************************************************************************/
+/* Queries */
+
+static void
+pending_query_free (PendingQuery *pending)
+{
+    if (pending->source_id)
+        g_source_remove (pending->source_id);
+    if (pending->fd >= 0)
+        close (pending->fd);
+    g_free (pending->key);
+    g_slice_free (PendingQuery, pending);
+}
+
+static void
+send_to_client (Listener                 *listener,
+                const struct sockaddr_in *client,
+                const guint8             *msg,
+                gsize                     len)
+{
+    if (sendto (listener->fd, msg, len, 0, (const struct sockaddr *) client, sizeof (*client)) < 0)
+        g_debug ("[dns %s] couldn't send response: %s", listener->address, g_strerror (errno));
+}
+
+static void
+reply_from_cache (Listener                 *listener,
+                  const struct sockaddr_in *client,
+                  const guint8             *query,
+                  gsize                     question_end,
+                  CacheEntry               *entry)
+{
+    guint8  response[DNS_MAX_MESSAGE];
+    guint32 min_ttl;
+
+    memcpy (response, entry->response, entry->response_len);
+
+    /* Same ID, and the same question spelling in case the client randomizes
+     * the letter case of the names; the key ensures the length matches */
+    memcpy (response, query, 2);
+    memcpy (&response[DNS_HEADER_SIZE], &query[DNS_HEADER_SIZE], question_end - DNS_HEADER_SIZE);
+
+    process_ttls (response, entry->response_len, now_seconds () - entry->stored, &min_ttl);
+    send_to_client (listener, client, response, entry->response_len);
+}
+
+static gboolean upstream_readable_cb (gint          fd,
+                                      GIOCondition  condition,
+                                      PendingQuery *pending);
+
+static void
+forward_query (DnsForwarder             *forwarder,
+               Listener                 *listener,
+               const struct sockaddr_in *client,
+               guint8                   *msg,
+               gsize                     len,
+               gchar                    *key)
+{
+    PendingQuery *pending;
+
+    if (g_hash_table_size (forwarder->pending) >= DNS_MAX_PENDING) {
+        g_debug ("[dns %s] too many pending queries, dropped", listener->address);
+        g_free (key);
+        return;
+    }
+
+    pending = g_slice_new0 (PendingQuery);
+    pending->forwarder = forwarder;
+    pending->listener = listener;
+    pending->client = *client;
+    pending->client_id = get16 (msg);
+    pending->key = key;
+    pending->sent = now_seconds ();
+
+    if (getrandom (&pending->id, sizeof (pending->id), 0) != sizeof (pending->id)) {
+        g_debug ("[dns] couldn't get random query ID: %s", g_strerror (errno));
+        pending->fd = -1;
+        pending_query_free (pending);
+        return;
+    }
+
+    if ((pending->fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        connect (pending->fd, (struct sockaddr *) &forwarder->upstream, sizeof (forwarder->upstream)) < 0) {
+        g_debug ("[dns] couldn't create upstream socket: %s", g_strerror (errno));
+        pending_query_free (pending);
+        return;
+    }
+
+    put16 (msg, pending->id);
+    if (send (pending->fd, msg, len, 0) < 0) {
+        g_debug ("[dns] couldn't forward query to %s: %s", forwarder->upstream_str, g_strerror (errno));
+        pending_query_free (pending);
+        return;
+    }
+
+    pending->source_id = g_unix_fd_add (pending->fd, G_IO_IN, (GUnixFDSourceFunc) upstream_readable_cb, pending);
+    g_hash_table_add (forwarder->pending, pending);
+}
+
+static gboolean
+listener_readable_cb (gint          fd,
+                      GIOCondition  condition,
+                      Listener     *listener)
+{
+    DnsForwarder       *forwarder = listener->forwarder;
+    guint8              msg[DNS_MAX_MESSAGE];
+    struct sockaddr_in  client;
+    socklen_t           client_len = sizeof (client);
+    gssize              len;
+    gsize               question_end = 0;
+    gchar              *key;
+    CacheEntry         *entry;
+
+    len = recvfrom (fd, msg, sizeof (msg), 0, (struct sockaddr *) &client, &client_len);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            g_warning ("[dns %s] couldn't receive query: %s", listener->address, g_strerror (errno));
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (len < DNS_HEADER_SIZE || (msg[2] & 0x80))
+        return G_SOURCE_CONTINUE;
+
+    key = build_query_key (msg, len, &question_end);
+    if (key && (entry = cache_lookup (forwarder, key)) != NULL) {
+        forwarder->n_hits++;
+        reply_from_cache (listener, &client, msg, question_end, entry);
+        g_free (key);
+        return G_SOURCE_CONTINUE;
+    }
+
+    forwarder->n_misses++;
+    forward_query (forwarder, listener, &client, msg, len, key);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+upstream_readable_cb (gint          fd,
+                      GIOCondition  condition,
+                      PendingQuery *pending)
+{
+    DnsForwarder *forwarder = pending->forwarder;
+    guint8        msg[DNS_MAX_MESSAGE];
+    gssize        len;
+
+    /* The socket is connected, only the upstream server gets through */
+    len = recv (fd, msg, sizeof (msg), 0);
+    if (len < 0) {
+        /* e.g. ICMP port unreachable; the query expires */
+        if (errno != EAGAIN && errno != EINTR)
+            g_debug ("[dns] couldn't receive response: %s", g_strerror (errno));
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* Only responses to the query we sent */
+    if (len < DNS_HEADER_SIZE || !(msg[2] & 0x80) || get16 (msg) != pending->id)
+        return G_SOURCE_CONTINUE;
+
+    if (pending->key) {
+        GString *question;
+        gsize    question_end;
+        guint    rcode = msg[3] & 0x0F;
+        guint32  min_ttl;
+
+        /* Drop responses to some other question */
+        question = parse_question (msg, len, &question_end);
+        if (question)
+            g_string_append_c (question, '/');
+        if (!question || !g_str_has_prefix (pending->key, question->str)) {
+            if (question)
+                g_string_free (question, TRUE);
+            return G_SOURCE_CONTINUE;
+        }
+        g_string_free (question, TRUE);
+
+        /* Positive answers, and negative ones carrying an SOA record, live
+         * as long as the shortest TTL in them; truncated ones aren't kept */
+        if (!(msg[2] & 0x02) &&
+            (rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN) &&
+            process_ttls (msg, len, 0, &min_ttl) > 0 &&
+            min_ttl > 0)
+            cache_store (forwarder, pending->key, msg, len, min_ttl);
+    }
+
+    put16 (msg, pending->client_id);
+    send_to_client (pending->listener, &pending->client, msg, len);
+    /* Removes this source */
+    pending->source_id = 0;
+    g_hash_table_remove (forwarder->pending, pending);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+pending_expired (PendingQuery *pending,
+                 gpointer      value,
+                 gint64       *now)
+{
+    return (*now - pending->sent >= DNS_QUERY_TIMEOUT_S);
+}
+
+static gboolean
+expire_pending_cb (DnsForwarder *forwarder)
+{
+    gint64 now = now_seconds ();
+
+    g_hash_table_foreach_remove (forwarder->pending, (GHRFunc) pending_expired, &now);
+    return G_SOURCE_CONTINUE;
+}
+
+/******************************************************************************/
+
+static void
+listener_free (Listener *listener)
+{
+    g_source_remove (listener->source_id);
+    close (listener->fd);
+    g_free (listener->address);
+    g_slice_free (Listener, listener);
+}
+
+gboolean
+dns_forwarder_listen (DnsForwarder  *forwarder,
+                      const gchar   *address,
+                      GError       **error)
+{
+    struct sockaddr_in  addr;
+    Listener           *listener;
+    gint                fd;
+    gint                one = 1;
+
+    if (g_hash_table_contains (forwarder->listeners, address))
+        return TRUE;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (DNS_PORT);
+    if (inet_pton (AF_INET, address, &addr.sin_addr) != 1) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "invalid address: %s", address);
+        return FALSE;
+    }
+
+    if ((fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "couldn't create socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    /* The address is only configured once the tunnel is up, and it goes away
+     * with it, so bind without requiring it to exist */
+    if (setsockopt (fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof (one)) < 0 ||
+        bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "couldn't bind to %s:%u: %s",
+                     address, DNS_PORT, g_strerror (errno));
+        close (fd);
+        return FALSE;
+    }
+
+    listener = g_slice_new0 (Listener);
+    listener->forwarder = forwarder;
+    listener->address = g_strdup (address);
+    listener->fd = fd;
+    listener->source_id = g_unix_fd_add (fd, G_IO_IN, (GUnixFDSourceFunc) listener_readable_cb, listener);
+    g_hash_table_insert (forwarder->listeners, listener->address, listener);
+
+    g_message ("[dns %s] listening, forwarding to %s", address, forwarder->upstream_str);
+    return TRUE;
+}
+
+gboolean
+dns_forwarder_is_listening (DnsForwarder *forwarder,
+                            const gchar  *address)
+{
+    return g_hash_table_contains (forwarder->listeners, address);
+}
+
+const gchar *
+dns_forwarder_get_upstream (DnsForwarder *forwarder)
+{
+    return forwarder->upstream_str;
+}
+
+/* First IPv4 nameserver in resolv.conf */
+static gchar *
+load_system_upstream (void)
+{
+    gchar  *contents = NULL;
+    gchar **lines;
+    gchar  *found = NULL;
+    guint   i;
+
+    if (!g_file_get_contents (DNS_RESOLV_CONF, &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; !found && lines[i]; i++) {
+        gchar          **tokens;
+        struct in_addr   addr;
+
+        tokens = g_strsplit_set (g_strstrip (lines[i]), " \t", -1);
+        if (g_strv_length (tokens) >= 2 &&
+            g_strcmp0 (tokens[0], "nameserver") == 0 &&
+            inet_pton (AF_INET, tokens[1], &addr) == 1)
+            found = g_strdup (tokens[1]);
+        g_strfreev (tokens);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return found;
+}
+
+DnsForwarder *
+dns_forwarder_new (const gchar  *upstream,
+                   GError      **error)
+{
+    DnsForwarder *forwarder;
+
+    forwarder = g_slice_new0 (DnsForwarder);
+    forwarder->upstream_str = upstream ? g_strdup (upstream) : load_system_upstream ();
+    if (!forwarder->upstream_str)
+        forwarder->upstream_str = g_strdup (DNS_DEFAULT_UPSTREAM);
+
+    forwarder->upstream.sin_family = AF_INET;
+    forwarder->upstream.sin_port = htons (DNS_PORT);
+    if (inet_pton (AF_INET, forwarder->upstream_str, &forwarder->upstream.sin_addr) != 1) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                     "invalid upstream DNS server address: %s", forwarder->upstream_str);
+        goto err;
+    }
+
+    forwarder->listeners = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) listener_free);
+    forwarder->pending = g_hash_table_new_full (g_direct_hash, g_direct_equal, (GDestroyNotify) pending_query_free, NULL);
+    forwarder->cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) cache_entry_free);
+    g_queue_init (&forwarder->lru);
+
+    forwarder->timeout_id = g_timeout_add_seconds (1, (GSourceFunc) expire_pending_cb, forwarder);
+
+    return forwarder;
+
+err:
+    g_free (forwarder->upstream_str);
+    g_slice_free (DnsForwarder, forwarder);
+    return NULL;
+}
+
+void
+dns_forwarder_free (DnsForwarder *forwarder)
+{
+    if (forwarder->n_hits + forwarder->n_misses > 0)
+        g_message ("[dns] %" G_GUINT64_FORMAT " queries answered from cache, %" G_GUINT64_FORMAT " forwarded",
+                   forwarder->n_hits, forwarder->n_misses);
+
+    g_source_remove (forwarder->timeout_id);
+
+    g_hash_table_unref (forwarder->listeners);
+    g_hash_table_unref (forwarder->pending);
+    g_queue_clear (&forwarder->lru);
+    g_hash_table_unref (forwarder->cache);
+
+    g_free (forwarder->upstream_str);
+    g_slice_free (DnsForwarder, forwarder);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_DNS_H
+#define G_SIMPLE_RT_DNS_H
+
+#include <glib.h>
+
+/*
+ * Caching DNS forwarder.
+ *
+ * Listens on UDP port 53 of each tunnel host address, and forwards the
+ * queries to a single upstream server. Answers are kept in an LRU cache
+ * shared by all tethered devices, for as long as their TTLs allow. Each
+ * query goes upstream from a new socket, with a port chosen by the kernel
+ * and an ID from getrandom(), to make spoofed answers hard to get cached.
+ *
+ * Runs in the main loop; not thread-safe.
+ */
+
+typedef struct _DnsForwarder DnsForwarder;
+
+DnsForwarder *dns_forwarder_new           (const gchar   *upstream,
+                                           GError       **error);
+void          dns_forwarder_free          (DnsForwarder  *forwarder);
+
+gboolean      dns_forwarder_listen        (DnsForwarder  *forwarder,
+                                           const gchar   *address,
+                                           GError       **error);
+gboolean      dns_forwarder_is_listening  (DnsForwarder  *forwarder,
+                                           const gchar   *address);
+
+const gchar  *dns_forwarder_get_upstream  (DnsForwarder  *forwarder);
+
+#endif /* G_SIMPLE_RT_DNS_H */
@@ -0,0 +1,317 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-flows.h"
+
+#define FLOW_TABLE_MAX_ENTRIES (1 << 20)
+
+/* Slots looked at for each flow */
+#define FLOW_PROBE_WINDOW 8
+
+typedef struct {
+    FlowKey key;
+    guint64 bytes;
+    guint64 packets; /* 0 if unused */
+    gint64  last_seen;
+} FlowEntry;
+
+typedef struct {
+    GMutex     mutex;
+    FlowEntry *entries;
+    guint64    evictions;
+} FlowHalf;
+
+struct _FlowTable {
+    guint    n_entries;
+    guint    mask;
+    FlowHalf halves[FLOW_DIRECTION_N];
+};
+
+/******************************************************************************/
+
+static gboolean
+flow_key_parse (FlowDirection  direction,
+                const guint8  *packet,
+                gsize          packet_len,
+                FlowKey       *key)
+{
+    guint32 src;
+    guint32 dst;
+    guint16 src_port = 0;
+    guint16 dst_port = 0;
+    guint   ihl;
+    guint16 frag;
+
+    if (packet_len < 20 || (packet[0] >> 4) != 4)
+        return FALSE;
+    ihl = (packet[0] & 0x0f) * 4;
+
+    memcpy (&src, &packet[12], sizeof (src));
+    memcpy (&dst, &packet[16], sizeof (dst));
+    memcpy (&frag, &packet[6], sizeof (frag));
+
+    /* Ports are only in the first fragment */
+    if ((packet[9] == IPPROTO_TCP || packet[9] == IPPROTO_UDP) &&
+        !(frag & htons (IP_OFFMASK)) && packet_len >= ihl + 4) {
+        memcpy (&src_port, &packet[ihl], sizeof (src_port));
+        memcpy (&dst_port, &packet[ihl + 2], sizeof (dst_port));
+    }
+
+    memset (key, 0, sizeof (*key));
+    key->proto = packet[9];
+    if (direction == FLOW_DIRECTION_OUT) {
+        key->local_addr = dst;
+        key->local_port = dst_port;
+        key->remote_addr = src;
+        key->remote_port = src_port;
+    } else {
+        key->local_addr = src;
+        key->local_port = src_port;
+        key->remote_addr = dst;
+        key->remote_port = dst_port;
+    }
+    return TRUE;
+}
+
+static inline guint
+flow_key_hash (const FlowKey *key)
+{
+    guint32 h;
+
+    h = key->local_addr * 0x9e3779b1u ^ key->remote_addr;
+    h = h * 0x85ebca6bu ^ (((guint32) key->local_port << 16) | key->remote_port);
+    h = h * 0xc2b2ae35u ^ key->proto;
+    return h ^ (h >> 16);
+}
+
+static inline gboolean
+flow_key_equal (const FlowKey *a,
+                const FlowKey *b)
+{
+    return (a->local_addr == b->local_addr &&
+            a->remote_addr == b->remote_addr &&
+            a->local_port == b->local_port &&
+            a->remote_port == b->remote_port &&
+            a->proto == b->proto);
+}
+
+void
+flow_table_add (FlowTable     *table,
+                FlowDirection  direction,
+                const guint8  *packet,
+                gsize          packet_len,
+                gint64         now)
+{
+    FlowHalf  *half = &table->halves[direction];
+    FlowEntry *entry = NULL;
+    FlowEntry *oldest = NULL;
+    FlowKey    key;
+    guint      hash;
+    guint      i;
+
+    if (!flow_key_parse (direction, packet, packet_len, &key))
+        return;
+    hash = flow_key_hash (&key);
+
+    g_mutex_lock (&half->mutex);
+
+    /* Entries are never removed, only replaced, so the first unused slot
+     * ends the search */
+    for (i = 0; i < FLOW_PROBE_WINDOW; i++) {
+        FlowEntry *aux = &half->entries[(hash + i) & table->mask];
+
+        if (!aux->packets) {
+            oldest = aux;
+            break;
+        }
+        if (flow_key_equal (&aux->key, &key)) {
+            entry = aux;
+            break;
+        }
+        if (!oldest || aux->last_seen < oldest->last_seen)
+            oldest = aux;
+    }
+
+    if (!entry) {
+        entry = oldest;
+        if (entry->packets)
+            half->evictions++;
+        entry->key = key;
+        entry->bytes = 0;
+        entry->packets = 0;
+    }
+
+    entry->bytes += packet_len;
+    entry->packets++;
+    entry->last_seen = now;
+
+    g_mutex_unlock (&half->mutex);
+}
+
+/******************************************************************************/
+
+#define CMP_FIELD(a, b, field) \
+    if ((a)->field != (b)->field) return (a)->field < (b)->field ? -1 : 1
+
+static gint
+flow_info_cmp_key (const FlowInfo *a,
+                   const FlowInfo *b)
+{
+    CMP_FIELD (&a->key, &b->key, local_addr);
+    CMP_FIELD (&a->key, &b->key, local_port);
+    CMP_FIELD (&a->key, &b->key, remote_addr);
+    CMP_FIELD (&a->key, &b->key, remote_port);
+    CMP_FIELD (&a->key, &b->key, proto);
+    return 0;
+}
+
+static gint
+flow_info_cmp_bytes (const FlowInfo *a,
+                     const FlowInfo *b)
+{
+    guint64 bytes_a = a->bytes[FLOW_DIRECTION_OUT] + a->bytes[FLOW_DIRECTION_IN];
+    guint64 bytes_b = b->bytes[FLOW_DIRECTION_OUT] + b->bytes[FLOW_DIRECTION_IN];
+
+    return bytes_a < bytes_b ? 1 : (bytes_a > bytes_b ? -1 : 0);
+}
+
+GArray *
+flow_table_top (FlowTable *table,
+                guint      n_flows)
+{
+    GArray *flows;
+    guint   dir;
+    guint   i;
+    guint   n;
+
+    flows = g_array_new (FALSE, FALSE, sizeof (FlowInfo));
+
+    /* Copied out first, so that the forwarding threads wait the least */
+    for (dir = 0; dir < FLOW_DIRECTION_N; dir++) {
+        FlowHalf *half = &table->halves[dir];
+
+        g_mutex_lock (&half->mutex);
+        for (i = 0; i < table->n_entries; i++) {
+            FlowEntry *entry = &half->entries[i];
+            FlowInfo   info;
+
+            if (!entry->packets)
+                continue;
+            memset (&info, 0, sizeof (info));
+            info.key = entry->key;
+            info.bytes[dir] = entry->bytes;
+            info.packets[dir] = entry->packets;
+            info.last_seen = entry->last_seen;
+            g_array_append_val (flows, info);
+        }
+        g_mutex_unlock (&half->mutex);
+    }
+
+    /* Both directions of the same flow next to each other, then merged */
+    g_array_sort (flows, (GCompareFunc) flow_info_cmp_key);
+    for (i = 0, n = 0; i < flows->len; i++) {
+        FlowInfo *info = &g_array_index (flows, FlowInfo, i);
+        FlowInfo *last = n ? &g_array_index (flows, FlowInfo, n - 1) : NULL;
+
+        if (last && !flow_info_cmp_key (last, info)) {
+            for (dir = 0; dir < FLOW_DIRECTION_N; dir++) {
+                last->bytes[dir] += info->bytes[dir];
+                last->packets[dir] += info->packets[dir];
+            }
+            last->last_seen = MAX (last->last_seen, info->last_seen);
+        } else
+            g_array_index (flows, FlowInfo, n++) = *info;
+    }
+    g_array_set_size (flows, n);
+
+    g_array_sort (flows, (GCompareFunc) flow_info_cmp_bytes);
+    if (flows->len > n_flows)
+        g_array_set_size (flows, n_flows);
+    return flows;
+}
+
+/******************************************************************************/
+
+guint
+flow_table_get_size (FlowTable *table)
+{
+    return table->n_entries;
+}
+
+guint64
+flow_table_get_evictions (FlowTable *table)
+{
+    guint64 evictions = 0;
+    guint   dir;
+
+    for (dir = 0; dir < FLOW_DIRECTION_N; dir++) {
+        g_mutex_lock (&table->halves[dir].mutex);
+        evictions += table->halves[dir].evictions;
+        g_mutex_unlock (&table->halves[dir].mutex);
+    }
+    return evictions;
+}
+
+FlowTable *
+flow_table_new (guint    n_entries,
+                GError **error)
+{
+    FlowTable *table;
+    guint      n = FLOW_PROBE_WINDOW;
+    guint      dir;
+
+    if (n_entries == 0 || n_entries > FLOW_TABLE_MAX_ENTRIES) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                     "invalid number of flow entries: %u (1-%u)", n_entries, FLOW_TABLE_MAX_ENTRIES);
+        return NULL;
+    }
+    while (n < n_entries)
+        n <<= 1;
+
+    table = g_slice_new0 (FlowTable);
+    table->n_entries = n;
+    table->mask = n - 1;
+    for (dir = 0; dir < FLOW_DIRECTION_N; dir++) {
+        g_mutex_init (&table->halves[dir].mutex);
+        table->halves[dir].entries = g_new0 (FlowEntry, n);
+    }
+    return table;
+}
+
+void
+flow_table_free (FlowTable *table)
+{
+    guint dir;
+
+    for (dir = 0; dir < FLOW_DIRECTION_N; dir++) {
+        g_mutex_clear (&table->halves[dir].mutex);
+        g_free (table->halves[dir].entries);
+    }
+    g_slice_free (FlowTable, table);
+}
@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_FLOWS_H
+#define G_SIMPLE_RT_FLOWS_H
+
+#include <glib.h>
+
+/*
+ * Per-flow accounting.
+ *
+ * Counts bytes and packets of each IPv4 flow (protocol, addresses and ports)
+ * of a device, in an open addressing hash table of fixed size. A flow is
+ * looked for in a short window of slots after its hash; when not found and
+ * the window is full, the flow seen least recently in it is evicted.
+ *
+ * Each direction has a table of its own, only written by the thread
+ * forwarding that direction, so that the lock taken for each packet is
+ * never contended but by the occasional query.
+ */
+
+#define FLOW_TABLE_DEFAULT_ENTRIES 4096
+
+typedef enum {
+    FLOW_DIRECTION_OUT, /* to the phone */
+    FLOW_DIRECTION_IN,  /* from the phone */
+    FLOW_DIRECTION_N
+} FlowDirection;
+
+/* Addresses and ports in network byte order; local is the phone side */
+typedef struct {
+    guint32 local_addr;
+    guint32 remote_addr;
+    guint16 local_port;
+    guint16 remote_port;
+    guint8  proto;
+} FlowKey;
+
+typedef struct {
+    FlowKey key;
+    guint64 bytes[FLOW_DIRECTION_N];
+    guint64 packets[FLOW_DIRECTION_N];
+    gint64  last_seen; /* monotonic time */
+} FlowInfo;
+
+typedef struct _FlowTable FlowTable;
+
+FlowTable *flow_table_new           (guint          n_entries,
+                                     GError       **error);
+void       flow_table_free          (FlowTable     *table);
+guint      flow_table_get_size      (FlowTable     *table);
+guint64    flow_table_get_evictions (FlowTable     *table);
+
+void       flow_table_add           (FlowTable     *table,
+                                     FlowDirection  direction,
+                                     const guint8  *packet,
+                                     gsize          packet_len,
+                                     gint64         now);
+
+/* Flows with the most bytes in both directions, as an array of FlowInfo */
+GArray    *flow_table_top           (FlowTable     *table,
+                                     guint          n_flows);
+
+#endif /* G_SIMPLE_RT_FLOWS_H */
@@ -71,6 +71,12 @@ FLOCK="$(which flock)"
         ${IPTABLES} -w -I FORWARD -j ACCEPT
     fi
 
+    # Let the tethered device reach the DNS forwarder in the host address
+    ${IPTABLES} -w -C INPUT -s ${TUNNEL_NET}/${TUNNEL_CIDR} -d ${HOST_ADDR} -p udp --dport 53 -j ACCEPT > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        ${IPTABLES} -w -I INPUT -s ${TUNNEL_NET}/${TUNNEL_CIDR} -d ${HOST_ADDR} -p udp --dport 53 -j ACCEPT
+    fi
+
     ${LOGGER} -s -t "g-simple-rt" "enabled forwarding ${TUNNEL_NET}/${TUNNEL_CIDR} --> ${LOCAL_INTERFACE}"
     ${IPTABLES} -w -t nat -I POSTROUTING -s ${TUNNEL_NET}/${TUNNEL_CIDR} -o $LOCAL_INTERFACE -j MASQUERADE
 
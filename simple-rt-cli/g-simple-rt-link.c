@@ -0,0 +1,322 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <time.h>
+
+#if defined WITH_LZ4
+# include <lz4.h>
+#endif
+
+#include "g-simple-rt-link.h"
+
+/******************************************************************************/
+/* Framing */
+
+gboolean
+link_is_framed (const guint8 *buffer,
+                gsize         buffer_len)
+{
+    return (buffer_len >= LINK_FRAME_HEADER_SIZE && (buffer[0] & 0xF0) == 0);
+}
+
+gsize
+link_frame_put (guint8       *buffer,
+                gsize         buffer_size,
+                LinkFrameType type,
+                const guint8 *payload,
+                gsize         payload_len)
+{
+    if (payload_len > G_MAXUINT16 || buffer_size < LINK_FRAME_HEADER_SIZE + payload_len)
+        return 0;
+
+    buffer[0] = (guint8) type;
+    buffer[1] = 0;
+    buffer[2] = (payload_len >> 8) & 0xFF;
+    buffer[3] = payload_len & 0xFF;
+    if (payload && payload != &buffer[LINK_FRAME_HEADER_SIZE])
+        memmove (&buffer[LINK_FRAME_HEADER_SIZE], payload, payload_len);
+
+    return LINK_FRAME_HEADER_SIZE + payload_len;
+}
+
+gboolean
+link_frame_next (const guint8 **buffer,
+                 gsize         *buffer_len,
+                 LinkFrame     *frame)
+{
+    gsize payload_len;
+
+    if (*buffer_len < LINK_FRAME_HEADER_SIZE)
+        return FALSE;
+
+    payload_len = ((*buffer)[2] << 8) | (*buffer)[3];
+    if (*buffer_len < LINK_FRAME_HEADER_SIZE + payload_len)
+        return FALSE;
+
+    frame->type        = (LinkFrameType) (*buffer)[0];
+    frame->payload     = *buffer + LINK_FRAME_HEADER_SIZE;
+    frame->payload_len = payload_len;
+
+    *buffer     += LINK_FRAME_HEADER_SIZE + payload_len;
+    *buffer_len -= LINK_FRAME_HEADER_SIZE + payload_len;
+    return TRUE;
+}
+
+gboolean
+link_hello_parse (const LinkFrame *frame,
+                  guint32         *caps,
+                  guint16         *max_rx_size)
+{
+    const guint8 *p = frame->payload;
+
+    if (frame->type != LINK_FRAME_HELLO || frame->payload_len < LINK_HELLO_PAYLOAD_SIZE)
+        return FALSE;
+
+    *caps        = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    *max_rx_size = (p[4] << 8) | p[5];
+    return TRUE;
+}
+
+/******************************************************************************/
+/* Health probes */
+
+#define PROBE_FIRST_BUCKET_SHIFT 6 /* 64us */
+
+gsize
+link_probe_put (guint8  *buffer,
+                gsize    buffer_size,
+                guint32  seq,
+                gint64   send_time)
+{
+    guint8 payload[LINK_PROBE_PAYLOAD_SIZE];
+    guint  i;
+
+    for (i = 0; i < 4; i++)
+        payload[i] = (seq >> (24 - 8 * i)) & 0xFF;
+    for (i = 0; i < 8; i++)
+        payload[4 + i] = ((guint64) send_time >> (56 - 8 * i)) & 0xFF;
+
+    return link_frame_put (buffer, buffer_size, LINK_FRAME_PROBE, payload, sizeof (payload));
+}
+
+gboolean
+link_reply_parse (const LinkFrame *frame,
+                  guint32         *seq,
+                  gint64          *send_time)
+{
+    const guint8 *p = frame->payload;
+    guint64       t = 0;
+    guint         i;
+
+    if (frame->type != LINK_FRAME_REPLY || frame->payload_len < LINK_PROBE_PAYLOAD_SIZE)
+        return FALSE;
+
+    *seq = ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    for (i = 0; i < 8; i++)
+        t = (t << 8) | p[4 + i];
+    *send_time = (gint64) t;
+    return TRUE;
+}
+
+void
+link_probe_stats_add (LinkProbeStats *stats,
+                      guint32         seq,
+                      gint64          rtt)
+{
+    guint bucket = 0;
+
+    if (stats->received > 0)
+        stats->jitter += (ABS (rtt - stats->last_rtt) - stats->jitter) / 16.0;
+    if (stats->received == 0 || rtt < stats->min_rtt)
+        stats->min_rtt = rtt;
+    if (rtt > stats->max_rtt)
+        stats->max_rtt = rtt;
+
+    while (bucket < LINK_PROBE_BUCKETS - 1 && rtt >= link_probe_stats_bucket_start (bucket + 1))
+        bucket++;
+    stats->buckets[bucket]++;
+
+    stats->sum_rtt += rtt;
+    stats->last_rtt = rtt;
+    stats->last_seq = seq;
+    stats->received++;
+}
+
+gint64
+link_probe_stats_bucket_start (guint bucket)
+{
+    return bucket ? ((gint64) 1 << (PROBE_FIRST_BUCKET_SHIFT + bucket - 1)) : 0;
+}
+
+/******************************************************************************/
+/* Compression */
+
+/* Batches smaller than this (e.g. bare TCP ACKs) are never worth compressing */
+#define COMPRESS_MIN_BATCH     128
+/* A batch must shrink at least this much to be sent compressed */
+#define COMPRESS_MAX_RATIO     0.9
+/* Upper bound of batches sent uncompressed after a compression loss */
+#define COMPRESS_MAX_BACKOFF   64
+/* EWMA weight for the ratio and cost estimates */
+#define COMPRESS_EWMA_WEIGHT   0.125
+
+gboolean
+link_lz4_supported (void)
+{
+#if defined WITH_LZ4
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+void
+link_compressor_init (LinkCompressor *compressor,
+                      guint64         link_rate)
+{
+    memset (compressor, 0, sizeof (LinkCompressor));
+    compressor->link_rate = link_rate;
+    compressor->ratio     = 0.5;
+}
+
+#if defined WITH_LZ4
+
+static void
+compressor_update (LinkCompressor *compressor,
+                   gsize           raw_len,
+                   gsize           compressed_len,
+                   gint64          elapsed_ns)
+{
+    gdouble ratio;
+    gdouble ns_per_byte;
+    gdouble saved_ns;
+
+    ratio       = (gdouble) compressed_len / (gdouble) raw_len;
+    ns_per_byte = (gdouble) elapsed_ns / (gdouble) raw_len;
+
+    compressor->ratio       += COMPRESS_EWMA_WEIGHT * (ratio - compressor->ratio);
+    compressor->ns_per_byte += COMPRESS_EWMA_WEIGHT * (ns_per_byte - compressor->ns_per_byte);
+
+    /* Compression is a loss if it doesn't shrink the data enough, or if
+     * compressing takes longer than sending the bytes it saves. */
+    saved_ns = (1.0 - compressor->ratio) * 1e9 / (gdouble) compressor->link_rate;
+    if (compressor->ratio > COMPRESS_MAX_RATIO || compressor->ns_per_byte > saved_ns) {
+        compressor->backoff = compressor->backoff ? MIN (compressor->backoff * 2, COMPRESS_MAX_BACKOFF) : 1;
+        compressor->skip    = compressor->backoff;
+    } else
+        compressor->backoff = 0;
+}
+
+gsize
+link_compressor_run (LinkCompressor *compressor,
+                     const guint8   *batch,
+                     gsize           batch_len,
+                     guint8         *out,
+                     gsize           out_size)
+{
+    struct timespec start, end;
+    gint            compressed_len;
+    gsize           max_len;
+
+    if (batch_len < COMPRESS_MIN_BATCH || batch_len > G_MAXUINT16)
+        return 0;
+
+    if (compressor->skip > 0) {
+        compressor->skip--;
+        compressor->n_skipped++;
+        return 0;
+    }
+
+    /* Never produce a frame bigger than the uncompressed batch */
+    max_len = MIN (out_size, batch_len);
+    if (max_len <= LINK_FRAME_HEADER_SIZE + 2)
+        return 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    compressed_len = LZ4_compress_default ((const char *) batch,
+                                           (char *) &out[LINK_FRAME_HEADER_SIZE + 2],
+                                           (int) batch_len,
+                                           (int) (max_len - LINK_FRAME_HEADER_SIZE - 2));
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    compressor_update (compressor,
+                       batch_len,
+                       compressed_len > 0 ? (gsize) compressed_len : batch_len,
+                       (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+
+    if (compressed_len <= 0) {
+        compressor->n_skipped++;
+        return 0;
+    }
+
+    out[LINK_FRAME_HEADER_SIZE]     = (batch_len >> 8) & 0xFF;
+    out[LINK_FRAME_HEADER_SIZE + 1] = batch_len & 0xFF;
+    compressor->n_compressed++;
+    return link_frame_put (out, out_size, LINK_FRAME_LZ4, NULL, compressed_len + 2);
+}
+
+gssize
+link_decompress (const LinkFrame *frame,
+                 guint8          *out,
+                 gsize            out_size)
+{
+    gsize raw_len;
+    gint  ret;
+
+    if (frame->type != LINK_FRAME_LZ4 || frame->payload_len < 2)
+        return -1;
+
+    raw_len = (frame->payload[0] << 8) | frame->payload[1];
+    if (raw_len > out_size)
+        return -1;
+
+    ret = LZ4_decompress_safe ((const char *) &frame->payload[2],
+                               (char *) out,
+                               (int) (frame->payload_len - 2),
+                               (int) raw_len);
+    if (ret < 0 || (gsize) ret != raw_len)
+        return -1;
+    return ret;
+}
+
+#else /* WITH_LZ4 */
+
+gsize
+link_compressor_run (LinkCompressor *compressor,
+                     const guint8   *batch,
+                     gsize           batch_len,
+                     guint8         *out,
+                     gsize           out_size)
+{
+    return 0;
+}
+
+gssize
+link_decompress (const LinkFrame *frame,
+                 guint8          *out,
+                 gsize            out_size)
+{
+    return -1;
+}
+
+#endif /* !WITH_LZ4 */
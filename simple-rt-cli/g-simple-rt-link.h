@@ -0,0 +1,142 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_LINK_H
+#define G_SIMPLE_RT_LINK_H
+
+#include <glib.h>
+
+/*
+ * Accessory link framing.
+ *
+ * A bulk transfer either carries a single raw IP packet (legacy peers), or a
+ * sequence of frames, each one with a 4-byte header:
+ *
+ *   byte 0:    frame type, always < 0x10 so that it never looks like the
+ *              first byte of an IPv4 or IPv6 header
+ *   byte 1:    flags, reserved, always 0
+ *   byte 2-3:  payload length, big endian
+ *
+ * Framing is only used towards the phone once it has announced itself with a
+ * HELLO frame. Keep in sync with the Android native layer (link.h).
+ */
+
+#define LINK_FRAME_HEADER_SIZE 4
+
+typedef enum {
+    LINK_FRAME_HELLO    = 0x01, /* payload: caps (u32 BE), max rx transfer (u16 BE) */
+    LINK_FRAME_PACKET   = 0x02, /* payload: one IP packet */
+    LINK_FRAME_LZ4      = 0x03, /* payload: raw size (u16 BE), LZ4 block of PACKET or ETHERNET frames */
+    LINK_FRAME_PROBE    = 0x04, /* payload: sequence (u32 BE), send time (u64 BE) */
+    LINK_FRAME_REPLY    = 0x05, /* payload: the one of the PROBE frame */
+    LINK_FRAME_ETHERNET = 0x06, /* payload: one Ethernet frame, when bridged */
+} LinkFrameType;
+
+#define LINK_HELLO_PAYLOAD_SIZE 6
+#define LINK_PROBE_PAYLOAD_SIZE 12
+
+/* Capabilities announced in the HELLO frame */
+#define LINK_CAP_LZ4      (1 << 0)
+#define LINK_CAP_PROBE    (1 << 1) /* PROBE frames are echoed back as REPLY */
+#define LINK_CAP_ETHERNET (1 << 2) /* ETHERNET frames are bridged, see --bridge */
+
+typedef struct {
+    LinkFrameType  type;
+    const guint8  *payload;
+    gsize          payload_len;
+} LinkFrame;
+
+gboolean link_is_framed  (const guint8 *buffer,
+                          gsize         buffer_len);
+gsize    link_frame_put  (guint8       *buffer,
+                          gsize         buffer_size,
+                          LinkFrameType type,
+                          const guint8 *payload,
+                          gsize         payload_len);
+gboolean link_frame_next (const guint8 **buffer,
+                          gsize         *buffer_len,
+                          LinkFrame     *frame);
+
+gboolean link_hello_parse (const LinkFrame *frame,
+                           guint32         *caps,
+                           guint16         *max_rx_size);
+
+/* Health probes. A PROBE frame is sent alone in a transfer, never
+ * compressed, and the phone writes it back as a REPLY frame as soon as it is
+ * read, without going through its TUN device; the round trip is then the
+ * time the link and the accessory drivers take. */
+
+gsize    link_probe_put   (guint8          *buffer,
+                           gsize            buffer_size,
+                           guint32          seq,
+                           gint64           send_time);
+gboolean link_reply_parse (const LinkFrame *frame,
+                           guint32         *seq,
+                           gint64          *send_time);
+
+/* Round trip times go into log2 buckets: the first one is below 64us, the
+ * last one 2^20us (about 1s) and above */
+#define LINK_PROBE_BUCKETS 16
+
+typedef struct {
+    guint64 sent;
+    guint64 received;
+    guint32 last_seq;
+    gint64  last_rtt;    /* us */
+    gint64  min_rtt;
+    gint64  max_rtt;
+    gint64  sum_rtt;
+    gdouble jitter;      /* us, smoothed RTT variation as in RFC 3550 */
+    guint64 buckets[LINK_PROBE_BUCKETS];
+} LinkProbeStats;
+
+void   link_probe_stats_add          (LinkProbeStats *stats,
+                                      guint32         seq,
+                                      gint64          rtt);
+/* Lower bound of the bucket, in us */
+gint64 link_probe_stats_bucket_start (guint           bucket);
+
+/* Compression */
+
+gboolean link_lz4_supported (void);
+
+typedef struct {
+    guint64 link_rate;   /* bytes per second */
+    gdouble ratio;       /* EWMA of compressed/raw size */
+    gdouble ns_per_byte; /* EWMA of compression cost */
+    guint   skip;        /* batches to send uncompressed before retrying */
+    guint   backoff;
+    guint64 n_compressed;
+    guint64 n_skipped;
+} LinkCompressor;
+
+void  link_compressor_init (LinkCompressor *compressor,
+                            guint64         link_rate);
+gsize link_compressor_run  (LinkCompressor *compressor,
+                            const guint8   *batch,
+                            gsize           batch_len,
+                            guint8         *out,
+                            gsize           out_size);
+
+gssize link_decompress (const LinkFrame *frame,
+                        guint8          *out,
+                        gsize            out_size);
+
+#endif /* G_SIMPLE_RT_LINK_H */
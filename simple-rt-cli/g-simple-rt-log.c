@@ -0,0 +1,217 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+
+#include <glib.h>
+
+#include "g-simple-rt-log.h"
+
+#define LOG_RING_SIZE          64
+#define LOG_MESSAGE_SIZE       248
+#define LOG_LIMIT_INTERVAL_US  (5 * G_USEC_PER_SEC)
+#define LOG_LIMIT_BURST        5
+#define LOG_DRAIN_INTERVAL_MS  100
+
+typedef struct {
+    GLogLevelFlags level;
+    gchar          message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+/* Single producer (the owner thread), single consumer (the drain thread) */
+typedef struct {
+    LogRecord     records[LOG_RING_SIZE];
+    volatile gint head;
+    volatile gint tail;
+    volatile gint dropped;
+    volatile gint orphaned; /* owner thread exited */
+} LogRing;
+
+static void log_ring_orphan (LogRing *ring);
+
+static GPrivate       thread_ring = G_PRIVATE_INIT ((GDestroyNotify) log_ring_orphan);
+static GMutex         rings_mutex;
+static GSList        *rings;
+static GThread       *drain_thread;
+static volatile gint  running;
+static LogOutputFunc  output_func;
+
+static void
+log_ring_orphan (LogRing *ring)
+{
+    /* Freed by the drain thread, once empty */
+    g_atomic_int_set (&ring->orphaned, TRUE);
+}
+
+static LogRing *
+log_ring_get (void)
+{
+    LogRing *ring;
+
+    if ((ring = g_private_get (&thread_ring)) != NULL)
+        return ring;
+    if (!g_atomic_int_get (&running))
+        return NULL;
+
+    ring = g_new0 (LogRing, 1);
+    g_mutex_lock (&rings_mutex);
+    rings = g_slist_prepend (rings, ring);
+    g_mutex_unlock (&rings_mutex);
+    g_private_set (&thread_ring, ring);
+    return ring;
+}
+
+/* Returns FALSE if the ring must be freed */
+static gboolean
+log_ring_drain (LogRing *ring)
+{
+    guint tail;
+    guint head;
+    gint  dropped;
+
+    head = (guint) g_atomic_int_get (&ring->head);
+    for (tail = (guint) g_atomic_int_get (&ring->tail); tail != head; tail++) {
+        LogRecord *record = &ring->records[tail % LOG_RING_SIZE];
+
+        output_func (record->level, record->message);
+        g_atomic_int_set (&ring->tail, (gint) (tail + 1));
+    }
+
+    if ((dropped = g_atomic_int_get (&ring->dropped)) != 0) {
+        gchar *message;
+
+        g_atomic_int_add (&ring->dropped, -dropped);
+        message = g_strdup_printf ("%d log messages dropped", dropped);
+        output_func (G_LOG_LEVEL_WARNING, message);
+        g_free (message);
+    }
+
+    return !(g_atomic_int_get (&ring->orphaned) && head == (guint) g_atomic_int_get (&ring->head));
+}
+
+static void
+log_drain (void)
+{
+    GSList *l;
+    GSList *next;
+
+    g_mutex_lock (&rings_mutex);
+    for (l = rings; l; l = next) {
+        next = g_slist_next (l);
+        if (!log_ring_drain (l->data)) {
+            g_free (l->data);
+            rings = g_slist_delete_link (rings, l);
+        }
+    }
+    g_mutex_unlock (&rings_mutex);
+}
+
+static gpointer
+drain_thread_func (gpointer unused)
+{
+    while (g_atomic_int_get (&running)) {
+        log_drain ();
+        g_usleep (LOG_DRAIN_INTERVAL_MS * 1000);
+    }
+    log_drain ();
+    return NULL;
+}
+
+void
+log_ring_start (LogOutputFunc output)
+{
+    g_assert (!drain_thread);
+
+    output_func = output;
+    g_atomic_int_set (&running, TRUE);
+    drain_thread = g_thread_new ("log", drain_thread_func, NULL);
+}
+
+void
+log_ring_stop (void)
+{
+    if (!drain_thread)
+        return;
+
+    /* Rings of threads still running are left alone, they may still be
+     * written; anything written from now on is lost */
+    g_atomic_int_set (&running, FALSE);
+    g_clear_pointer (&drain_thread, g_thread_join);
+}
+
+void
+log_ring_message (LogLimit       *limit,
+                  GLogLevelFlags  level,
+                  const gchar    *format,
+                  ...)
+{
+    LogRing   *ring;
+    LogRecord *record;
+    va_list    args;
+    gint64     now;
+    guint      suppressed = 0;
+    guint      head;
+    gint       len;
+
+    now = g_get_monotonic_time ();
+    if (now - limit->window_start >= LOG_LIMIT_INTERVAL_US) {
+        suppressed = limit->suppressed;
+        limit->window_start = now;
+        limit->count = 0;
+        limit->suppressed = 0;
+    }
+    if (limit->count >= LOG_LIMIT_BURST) {
+        limit->suppressed++;
+        return;
+    }
+    limit->count++;
+
+    if (!(ring = log_ring_get ())) {
+        gchar *message;
+
+        va_start (args, format);
+        message = g_strdup_vprintf (format, args);
+        va_end (args);
+        if (suppressed)
+            g_log (G_LOG_DOMAIN, level, "%s (%u similar messages suppressed)", message, suppressed);
+        else
+            g_log (G_LOG_DOMAIN, level, "%s", message);
+        g_free (message);
+        return;
+    }
+
+    head = (guint) g_atomic_int_get (&ring->head);
+    if (head - (guint) g_atomic_int_get (&ring->tail) >= LOG_RING_SIZE) {
+        g_atomic_int_inc (&ring->dropped);
+        return;
+    }
+
+    record = &ring->records[head % LOG_RING_SIZE];
+    record->level = level;
+    va_start (args, format);
+    len = g_vsnprintf (record->message, sizeof (record->message), format, args);
+    va_end (args);
+    if (suppressed && len < (gint) sizeof (record->message) - 1)
+        g_snprintf (&record->message[len], sizeof (record->message) - len,
+                    " (%u similar messages suppressed)", suppressed);
+    g_atomic_int_set (&ring->head, (gint) (head + 1));
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_LOG_H
+#define G_SIMPLE_RT_LOG_H
+
+#include <glib.h>
+
+/*
+ * Asynchronous logging for the data path.
+ *
+ * Messages are formatted in the calling thread into a ring of its own, with
+ * no locks nor syscalls involved, and written out by a background thread.
+ * Each message goes through a rate limit (a burst every few seconds), whose
+ * state is kept by the caller, usually per device and per reason; the
+ * number of messages suppressed is reported along with the next one let
+ * through. Messages that don't fit in a full ring are counted and reported
+ * as dropped.
+ *
+ * Before log_ring_start() and after log_ring_stop(), messages go straight
+ * to g_log().
+ */
+
+typedef struct {
+    gint64 window_start;
+    guint  count;
+    guint  suppressed;
+} LogLimit;
+
+typedef void (* LogOutputFunc) (GLogLevelFlags  level,
+                                const gchar    *message);
+
+void log_ring_start   (LogOutputFunc   output);
+void log_ring_stop    (void);
+
+/* A limit should only be used by one thread at a time */
+void log_ring_message (LogLimit       *limit,
+                       GLogLevelFlags  level,
+                       const gchar    *format,
+                       ...) G_GNUC_PRINTF (3, 4);
+
+#endif /* G_SIMPLE_RT_LOG_H */
@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include "g-simple-rt-mss.h"
+
+#define IPV4_HEADER_MIN 20
+#define IPV6_HEADER     40
+#define TCP_HEADER_MIN  20
+#define TCP_FLAG_SYN    0x02
+#define TCP_OPT_END     0
+#define TCP_OPT_NOP     1
+#define TCP_OPT_MSS     2
+
+/* Only the given byte of the segment changes, at the given offset from the
+ * TCP header; the checksum is updated with the 16-bit word it belongs to */
+static void
+checksum_update_byte (guint8 *tcp,
+                      gsize   offset,
+                      guint8  value)
+{
+    guint16 old_word;
+    guint16 new_word;
+    guint32 sum;
+
+    old_word = (offset % 2) ? tcp[offset] : (tcp[offset] << 8);
+    new_word = (offset % 2) ? value : (value << 8);
+
+    /* HC' = ~(~HC + ~m + m') */
+    sum = (guint16) ~((tcp[16] << 8) | tcp[17]);
+    sum += (guint16) ~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (guint16) ~sum;
+
+    tcp[16] = sum >> 8;
+    tcp[17] = sum & 0xFF;
+    tcp[offset] = value;
+}
+
+gboolean
+mss_clamp (guint8 *packet,
+           gsize   packet_len,
+           guint   mtu)
+{
+    guint8 *tcp;
+    gsize   tcp_len;
+    gsize   header_len;
+    gsize   i;
+    guint   max_mss;
+
+    switch (packet_len ? packet[0] >> 4 : 0) {
+    case 4:
+        header_len = (packet[0] & 0x0F) * 4;
+        if (packet_len < IPV4_HEADER_MIN ||
+            header_len < IPV4_HEADER_MIN ||
+            packet[9] != IPPROTO_TCP ||
+            ((packet[6] & 0x1F) | packet[7]) != 0)
+            return FALSE;
+        max_mss = mtu - IPV4_HEADER_MIN - TCP_HEADER_MIN;
+        break;
+    case 6:
+        header_len = IPV6_HEADER;
+        if (packet_len < IPV6_HEADER || packet[6] != IPPROTO_TCP)
+            return FALSE;
+        max_mss = mtu - IPV6_HEADER - TCP_HEADER_MIN;
+        break;
+    default:
+        return FALSE;
+    }
+
+    if (mtu <= header_len + TCP_HEADER_MIN || packet_len < header_len + TCP_HEADER_MIN)
+        return FALSE;
+
+    tcp = &packet[header_len];
+    tcp_len = packet_len - header_len;
+    if (!(tcp[13] & TCP_FLAG_SYN))
+        return FALSE;
+
+    /* Options go up to the data offset */
+    tcp_len = MIN (tcp_len, (gsize) (tcp[12] >> 4) * 4);
+    for (i = TCP_HEADER_MIN; i < tcp_len; ) {
+        guint mss;
+
+        if (tcp[i] == TCP_OPT_END)
+            break;
+        if (tcp[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= tcp_len || tcp[i + 1] < 2 || i + tcp[i + 1] > tcp_len)
+            break;
+        if (tcp[i] != TCP_OPT_MSS || tcp[i + 1] != 4) {
+            i += tcp[i + 1];
+            continue;
+        }
+
+        mss = (tcp[i + 2] << 8) | tcp[i + 3];
+        if (mss <= max_mss)
+            return FALSE;
+        checksum_update_byte (tcp, i + 2, max_mss >> 8);
+        checksum_update_byte (tcp, i + 3, max_mss & 0xFF);
+        return TRUE;
+    }
+
+    return FALSE;
+}
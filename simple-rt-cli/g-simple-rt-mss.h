@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef G_SIMPLE_RT_MSS_H
+#define G_SIMPLE_RT_MSS_H
+
+#include <glib.h>
+
+/*
+ * TCP MSS clamping.
+ *
+ * Lowers the MSS option of TCP SYN segments so that full-sized segments of
+ * the connection fit in the given MTU, as the TCPMSS target of iptables does,
+ * updating the TCP checksum incrementally (RFC 1624). Handles IPv4 (first
+ * fragments only) and IPv6 (TCP right after the fixed header).
+ */
+
+/* Returns TRUE if the packet was modified */
+gboolean mss_clamp (guint8 *packet,
+                    gsize   packet_len,
+                    guint   mtu);
+
+#endif /* G_SIMPLE_RT_MSS_H */
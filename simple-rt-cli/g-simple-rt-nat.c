@@ -0,0 +1,1198 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-nat.h"
+
+#define NAT_HASH_SIZE        2048
+#define NAT_QUEUE_SIZE       256
+
+#define NAT_TCP_TIMEOUT_S    7440
+#define NAT_UDP_TIMEOUT_S    120
+#define NAT_CLOSED_TIMEOUT_S 10
+
+/* TX rings are per slice, RX ring is shared by all */
+#define NAT_TX_FRAME_SIZE    2048
+#define NAT_TX_BLOCK_SIZE    (1 << 16)
+#define NAT_TX_BLOCK_NR      8
+#define NAT_TX_FRAME_NR      (NAT_TX_BLOCK_NR * (NAT_TX_BLOCK_SIZE / NAT_TX_FRAME_SIZE))
+#define NAT_RX_BLOCK_SIZE    (1 << 18)
+#define NAT_RX_BLOCK_NR      16
+#define NAT_RX_BLOCK_TOV_MS  1
+
+#define TCP_FLAGS_OFFSET     13
+#define TCP_FLAG_FIN         0x01
+#define TCP_FLAG_SYN         0x02
+#define TCP_FLAG_RST         0x04
+#define TCP_FLAG_ACK         0x10
+
+/******************************************************************************/
+/* Types */
+
+typedef struct {
+    volatile gint seq;          /* odd while being rewritten */
+    guint8        proto;        /* 0 if unused */
+    guint16       private_port; /* all in network byte order */
+    guint16       remote_port;
+    guint32       remote_addr;
+    guint16       next;         /* hash chain, entry index + 1 */
+    volatile gint closing;
+    volatile gint last_used;    /* seconds */
+} NatEntry;
+
+typedef struct {
+    guint16 len;
+    guint8  data[NAT_MAX_PACKET];
+} NatQueueSlot;
+
+struct _NatSlice {
+    NatEngine     *engine;
+    guint16        first_port;
+    volatile gint  address;     /* network byte order, 0 if detached */
+    gsize          mtu;
+
+    /* Owned by the thread forwarding from the device */
+    NatEntry       entries[NAT_SLICE_PORTS];
+    guint16        buckets[NAT_HASH_SIZE];
+    guint          hand;
+    gint           tx_fd;
+    guint8        *tx_ring;
+    guint          tx_next;
+    guint          tx_pending;
+
+    /* Single producer (RX thread), single consumer (thread forwarding to
+     * the device) */
+    NatQueueSlot   queue[NAT_QUEUE_SIZE];
+    volatile gint  queue_head;
+    volatile gint  queue_tail;
+    volatile gint  signaled;
+    gint           event_fd;
+};
+
+struct _NatEngine {
+    gchar          *uplink;
+    gint            ifindex;
+    guint32         address;
+    gchar          *address_str;
+    guint8          mac[ETH_ALEN];
+    guint32         local_network;
+    guint32         local_netmask;
+    guint16         first_port;
+    guint           n_slices;
+
+    /* Slices are created on first attach and kept until the engine is
+     * freed, so that the RX thread never sees one going away */
+    GMutex          mutex;
+    NatSlice      **slices;
+
+    /* Gateway link address, refreshed from the main loop */
+    volatile gint   gateway_seq;
+    guint32         gateway;
+    guint8          gateway_mac[ETH_ALEN];
+    gboolean        gateway_known;
+
+    /* Uplink MTU, refreshed from the main loop */
+    volatile gint   mtu;
+
+    gint            rx_fd;
+    guint8         *rx_ring;
+    GThread        *rx_thread;
+    gint            halt_fd;
+    volatile gint   halt;
+
+    volatile gint   n_out;
+    volatile gint   n_in;
+    volatile gint   n_dropped;
+};
+
+/******************************************************************************/
+/* Helpers */
+
+static inline guint16
+rd16 (const guint8 *p)
+{
+    guint16 v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static inline guint32
+rd32 (const guint8 *p)
+{
+    guint32 v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static inline void
+wr16 (guint8  *p,
+      guint16  v)
+{
+    memcpy (p, &v, sizeof (v));
+}
+
+static inline void
+wr32 (guint8  *p,
+      guint32  v)
+{
+    memcpy (p, &v, sizeof (v));
+}
+
+/* Incremental checksum update (RFC 1624). One's complement sums don't depend
+ * on byte order, so values are used as found in the packet. */
+static inline guint16
+csum_update16 (guint16 sum,
+               guint16 from,
+               guint16 to)
+{
+    guint32 s;
+
+    s = (guint16) ~sum + (guint16) ~from + to;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    return (guint16) ~s;
+}
+
+static inline guint16
+csum_update32 (guint16 sum,
+               guint32 from,
+               guint32 to)
+{
+    sum = csum_update16 (sum, (guint16) (from >> 16), (guint16) (to >> 16));
+    return csum_update16 (sum, (guint16) (from & 0xffff), (guint16) (to & 0xffff));
+}
+
+/* Rewrites one of the addresses and one of the ports of the packet, and
+ * decrements its TTL. Lengths were validated by the caller. */
+static void
+rewrite_packet (guint8  *ip,
+                guint    ihl,
+                guint    addr_offset,
+                guint32  addr,
+                guint    port_offset,
+                guint16  port)
+{
+    guint8  *l4 = ip + ihl;
+    guint32  old_addr;
+    guint16  old_port;
+    guint16  old_ttl;
+    guint16  sum;
+
+    old_addr = rd32 (ip + addr_offset);
+    old_port = rd16 (l4 + port_offset);
+
+    /* TTL shares its 16-bit word with the protocol */
+    old_ttl = rd16 (ip + 8);
+    ip[8]--;
+    sum = rd16 (ip + 10);
+    sum = csum_update16 (sum, old_ttl, rd16 (ip + 8));
+    sum = csum_update32 (sum, old_addr, addr);
+    wr16 (ip + 10, sum);
+    wr32 (ip + addr_offset, addr);
+
+    /* The transport checksum covers the pseudo-header, so the address too */
+    if (ip[9] == IPPROTO_TCP) {
+        sum = rd16 (l4 + 16);
+        sum = csum_update32 (sum, old_addr, addr);
+        sum = csum_update16 (sum, old_port, port);
+        wr16 (l4 + 16, sum);
+    } else if ((sum = rd16 (l4 + 6)) != 0) {
+        sum = csum_update32 (sum, old_addr, addr);
+        sum = csum_update16 (sum, old_port, port);
+        wr16 (l4 + 6, sum ? sum : 0xffff);
+    }
+    wr16 (l4 + port_offset, port);
+}
+
+/* Validates a TCP or UDP over IPv4 packet, returning its header length */
+static guint
+validate_packet (const guint8 *ip,
+                 gsize         len)
+{
+    guint ihl;
+
+    if (len < 20 || (ip[0] >> 4) != 4)
+        return 0;
+    ihl = (ip[0] & 0x0f) * 4;
+    if (ihl < 20 || ntohs (rd16 (ip + 2)) != len)
+        return 0;
+    /* No fragments; the ports are only in the first one */
+    if (rd16 (ip + 6) & htons (IP_MF | IP_OFFMASK))
+        return 0;
+    if (ip[8] <= 1)
+        return 0;
+    switch (ip[9]) {
+    case IPPROTO_TCP:
+        return len >= ihl + 20 ? ihl : 0;
+    case IPPROTO_UDP:
+        return len >= ihl + 8 ? ihl : 0;
+    default:
+        return 0;
+    }
+}
+
+/* Flows are only taken from their first packet; those started in the kernel
+ * path stay there. UDP has no such thing, so any datagram of an unknown flow
+ * starts one. */
+static gboolean
+entry_is_opening (const guint8 *ip,
+                  guint         ihl)
+{
+    return (ip[9] == IPPROTO_UDP ||
+            (ip[ihl + TCP_FLAGS_OFFSET] & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == TCP_FLAG_SYN);
+}
+
+static gboolean
+entry_is_closing (const guint8 *ip,
+                  guint         ihl)
+{
+    return ip[9] == IPPROTO_TCP && (ip[ihl + TCP_FLAGS_OFFSET] & (TCP_FLAG_FIN | TCP_FLAG_RST));
+}
+
+static inline gint
+now_s (void)
+{
+    return (gint) (g_get_monotonic_time () / G_USEC_PER_SEC);
+}
+
+/******************************************************************************/
+/* Translation table, owned by the slice thread */
+
+static guint
+entry_hash (guint8  proto,
+            guint16 private_port,
+            guint32 remote_addr,
+            guint16 remote_port)
+{
+    guint32 h;
+
+    h = remote_addr * 2654435761u;
+    h ^= (((guint32) private_port << 16) | remote_port) * 40503u;
+    h ^= proto;
+    h ^= h >> 15;
+    return h & (NAT_HASH_SIZE - 1);
+}
+
+static gboolean
+entry_expired (NatEntry *entry,
+               gint      now)
+{
+    gint timeout;
+
+    if (!entry->proto)
+        return TRUE;
+    if (g_atomic_int_get (&entry->closing))
+        timeout = NAT_CLOSED_TIMEOUT_S;
+    else
+        timeout = (entry->proto == IPPROTO_TCP ? NAT_TCP_TIMEOUT_S : NAT_UDP_TIMEOUT_S);
+    return now - g_atomic_int_get (&entry->last_used) > timeout;
+}
+
+static void
+entry_unlink (NatSlice *slice,
+              NatEntry *entry)
+{
+    guint16 *link;
+    guint16  index;
+
+    index = (guint16) (entry - slice->entries) + 1;
+    link = &slice->buckets[entry_hash (entry->proto, entry->private_port, entry->remote_addr, entry->remote_port)];
+    while (*link && *link != index)
+        link = &slice->entries[*link - 1].next;
+    if (*link)
+        *link = entry->next;
+}
+
+static NatEntry *
+entry_lookup (NatSlice *slice,
+              guint8    proto,
+              guint16   private_port,
+              guint32   remote_addr,
+              guint16   remote_port)
+{
+    NatEntry *entry;
+    guint16   i;
+
+    for (i = slice->buckets[entry_hash (proto, private_port, remote_addr, remote_port)]; i; i = entry->next) {
+        entry = &slice->entries[i - 1];
+        if (entry->proto == proto &&
+            entry->private_port == private_port &&
+            entry->remote_addr == remote_addr &&
+            entry->remote_port == remote_port)
+            return entry;
+    }
+    return NULL;
+}
+
+static NatEntry *
+entry_new (NatSlice *slice,
+           guint8    proto,
+           guint16   private_port,
+           guint32   remote_addr,
+           guint16   remote_port,
+           gint      now)
+{
+    NatEntry *entry;
+    guint     bucket;
+    guint     n;
+
+    bucket = entry_hash (proto, private_port, remote_addr, remote_port);
+
+    /* Clock hand over the slice; the first free or expired entry is taken */
+    for (n = 0; n < NAT_SLICE_PORTS; n++) {
+        entry = &slice->entries[slice->hand];
+        slice->hand = (slice->hand + 1) % NAT_SLICE_PORTS;
+        if (entry_expired (entry, now))
+            break;
+    }
+    if (n == NAT_SLICE_PORTS)
+        return NULL;
+
+    if (entry->proto)
+        entry_unlink (slice, entry);
+
+    /* The RX thread reads entries without locks */
+    g_atomic_int_inc (&entry->seq);
+    entry->proto = proto;
+    entry->private_port = private_port;
+    entry->remote_addr = remote_addr;
+    entry->remote_port = remote_port;
+    g_atomic_int_set (&entry->closing, 0);
+    g_atomic_int_set (&entry->last_used, now);
+    g_atomic_int_inc (&entry->seq);
+
+    entry->next = slice->buckets[bucket];
+    slice->buckets[bucket] = (guint16) (entry - slice->entries) + 1;
+    return entry;
+}
+
+static void
+slice_reset (NatSlice *slice)
+{
+    guint i;
+
+    for (i = 0; i < NAT_SLICE_PORTS; i++) {
+        g_atomic_int_inc (&slice->entries[i].seq);
+        slice->entries[i].proto = 0;
+        slice->entries[i].next = 0;
+        g_atomic_int_inc (&slice->entries[i].seq);
+    }
+    memset (slice->buckets, 0, sizeof (slice->buckets));
+    slice->hand = 0;
+    /* Only the producer moves the head */
+    g_atomic_int_set (&slice->queue_tail, g_atomic_int_get (&slice->queue_head));
+}
+
+/******************************************************************************/
+/* Output, from the device to the uplink */
+
+static gboolean
+engine_get_gateway (NatEngine *engine,
+                    guint8    *mac)
+{
+    gboolean known;
+    gint     seq;
+
+    do {
+        while ((seq = g_atomic_int_get (&engine->gateway_seq)) & 1)
+            ;
+        known = engine->gateway_known;
+        memcpy (mac, engine->gateway_mac, ETH_ALEN);
+    } while (g_atomic_int_get (&engine->gateway_seq) != seq);
+
+    return known;
+}
+
+static gboolean
+engine_is_remote (NatEngine *engine,
+                  guint32    addr)
+{
+    guint32 host = ntohl (addr);
+
+    if ((addr & engine->local_netmask) == engine->local_network)
+        return FALSE;
+    if (addr == engine->address || host == INADDR_BROADCAST)
+        return FALSE;
+    return !IN_MULTICAST (host) && host >> 24 != IN_LOOPBACKNET && host >> 24 != 0;
+}
+
+gboolean
+nat_slice_output (NatSlice     *slice,
+                  const guint8 *packet,
+                  gsize         packet_len)
+{
+    NatEngine           *engine = slice->engine;
+    struct tpacket2_hdr *hdr;
+    NatEntry            *entry;
+    guint8               gateway_mac[ETH_ALEN];
+    guint8              *frame;
+    guint8              *ip;
+    guint                ihl;
+    gint                 now;
+    gint                 status;
+    gboolean             sendable;
+
+    if (!(ihl = validate_packet (packet, packet_len)))
+        return FALSE;
+    if (rd32 (packet + 12) != (guint32) g_atomic_int_get (&slice->address))
+        return FALSE;
+    if (!engine_is_remote (engine, rd32 (packet + 16)))
+        return FALSE;
+
+    /* Larger packets are left to the kernel, which may fragment them or
+     * tell the sender */
+    sendable = (packet_len <= MIN ((gsize) g_atomic_int_get (&engine->mtu),
+                                   NAT_TX_FRAME_SIZE - TPACKET2_HDRLEN - ETH_HLEN) &&
+                engine_get_gateway (engine, gateway_mac));
+
+    now = now_s ();
+    if (!(entry = entry_lookup (slice, packet[9], rd16 (packet + ihl), rd32 (packet + 16), rd16 (packet + ihl + 2)))) {
+        if (!sendable || !entry_is_opening (packet, ihl))
+            return FALSE;
+        if (!(entry = entry_new (slice, packet[9], rd16 (packet + ihl), rd32 (packet + 16), rd16 (packet + ihl + 2), now)))
+            return FALSE;
+    }
+
+    /* From here on the flow is owned by the NAT, so it's dropped rather
+     * than left to the kernel, which would pick another port */
+    g_atomic_int_set (&entry->last_used, now);
+    if (entry_is_closing (packet, ihl))
+        g_atomic_int_set (&entry->closing, 1);
+
+    if (!sendable) {
+        g_atomic_int_inc (&engine->n_dropped);
+        return TRUE;
+    }
+
+    /* Frames the kernel refused are taken back as well */
+    frame = slice->tx_ring + (gsize) slice->tx_next * NAT_TX_FRAME_SIZE;
+    hdr = (struct tpacket2_hdr *) frame;
+    status = g_atomic_int_get ((volatile gint *) &hdr->tp_status);
+    if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+        g_atomic_int_inc (&engine->n_dropped);
+        return TRUE;
+    }
+
+    frame += TPACKET2_HDRLEN - sizeof (struct sockaddr_ll);
+    memcpy (frame, gateway_mac, ETH_ALEN);
+    memcpy (frame + ETH_ALEN, engine->mac, ETH_ALEN);
+    wr16 (frame + 2 * ETH_ALEN, htons (ETH_P_IP));
+    ip = frame + ETH_HLEN;
+    memcpy (ip, packet, packet_len);
+    rewrite_packet (ip, ihl,
+                    12, engine->address,
+                    0, htons ((guint16) (slice->first_port + (entry - slice->entries))));
+
+    hdr->tp_len = (guint32) (ETH_HLEN + packet_len);
+    g_atomic_int_set ((volatile gint *) &hdr->tp_status, TP_STATUS_SEND_REQUEST);
+    slice->tx_next = (slice->tx_next + 1) % NAT_TX_FRAME_NR;
+    slice->tx_pending++;
+    g_atomic_int_inc (&engine->n_out);
+    return TRUE;
+}
+
+void
+nat_slice_flush (NatSlice *slice)
+{
+    if (!slice->tx_pending)
+        return;
+    slice->tx_pending = 0;
+    if (send (slice->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS)
+        g_debug ("couldn't flush NAT TX ring: %s", g_strerror (errno));
+}
+
+/******************************************************************************/
+/* Input, from the uplink to the device */
+
+gint
+nat_slice_get_fd (NatSlice *slice)
+{
+    return slice->event_fd;
+}
+
+gsize
+nat_slice_input (NatSlice *slice,
+                 guint8   *buffer,
+                 gsize     buffer_size)
+{
+    NatQueueSlot *slot;
+    guint         tail;
+    guint64       value;
+
+    tail = (guint) g_atomic_int_get (&slice->queue_tail);
+    if (tail == (guint) g_atomic_int_get (&slice->queue_head)) {
+        /* Rearm the fd only when it was written, to keep busy-polling free
+         * of syscalls */
+        if (g_atomic_int_get (&slice->signaled)) {
+            g_atomic_int_set (&slice->signaled, 0);
+            if (read (slice->event_fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+                g_debug ("couldn't read NAT event: %s", g_strerror (errno));
+        }
+        return 0;
+    }
+
+    slot = &slice->queue[tail % NAT_QUEUE_SIZE];
+    if (slot->len > buffer_size)
+        return 0;
+    memcpy (buffer, slot->data, slot->len);
+    g_atomic_int_set (&slice->queue_tail, (gint) (tail + 1));
+    return slot->len;
+}
+
+static void
+engine_input (NatEngine *engine,
+              guint8    *ip,
+              gsize      len)
+{
+    NatSlice     *slice;
+    NatEntry     *entry;
+    NatQueueSlot *slot;
+    guint8        proto;
+    guint16       private_port;
+    guint16       remote_port;
+    guint32       remote_addr;
+    guint32       address;
+    guint         index;
+    guint         ihl;
+    guint         head;
+    gint          seq;
+
+    /* The RX ring hands over the frame; the IP length rules over it, as
+     * short frames may be padded */
+    if (len >= 4 && ntohs (rd16 (ip + 2)) < len)
+        len = ntohs (rd16 (ip + 2));
+    if (!(ihl = validate_packet (ip, len)) || rd32 (ip + 16) != engine->address)
+        return;
+
+    index = ntohs (rd16 (ip + ihl + 2)) - engine->first_port;
+    if (index >= engine->n_slices * NAT_SLICE_PORTS)
+        return;
+    slice = g_atomic_pointer_get (&engine->slices[index / NAT_SLICE_PORTS]);
+    if (!slice || !(address = (guint32) g_atomic_int_get (&slice->address)))
+        return;
+
+    entry = &slice->entries[index % NAT_SLICE_PORTS];
+    if ((seq = g_atomic_int_get (&entry->seq)) & 1)
+        return;
+    proto = entry->proto;
+    private_port = entry->private_port;
+    remote_addr = entry->remote_addr;
+    remote_port = entry->remote_port;
+    if (g_atomic_int_get (&entry->seq) != seq)
+        return;
+
+    /* Endpoint-dependent filtering: only replies from the peer get in */
+    if (proto != ip[9] || remote_addr != rd32 (ip + 12) || remote_port != rd16 (ip + ihl))
+        return;
+
+    head = (guint) g_atomic_int_get (&slice->queue_head);
+    if (len > slice->mtu || head - (guint) g_atomic_int_get (&slice->queue_tail) >= NAT_QUEUE_SIZE) {
+        g_atomic_int_inc (&engine->n_dropped);
+        return;
+    }
+
+    g_atomic_int_set (&entry->last_used, now_s ());
+    if (entry_is_closing (ip, ihl))
+        g_atomic_int_set (&entry->closing, 1);
+
+    slot = &slice->queue[head % NAT_QUEUE_SIZE];
+    memcpy (slot->data, ip, len);
+    slot->len = (guint16) len;
+    rewrite_packet (slot->data, ihl, 16, address, 2, private_port);
+    g_atomic_int_set (&slice->queue_head, (gint) (head + 1));
+    g_atomic_int_inc (&engine->n_in);
+
+    /* Wake up the consumer only if it had already emptied the queue; it
+     * checks the head again after moving the tail */
+    if ((guint) g_atomic_int_get (&slice->queue_tail) == head) {
+        guint64 value = 1;
+
+        g_atomic_int_set (&slice->signaled, 1);
+        if (write (slice->event_fd, &value, sizeof (value)) < 0)
+            g_debug ("couldn't signal NAT event: %s", g_strerror (errno));
+    }
+}
+
+static gpointer
+rx_thread_func (NatEngine *engine)
+{
+    struct pollfd pfd[2];
+    guint         current = 0;
+
+    pfd[0].fd = engine->rx_fd;
+    pfd[0].events = POLLIN | POLLERR;
+    pfd[1].fd = engine->halt_fd;
+    pfd[1].events = POLLIN;
+
+    while (!g_atomic_int_get (&engine->halt)) {
+        struct tpacket_block_desc *block;
+        struct tpacket3_hdr       *pkt;
+        guint                      i;
+
+        block = (struct tpacket_block_desc *) (engine->rx_ring + (gsize) current * NAT_RX_BLOCK_SIZE);
+        if (!(g_atomic_int_get ((volatile gint *) &block->hdr.bh1.block_status) & TP_STATUS_USER)) {
+            if (poll (pfd, G_N_ELEMENTS (pfd), -1) < 0 && errno != EINTR) {
+                g_warning ("NAT RX thread failed: %s", g_strerror (errno));
+                break;
+            }
+            continue;
+        }
+
+        pkt = (struct tpacket3_hdr *) ((guint8 *) block + block->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            if (pkt->tp_snaplen > pkt->tp_net - pkt->tp_mac)
+                engine_input (engine,
+                              (guint8 *) pkt + pkt->tp_net,
+                              pkt->tp_snaplen - (pkt->tp_net - pkt->tp_mac));
+            pkt = (struct tpacket3_hdr *) ((guint8 *) pkt + pkt->tp_next_offset);
+        }
+
+        g_atomic_int_set ((volatile gint *) &block->hdr.bh1.block_status, TP_STATUS_KERNEL);
+        current = (current + 1) % NAT_RX_BLOCK_NR;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************/
+/* Slices */
+
+static gboolean
+slice_setup_tx (NatSlice  *slice,
+                GError   **error)
+{
+    struct tpacket_req  req;
+    struct sockaddr_ll  sll;
+    gint                version = TPACKET_V2;
+    gint                bypass = 1;
+    gint                loss = 1;
+
+    if ((slice->tx_fd = socket (AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create packet socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    if (setsockopt (slice->tx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof (version)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't set packet socket version: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    /* Packets are already complete, no need to go through the qdisc */
+    if (setsockopt (slice->tx_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof (bypass)) < 0)
+        g_debug ("couldn't bypass qdisc: %s", g_strerror (errno));
+
+    /* Malformed frames are skipped instead of stopping the ring */
+    if (setsockopt (slice->tx_fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof (loss)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't set packet socket loss mode: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    memset (&req, 0, sizeof (req));
+    req.tp_block_size = NAT_TX_BLOCK_SIZE;
+    req.tp_block_nr = NAT_TX_BLOCK_NR;
+    req.tp_frame_size = NAT_TX_FRAME_SIZE;
+    req.tp_frame_nr = NAT_TX_FRAME_NR;
+    if (setsockopt (slice->tx_fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof (req)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't setup TX ring: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    slice->tx_ring = mmap (NULL, (gsize) NAT_TX_BLOCK_SIZE * NAT_TX_BLOCK_NR,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, slice->tx_fd, 0);
+    if (slice->tx_ring == MAP_FAILED) {
+        slice->tx_ring = NULL;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't map TX ring: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    memset (&sll, 0, sizeof (sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = slice->engine->ifindex;
+    if (bind (slice->tx_fd, (struct sockaddr *) &sll, sizeof (sll)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't bind packet socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+slice_free (NatSlice *slice)
+{
+    if (slice->tx_ring)
+        munmap (slice->tx_ring, (gsize) NAT_TX_BLOCK_SIZE * NAT_TX_BLOCK_NR);
+    if (slice->tx_fd >= 0)
+        close (slice->tx_fd);
+    if (slice->event_fd >= 0)
+        close (slice->event_fd);
+    g_free (slice);
+}
+
+static NatSlice *
+slice_new (NatEngine  *engine,
+           guint       index,
+           GError    **error)
+{
+    NatSlice *slice;
+
+    slice = g_new0 (NatSlice, 1);
+    slice->engine = engine;
+    slice->first_port = (guint16) (engine->first_port + index * NAT_SLICE_PORTS);
+    slice->tx_fd = -1;
+
+    if ((slice->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create event fd: %s", g_strerror (errno));
+        slice_free (slice);
+        return NULL;
+    }
+
+    if (!slice_setup_tx (slice, error)) {
+        slice_free (slice);
+        return NULL;
+    }
+
+    return slice;
+}
+
+NatSlice *
+nat_slice_attach (NatEngine  *engine,
+                  guint32     address,
+                  guint       mtu,
+                  GError    **error)
+{
+    NatSlice *slice = NULL;
+    guint     i;
+
+    g_mutex_lock (&engine->mutex);
+
+    for (i = 0; i < engine->n_slices; i++) {
+        if (!engine->slices[i]) {
+            if (!(slice = slice_new (engine, i, error)))
+                break;
+            g_atomic_pointer_set (&engine->slices[i], slice);
+            break;
+        }
+        if (!g_atomic_int_get (&engine->slices[i]->address)) {
+            slice = engine->slices[i];
+            slice_reset (slice);
+            break;
+        }
+    }
+
+    if (slice) {
+        slice->mtu = MIN (mtu, NAT_MAX_PACKET);
+        g_atomic_int_set (&slice->address, (gint) address);
+    }
+    else if (i == engine->n_slices)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "no NAT port range left");
+
+    g_mutex_unlock (&engine->mutex);
+    return slice;
+}
+
+void
+nat_slice_detach (NatSlice *slice)
+{
+    NatEngine *engine = slice->engine;
+
+    g_mutex_lock (&engine->mutex);
+    nat_slice_flush (slice);
+    g_atomic_int_set (&slice->address, 0);
+    g_mutex_unlock (&engine->mutex);
+}
+
+/******************************************************************************/
+/* Engine */
+
+const gchar *
+nat_engine_get_address (NatEngine *engine)
+{
+    return engine->address_str;
+}
+
+/* Default gateway of the uplink, from the kernel routing table */
+static gboolean
+read_gateway (const gchar *uplink,
+              guint32     *gateway)
+{
+    gchar   *contents = NULL;
+    gchar  **lines;
+    gboolean found = FALSE;
+    guint    i;
+
+    if (!g_file_get_contents ("/proc/net/route", &contents, NULL, NULL))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 1; lines[i] && !found; i++) {
+        gchar iface[IF_NAMESIZE + 1];
+        guint destination;
+        guint gw;
+        guint flags;
+        guint mask;
+
+        if (sscanf (lines[i], "%16s %x %x %x %*d %*d %*d %x", iface, &destination, &gw, &flags, &mask) != 5)
+            continue;
+        /* Values are printed as stored, i.e. in network byte order */
+        if (g_str_equal (iface, uplink) && !destination && !mask && (flags & 0x2)) {
+            *gateway = gw;
+            found = TRUE;
+        }
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return found;
+}
+
+static gboolean
+read_neighbour (const gchar *uplink,
+                guint32      address,
+                guint8      *mac)
+{
+    gchar   *contents = NULL;
+    gchar  **lines;
+    gchar    address_str[INET_ADDRSTRLEN];
+    gboolean found = FALSE;
+    guint    i;
+
+    if (!inet_ntop (AF_INET, &address, address_str, sizeof (address_str)))
+        return FALSE;
+    if (!g_file_get_contents ("/proc/net/arp", &contents, NULL, NULL))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 1; lines[i] && !found; i++) {
+        gchar ip[INET_ADDRSTRLEN];
+        gchar iface[IF_NAMESIZE + 1];
+        guint flags;
+        guint m[ETH_ALEN];
+        guint j;
+
+        if (sscanf (lines[i], "%15s %*x %x %x:%x:%x:%x:%x:%x %*s %16s",
+                    ip, &flags, &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], iface) != 9)
+            continue;
+        if (!g_str_equal (ip, address_str) || !g_str_equal (iface, uplink) || !(flags & ATF_COM))
+            continue;
+        for (j = 0; j < ETH_ALEN; j++)
+            mac[j] = (guint8) m[j];
+        found = TRUE;
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return found;
+}
+
+static gint
+read_mtu (const gchar *uplink)
+{
+    gchar *path;
+    gchar *contents = NULL;
+    gint   mtu = 0;
+
+    path = g_strdup_printf ("/sys/class/net/%s/mtu", uplink);
+    if (g_file_get_contents (path, &contents, NULL, NULL))
+        mtu = (gint) g_ascii_strtoull (contents, NULL, 10);
+    g_free (contents);
+    g_free (path);
+    return mtu;
+}
+
+void
+nat_engine_refresh (NatEngine *engine)
+{
+    guint8   mac[ETH_ALEN];
+    guint32  gateway = 0;
+    gboolean known;
+    gint     mtu;
+
+    /* Nothing is sent through the NAT if unknown */
+    mtu = read_mtu (engine->uplink);
+    if (mtu != g_atomic_int_get (&engine->mtu)) {
+        g_debug ("NAT uplink %s MTU: %d", engine->uplink, mtu);
+        g_atomic_int_set (&engine->mtu, mtu);
+    }
+
+    known = (read_gateway (engine->uplink, &gateway) &&
+             read_neighbour (engine->uplink, gateway, mac));
+
+    if (known == engine->gateway_known &&
+        (!known || (gateway == engine->gateway && !memcmp (mac, engine->gateway_mac, ETH_ALEN))))
+        return;
+
+    if (known)
+        g_message ("NAT gateway at %s: %02x:%02x:%02x:%02x:%02x:%02x",
+                   engine->uplink, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    else
+        g_message ("NAT gateway at %s unknown: new flows use kernel path", engine->uplink);
+
+    g_atomic_int_inc (&engine->gateway_seq);
+    engine->gateway = gateway;
+    engine->gateway_known = known;
+    if (known)
+        memcpy (engine->gateway_mac, mac, ETH_ALEN);
+    g_atomic_int_inc (&engine->gateway_seq);
+}
+
+static gboolean
+engine_setup_link (NatEngine  *engine,
+                   GError    **error)
+{
+    struct ifreq ifr;
+    gint         fd;
+    gboolean     ret = FALSE;
+
+    if (!(engine->ifindex = (gint) if_nametoindex (engine->uplink))) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "unknown interface: %s", engine->uplink);
+        return FALSE;
+    }
+
+    if ((fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    memset (&ifr, 0, sizeof (ifr));
+    g_strlcpy (ifr.ifr_name, engine->uplink, sizeof (ifr.ifr_name));
+    if (ioctl (fd, SIOCGIFHWADDR, &ifr) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't get link address of %s: %s", engine->uplink, g_strerror (errno));
+        goto out;
+    }
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "not an Ethernet interface: %s", engine->uplink);
+        goto out;
+    }
+    memcpy (engine->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    memset (&ifr, 0, sizeof (ifr));
+    g_strlcpy (ifr.ifr_name, engine->uplink, sizeof (ifr.ifr_name));
+    ifr.ifr_addr.sa_family = AF_INET;
+    if (ioctl (fd, SIOCGIFADDR, &ifr) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't get address of %s: %s", engine->uplink, g_strerror (errno));
+        goto out;
+    }
+    engine->address = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr;
+    engine->address_str = g_strdup (inet_ntoa (((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr));
+    ret = TRUE;
+
+out:
+    close (fd);
+    return ret;
+}
+
+static gboolean
+engine_setup_rx (NatEngine  *engine,
+                 GError    **error)
+{
+    /* Unfragmented TCP and UDP to the uplink address, within the port range */
+    struct sock_filter code[] = {
+        BPF_STMT (BPF_LD  | BPF_H    | BPF_ABS, 12),
+        BPF_JUMP (BPF_JMP | BPF_JEQ  | BPF_K,   ETH_P_IP, 0, 12),
+        BPF_STMT (BPF_LD  | BPF_W    | BPF_ABS, ETH_HLEN + 16),
+        BPF_JUMP (BPF_JMP | BPF_JEQ  | BPF_K,   ntohl (engine->address), 0, 10),
+        BPF_STMT (BPF_LD  | BPF_B    | BPF_ABS, ETH_HLEN + 9),
+        BPF_JUMP (BPF_JMP | BPF_JEQ  | BPF_K,   IPPROTO_TCP, 1, 0),
+        BPF_JUMP (BPF_JMP | BPF_JEQ  | BPF_K,   IPPROTO_UDP, 0, 7),
+        BPF_STMT (BPF_LD  | BPF_H    | BPF_ABS, ETH_HLEN + 6),
+        BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K,   IP_OFFMASK, 5, 0),
+        BPF_STMT (BPF_LDX | BPF_B    | BPF_MSH, ETH_HLEN),
+        BPF_STMT (BPF_LD  | BPF_H    | BPF_IND, ETH_HLEN + 2),
+        BPF_JUMP (BPF_JMP | BPF_JGE  | BPF_K,   engine->first_port, 0, 2),
+        BPF_JUMP (BPF_JMP | BPF_JGT  | BPF_K,   engine->first_port + engine->n_slices * NAT_SLICE_PORTS - 1, 1, 0),
+        BPF_STMT (BPF_RET | BPF_K,              0xffff),
+        BPF_STMT (BPF_RET | BPF_K,              0),
+    };
+    struct tpacket_req3 req;
+    struct sockaddr_ll  sll;
+    struct sock_fprog   fprog;
+    gint                version = TPACKET_V3;
+
+    if ((engine->rx_fd = socket (AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons (ETH_P_IP))) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create packet socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    fprog.len = G_N_ELEMENTS (code);
+    fprog.filter = code;
+    if (setsockopt (engine->rx_fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof (fprog)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't attach packet filter: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    if (setsockopt (engine->rx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof (version)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't set packet socket version: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    /* Blocks are handed over when full or after the timeout, whatever
+     * comes first */
+    memset (&req, 0, sizeof (req));
+    req.tp_block_size = NAT_RX_BLOCK_SIZE;
+    req.tp_block_nr = NAT_RX_BLOCK_NR;
+    req.tp_frame_size = NAT_TX_FRAME_SIZE;
+    req.tp_frame_nr = (NAT_RX_BLOCK_SIZE / NAT_TX_FRAME_SIZE) * NAT_RX_BLOCK_NR;
+    req.tp_retire_blk_tov = NAT_RX_BLOCK_TOV_MS;
+    if (setsockopt (engine->rx_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof (req)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't setup RX ring: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    engine->rx_ring = mmap (NULL, (gsize) NAT_RX_BLOCK_SIZE * NAT_RX_BLOCK_NR,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->rx_fd, 0);
+    if (engine->rx_ring == MAP_FAILED) {
+        engine->rx_ring = NULL;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't map RX ring: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    memset (&sll, 0, sizeof (sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons (ETH_P_IP);
+    sll.sll_ifindex = engine->ifindex;
+    if (bind (engine->rx_fd, (struct sockaddr *) &sll, sizeof (sll)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't bind packet socket: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    if ((engine->halt_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create event fd: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    engine->rx_thread = g_thread_new ("nat-rx", (GThreadFunc) rx_thread_func, engine);
+    return TRUE;
+}
+
+NatEngine *
+nat_engine_new (const gchar  *uplink,
+                guint32       local_network,
+                guint32       local_netmask,
+                guint16       first_port,
+                guint         n_slices,
+                GError      **error)
+{
+    NatEngine *engine;
+
+    if (!n_slices || (guint) first_port + n_slices * NAT_SLICE_PORTS > G_MAXUINT16 + 1) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "invalid NAT port range");
+        return NULL;
+    }
+
+    engine = g_new0 (NatEngine, 1);
+    engine->uplink = g_strdup (uplink);
+    engine->local_network = local_network;
+    engine->local_netmask = local_netmask;
+    engine->first_port = first_port;
+    engine->n_slices = n_slices;
+    engine->slices = g_new0 (NatSlice *, n_slices);
+    engine->rx_fd = -1;
+    engine->halt_fd = -1;
+    g_mutex_init (&engine->mutex);
+
+    if (!engine_setup_link (engine, error) || !engine_setup_rx (engine, error)) {
+        nat_engine_free (engine);
+        return NULL;
+    }
+
+    nat_engine_refresh (engine);
+    return engine;
+}
+
+void
+nat_engine_free (NatEngine *engine)
+{
+    guint i;
+
+    if (engine->rx_thread) {
+        guint64 value = 1;
+
+        g_atomic_int_set (&engine->halt, 1);
+        if (write (engine->halt_fd, &value, sizeof (value)) < 0)
+            g_warning ("couldn't stop NAT RX thread: %s", g_strerror (errno));
+        g_thread_join (engine->rx_thread);
+        g_message ("NAT totals: %u packets out, %u packets in, %u dropped",
+                   (guint) g_atomic_int_get (&engine->n_out),
+                   (guint) g_atomic_int_get (&engine->n_in),
+                   (guint) g_atomic_int_get (&engine->n_dropped));
+    }
+
+    /* Slices still attached belong to devices being torn down on exit, left
+     * to go away with the process */
+    for (i = 0; i < engine->n_slices; i++) {
+        if (engine->slices[i] && !g_atomic_int_get (&engine->slices[i]->address))
+            slice_free (engine->slices[i]);
+    }
+    g_free (engine->slices);
+
+    if (engine->rx_ring)
+        munmap (engine->rx_ring, (gsize) NAT_RX_BLOCK_SIZE * NAT_RX_BLOCK_NR);
+    if (engine->rx_fd >= 0)
+        close (engine->rx_fd);
+    if (engine->halt_fd >= 0)
+        close (engine->halt_fd);
+    g_mutex_clear (&engine->mutex);
+    g_free (engine->address_str);
+    g_free (engine->uplink);
+    g_free (engine);
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_NAT_H
+#define G_SIMPLE_RT_NAT_H
+
+#include <glib.h>
+
+/*
+ * Userspace NAT.
+ *
+ * Translates TCP and UDP over IPv4 between the tethered devices and a single
+ * Ethernet uplink, skipping the kernel forwarding path (routing, netfilter
+ * and conntrack). Packets from the phones are sent straight to the uplink
+ * gateway through packet socket TX rings; replies are received through a
+ * TPACKET_V3 RX ring by a thread of its own, and queued to each device.
+ *
+ * The uplink ports from the first one given are owned by the NAT, split in
+ * slices of NAT_SLICE_PORTS, one per device. Each slice is only written by
+ * the threads of its device, and read without locks by the RX thread.
+ *
+ * Packets that can't be translated (other protocols, fragments, expiring
+ * TTL, local destinations, larger than the uplink MTU) are left to the
+ * kernel path. So are flows not started through the NAT (full slice, unknown
+ * gateway or TCP connections already open); once a flow is translated, its
+ * packets are never left to the kernel, which would change its port.
+ */
+
+#define NAT_SLICE_PORTS  1024
+#define NAT_MAX_PACKET   2046
+
+typedef struct _NatEngine NatEngine;
+typedef struct _NatSlice  NatSlice;
+
+NatEngine   *nat_engine_new          (const gchar   *uplink,
+                                      guint32        local_network,
+                                      guint32        local_netmask,
+                                      guint16        first_port,
+                                      guint          n_slices,
+                                      GError       **error);
+void         nat_engine_free         (NatEngine     *engine);
+
+/* Gateway of the uplink; call periodically from the main loop */
+void         nat_engine_refresh      (NatEngine     *engine);
+const gchar *nat_engine_get_address  (NatEngine     *engine);
+
+/* Slices are kept by the engine, and reused */
+NatSlice    *nat_slice_attach        (NatEngine     *engine,
+                                      guint32        address,
+                                      guint          mtu,
+                                      GError       **error);
+void         nat_slice_detach        (NatSlice      *slice);
+
+/* Thread forwarding packets from the device. Returns TRUE if the packet was
+ * taken by the NAT; sent once flushed. */
+gboolean     nat_slice_output        (NatSlice      *slice,
+                                      const guint8  *packet,
+                                      gsize          packet_len);
+void         nat_slice_flush         (NatSlice      *slice);
+
+/* Thread forwarding packets to the device. The fd is readable when there
+ * may be packets queued; returns the length of the packet read, 0 if none
+ * (or if it doesn't fit). */
+gint         nat_slice_get_fd        (NatSlice      *slice);
+gsize        nat_slice_input         (NatSlice      *slice,
+                                      guint8        *buffer,
+                                      gsize          buffer_size);
+
+#endif /* G_SIMPLE_RT_NAT_H */
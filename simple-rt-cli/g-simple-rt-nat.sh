@@ -0,0 +1,120 @@
+#!/bin/bash
+# SimpleRT: Reverse tethering utility for Android
+# Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Hands a range of ports of the uplink over to the userspace NAT: the kernel
+# won't use them for its own sockets, and drops what it receives on them
+# once the NAT has taken its copy.
+
+#params from simple-rt-cli
+
+[ $# -ge 6 ] || {
+    echo "error: missing arguments"
+    exit 1
+}
+
+PLATFORM=$1
+UPLINK=$2
+ADDRESS=$3
+FIRST_PORT=$4
+LAST_PORT=$5
+ACTION=$6
+
+LOGGER="$(which logger)"
+[ -n "${LOGGER}" ] || exit 1
+
+IPTABLES="$(which iptables)"
+[ -n "${IPTABLES}" ] || exit 1
+
+SYSCTL="$(which sysctl)"
+[ -n "${SYSCTL}" ] || exit 1
+
+FLOCK="$(which flock)"
+[ -n "${FLOCK}" ] || exit 1
+
+# Optional, packets merged by GRO are too big to be translated
+ETHTOOL="$(which ethtool)"
+
+# Offloads of the uplink before the first range was handed over, restored
+# once the last one is given back
+STATE_DIR=/run/g-simple-rt
+OFFLOADS_FILE="${STATE_DIR}/nat-${UPLINK}.offloads"
+RANGES_FILE="${STATE_DIR}/nat-${UPLINK}.ranges"
+
+# Only allow Linux platform here
+[ "$PLATFORM" = "linux" ] || exit 2
+
+PORTS="${FIRST_PORT}-${LAST_PORT}"
+
+(
+    ${FLOCK} -x --timeout=30 200 || exit 3
+
+    RESERVED=$(${SYSCTL} -n net.ipv4.ip_local_reserved_ports)
+
+    if [ "${ACTION}" = "down" ]; then
+        for PROTO in tcp udp; do
+            while ${IPTABLES} -w -D INPUT -i ${UPLINK} -d ${ADDRESS} -p ${PROTO} --dport ${FIRST_PORT}:${LAST_PORT} -j DROP > /dev/null 2>&1; do :; done
+        done
+        RESERVED=$(echo ",${RESERVED}," | sed "s/,${PORTS},/,/; s/^,//; s/,$//")
+        ${SYSCTL} -q -w net.ipv4.ip_local_reserved_ports="${RESERVED}"
+
+        if [ -f "${RANGES_FILE}" ]; then
+            sed -i "/^${PORTS}\$/d" "${RANGES_FILE}"
+            if [ ! -s "${RANGES_FILE}" ]; then
+                if [ -n "${ETHTOOL}" ] && [ -f "${OFFLOADS_FILE}" ]; then
+                    while read FEATURE STATE; do
+                        ${ETHTOOL} -K ${UPLINK} ${FEATURE} ${STATE} > /dev/null 2>&1
+                    done < "${OFFLOADS_FILE}"
+                fi
+                rm -f "${RANGES_FILE}" "${OFFLOADS_FILE}"
+            fi
+        fi
+
+        ${LOGGER} -s -t "g-simple-rt" "userspace NAT disabled on ${UPLINK}"
+        exit 0
+    fi
+
+    for PROTO in tcp udp; do
+        ${IPTABLES} -w -C INPUT -i ${UPLINK} -d ${ADDRESS} -p ${PROTO} --dport ${FIRST_PORT}:${LAST_PORT} -j DROP > /dev/null 2>&1
+        if [ $? -ne 0 ]; then
+            ${IPTABLES} -w -I INPUT -i ${UPLINK} -d ${ADDRESS} -p ${PROTO} --dport ${FIRST_PORT}:${LAST_PORT} -j DROP
+        fi
+    done
+
+    echo ",${RESERVED}," | grep -q ",${PORTS},"
+    if [ $? -ne 0 ]; then
+        ${SYSCTL} -q -w net.ipv4.ip_local_reserved_ports="${RESERVED:+${RESERVED},}${PORTS}" || exit 4
+    fi
+
+    if [ -n "${ETHTOOL}" ]; then
+        mkdir -p "${STATE_DIR}"
+        if [ ! -s "${RANGES_FILE}" ]; then
+            ${ETHTOOL} -k ${UPLINK} 2> /dev/null | \
+                sed -n 's/^generic-receive-offload: \(on\|off\)$/gro \1/p; s/^large-receive-offload: \(on\|off\)$/lro \1/p' \
+                > "${OFFLOADS_FILE}"
+        fi
+        grep -qx "${PORTS}" "${RANGES_FILE}" 2> /dev/null || echo "${PORTS}" >> "${RANGES_FILE}"
+        ${ETHTOOL} -K ${UPLINK} gro off > /dev/null 2>&1
+        ${ETHTOOL} -K ${UPLINK} lro off > /dev/null 2>&1
+    else
+        ${LOGGER} -s -t "g-simple-rt" "warning: ethtool not found, GRO left as is on ${UPLINK}"
+    fi
+
+    ${LOGGER} -s -t "g-simple-rt" "userspace NAT enabled on ${UPLINK} (${ADDRESS}, ports ${PORTS})"
+
+) 200>/var/lock/g-simple-rt-iface-up
+
+exit $?
@@ -0,0 +1,488 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netfilter_ipv4.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "g-simple-rt-proxy.h"
+
+#define PROXY_LISTEN_BACKLOG 128
+#define PROXY_MAX_EVENTS     64
+/* Splice calls per direction and event, so that a single busy connection
+ * doesn't hold all the others back */
+#define PROXY_PUMP_ROUNDS    16
+
+/******************************************************************************/
+/* Types */
+
+typedef enum {
+    PROXY_SIDE_DEVICE,
+    PROXY_SIDE_REMOTE,
+    PROXY_N_SIDES
+} ProxySide;
+
+/* Data flowing from one side to the other one, through a pipe */
+typedef struct {
+    gint     pipe[2];
+    gsize    pending;  /* bytes in the pipe */
+    gboolean eof;      /* nothing else to read */
+    gboolean done;     /* everything written and shut down */
+} ProxyDirection;
+
+typedef struct {
+    gint           fds[PROXY_N_SIDES];
+    guint32        events[PROXY_N_SIDES]; /* registered in epoll, 0 if not */
+    ProxyDirection dir[PROXY_N_SIDES];    /* by the side data comes from */
+    gboolean       connecting;
+    gboolean       closed;
+} ProxyConn;
+
+struct _ProxyServer {
+    guint32     local_network;  /* network byte order */
+    guint32     local_netmask;
+    gint        listen_fd;
+    gint        epoll_fd;
+    gint        halt_fd;
+    GThread    *thread;
+    GHashTable *conns;          /* only used by the relay thread */
+
+    GMutex      mutex;
+    ProxyStats  stats;
+};
+
+/******************************************************************************/
+/* Connections */
+
+static void
+proxy_conn_free (ProxyConn *conn)
+{
+    guint i;
+
+    for (i = 0; i < PROXY_N_SIDES; i++) {
+        if (conn->fds[i] >= 0)
+            close (conn->fds[i]);
+        if (conn->dir[i].pipe[0] >= 0)
+            close (conn->dir[i].pipe[0]);
+        if (conn->dir[i].pipe[1] >= 0)
+            close (conn->dir[i].pipe[1]);
+    }
+    g_slice_free (ProxyConn, conn);
+}
+
+/* Failed connections are reset, so that the other end notices right away */
+static void
+proxy_conn_close (ProxyServer *server,
+                  ProxyConn   *conn,
+                  gboolean     reset)
+{
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    guint         i;
+
+    for (i = 0; i < PROXY_N_SIDES; i++) {
+        if (conn->events[i])
+            epoll_ctl (server->epoll_fd, EPOLL_CTL_DEL, conn->fds[i], NULL);
+        conn->events[i] = 0;
+        if (reset)
+            setsockopt (conn->fds[i], SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+    }
+    conn->closed = TRUE;
+
+    g_mutex_lock (&server->mutex);
+    server->stats.active--;
+    if (reset)
+        server->stats.failed++;
+    g_mutex_unlock (&server->mutex);
+}
+
+/* Moves as much data as possible from one side to the other. Returns FALSE on
+ * error. */
+static gboolean
+proxy_direction_pump (ProxyDirection *dir,
+                      gint            from,
+                      gint            to,
+                      guint64        *bytes)
+{
+    guint i;
+
+    for (i = 0; i < PROXY_PUMP_ROUNDS && !dir->done; i++) {
+        gssize n;
+
+        if (dir->pending > 0) {
+            n = splice (dir->pipe[0], NULL, to, NULL, dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EINTR);
+            dir->pending -= n;
+            *bytes += n;
+            continue;
+        }
+
+        if (dir->eof) {
+            if (shutdown (to, SHUT_WR) < 0 && errno != ENOTCONN)
+                return FALSE;
+            dir->done = TRUE;
+            break;
+        }
+
+        n = splice (from, NULL, dir->pipe[1], NULL, PROXY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR);
+        if (n == 0)
+            dir->eof = TRUE;
+        dir->pending += n;
+    }
+    return TRUE;
+}
+
+/* Registers the events each direction is waiting for: room in the receiving
+ * side while the pipe has data, and data in the sending side otherwise */
+static gboolean
+proxy_conn_update (ProxyServer *server,
+                   ProxyConn   *conn)
+{
+    guint32 events[PROXY_N_SIDES] = { 0, 0 };
+    guint   i;
+
+    if (conn->connecting)
+        events[PROXY_SIDE_REMOTE] = EPOLLOUT;
+    else {
+        for (i = 0; i < PROXY_N_SIDES; i++) {
+            if (conn->dir[i].pending > 0)
+                events[!i] |= EPOLLOUT;
+            else if (!conn->dir[i].eof)
+                events[i] |= EPOLLIN;
+        }
+    }
+
+    /* Sockets waiting for nothing are removed, so that hang ups aren't
+     * reported over and over while the other side catches up */
+    for (i = 0; i < PROXY_N_SIDES; i++) {
+        struct epoll_event event = { .events = events[i], .data.ptr = conn };
+        gint               op;
+
+        if (events[i] == conn->events[i])
+            continue;
+        op = !conn->events[i] ? EPOLL_CTL_ADD : (!events[i] ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+        if (epoll_ctl (server->epoll_fd, op, conn->fds[i], &event) < 0)
+            return FALSE;
+        conn->events[i] = events[i];
+    }
+    return TRUE;
+}
+
+static void
+proxy_conn_event (ProxyServer *server,
+                  ProxyConn   *conn)
+{
+    guint64 bytes[PROXY_N_SIDES] = { 0, 0 };
+    guint   i;
+
+    if (conn->connecting) {
+        gint      err = 0;
+        socklen_t len = sizeof (err);
+
+        if (getsockopt (conn->fds[PROXY_SIDE_REMOTE], SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err) {
+            g_debug ("proxied connection failed: %s", g_strerror (err));
+            proxy_conn_close (server, conn, TRUE);
+            return;
+        }
+        conn->connecting = FALSE;
+    }
+
+    for (i = 0; i < PROXY_N_SIDES; i++) {
+        if (!proxy_direction_pump (&conn->dir[i], conn->fds[i], conn->fds[!i], &bytes[i])) {
+            proxy_conn_close (server, conn, TRUE);
+            return;
+        }
+    }
+
+    g_mutex_lock (&server->mutex);
+    server->stats.bytes_in += bytes[PROXY_SIDE_DEVICE];
+    server->stats.bytes_out += bytes[PROXY_SIDE_REMOTE];
+    g_mutex_unlock (&server->mutex);
+
+    if (conn->dir[PROXY_SIDE_DEVICE].done && conn->dir[PROXY_SIDE_REMOTE].done)
+        proxy_conn_close (server, conn, FALSE);
+    else if (!proxy_conn_update (server, conn))
+        proxy_conn_close (server, conn, TRUE);
+}
+
+static void
+proxy_refuse (ProxyServer *server,
+              gint         fd)
+{
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+    setsockopt (fd, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+    close (fd);
+
+    g_mutex_lock (&server->mutex);
+    server->stats.failed++;
+    g_mutex_unlock (&server->mutex);
+}
+
+static void
+proxy_accept (ProxyServer *server,
+              gint         fd)
+{
+    struct sockaddr_in client, local, destination;
+    socklen_t          len;
+    ProxyConn         *conn;
+    gint               one = 1;
+    guint              i;
+
+    /* Only connections redirected from the devices; anything else would
+     * be relayed to ourselves */
+    len = sizeof (client);
+    if (getpeername (fd, (struct sockaddr *) &client, &len) < 0 ||
+        (client.sin_addr.s_addr & server->local_netmask) != server->local_network) {
+        proxy_refuse (server, fd);
+        return;
+    }
+    len = sizeof (local);
+    if (getsockname (fd, (struct sockaddr *) &local, &len) < 0) {
+        proxy_refuse (server, fd);
+        return;
+    }
+    len = sizeof (destination);
+    if (getsockopt (fd, SOL_IP, SO_ORIGINAL_DST, &destination, &len) < 0 ||
+        (destination.sin_addr.s_addr == local.sin_addr.s_addr && destination.sin_port == local.sin_port)) {
+        proxy_refuse (server, fd);
+        return;
+    }
+
+    conn = g_slice_new0 (ProxyConn);
+    conn->fds[PROXY_SIDE_DEVICE] = fd;
+    conn->fds[PROXY_SIDE_REMOTE] = -1;
+    for (i = 0; i < PROXY_N_SIDES; i++)
+        conn->dir[i].pipe[0] = conn->dir[i].pipe[1] = -1;
+
+    g_mutex_lock (&server->mutex);
+    server->stats.accepted++;
+    server->stats.active++;
+    g_mutex_unlock (&server->mutex);
+
+    for (i = 0; i < PROXY_N_SIDES; i++) {
+        if (pipe2 (conn->dir[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+            goto failed;
+        /* Best effort, limited by /proc/sys/fs/pipe-max-size */
+        fcntl (conn->dir[i].pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    }
+
+    if ((conn->fds[PROXY_SIDE_REMOTE] = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        goto failed;
+
+    /* Data is relayed as soon as it arrives, coalescing is left to the
+     * original senders */
+    for (i = 0; i < PROXY_N_SIDES; i++)
+        setsockopt (conn->fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    if (connect (conn->fds[PROXY_SIDE_REMOTE], (struct sockaddr *) &destination, sizeof (destination)) < 0 &&
+        errno != EINPROGRESS)
+        goto failed;
+
+    conn->connecting = TRUE;
+    if (!proxy_conn_update (server, conn))
+        goto failed;
+
+    g_hash_table_add (server->conns, conn);
+    return;
+
+failed:
+    g_debug ("couldn't proxy connection: %s", g_strerror (errno));
+    proxy_conn_close (server, conn, TRUE);
+    proxy_conn_free (conn);
+}
+
+/******************************************************************************/
+/* Relay thread */
+
+static gpointer
+proxy_thread_func (ProxyServer *server)
+{
+    struct epoll_event events[PROXY_MAX_EVENTS];
+
+    while (1) {
+        GSList *closed = NULL;
+        gint    n;
+        gint    i;
+
+        if ((n = epoll_wait (server->epoll_fd, events, PROXY_MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("proxy: couldn't wait for events: %s", g_strerror (errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            ProxyConn *conn = events[i].data.ptr;
+
+            if (conn == (gpointer) server)
+                return NULL;
+
+            if (!conn) {
+                gint fd;
+
+                while ((fd = accept4 (server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    proxy_accept (server, fd);
+                continue;
+            }
+
+            /* Both sockets may be in the same batch */
+            if (conn->closed)
+                continue;
+            proxy_conn_event (server, conn);
+            if (conn->closed)
+                closed = g_slist_prepend (closed, conn);
+        }
+
+        for (; closed; closed = g_slist_delete_link (closed, closed)) {
+            g_hash_table_remove (server->conns, closed->data);
+            proxy_conn_free (closed->data);
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************/
+
+ProxyServer *
+proxy_server_new (guint16   port,
+                  guint32   local_network,
+                  guint32   local_netmask,
+                  GError  **error)
+{
+    ProxyServer        *server;
+    struct sockaddr_in  addr = { .sin_family = AF_INET };
+    struct epoll_event  event = { .events = EPOLLIN };
+    gint                one = 1;
+
+    server = g_new0 (ProxyServer, 1);
+    server->local_network = local_network;
+    server->local_netmask = local_netmask;
+    server->epoll_fd = -1;
+    server->halt_fd = -1;
+    server->conns = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_mutex_init (&server->mutex);
+
+    /* Redirected connections arrive to the host address of each tunnel */
+    if ((server->listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt (server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create socket: %s", g_strerror (errno));
+        goto failed;
+    }
+    addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    addr.sin_port = htons (port);
+    if (bind (server->listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        listen (server->listen_fd, PROXY_LISTEN_BACKLOG) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't listen on port %u: %s", port, g_strerror (errno));
+        goto failed;
+    }
+
+    if ((server->epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0 ||
+        (server->halt_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't setup event polling: %s", g_strerror (errno));
+        goto failed;
+    }
+
+    event.data.ptr = NULL;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't poll listening socket: %s", g_strerror (errno));
+        goto failed;
+    }
+    event.data.ptr = server;
+    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, server->halt_fd, &event) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't poll halt event: %s", g_strerror (errno));
+        goto failed;
+    }
+
+    server->thread = g_thread_new ("proxy", (GThreadFunc) proxy_thread_func, server);
+    return server;
+
+failed:
+    proxy_server_free (server);
+    return NULL;
+}
+
+void
+proxy_server_free (ProxyServer *server)
+{
+    GHashTableIter iter;
+    ProxyConn     *conn;
+
+    if (server->thread) {
+        guint64 value = 1;
+
+        if (write (server->halt_fd, &value, sizeof (value)) < 0)
+            g_warning ("couldn't stop proxy thread: %s", g_strerror (errno));
+        g_thread_join (server->thread);
+        g_message ("proxy totals: %" G_GUINT64_FORMAT " connections (%" G_GUINT64_FORMAT " failed), "
+                   "%" G_GUINT64_FORMAT " bytes in, %" G_GUINT64_FORMAT " bytes out",
+                   server->stats.accepted, server->stats.failed,
+                   server->stats.bytes_in, server->stats.bytes_out);
+    }
+
+    g_hash_table_iter_init (&iter, server->conns);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &conn, NULL))
+        proxy_conn_free (conn);
+    g_hash_table_unref (server->conns);
+
+    if (server->listen_fd >= 0)
+        close (server->listen_fd);
+    if (server->epoll_fd >= 0)
+        close (server->epoll_fd);
+    if (server->halt_fd >= 0)
+        close (server->halt_fd);
+    g_mutex_clear (&server->mutex);
+    g_free (server);
+}
+
+void
+proxy_server_get_stats (ProxyServer *server,
+                        ProxyStats  *stats)
+{
+    g_mutex_lock (&server->mutex);
+    *stats = server->stats;
+    g_mutex_unlock (&server->mutex);
+}
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef G_SIMPLE_RT_PROXY_H
+#define G_SIMPLE_RT_PROXY_H
+
+#include <glib.h>
+
+/*
+ * Transparent TCP proxy.
+ *
+ * TCP connections from the tethered devices are redirected by netfilter to a
+ * local port (see g-simple-rt-proxy.sh), so that the host kernel terminates
+ * them on the tunnel side. Each one is relayed to its original destination
+ * over a new host socket, using the host's buffers and congestion control
+ * towards the internet, so the phone only sees the short tunnel round trip.
+ *
+ * Data is moved between both sockets with splice() through a pipe per
+ * direction, by a thread of its own. Connections that weren't redirected,
+ * or that don't come from the given network, are refused.
+ */
+
+#define PROXY_PIPE_SIZE (1 << 20)
+
+typedef struct _ProxyServer ProxyServer;
+
+typedef struct {
+    guint   active;
+    guint64 accepted;
+    guint64 failed;     /* refused, or couldn't reach their destination */
+    guint64 bytes_out;  /* to the devices */
+    guint64 bytes_in;   /* from the devices */
+} ProxyStats;
+
+ProxyServer *proxy_server_new       (guint16       port,
+                                     guint32       local_network,
+                                     guint32       local_netmask,
+                                     GError      **error);
+void         proxy_server_free      (ProxyServer  *server);
+
+void         proxy_server_get_stats (ProxyServer  *server,
+                                     ProxyStats   *stats);
+
+#endif /* G_SIMPLE_RT_PROXY_H */
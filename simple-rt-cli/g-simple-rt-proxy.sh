@@ -0,0 +1,73 @@
+#!/bin/bash
+# SimpleRT: Reverse tethering utility for Android
+# Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Redirects the TCP connections of the tethered devices to the transparent
+# proxy port, except the ones to the tunnel networks themselves.
+
+#params from simple-rt-cli
+
+[ $# -ge 5 ] || {
+    echo "error: missing arguments"
+    exit 1
+}
+
+PLATFORM=$1
+TUNNEL_NET=$2
+TUNNEL_CIDR=$3
+PORT=$4
+ACTION=$5
+
+LOGGER="$(which logger)"
+[ -n "${LOGGER}" ] || exit 1
+
+IPTABLES="$(which iptables)"
+[ -n "${IPTABLES}" ] || exit 1
+
+FLOCK="$(which flock)"
+[ -n "${FLOCK}" ] || exit 1
+
+# Only allow Linux platform here
+[ "$PLATFORM" = "linux" ] || exit 2
+
+REDIRECT_RULE="PREROUTING -s ${TUNNEL_NET}/${TUNNEL_CIDR} ! -d ${TUNNEL_NET}/${TUNNEL_CIDR} -p tcp -j REDIRECT --to-ports ${PORT}"
+INPUT_RULE="INPUT -s ${TUNNEL_NET}/${TUNNEL_CIDR} -p tcp --dport ${PORT} -j ACCEPT"
+
+(
+    ${FLOCK} -x --timeout=30 200 || exit 3
+
+    if [ "${ACTION}" = "down" ]; then
+        while ${IPTABLES} -w -t nat -D ${REDIRECT_RULE} > /dev/null 2>&1; do :; done
+        while ${IPTABLES} -w -D ${INPUT_RULE} > /dev/null 2>&1; do :; done
+        ${LOGGER} -s -t "g-simple-rt" "TCP proxy disabled"
+        exit 0
+    fi
+
+    ${IPTABLES} -w -C ${INPUT_RULE} > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        ${IPTABLES} -w -I ${INPUT_RULE} || exit 4
+    fi
+
+    ${IPTABLES} -w -t nat -C ${REDIRECT_RULE} > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        ${IPTABLES} -w -t nat -I ${REDIRECT_RULE} || exit 4
+    fi
+
+    ${LOGGER} -s -t "g-simple-rt" "TCP proxy enabled for ${TUNNEL_NET}/${TUNNEL_CIDR} (port ${PORT})"
+
+) 200>/var/lock/g-simple-rt-iface-up
+
+exit $?
@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+
+#include "g-simple-rt-shaper.h"
+
+/* The bucket holds up to 50ms worth of traffic, and never less than two full
+ * accessory transfers, so that batching isn't broken at low rates */
+#define TOKEN_BUCKET_BURST_DIVISOR 20
+#define TOKEN_BUCKET_MIN_BURST     (2 * 16384)
+
+void
+token_bucket_set_rate (TokenBucket *bucket,
+                       guint        rate)
+{
+    g_atomic_int_set (&bucket->rate, (gint) MIN (rate, (guint) G_MAXINT));
+}
+
+guint
+token_bucket_get_rate (TokenBucket *bucket)
+{
+    return (guint) g_atomic_int_get (&bucket->rate);
+}
+
+guint
+token_bucket_get_bytes (TokenBucket *bucket)
+{
+    return (guint) g_atomic_int_get (&bucket->bytes);
+}
+
+gint64
+token_bucket_delay (TokenBucket *bucket)
+{
+    gint64 rate;
+    gint64 burst;
+    gint64 now;
+
+    if (!(rate = g_atomic_int_get (&bucket->rate))) {
+        bucket->tokens = 0;
+        return 0;
+    }
+
+    /* Tokens are kept in byte-microseconds so that no fraction is lost
+     * when refilling often, e.g. while busy-polling */
+    now = g_get_monotonic_time ();
+    burst = MAX (rate / TOKEN_BUCKET_BURST_DIVISOR, TOKEN_BUCKET_MIN_BURST) * G_USEC_PER_SEC;
+    if (bucket->last)
+        bucket->tokens = MIN (bucket->tokens + (now - bucket->last) * rate, burst);
+    bucket->last = now;
+
+    return bucket->tokens >= 0 ? 0 : (-bucket->tokens + rate - 1) / rate;
+}
+
+void
+token_bucket_take (TokenBucket *bucket,
+                   gsize        len)
+{
+    g_atomic_int_add (&bucket->bytes, (gint) len);
+    if (g_atomic_int_get (&bucket->rate))
+        bucket->tokens -= (gint64) len * G_USEC_PER_SEC;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ *
+ * Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef G_SIMPLE_RT_SHAPER_H
+#define G_SIMPLE_RT_SHAPER_H
+
+#include <glib.h>
+
+/*
+ * Token bucket rate limiter.
+ *
+ * Each bucket is drained by a single forwarding thread, which sends what it
+ * has and then waits until the bucket is out of debt. The rate may be
+ * changed from any other thread at any time, and the bytes taken are
+ * counted so that the load may be measured from outside.
+ */
+
+typedef struct {
+    volatile gint rate;   /* bytes per second, 0 for unlimited */
+    volatile gint bytes;  /* taken so far, wraps around */
+    gint64        tokens; /* in byte-microseconds, negative when in debt */
+    gint64        last;
+} TokenBucket;
+
+void   token_bucket_set_rate  (TokenBucket *bucket,
+                               guint        rate);
+guint  token_bucket_get_rate  (TokenBucket *bucket);
+guint  token_bucket_get_bytes (TokenBucket *bucket);
+
+/* Time to wait before sending again, in microseconds */
+gint64 token_bucket_delay     (TokenBucket *bucket);
+void   token_bucket_take      (TokenBucket *bucket,
+                               gsize        len);
+
+#endif /* G_SIMPLE_RT_SHAPER_H */
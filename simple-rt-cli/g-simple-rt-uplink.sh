@@ -0,0 +1,86 @@
+#!/bin/bash
+# SimpleRT: Reverse tethering utility for Android
+# Copyright (C) 2017 Aleksander Morgado <aleksander@aleksander.es>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Routes a tunnel network through the given uplink, with its own policy
+# routing table and NAT rule, moving it away from the previous uplink if any.
+
+#params from simple-rt-cli
+
+[ $# -ge 5 ] || {
+    echo "error: missing arguments"
+    exit 1
+}
+
+PLATFORM=$1
+TUNNEL_NET=$2
+TUNNEL_CIDR=$3
+TABLE=$4
+UPLINK=$5
+PREVIOUS_UPLINK=$6
+
+LOGGER="$(which logger)"
+[ -n "${LOGGER}" ] || exit 1
+
+IPTABLES="$(which iptables)"
+[ -n "${IPTABLES}" ] || exit 1
+
+IPROUTE2="$(which ip)"
+[ -n "${IPROUTE2}" ] || exit 1
+
+FLOCK="$(which flock)"
+[ -n "${FLOCK}" ] || exit 1
+
+# Optional, to drop the NAT state of flows through the previous uplink
+CONNTRACK="$(which conntrack)"
+
+# Only allow Linux platform here
+[ "$PLATFORM" = "linux" ] || exit 2
+
+# Same lock as the interface setup, both touch the NAT rules
+(
+    ${FLOCK} -x --timeout=30 200 || exit 3
+
+    if [ -n "${PREVIOUS_UPLINK}" ] && [ "${PREVIOUS_UPLINK}" != "${UPLINK}" ]; then
+        ${LOGGER} -s -t "g-simple-rt" "moving ${TUNNEL_NET}/${TUNNEL_CIDR} from ${PREVIOUS_UPLINK} to ${UPLINK}"
+        while ${IPTABLES} -w -t nat -D POSTROUTING -s ${TUNNEL_NET}/${TUNNEL_CIDR} -o ${PREVIOUS_UPLINK} -j MASQUERADE > /dev/null 2>&1; do :; done
+        [ -n "${CONNTRACK}" ] && ${CONNTRACK} -D -s ${TUNNEL_NET}/${TUNNEL_CIDR} > /dev/null 2>&1
+    fi
+
+    # Traffic from the tunnel network looks up its own table
+    ${IPROUTE2} rule show | grep -q "from ${TUNNEL_NET}/${TUNNEL_CIDR} lookup ${TABLE}"
+    if [ $? -ne 0 ]; then
+        ${IPROUTE2} rule add from ${TUNNEL_NET}/${TUNNEL_CIDR} lookup ${TABLE} priority ${TABLE}
+    fi
+
+    # Same gateway as in the main table, if the uplink has one
+    GATEWAY=$(${IPROUTE2} -4 route show default dev ${UPLINK} | sed -n 's/.* via \([0-9.]*\).*/\1/p' | head -n 1)
+    if [ -n "${GATEWAY}" ]; then
+        ${IPROUTE2} route replace default via ${GATEWAY} dev ${UPLINK} table ${TABLE}
+    else
+        ${IPROUTE2} route replace default dev ${UPLINK} table ${TABLE}
+    fi
+
+    ${IPTABLES} -w -t nat -C POSTROUTING -s ${TUNNEL_NET}/${TUNNEL_CIDR} -o ${UPLINK} -j MASQUERADE > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        ${IPTABLES} -w -t nat -I POSTROUTING -s ${TUNNEL_NET}/${TUNNEL_CIDR} -o ${UPLINK} -j MASQUERADE
+    fi
+
+    ${LOGGER} -s -t "g-simple-rt" "routed ${TUNNEL_NET}/${TUNNEL_CIDR} --> ${UPLINK} (table ${TABLE})"
+
+) 200>/var/lock/g-simple-rt-iface-up
+
+exit 0
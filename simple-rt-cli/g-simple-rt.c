@@ -38,13 +38,19 @@
 #include <string.h>
 #include <signal.h>
 #include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <linux/usbdevice_fs.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <syslog.h>
 
@@ -52,14 +58,30 @@
 
 #include <glib.h>
 #include <glib-unix.h>
+#include <gio/gio.h>
 
 #include <gudev/gudev.h>
 
+#include "g-simple-rt-link.h"
+#include "g-simple-rt-dns.h"
+#include "g-simple-rt-control.h"
+#include "g-simple-rt-capture.h"
+#include "g-simple-rt-flows.h"
+#include "g-simple-rt-mss.h"
+#include "g-simple-rt-shaper.h"
+#include "g-simple-rt-nat.h"
+#include "g-simple-rt-proxy.h"
+#include "g-simple-rt-log.h"
+
 #if !defined BINDIR_PATH
 # error BINDIR_PATH not defined
 #endif
 
 #define IFACE_UP_SCRIPT "g-simple-rt-iface-up.sh"
+#define UPLINK_SCRIPT   "g-simple-rt-uplink.sh"
+#define NAT_SCRIPT      "g-simple-rt-nat.sh"
+#define BRIDGE_SCRIPT   "g-simple-rt-bridge.sh"
+#define PROXY_SCRIPT    "g-simple-rt-proxy.sh"
 
 /* Android Open Accessory protocol defines */
 #define AOA_GET_PROTOCOL            51
@@ -97,7 +119,7 @@ static const guint16 aoa_pids[] = {
     AOA_ACCESSORY_AUDIO_ADB_PID
 };
 
-/* Endpoint Addresses TODO get from interface descriptor */
+/* Default endpoint addresses, if the interface descriptor can't be read */
 #define AOA_ACCESSORY_EP_IN  0x81
 #define AOA_ACCESSORY_EP_OUT 0x02
 
@@ -113,19 +135,180 @@ typedef enum {
     ACTION_RESET,
 } Action;
 
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_LZ4,
+} Compression;
+
+typedef enum {
+    UPLINK_POLICY_ROUND_ROBIN,
+    UPLINK_POLICY_LEAST_LOADED,
+} UplinkPolicy;
+
+typedef enum {
+    AOA_STEP_GET_PROTOCOL,
+    AOA_STEP_SEND_MANUFACTURER,
+    AOA_STEP_SEND_MODEL,
+    AOA_STEP_SEND_DESCRIPTION,
+    AOA_STEP_SEND_VERSION,
+    AOA_STEP_SEND_URL,
+    AOA_STEP_SEND_SERIAL,
+    AOA_STEP_START,
+    AOA_STEP_DONE,
+} AoaStep;
+
+/* Shaped directions, from the point of view of the phone */
+typedef enum {
+    SHAPER_DOWN, /* to the phone, read from TUN */
+    SHAPER_UP,   /* from the phone, written to TUN */
+    SHAPER_N
+} ShaperDirection;
+
+/* CPUs the forwarding threads are pinned to, when picked per device */
+typedef enum {
+    CPU_TOPOLOGY_NONE, /* the given list */
+    CPU_TOPOLOGY_IRQ,  /* handling the interrupt of the USB controller */
+    CPU_TOPOLOGY_NODE, /* in the NUMA node of the USB controller */
+} CpuTopology;
+
+typedef struct {
+    Compression compression;
+    gboolean    ack_filter;
+    gboolean    clamp_mss;
+
+    /* Forwarding threads scheduling */
+    gboolean    pin_cpus;
+    cpu_set_t   cpus;
+    CpuTopology cpu_topology;
+    gint        sched_policy;
+    gint        sched_priority; /* 0 for the policy minimum */
+
+    /* Idle time before a busy-polling thread blocks, 0 to never busy-poll */
+    guint       busy_poll_us;
+
+    /* Uplink the device is pinned to, if any */
+    gchar      *uplink;
+
+    /* Packet capture ring size, 0 to not capture */
+    guint       capture_records;
+
+    /* Flow table size, 0 to not account flows */
+    guint       flow_entries;
+
+    /* Interval between link health probes, 0 to not send them */
+    guint       probe_interval_ms;
+
+    /* Rate limits in bytes per second (0 for unlimited), and share of the
+     * uplink capacity relative to other devices */
+    guint       rate[SHAPER_N];
+    guint       weight;
+} DeviceSettings;
+
+typedef struct {
+    gchar    *name;
+    gboolean  up;
+    guint64   last_bytes;
+    gdouble   rate;      /* bytes per second, smoothed */
+    guint     n_devices;
+} Uplink;
+
+/* Where a device is attached, resolved once from its sysfs path */
+typedef struct {
+    gchar      *controller; /* sysfs path of the host controller */
+    gchar     **hubs;       /* sysfs paths, from the parent hub up to the root hub */
+    gint        numa_node;  /* -1 if unknown */
+    gint        irq;        /* -1 if unknown */
+    cpu_set_t   irq_cpus;   /* empty if unknown */
+    cpu_set_t   node_cpus;  /* empty if unknown */
+} UsbTopology;
+
+/* Traffic of all the devices below a hub, directly attached or not */
+typedef struct {
+    gchar    *path;
+    guint     speed;     /* Mbit/s of its upstream link, 0 if unknown */
+    guint     n_devices;
+    guint64   bytes;     /* since the last check */
+    gdouble   rate;      /* bytes per second, smoothed */
+    gboolean  busy;
+} UsbHub;
+
 typedef struct {
     Action          action;
     guint16         vid;
     guint16         pid;
-    gchar          *interface;
+    GPtrArray      *uplinks;
+    gchar          *bridge;            /* TAP devices are enslaved to it, if given */
+    UplinkPolicy    uplink_policy;
+    guint           uplink_next;
+    guint           uplink_check_id;
     GMainLoop      *loop;
     GUdevClient    *udev;
-    GList          *tracked_devices;
+    GHashTable     *tracked_devices;   /* sysfs path -> Device */
+    GHashTable     *tracked_addresses; /* busnum/devnum -> Device */
     libusb_context *usb_context;
+    libusb_context *handshake_usb_context;
+    GSource        *handshake_usb_source;
     guint8          next_subnet;
     GHashTable     *subnets;
+    DeviceSettings  default_settings;
+    GKeyFile       *config;
+    GHashTable     *settings;
+    DnsForwarder   *dns;
+    ControlServer  *control;
+    guint           capacity[SHAPER_N]; /* bytes per second, 0 if not shared */
+    guint           share_check_id;
+    NatEngine      *nat;
+    guint           nat_refresh_id;
+    ProxyServer    *proxy;
+    guint16         proxy_port;
+    GHashTable     *watchdog_resets;   /* sysfs path -> recent resets */
+    GHashTable     *bringups;          /* sysfs path -> phases before the AOA switch */
+    guint           watchdog_check_id;
+    guint           mss_check_id;
+    GHashTable     *usb_hubs;          /* sysfs path -> UsbHub */
+    guint           hub_check_id;
 } Context;
 
+/* Data path log messages, rate limited separately */
+typedef enum {
+    LOG_REASON_USB_OUT,
+    LOG_REASON_USB_IN,
+    LOG_REASON_TUN_WRITE,
+    LOG_REASON_FRAME,
+    LOG_REASON_N
+} LogReason;
+
+/* Bring-up phases, from the first uevent of the phone to its first packet */
+typedef enum {
+    BRINGUP_UEVENT,        /* candidate device found */
+    BRINGUP_AOA_PROBED,    /* AOA protocol version read */
+    BRINGUP_AOA_SWITCHED,  /* switch to accessory mode requested */
+    BRINGUP_ACCESSORY,     /* accessory device found */
+    BRINGUP_TETHERING,     /* connection thread started */
+    BRINGUP_INTERFACE,     /* TUN device created and configured */
+    BRINGUP_USB_CLAIMED,   /* accessory interface claimed */
+    BRINGUP_HELLO,         /* link framing announced by the phone */
+    BRINGUP_FIRST_OUT,     /* first packet to the phone */
+    BRINGUP_FIRST_IN,      /* first packet from the phone */
+    BRINGUP_N
+} BringupPhase;
+
+static const gchar *bringup_phase_names[] = {
+    [BRINGUP_UEVENT]       = "uevent",
+    [BRINGUP_AOA_PROBED]   = "aoa-probed",
+    [BRINGUP_AOA_SWITCHED] = "aoa-switched",
+    [BRINGUP_ACCESSORY]    = "accessory",
+    [BRINGUP_TETHERING]    = "tethering",
+    [BRINGUP_INTERFACE]    = "interface",
+    [BRINGUP_USB_CLAIMED]  = "usb-claimed",
+    [BRINGUP_HELLO]        = "hello",
+    [BRINGUP_FIRST_OUT]    = "first-out",
+    [BRINGUP_FIRST_IN]     = "first-in",
+};
+
+/* Phases of a candidate are only kept this long waiting for its accessory */
+#define BRINGUP_MAX_SWITCH_S 30
+
 typedef struct {
     Context  *context;
     guint16   vid;
@@ -133,32 +316,158 @@ typedef struct {
     guint     busnum;
     guint     devnum;
     gchar    *sysfs_path;
+    gchar    *devnode;
     gboolean  aoa;
     guint     timeout_id;
 
+    libusb_context       *usb_context; /* per connection, AOA devices only */
     libusb_device        *usb_device;
     libusb_device_handle *usb_handle;
-
-    guint8 subnet;
+    gint                  usb_fd; /* usbfs fd backing usb_handle, if wrapped */
+
+    /* Accessory interface endpoints and transfer sizing */
+    gint    speed;
+    guint8  ep_in;
+    guint8  ep_out;
+    guint16 max_packet_size;
+    gsize   transfer_size; /* IN, as announced to the phone */
+
+    /* Data path tunables, may be changed live through the control socket */
+    volatile gint out_transfer_size;
+    volatile gint queue_depth;
+    volatile gint timeout_ms;
+    volatile gint busy_poll_us;
+
+    /* AOA handshake, candidate devices only */
+    AoaStep                      aoa_step;
+    enum libusb_transfer_status  aoa_status;
+    guint16                      aoa_version;
+    struct libusb_transfer      *aoa_transfer;
+
+    guint8          subnet;
+    DeviceSettings *settings;
+
+    /* Uplink selected in the main loop, and the one actually configured */
+    Uplink *uplink;
+    Uplink *uplink_applied;
 
     gchar tun_name[IFNAMSIZ];
     gint  tun_fd;
-
-    GMutex    mutex;
-    gboolean  halt;
-    GThread  *conn_thread;
-    GThread  *tun_thread;
-    GThread  *acc_thread;
+    guint tun_mtu;
+
+    /* Userspace NAT port range, while forwarding */
+    NatSlice *nat;
+
+    /* Link setup announced by the phone in its HELLO frame */
+    volatile gint peer_caps;
+    volatile gint peer_rx_size;
+
+    /* Packet capture; the ring is kept until the device is gone */
+    CaptureRing   *capture;
+    volatile gint  capturing;
+
+    /* MTU the MSS of TCP SYNs is clamped to, 0 if not clamping; set from
+     * the main loop, and the count of SYNs rewritten */
+    volatile gint  clamp_mtu;
+    volatile gint  mss_clamped;
+
+    /* Per-flow accounting, kept until the device is gone */
+    FlowTable     *flows;
+
+    /* Link health probes; the sequence and schedule are only used by the
+     * thread sending to the phone, the stats are protected by the mutex */
+    guint32        probe_seq;
+    gint64         probe_next;
+    LinkProbeStats probe_stats;
+
+    /* Watchdog; counters are updated by the forwarding threads, the rest is
+     * only used in the main loop */
+    volatile gint out_done;
+    volatile gint out_timeouts;
+    volatile gint in_done;
+    volatile gint usb_errors; /* consecutive */
+    gint64        tethered_time;
+    guint         last_out_done;
+    guint         last_out_timeouts;
+    guint         last_in_done;
+    gint64        stall_since;
+    gint64        last_stall_time;
+    gboolean      watchdog_fired;
+
+    /* Shaping; limits and weight are only used in the main loop */
+    TokenBucket shaper[SHAPER_N];
+    guint       limit[SHAPER_N];
+    guint       weight;
+    guint       last_bytes[SHAPER_N];
+    gboolean    active[SHAPER_N];
+
+    /* Each one only used by the thread handling that direction */
+    LogLimit log_limits[LOG_REASON_N];
+
+    /* Bring-up trace, monotonic time of each phase reached, protected by
+     * the mutex; the first packet flags are only used by the thread
+     * handling each direction */
+    gint64   bringup[BRINGUP_N];
+    gboolean bringup_out_done;
+    gboolean bringup_in_done;
+
+    /* Retries of the current AOA handshake step */
+    guint aoa_retries;
+
+    /* Where the device is attached, set in the main loop before the
+     * forwarding threads are started; the bytes last accounted to its hubs
+     * are only used in the main loop */
+    UsbTopology *topology;
+    guint        hub_last_bytes;
+
+    GMutex        mutex;
+    gboolean      halt;
+    volatile gint conn_done;
+    GThread      *conn_thread;
+    GThread      *tun_thread;
+    GThread      *acc_thread;
+    GThread      *poll_thread;
 } Device;
 
+#define DEVICE_ADDRESS_KEY(busnum, devnum) GUINT_TO_POINTER (((busnum) << 16) | (devnum))
+
+/* For the forwarding threads, which must never block on logging */
+#define device_log(device, reason, level, format, ...)                              \
+    log_ring_message (&(device)->log_limits[reason], level, "[%03o,%03o] " format, \
+                      (device)->busnum, (device)->devnum, ## __VA_ARGS__)
+
+static void
+device_close_usb_handle (Device *device)
+{
+    g_clear_pointer (&device->usb_handle, (GDestroyNotify) libusb_close);
+    if (device->usb_fd >= 0) {
+        close (device->usb_fd);
+        device->usb_fd = -1;
+    }
+}
+
+static void usb_topology_free (UsbTopology *topology);
+
 static void
 device_free (Device *device)
 {
+    if (device->uplink)
+        device->uplink->n_devices--;
     if (device->timeout_id)
         g_source_remove (device->timeout_id);
+    /* AOA devices handles are owned by the connection thread */
+    if (!device->aoa)
+        device_close_usb_handle (device);
     if (device->usb_device)
         libusb_unref_device (device->usb_device);
+    if (device->capture)
+        capture_ring_free (device->capture);
+    if (device->flows)
+        flow_table_free (device->flows);
     g_free (device->sysfs_path);
+    if (device->topology)
+        usb_topology_free (device->topology);
+    g_free (device->devnode);
     g_slice_free (Device, device);
 }
 
@@ -179,367 +488,3781 @@ select_subnet (Context     *context,
         else {
             g_message ("subnet mapping added: %s --> 10.11.%u.0", sysfs_path, val);
             g_hash_table_insert (context->subnets, g_strdup (sysfs_path), GUINT_TO_POINTER (val));
+
+            /* Subnets are never released, neither are their DNS listeners */
+            if (context->dns) {
+                gchar  *host_address;
+                GError *error = NULL;
+
+                host_address = g_strdup_printf ("10.11.%u.1", val);
+                if (!dns_forwarder_listen (context->dns, host_address, &error)) {
+                    g_warning ("couldn't setup DNS forwarder in %s: %s", host_address, error->message);
+                    g_error_free (error);
+                }
+                g_free (host_address);
+            }
         }
     }
     return val;
 }
 
 /******************************************************************************/
-/* Tethering */
-
-#define ACC_BUFFER_SIZE 4096
-#define ACC_TIMEOUT     200
+/* Per-device settings
+ *
+ * Defaults come from the command line, and may be overridden per device in
+ * the --config key file, in groups named after the device, from the least to
+ * the most specific one:
+ *
+ *   [device 04e8]
+ *   [device 04e8:6860]
+ *   [device /sys/devices/pci0000:00/0000:00:14.0/usb3/3-2]
+ */
 
-static void *
-tun_thread_func (Device *device)
+static gboolean
+parse_compression (const gchar *str,
+                   Compression *out)
 {
-    gsize nread;
-    gint ret;
-    gint transferred;
-    guint8 acc_buf[ACC_BUFFER_SIZE];
-
-    while (1) {
-        gint           status;
-        fd_set         rfds;
-        struct timeval tv;
-        gboolean       halt_thread;
-
-        g_mutex_lock (&device->mutex);
-        halt_thread = device->halt;
-        g_mutex_unlock (&device->mutex);
+    if (g_ascii_strcasecmp (str, "none") == 0)
+        *out = COMPRESSION_NONE;
+    else if (g_ascii_strcasecmp (str, "lz4") == 0)
+        *out = COMPRESSION_LZ4;
+    else
+        return FALSE;
+    return TRUE;
+}
 
-        if (halt_thread)
-            break;
+/* CPU lists as in taskset(1) or the kernel cmdline, e.g. "2,3" or "0-1,4" */
+static gboolean
+parse_cpu_list (const gchar *str,
+                cpu_set_t   *out)
+{
+    gchar    **items;
+    guint      i;
+    gboolean   ret = TRUE;
 
-        FD_ZERO (&rfds);
-        FD_SET  (device->tun_fd, &rfds);
+    CPU_ZERO (out);
 
-        tv.tv_sec  = 1;
-        tv.tv_usec = 0;
+    items = g_strsplit (str, ",", -1);
+    for (i = 0; items[i]; i++) {
+        gchar   *end;
+        guint64  first;
+        guint64  last;
 
-        if ((status = select (device->tun_fd + 1, &rfds, NULL, NULL, &tv)) < 0) {
-            if (errno == EINTR)
-                continue;
-            g_warning ("[%03o,%03o] waiting to write: %s", device->busnum, device->devnum, g_strerror (errno));
+        first = g_ascii_strtoull (items[i], &end, 10);
+        if (end == items[i]) {
+            ret = FALSE;
             break;
         }
+        last = first;
+        if (*end == '-') {
+            const gchar *start = end + 1;
 
-        if (status == 0)
-            continue;
-
-        nread = read (device->tun_fd, acc_buf, sizeof (acc_buf));
-        if (nread > 0) {
-            if ((ret = libusb_bulk_transfer (device->usb_handle,
-                                             AOA_ACCESSORY_EP_OUT,
-                                             acc_buf,
-                                             nread,
-                                             &transferred,
-                                             ACC_TIMEOUT)) < 0) {
-                if (ret == LIBUSB_ERROR_TIMEOUT)
-                    continue;
-                g_warning ("[%03o,%03o] bulk transfer failed: %s", device->busnum, device->devnum, libusb_strerror (ret));
+            last = g_ascii_strtoull (start, &end, 10);
+            if (end == start) {
+                ret = FALSE;
+                break;
             }
-            continue;
         }
-
-        if (nread < 0) {
-            g_warning ("[%03o,%03o] couldn't read from TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
+        if (*end != '\0' || last < first || last >= CPU_SETSIZE) {
+            ret = FALSE;
             break;
         }
-
-        /* EOF received */
-        break;
+        for (; first <= last; first++)
+            CPU_SET ((gint) first, out);
     }
+    g_strfreev (items);
 
-    g_mutex_lock (&device->mutex);
-    device->halt = TRUE;
-    g_mutex_unlock (&device->mutex);
-    return NULL;
+    return ret && CPU_COUNT (out) > 0;
 }
 
-static void *
-acc_thread_func (Device *device)
+static gchar *
+format_cpu_list (const cpu_set_t *cpus)
 {
-    gint ret;
-    gint transferred;
-    guint8 acc_buf[ACC_BUFFER_SIZE];
-
-    while (1) {
-        gboolean halt_thread;
+    GString *str;
+    gint     cpu;
 
-        g_mutex_lock (&device->mutex);
-        halt_thread = device->halt;
-        g_mutex_unlock (&device->mutex);
+    str = g_string_new (NULL);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        gint first;
 
-        if (halt_thread)
-            break;
+        if (!CPU_ISSET (cpu, cpus))
+            continue;
+        first = cpu;
+        while (cpu + 1 < CPU_SETSIZE && CPU_ISSET (cpu + 1, cpus))
+            cpu++;
+        g_string_append_printf (str, "%s%d", str->len ? "," : "", first);
+        if (cpu > first)
+            g_string_append_printf (str, "-%d", cpu);
+    }
+    if (!str->len)
+        g_string_append_c (str, '-');
+    return g_string_free (str, FALSE);
+}
 
-        if ((ret = libusb_bulk_transfer (device->usb_handle,
-                                         AOA_ACCESSORY_EP_IN,
-                                         acc_buf,
-                                         sizeof (acc_buf),
-                                         &transferred,
-                                         ACC_TIMEOUT)) < 0) {
-            if (ret == LIBUSB_ERROR_TIMEOUT)
-                continue;
+/* Either a list of CPUs, or where to pick them from for each device */
+static gboolean
+parse_cpus (const gchar    *str,
+            DeviceSettings *settings)
+{
+    if (g_str_equal (str, "irq"))
+        settings->cpu_topology = CPU_TOPOLOGY_IRQ;
+    else if (g_str_equal (str, "node"))
+        settings->cpu_topology = CPU_TOPOLOGY_NODE;
+    else if (parse_cpu_list (str, &settings->cpus))
+        settings->cpu_topology = CPU_TOPOLOGY_NONE;
+    else
+        return FALSE;
+    settings->pin_cpus = TRUE;
+    return TRUE;
+}
 
-            g_warning ("[%03o,%03o] bulk transfer error: %s", device->busnum, device->devnum, libusb_strerror (ret));
-            continue;
-        }
+static gboolean
+parse_sched_policy (const gchar *str,
+                    gint        *out)
+{
+    if (g_ascii_strcasecmp (str, "other") == 0)
+        *out = SCHED_OTHER;
+    else if (g_ascii_strcasecmp (str, "fifo") == 0)
+        *out = SCHED_FIFO;
+    else if (g_ascii_strcasecmp (str, "rr") == 0)
+        *out = SCHED_RR;
+    else
+        return FALSE;
+    return TRUE;
+}
 
-        if (write (device->tun_fd, acc_buf, transferred) < 0) {
-            g_warning ("[%03o,%03o] couldn't write to TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
-            break;
-        }
+static const gchar *
+sched_policy_to_string (gint policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+        return "fifo";
+    case SCHED_RR:
+        return "rr";
+    default:
+        return "other";
     }
+}
 
-    g_mutex_lock (&device->mutex);
-    device->halt = TRUE;
-    g_mutex_unlock (&device->mutex);
-    return NULL;
+/* Rates are given in kbit/s */
+#define SHAPER_MAX_KBPS   10000000
+#define SHAPER_MAX_WEIGHT 100
+
+/* Link health probes */
+#define PROBE_DEFAULT_INTERVAL_MS 1000
+#define PROBE_MAX_INTERVAL_MS     60000
+
+static gboolean
+parse_rate (gint   kbps,
+            guint *rate)
+{
+    if (kbps < 0 || kbps > SHAPER_MAX_KBPS)
+        return FALSE;
+    *rate = (guint) kbps * 125;
+    return TRUE;
 }
 
-static void *
-conn_thread_func (Device *device)
+static void
+settings_apply_rate (GKeyFile    *config,
+                     const gchar *group,
+                     const gchar *key,
+                     guint       *rate)
 {
-#define MAX_ARGS 10
-    gchar              *args[MAX_ARGS];
-    guint               iarg = 0;
-    static const gchar *clonedev = "/dev/net/tun";
-    struct ifreq        ifr;
-    gchar              *cmd = NULL;
-    gchar              *network;
-    gchar              *host_address;
-    gint                ret;
-    GError             *error = NULL;
+    GError *error = NULL;
+    gint    kbps;
 
-    device->timeout_id = 0;
+    if (!g_key_file_has_key (config, group, key, NULL))
+        return;
 
-    if ((device->tun_fd = open (clonedev, O_RDWR)) < 0 ) {
-        g_critical ("[%03o,%03o] couldn't open TUN clone device: %s", device->busnum, device->devnum, g_strerror (errno));
-        goto out;
-    }
+    kbps = g_key_file_get_integer (config, group, key, &error);
+    if (error) {
+        g_warning ("[%s] invalid %s value: %s", group, key, error->message);
+        g_error_free (error);
+    } else if (!parse_rate (kbps, rate))
+        g_warning ("[%s] invalid %s value: %d (0-%d)", group, key, kbps, SHAPER_MAX_KBPS);
+}
 
-    memset(&ifr, 0, sizeof (ifr));
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+static void
+settings_apply_group (GKeyFile       *config,
+                      const gchar    *group,
+                      DeviceSettings *settings)
+{
+    gchar *str;
 
-    if (ioctl (device->tun_fd, TUNSETIFF, (void *) &ifr) < 0) {
-        close (device->tun_fd);
-        device->tun_fd = 0;
-        g_critical ("[%03o,%03o] couldn't create TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
-        goto out;
+    if (!g_key_file_has_group (config, group))
+        return;
+
+    g_debug ("applying settings from [%s]", group);
+
+    if ((str = g_key_file_get_string (config, group, "compression", NULL)) != NULL) {
+        if (!parse_compression (str, &settings->compression))
+            g_warning ("[%s] invalid compression value: '%s'", group, str);
+        else if (settings->compression == COMPRESSION_LZ4 && !link_lz4_supported ()) {
+            g_warning ("[%s] LZ4 compression not supported in this build", group);
+            settings->compression = COMPRESSION_NONE;
+        }
+        g_free (str);
     }
 
-    strncpy (device->tun_name, ifr.ifr_name, sizeof (device->tun_name) - 1);
+    if (g_key_file_has_key (config, group, "ack-filter", NULL)) {
+        GError *error = NULL;
+        gboolean ack_filter;
 
-    network      = g_strdup_printf ("10.11.%u.0", device->subnet);
-    host_address = g_strdup_printf ("10.11.%u.1", device->subnet);
+        ack_filter = g_key_file_get_boolean (config, group, "ack-filter", &error);
+        if (error) {
+            g_warning ("[%s] invalid ack-filter value: %s", group, error->message);
+            g_error_free (error);
+        } else
+            settings->ack_filter = ack_filter;
+    }
 
-    args[iarg++] = BINDIR_PATH "/" IFACE_UP_SCRIPT;
-    args[iarg++] = "linux";
-    args[iarg++] = device->tun_name;
-    args[iarg++] = device->context->interface;
-    args[iarg++] = network;
-    args[iarg++] = "30";
-    args[iarg++] = host_address;
-    args[iarg++] = NULL;
+    if (g_key_file_has_key (config, group, "clamp-mss", NULL)) {
+        GError *error = NULL;
+        gboolean clamp_mss;
 
-    g_assert (iarg <= MAX_ARGS);
+        clamp_mss = g_key_file_get_boolean (config, group, "clamp-mss", &error);
+        if (error) {
+            g_warning ("[%s] invalid clamp-mss value: %s", group, error->message);
+            g_error_free (error);
+        } else
+            settings->clamp_mss = clamp_mss;
+    }
 
-    if (!g_spawn_sync (NULL, /* working_directory */
-                       args,
-                       NULL, /* envp */
-                       G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
-                       NULL, /* child_setup */
-                       NULL, /* user_data */
-                       NULL, /* standard_output */
-                       NULL, /* standard_error */
-                       &ret,
-                       &error)) {
-        g_critical ("[%03o,%03o] couldn't run " IFACE_UP_SCRIPT " for %s: %s",
-                    device->busnum, device->devnum, device->tun_name, error->message);
-        g_clear_error (&error);
-        goto out;
+    if ((str = g_key_file_get_string (config, group, "cpus", NULL)) != NULL) {
+        if (!parse_cpus (str, settings))
+            g_warning ("[%s] invalid cpus value: '%s'", group, str);
+        g_free (str);
     }
 
-    if (!g_spawn_check_exit_status (ret, &error)) {
-        g_critical ("[%03o,%03o] " IFACE_UP_SCRIPT " returned error for %s: %s",
-                    device->busnum, device->devnum, device->tun_name, error->message);
-        g_clear_error (&error);
-        goto out;
+    if ((str = g_key_file_get_string (config, group, "sched-policy", NULL)) != NULL) {
+        if (!parse_sched_policy (str, &settings->sched_policy))
+            g_warning ("[%s] invalid sched-policy value: '%s'", group, str);
+        g_free (str);
     }
 
-    /* Trying to open supplied device */
-    if ((ret = libusb_open (device->usb_device, &device->usb_handle)) < 0) {
-        g_critical ("[%03o,%03o] unable to open device: %s",
-                    device->busnum, device->devnum, libusb_strerror (ret));
-        goto out;
+    if (g_key_file_has_key (config, group, "sched-priority", NULL)) {
+        GError *error = NULL;
+        gint    priority;
+
+        priority = g_key_file_get_integer (config, group, "sched-priority", &error);
+        if (error) {
+            g_warning ("[%s] invalid sched-priority value: %s", group, error->message);
+            g_error_free (error);
+        } else if (settings->sched_policy == SCHED_OTHER)
+            g_warning ("[%s] sched-priority requires sched-policy=fifo|rr", group);
+        else if (priority < sched_get_priority_min (settings->sched_policy) ||
+                 priority > sched_get_priority_max (settings->sched_policy))
+            g_warning ("[%s] invalid sched-priority value: '%d' (%d-%d)", group, priority,
+                       sched_get_priority_min (settings->sched_policy),
+                       sched_get_priority_max (settings->sched_policy));
+        else
+            settings->sched_priority = priority;
     }
 
-    /* Claiming first (accessory) interface from the opened device */
-    if ((ret = libusb_claim_interface (device->usb_handle, 0)) < 0) {
-        g_critical ("[%03o,%03o] couldn't claim interface: %s",
-                    device->busnum, device->devnum, libusb_strerror (ret));
-        goto out;
+    if (g_key_file_has_key (config, group, "busy-poll", NULL)) {
+        GError *error = NULL;
+        gint    busy_poll_us;
+
+        busy_poll_us = g_key_file_get_integer (config, group, "busy-poll", &error);
+        if (error) {
+            g_warning ("[%s] invalid busy-poll value: %s", group, error->message);
+            g_error_free (error);
+        } else if (busy_poll_us < 0)
+            g_warning ("[%s] invalid busy-poll value: %d", group, busy_poll_us);
+        else
+            settings->busy_poll_us = busy_poll_us;
     }
 
-    device->tun_thread = g_thread_new (NULL, (GThreadFunc) tun_thread_func, device);
-    device->acc_thread = g_thread_new (NULL, (GThreadFunc) acc_thread_func, device);
+    if ((str = g_key_file_get_string (config, group, "uplink", NULL)) != NULL) {
+        g_free (settings->uplink);
+        settings->uplink = str;
+    }
 
-    /* Wait for children to exit themselves */
-    g_clear_pointer (&device->tun_thread, g_thread_join);
-    g_clear_pointer (&device->acc_thread, g_thread_join);
+    settings_apply_rate (config, group, "rate-down", &settings->rate[SHAPER_DOWN]);
+    settings_apply_rate (config, group, "rate-up", &settings->rate[SHAPER_UP]);
+
+    if (g_key_file_has_key (config, group, "weight", NULL)) {
+        GError *error = NULL;
+        gint    weight;
+
+        weight = g_key_file_get_integer (config, group, "weight", &error);
+        if (error) {
+            g_warning ("[%s] invalid weight value: %s", group, error->message);
+            g_error_free (error);
+        } else if (weight < 1 || weight > SHAPER_MAX_WEIGHT)
+            g_warning ("[%s] invalid weight value: %d (1-%d)", group, weight, SHAPER_MAX_WEIGHT);
+        else
+            settings->weight = weight;
+    }
 
-out:
-    if (device->tun_fd) {
-        close (device->tun_fd);
-        device->tun_fd = 0;
+    if (g_key_file_has_key (config, group, "capture", NULL)) {
+        GError *error = NULL;
+        gint    capture_records;
+
+        capture_records = g_key_file_get_integer (config, group, "capture", &error);
+        if (error) {
+            g_warning ("[%s] invalid capture value: %s", group, error->message);
+            g_error_free (error);
+        } else if (capture_records < 0)
+            g_warning ("[%s] invalid capture value: %d", group, capture_records);
+        else
+            settings->capture_records = capture_records;
     }
 
-    if (device->usb_handle != NULL) {
-        libusb_release_interface (device->usb_handle, 0);
-        libusb_close (device->usb_handle);
-        device->usb_handle = NULL;
+    if (g_key_file_has_key (config, group, "flows", NULL)) {
+        GError *error = NULL;
+        gint    flow_entries;
+
+        flow_entries = g_key_file_get_integer (config, group, "flows", &error);
+        if (error) {
+            g_warning ("[%s] invalid flows value: %s", group, error->message);
+            g_error_free (error);
+        } else if (flow_entries < 0)
+            g_warning ("[%s] invalid flows value: %d", group, flow_entries);
+        else
+            settings->flow_entries = flow_entries;
     }
 
-    g_free (network);
-    g_free (host_address);
-    g_free (cmd);
-    return NULL;
+    if (g_key_file_has_key (config, group, "probe-interval", NULL)) {
+        GError *error = NULL;
+        gint    probe_interval_ms;
+
+        probe_interval_ms = g_key_file_get_integer (config, group, "probe-interval", &error);
+        if (error) {
+            g_warning ("[%s] invalid probe-interval value: %s", group, error->message);
+            g_error_free (error);
+        } else if (probe_interval_ms < 0 || probe_interval_ms > PROBE_MAX_INTERVAL_MS)
+            g_warning ("[%s] invalid probe-interval value: %d", group, probe_interval_ms);
+        else
+            settings->probe_interval_ms = probe_interval_ms;
+    }
 }
 
-static gboolean
-device_setup_tethering (Device *device)
+/* Settings are resolved once per sysfs path, when the device is first seen,
+ * so that they survive the re-enumeration as an AOA device with a different
+ * VID/PID. */
+static DeviceSettings *
+select_settings (Context     *context,
+                 const gchar *sysfs_path,
+                 guint16      vid,
+                 guint16      pid)
 {
-    device->subnet = select_subnet (device->context, device->sysfs_path);
-    if (device->subnet != 0)
-        device->conn_thread = g_thread_new (NULL, (GThreadFunc) conn_thread_func, device);
+    DeviceSettings *settings;
 
-    return G_SOURCE_REMOVE;
-}
+    settings = g_hash_table_lookup (context->settings, sysfs_path);
+    if (settings)
+        return settings;
 
-/******************************************************************************/
-/* USB device processing */
+    settings = g_slice_new (DeviceSettings);
+    *settings = context->default_settings;
 
-#define TIMEOUT_AFTER_PROTOCOL_PROBE_MS 10
+    if (context->config) {
+        gchar *group;
 
-static gboolean
-device_setup_aoa (Device *device)
-{
-    gint   ret;
-    gchar *device_address;
+        group = g_strdup_printf ("device %04x", vid);
+        settings_apply_group (context->config, group, settings);
+        g_free (group);
 
-    device->timeout_id = 0;
+        group = g_strdup_printf ("device %04x:%04x", vid, pid);
+        settings_apply_group (context->config, group, settings);
+        g_free (group);
 
-    device->subnet = select_subnet (device->context, device->sysfs_path);
-    if (device->subnet == 0) {
-        g_critical ("[%03o,%03o] subnet allocation failed", device->busnum, device->devnum);
-        goto out;
+        group = g_strdup_printf ("device %s", sysfs_path);
+        settings_apply_group (context->config, group, settings);
+        g_free (group);
     }
 
-    device_address = g_strdup_printf ("10.11.%u.2", device->subnet);
-    g_message ("[%03o,%03o] subnet allocated: 10.11.%u.0",
-               device->busnum, device->devnum, device->subnet);
-
-    g_debug ("[%03o,%03o] sending manufacturer: %s", device->busnum, device->devnum, default_manufacturer);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_MAN_ID,
-                                        (uint8_t *) default_manufacturer,
-                                        strlen (default_manufacturer) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] sending model: %s", device->busnum, device->devnum, default_model);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_MOD_ID,
-                                        (uint8_t *) default_model,
-                                        strlen (default_model) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] sending description: %s", device->busnum, device->devnum, default_description);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_DSC_ID,
-                                        (uint8_t *) default_description,
-                                        strlen (default_description) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] sending version: %s", device->busnum, device->devnum, default_version);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_VER_ID,
-                                        (uint8_t *) default_version,
-                                        strlen (default_version) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] sending url: %s", device->busnum, device->devnum, default_url);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_URL_ID,
-                                        (uint8_t *) default_url,
-                                        strlen (default_url) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] sending serial: %s", device->busnum, device->devnum, device_address);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_SEND_IDENT,
-                                        0,
-                                        AOA_STRING_SER_ID,
-                                        (uint8_t *) device_address,
-                                        strlen (device_address) + 1,
-                                        0)) < 0)
-        goto out;
-
-    g_debug ("[%03o,%03o] switching device into accessory mode...", device->busnum, device->devnum);
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_START_ACCESSORY,
-                                        0,
-                                        0,
-                                        NULL,
-                                        0,
-                                        0)) < 0)
-        goto out;
+    g_hash_table_insert (context->settings, g_strdup (sysfs_path), settings);
+    return settings;
+}
 
-    g_debug ("[%03o,%03o] switch requested", device->busnum, device->devnum);
+static void
+device_settings_free (DeviceSettings *settings)
+{
+    g_free (settings->uplink);
+    g_slice_free (DeviceSettings, settings);
+}
 
-out:
-    if (ret < 0)
-        g_warning ("[%03o,%03o] accessory initialization failed: %s", device->busnum, device->devnum, libusb_strerror (ret));
+/******************************************************************************/
+/* Uplinks
+ *
+ * With more than one --interface, each device is routed through one of them
+ * with its own policy routing table (UPLINK_TABLE_BASE + subnet), selected by
+ * source address, and its own NAT rule. Devices are spread across uplinks by
+ * the uplink policy, unless pinned to one in their settings, and are moved
+ * away from uplinks going down. With a single uplink the main routing table
+ * is used, as always. */
+
+#define UPLINK_TABLE_BASE         1000
+#define UPLINK_CHECK_INTERVAL_S   2
+#define UPLINK_RATE_WEIGHT        0.5
+/* Load expected from a new device until the next measurement */
+#define UPLINK_DEVICE_RATE_MIN    1000000.0
+
+static Uplink *
+uplink_new (const gchar *name)
+{
+    Uplink *uplink;
 
-    g_clear_pointer (&device->usb_handle, (GDestroyNotify) libusb_close);
-    g_free (device_address);
+    uplink = g_slice_new0 (Uplink);
+    uplink->name = g_strdup (name);
+    return uplink;
+}
 
-    return G_SOURCE_REMOVE;
+static void
+uplink_free (Uplink *uplink)
+{
+    g_free (uplink->name);
+    g_slice_free (Uplink, uplink);
 }
 
 static gboolean
-device_probe_aoa (Device *device)
+parse_uplink_policy (const gchar  *str,
+                     UplinkPolicy *out)
 {
-    gint    ret;
-    guint16 aoa_version;
+    if (g_ascii_strcasecmp (str, "round-robin") == 0)
+        *out = UPLINK_POLICY_ROUND_ROBIN;
+    else if (g_ascii_strcasecmp (str, "least-loaded") == 0)
+        *out = UPLINK_POLICY_LEAST_LOADED;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static guint64
+uplink_read_counter (Uplink      *uplink,
+                     const gchar *counter)
+{
+    gchar   *path;
+    gchar   *contents = NULL;
+    guint64  value = 0;
+
+    path = g_strdup_printf ("/sys/class/net/%s/statistics/%s", uplink->name, counter);
+    if (g_file_get_contents (path, &contents, NULL, NULL))
+        value = g_ascii_strtoull (contents, NULL, 10);
+    g_free (contents);
+    g_free (path);
+    return value;
+}
+
+/* Refreshes the operational state and the throughput of the uplink */
+static void
+uplink_update (Uplink *uplink,
+               guint   interval_s)
+{
+    gchar   *path;
+    gchar   *operstate = NULL;
+    guint64  bytes;
+
+    /* Interfaces not reporting their state (e.g. PPP) say "unknown" */
+    path = g_strdup_printf ("/sys/class/net/%s/operstate", uplink->name);
+    if (g_file_get_contents (path, &operstate, NULL, NULL)) {
+        g_strstrip (operstate);
+        uplink->up = (g_str_equal (operstate, "up") || g_str_equal (operstate, "unknown"));
+    } else
+        uplink->up = FALSE;
+    g_free (operstate);
+    g_free (path);
+
+    bytes = uplink_read_counter (uplink, "rx_bytes") + uplink_read_counter (uplink, "tx_bytes");
+    if (interval_s && bytes >= uplink->last_bytes)
+        uplink->rate = (UPLINK_RATE_WEIGHT * (bytes - uplink->last_bytes) / interval_s +
+                        (1.0 - UPLINK_RATE_WEIGHT) * uplink->rate);
+    uplink->last_bytes = bytes;
+}
+
+static Uplink *
+uplink_lookup (Context     *context,
+               const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < context->uplinks->len; i++) {
+        Uplink *uplink = g_ptr_array_index (context->uplinks, i);
+
+        if (g_str_equal (uplink->name, name))
+            return uplink;
+    }
+    return NULL;
+}
+
+/* Selects an uplink for the device, among the ones that are up. If none is,
+ * the device stays where it was. */
+static Uplink *
+uplink_select (Context *context,
+               Device  *device)
+{
+    Uplink *best = NULL;
+    guint   i;
+
+    if (device->settings->uplink) {
+        best = uplink_lookup (context, device->settings->uplink);
+        if (best && best->up)
+            return best;
+        best = NULL;
+    }
+
+    for (i = 0; i < context->uplinks->len; i++) {
+        Uplink *uplink;
+
+        if (context->uplink_policy == UPLINK_POLICY_ROUND_ROBIN) {
+            guint index = (context->uplink_next + i) % context->uplinks->len;
+
+            uplink = g_ptr_array_index (context->uplinks, index);
+            if (uplink->up) {
+                context->uplink_next = index + 1;
+                return uplink;
+            }
+            continue;
+        }
+
+        uplink = g_ptr_array_index (context->uplinks, i);
+        if (uplink->up &&
+            (!best ||
+             uplink->rate < best->rate ||
+             (uplink->rate == best->rate && uplink->n_devices < best->n_devices)))
+            best = uplink;
+    }
+
+    if (best)
+        return best;
+    return device->uplink ? device->uplink : g_ptr_array_index (context->uplinks, 0);
+}
+
+static gchar **
+uplink_script_args (Device *device,
+                    Uplink *uplink,
+                    Uplink *previous)
+{
+    gchar **args;
+
+    args = g_new0 (gchar *, 8);
+    args[0] = g_strdup (BINDIR_PATH "/" UPLINK_SCRIPT);
+    args[1] = g_strdup ("linux");
+    args[2] = g_strdup_printf ("10.11.%u.0", device->subnet);
+    args[3] = g_strdup ("30");
+    args[4] = g_strdup_printf ("%u", UPLINK_TABLE_BASE + device->subnet);
+    args[5] = g_strdup (uplink->name);
+    args[6] = previous ? g_strdup (previous->name) : NULL;
+    return args;
+}
+
+static void
+uplink_script_done (GPid   pid,
+                    gint   status,
+                    gchar *description)
+{
+    GError *error = NULL;
+
+    if (!g_spawn_check_exit_status (status, &error)) {
+        g_warning ("%s failed: %s", description, error->message);
+        g_error_free (error);
+    }
+    g_spawn_close_pid (pid);
+    g_free (description);
+}
+
+/* Runs in the main loop. Devices whose uplink is already configured are
+ * moved right away; otherwise the connection thread picks the new uplink. */
+static void
+device_set_uplink (Device *device,
+                   Uplink *uplink)
+{
+    Uplink *previous;
+    Uplink *applied;
+
+    g_mutex_lock (&device->mutex);
+    previous = device->uplink;
+    device->uplink = uplink;
+    applied = device->uplink_applied;
+    if (applied)
+        device->uplink_applied = uplink;
+    g_mutex_unlock (&device->mutex);
+
+    if (previous)
+        previous->n_devices--;
+    uplink->n_devices++;
+
+    /* Until the next measurement, account for the load this device adds */
+    if (previous != uplink && device->context->uplinks->len > 1) {
+        gdouble total_rate = 0.0;
+        guint   total_devices = 0;
+        guint   i;
+
+        for (i = 0; i < device->context->uplinks->len; i++) {
+            Uplink *aux = g_ptr_array_index (device->context->uplinks, i);
+
+            total_rate += aux->rate;
+            total_devices += aux->n_devices;
+        }
+        uplink->rate += MAX (UPLINK_DEVICE_RATE_MIN, total_rate / MAX (total_devices, 1));
+    }
+
+    if (applied && applied != uplink) {
+        gchar  **args;
+        GPid     pid;
+        GError  *error = NULL;
+
+        g_message ("[%03o,%03o] moving from uplink %s to %s", device->busnum, device->devnum, applied->name, uplink->name);
+
+        args = uplink_script_args (device, uplink, applied);
+        if (!g_spawn_async (NULL, args, NULL,
+                            G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                            NULL, NULL, &pid, &error)) {
+            g_warning ("[%03o,%03o] couldn't run " UPLINK_SCRIPT ": %s", device->busnum, device->devnum, error->message);
+            g_error_free (error);
+        } else
+            g_child_watch_add (pid, (GChildWatchFunc) uplink_script_done,
+                               g_strdup_printf ("[%03o,%03o] " UPLINK_SCRIPT, device->busnum, device->devnum));
+        g_strfreev (args);
+    }
+}
+
+static gboolean
+uplink_check_cb (Context *context)
+{
+    GHashTableIter  iter;
+    Device         *device;
+    guint           i;
+
+    for (i = 0; i < context->uplinks->len; i++) {
+        Uplink   *uplink = g_ptr_array_index (context->uplinks, i);
+        gboolean  was_up = uplink->up;
+
+        uplink_update (uplink, UPLINK_CHECK_INTERVAL_S);
+        if (uplink->up != was_up)
+            g_message ("uplink %s is %s (%u devices)", uplink->name, uplink->up ? "up" : "down", uplink->n_devices);
+    }
+
+    /* Move devices off uplinks that went down, and pinned ones back home */
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        Uplink *target;
+
+        if (!device->uplink)
+            continue;
+        if (device->uplink->up &&
+            (!device->settings->uplink || g_str_equal (device->uplink->name, device->settings->uplink)))
+            continue;
+
+        target = uplink_select (context, device);
+        if (target != device->uplink && target->up)
+            device_set_uplink (device, target);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************************************************************************/
+/* Shaping
+ *
+ * Each device may be rate limited in each direction with token buckets
+ * drained by the forwarding threads, which stop reading from the TUN device
+ * or from the phone while in debt. The excess queues up in the TUN device
+ * and in the phone, where TCP sees it as congestion.
+ *
+ * When the uplink capacity is given, it is also split periodically across
+ * the devices that moved traffic in the last period, in proportion to their
+ * weights. Idle devices get the share they would have if they became
+ * active, so that they may start right away. */
+
+#define SHARE_CHECK_INTERVAL_MS 500
+
+/* DOWN[/UP] in kbit/s, a single value for both */
+static gboolean
+parse_uplink_capacity (const gchar *str,
+                       guint       *capacity)
+{
+    gchar  **split;
+    gchar   *end;
+    gint64   kbps[SHAPER_N];
+    guint    n;
+    guint    dir;
+    gboolean ret = FALSE;
+
+    split = g_strsplit (str, "/", -1);
+    n = g_strv_length (split);
+    if (n < 1 || n > SHAPER_N)
+        goto out;
+
+    for (dir = 0; dir < n; dir++) {
+        kbps[dir] = g_ascii_strtoll (split[dir], &end, 10);
+        if (end == split[dir] || *end != '\0' || kbps[dir] < 0 || kbps[dir] > SHAPER_MAX_KBPS)
+            goto out;
+    }
+    if (n == 1)
+        kbps[SHAPER_UP] = kbps[SHAPER_DOWN];
+
+    for (dir = 0; dir < SHAPER_N; dir++)
+        parse_rate ((gint) kbps[dir], &capacity[dir]);
+    ret = TRUE;
+
+ out:
+    g_strfreev (split);
+    return ret;
+}
+
+static void
+device_apply_shaping (Device *device)
+{
+    guint dir;
+
+    /* Shared capacity applied in the next check */
+    for (dir = 0; dir < SHAPER_N; dir++) {
+        if (!device->context->capacity[dir])
+            token_bucket_set_rate (&device->shaper[dir], device->limit[dir]);
+    }
+}
+
+static void
+device_setup_shaping (Device *device)
+{
+    guint dir;
+
+    for (dir = 0; dir < SHAPER_N; dir++)
+        device->limit[dir] = device->settings->rate[dir];
+    device->weight = device->settings->weight;
+    device_apply_shaping (device);
+}
+
+static gboolean
+share_check_cb (Context *context)
+{
+    GHashTableIter  iter;
+    Device         *device;
+    guint           dir;
+
+    for (dir = 0; dir < SHAPER_N; dir++) {
+        guint64 active_weight = 0;
+
+        if (!context->capacity[dir])
+            continue;
+
+        g_hash_table_iter_init (&iter, context->tracked_devices);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+            guint bytes;
+
+            if (!device->conn_thread)
+                continue;
+            bytes = token_bucket_get_bytes (&device->shaper[dir]);
+            device->active[dir] = (bytes != device->last_bytes[dir]);
+            device->last_bytes[dir] = bytes;
+            if (device->active[dir])
+                active_weight += device->weight;
+        }
+
+        g_hash_table_iter_init (&iter, context->tracked_devices);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+            guint rate;
+
+            if (!device->conn_thread)
+                continue;
+            rate = (guint) ((guint64) context->capacity[dir] * device->weight /
+                            (active_weight + (device->active[dir] ? 0 : device->weight)));
+            if (device->limit[dir])
+                rate = MIN (rate, device->limit[dir]);
+            /* 0 would be unlimited */
+            token_bucket_set_rate (&device->shaper[dir], MAX (rate, 1));
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************************************************************************/
+/* USB topology
+ *
+ * The host controller and the hubs a device is attached to are found in its
+ * sysfs path, e.g. /sys/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.4 hangs
+ * from hub 1-2, below the root hub usb1 of the controller 0000:00:14.0. The
+ * forwarding threads of each device may be pinned to the CPUs handling the
+ * interrupt of its controller, or to those of its NUMA node, so that devices
+ * on different controllers run on different CPUs. The traffic of all devices
+ * is also added up per hub, to spot the hubs running out of bandwidth. */
+
+#define HUB_CHECK_INTERVAL_S 2
+#define HUB_RATE_WEIGHT      0.5
+/* Bulk transfers rarely get much more than two thirds of the signalling rate */
+#define HUB_BUSY_PERCENT     60
+#define HUB_IDLE_PERCENT     50
+
+static gint
+topology_read_int (const gchar *dir,
+                   const gchar *name,
+                   gint         fallback)
+{
+    gchar  *path;
+    gchar  *contents = NULL;
+    gchar  *end;
+    gint64  value;
+    gint    ret = fallback;
+
+    path = g_build_filename (dir, name, NULL);
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        value = g_ascii_strtoll (contents, &end, 10);
+        if (end != contents && value >= G_MININT && value <= G_MAXINT)
+            ret = (gint) value;
+    }
+    g_free (contents);
+    g_free (path);
+    return ret;
+}
+
+static gboolean
+topology_read_cpus (const gchar *path,
+                    cpu_set_t   *cpus)
+{
+    gchar    *contents = NULL;
+    gboolean  ret = FALSE;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL))
+        ret = parse_cpu_list (g_strstrip (contents), cpus);
+    if (!ret)
+        CPU_ZERO (cpus);
+    g_free (contents);
+    return ret;
+}
+
+/* With MSI-X, the first vector is the one of the primary interrupter */
+static gint
+topology_read_irq (const gchar *controller)
+{
+    gchar       *path;
+    GDir        *dir;
+    const gchar *name;
+    gint         irq = -1;
+
+    path = g_build_filename (controller, "msi_irqs", NULL);
+    if ((dir = g_dir_open (path, 0, NULL)) != NULL) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            guint64 value;
+
+            value = g_ascii_strtoull (name, NULL, 10);
+            if (value > 0 && value <= G_MAXINT && (irq < 0 || (gint) value < irq))
+                irq = (gint) value;
+        }
+        g_dir_close (dir);
+    }
+    g_free (path);
+
+    if (irq < 0 && (irq = topology_read_int (controller, "irq", -1)) == 0)
+        irq = -1;
+    return irq;
+}
+
+/* Path made of the first n components */
+static gchar *
+topology_join (gchar **components,
+               guint   n)
+{
+    gchar *component;
+    gchar *path;
+
+    component = components[n];
+    components[n] = NULL;
+    path = g_strjoinv ("/", components);
+    components[n] = component;
+    return path;
+}
+
+static UsbTopology *
+usb_topology_new (const gchar *sysfs_path)
+{
+    UsbTopology  *topology;
+    gchar       **components;
+    GPtrArray    *hubs;
+    gchar        *path;
+    guint         n_components;
+    guint         root;
+    guint         i;
+
+    components = g_strsplit (sysfs_path, "/", -1);
+    n_components = g_strv_length (components);
+    for (root = 1; root < n_components; root++) {
+        guint busnum;
+        gchar extra;
+
+        if (sscanf (components[root], "usb%u%c", &busnum, &extra) == 1)
+            break;
+    }
+    /* Root hubs themselves are never tethered */
+    if (root + 1 >= n_components) {
+        g_strfreev (components);
+        return NULL;
+    }
+
+    topology = g_slice_new0 (UsbTopology);
+    topology->controller = topology_join (components, root);
+    hubs = g_ptr_array_new ();
+    for (i = n_components - 1; i > root; i--)
+        g_ptr_array_add (hubs, topology_join (components, i));
+    g_ptr_array_add (hubs, NULL);
+    topology->hubs = (gchar **) g_ptr_array_free (hubs, FALSE);
+    g_strfreev (components);
+
+    topology->numa_node = topology_read_int (topology->controller, "numa_node", -1);
+    topology->irq = topology_read_irq (topology->controller);
+
+    CPU_ZERO (&topology->irq_cpus);
+    if (topology->irq >= 0) {
+        path = g_strdup_printf ("/proc/irq/%d/effective_affinity_list", topology->irq);
+        if (!topology_read_cpus (path, &topology->irq_cpus)) {
+            g_free (path);
+            path = g_strdup_printf ("/proc/irq/%d/smp_affinity_list", topology->irq);
+            topology_read_cpus (path, &topology->irq_cpus);
+        }
+        g_free (path);
+    }
+
+    path = g_build_filename (topology->controller, "local_cpulist", NULL);
+    if (!topology_read_cpus (path, &topology->node_cpus) && topology->numa_node >= 0) {
+        g_free (path);
+        path = g_strdup_printf ("/sys/devices/system/node/node%d/cpulist", topology->numa_node);
+        topology_read_cpus (path, &topology->node_cpus);
+    }
+    g_free (path);
+
+    return topology;
+}
+
+static void
+usb_topology_free (UsbTopology *topology)
+{
+    g_free (topology->controller);
+    g_strfreev (topology->hubs);
+    g_slice_free (UsbTopology, topology);
+}
+
+/* CPUs the forwarding threads of the device are pinned to, if any. Without
+ * the interrupt affinity, the NUMA node of the controller is used. */
+static const cpu_set_t *
+device_get_cpus (Device *device)
+{
+    DeviceSettings *settings = device->settings;
+    UsbTopology    *topology = device->topology;
+
+    if (!settings->pin_cpus)
+        return NULL;
+
+    switch (settings->cpu_topology) {
+    case CPU_TOPOLOGY_NONE:
+        return &settings->cpus;
+    case CPU_TOPOLOGY_IRQ:
+        if (topology && CPU_COUNT (&topology->irq_cpus) > 0)
+            return &topology->irq_cpus;
+        /* fall through */
+    case CPU_TOPOLOGY_NODE:
+        if (topology && CPU_COUNT (&topology->node_cpus) > 0)
+            return &topology->node_cpus;
+        break;
+    }
+    return NULL;
+}
+
+static void
+usb_hub_free (UsbHub *hub)
+{
+    g_free (hub->path);
+    g_slice_free (UsbHub, hub);
+}
+
+static UsbHub *
+usb_hub_lookup (Context     *context,
+                const gchar *path)
+{
+    UsbHub *hub;
+    gchar  *speed_path;
+    gchar  *contents = NULL;
+
+    if ((hub = g_hash_table_lookup (context->usb_hubs, path)) != NULL)
+        return hub;
+
+    hub = g_slice_new0 (UsbHub);
+    hub->path = g_strdup (path);
+
+    /* Given in Mbit/s, e.g. 1.5, 12, 480 or 5000 */
+    speed_path = g_build_filename (path, "speed", NULL);
+    if (g_file_get_contents (speed_path, &contents, NULL, NULL))
+        hub->speed = (guint) g_ascii_strtod (contents, NULL);
+    g_free (contents);
+    g_free (speed_path);
+
+    g_hash_table_insert (context->usb_hubs, hub->path, hub);
+    return hub;
+}
+
+/* Percentage of the signalling rate in use, 0 if unknown */
+static guint
+usb_hub_get_load (UsbHub *hub)
+{
+    if (!hub->speed)
+        return 0;
+    return (guint) (hub->rate * 8 * 100 / (hub->speed * 1000000.0));
+}
+
+static void
+usb_hub_update (UsbHub *hub)
+{
+    guint load;
+
+    hub->rate = (HUB_RATE_WEIGHT * hub->bytes / HUB_CHECK_INTERVAL_S +
+                 (1.0 - HUB_RATE_WEIGHT) * hub->rate);
+    hub->bytes = 0;
+
+    load = usb_hub_get_load (hub);
+    if (!hub->busy && load >= HUB_BUSY_PERCENT) {
+        hub->busy = TRUE;
+        g_warning ("hub %s at %u%% of its %u Mbit/s, shared by %u device(s)",
+                   hub->path, load, hub->speed, hub->n_devices);
+    } else if (hub->busy && load < HUB_IDLE_PERCENT) {
+        hub->busy = FALSE;
+        g_message ("hub %s back at %u%% of its %u Mbit/s", hub->path, load, hub->speed);
+    }
+}
+
+static gboolean
+hub_check_cb (Context *context)
+{
+    GHashTableIter  iter;
+    Device         *device;
+    UsbHub         *hub;
+
+    g_hash_table_iter_init (&iter, context->usb_hubs);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &hub))
+        hub->n_devices = 0;
+
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        guint bytes;
+        guint i;
+
+        if (!device->conn_thread || !device->topology)
+            continue;
+        /* Both directions share the bus; counters wrap around */
+        bytes = (token_bucket_get_bytes (&device->shaper[SHAPER_DOWN]) +
+                 token_bucket_get_bytes (&device->shaper[SHAPER_UP]));
+        for (i = 0; device->topology->hubs[i]; i++) {
+            hub = usb_hub_lookup (context, device->topology->hubs[i]);
+            hub->n_devices++;
+            hub->bytes += (guint) (bytes - device->hub_last_bytes);
+        }
+        device->hub_last_bytes = bytes;
+    }
+
+    g_hash_table_iter_init (&iter, context->usb_hubs);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &hub)) {
+        if (!hub->n_devices)
+            g_hash_table_iter_remove (&iter);
+        else
+            usb_hub_update (hub);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************************************************************************/
+/* Userspace NAT
+ *
+ * With a single Ethernet uplink, TCP and UDP from the phones may be
+ * translated by the forwarding threads themselves, and sent straight to the
+ * gateway without going through the kernel forwarding path. Each device gets
+ * its own range of uplink ports while forwarding; the helper script takes
+ * all of them away from the kernel. */
+
+#define NAT_FIRST_PORT         40960
+#define NAT_MAX_SLICES         16
+#define NAT_REFRESH_INTERVAL_S 5
+
+static gboolean
+nat_run_script (Context     *context,
+                const gchar *action)
+{
+    gchar   *args[8];
+    GError  *error = NULL;
+    gint     status;
+    gboolean ret;
+
+    args[0] = g_strdup (BINDIR_PATH "/" NAT_SCRIPT);
+    args[1] = g_strdup ("linux");
+    args[2] = g_strdup (((Uplink *) g_ptr_array_index (context->uplinks, 0))->name);
+    args[3] = g_strdup (nat_engine_get_address (context->nat));
+    args[4] = g_strdup_printf ("%u", NAT_FIRST_PORT);
+    args[5] = g_strdup_printf ("%u", NAT_FIRST_PORT + NAT_MAX_SLICES * NAT_SLICE_PORTS - 1);
+    args[6] = g_strdup (action);
+    args[7] = NULL;
+
+    ret = (g_spawn_sync (NULL, args, NULL,
+                         G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                         NULL, NULL, NULL, NULL, &status, &error) &&
+           g_spawn_check_exit_status (status, &error));
+    if (!ret) {
+        g_critical ("couldn't run " NAT_SCRIPT ": %s", error->message);
+        g_error_free (error);
+    }
+
+    g_strfreev (args);
+    return ret;
+}
+
+static gboolean
+nat_refresh_cb (Context *context)
+{
+    nat_engine_refresh (context->nat);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+nat_setup (Context *context)
+{
+    GError *error = NULL;
+
+    context->nat = nat_engine_new (((Uplink *) g_ptr_array_index (context->uplinks, 0))->name,
+                                   htonl (0x0a0b0000), /* 10.11.0.0/16 */
+                                   htonl (0xffff0000),
+                                   NAT_FIRST_PORT,
+                                   NAT_MAX_SLICES,
+                                   &error);
+    if (!context->nat) {
+        g_critical ("couldn't setup userspace NAT: %s", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    if (!nat_run_script (context, "up")) {
+        g_clear_pointer (&context->nat, nat_engine_free);
+        return FALSE;
+    }
+
+    g_message ("userspace NAT on %s, ports %u-%u",
+               nat_engine_get_address (context->nat),
+               NAT_FIRST_PORT, NAT_FIRST_PORT + NAT_MAX_SLICES * NAT_SLICE_PORTS - 1);
+    context->nat_refresh_id = g_timeout_add_seconds (NAT_REFRESH_INTERVAL_S, (GSourceFunc) nat_refresh_cb, context);
+    return TRUE;
+}
+
+static void
+nat_teardown (Context *context)
+{
+    if (context->nat_refresh_id)
+        g_source_remove (context->nat_refresh_id);
+    nat_run_script (context, "down");
+    g_clear_pointer (&context->nat, nat_engine_free);
+}
+
+/******************************************************************************/
+/* Transparent TCP proxy
+ *
+ * TCP connections from all the tunnel networks are redirected to a local
+ * port by the helper script, and relayed by the proxy thread. */
+
+static gboolean
+proxy_run_script (Context     *context,
+                  const gchar *action)
+{
+    gchar   *args[7];
+    GError  *error = NULL;
+    gint     status;
+    gboolean ret;
+
+    args[0] = g_strdup (BINDIR_PATH "/" PROXY_SCRIPT);
+    args[1] = g_strdup ("linux");
+    args[2] = g_strdup ("10.11.0.0");
+    args[3] = g_strdup ("16");
+    args[4] = g_strdup_printf ("%u", context->proxy_port);
+    args[5] = g_strdup (action);
+    args[6] = NULL;
+
+    ret = (g_spawn_sync (NULL, args, NULL,
+                         G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                         NULL, NULL, NULL, NULL, &status, &error) &&
+           g_spawn_check_exit_status (status, &error));
+    if (!ret) {
+        g_critical ("couldn't run " PROXY_SCRIPT ": %s", error->message);
+        g_error_free (error);
+    }
+
+    g_strfreev (args);
+    return ret;
+}
+
+static gboolean
+proxy_setup (Context *context)
+{
+    GError *error = NULL;
+
+    context->proxy = proxy_server_new (context->proxy_port,
+                                       htonl (0x0a0b0000), /* 10.11.0.0/16 */
+                                       htonl (0xffff0000),
+                                       &error);
+    if (!context->proxy) {
+        g_critical ("couldn't setup TCP proxy: %s", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    if (!proxy_run_script (context, "up")) {
+        g_clear_pointer (&context->proxy, proxy_server_free);
+        return FALSE;
+    }
+
+    g_message ("TCP proxy listening on port %u", context->proxy_port);
+    return TRUE;
+}
+
+static void
+proxy_teardown (Context *context)
+{
+    /* Rules go first, so that no new connection is left hanging */
+    proxy_run_script (context, "down");
+    g_clear_pointer (&context->proxy, proxy_server_free);
+}
+
+/******************************************************************************/
+/* Find libusb_device */
+
+#if defined HAVE_LIBUSB_WRAP_SYS_DEVICE
+
+/* Opens the device straight from its usbfs node, instead of enumerating all
+ * the USB devices in the system. The handle is returned as well, and stays
+ * valid while the fd is open. */
+static libusb_device *
+find_usb_device (libusb_context        *usb_context,
+                 const gchar           *devnode,
+                 guint                  busnum,
+                 guint                  devnum,
+                 libusb_device_handle **out_handle,
+                 gint                  *out_fd)
+{
+    libusb_device_handle *handle = NULL;
+    gint                  fd;
+    gint                  ret;
+
+    if ((fd = open (devnode, O_RDWR | O_CLOEXEC)) < 0) {
+        g_critical ("[%03u,%03u] couldn't open %s: %s", busnum, devnum, devnode, g_strerror (errno));
+        return NULL;
+    }
+
+    if ((ret = libusb_wrap_sys_device (usb_context, (intptr_t) fd, &handle)) < 0) {
+        g_critical ("[%03u,%03u] couldn't wrap %s: %s", busnum, devnum, devnode, libusb_strerror (ret));
+        close (fd);
+        return NULL;
+    }
+
+    *out_handle = handle;
+    *out_fd = fd;
+    return libusb_ref_device (libusb_get_device (handle));
+}
+
+#else
+
+static libusb_device *
+find_usb_device (libusb_context        *usb_context,
+                 const gchar           *devnode,
+                 guint                  busnum,
+                 guint                  devnum,
+                 libusb_device_handle **out_handle,
+                 gint                  *out_fd)
+{
+    libusb_device  *found_device = NULL;
+    libusb_device **devices = NULL;
+    ssize_t         n_devices = 0;
+    unsigned int    i;
+
+    n_devices = libusb_get_device_list (usb_context, &devices);
+    if (!n_devices || !devices) {
+        g_critical ("libusb device enumeration failed");
+        return NULL;
+    }
+
+    /* Go over the devices and find the one we want */
+    for (i = 0; !found_device && i < n_devices; i++) {
+        if (libusb_get_bus_number (devices[i]) == busnum &&
+            libusb_get_device_address (devices[i]) == devnum)
+            found_device = libusb_ref_device (devices[i]);
+    }
+
+    libusb_free_device_list (devices, 1);
+
+    if (!found_device)
+        g_critical ("libusb device (%03u:%03u) not found", busnum, devnum);
+
+    *out_handle = NULL;
+    *out_fd = -1;
+    return found_device;
+}
+
+#endif
+
+/******************************************************************************/
+/* Tethering */
+
+/* The accessory gadget driver in the phone never moves more than 16 KB per
+ * request, so faster links get more transfers in flight rather than bigger
+ * ones */
+#define ACC_MAX_TRANSFER_SIZE 16384
+#define ACC_MAX_QUEUE_DEPTH   16
+#define ACC_TIMEOUT           200
+#define ACC_MAX_TIMEOUT       10000
+
+static void
+timeout_to_timeval (gint            timeout_ms,
+                    struct timeval *tv)
+{
+    tv->tv_sec = timeout_ms / 1000;
+    tv->tv_usec = (timeout_ms % 1000) * 1000;
+}
+
+/* Rough usable bulk throughput for each link speed, in bytes per second */
+static guint64
+link_rate_from_speed (gint speed)
+{
+    switch (speed) {
+    case LIBUSB_SPEED_LOW:
+    case LIBUSB_SPEED_FULL:
+        return 1000000;
+    case LIBUSB_SPEED_HIGH:
+    case LIBUSB_SPEED_UNKNOWN:
+        return 40000000;
+    default:
+        /* SuperSpeed and above */
+        return 400000000;
+    }
+}
+
+/* Applies the CPU affinity and scheduling policy configured for the device to
+ * the calling forwarding thread. Failures are not fatal: the thread just
+ * keeps running with the defaults. */
+static void
+device_setup_thread (Device      *device,
+                     const gchar *name)
+{
+    DeviceSettings  *settings = device->settings;
+    const cpu_set_t *cpus;
+    gint             ret;
+
+    if ((cpus = device_get_cpus (device)) != NULL) {
+        if ((ret = pthread_setaffinity_np (pthread_self (), sizeof (*cpus), cpus)) != 0)
+            g_warning ("[%03o,%03o] couldn't set %s thread CPU affinity: %s",
+                       device->busnum, device->devnum, name, g_strerror (ret));
+        else
+            g_debug ("[%03o,%03o] %s thread pinned to %d CPU(s)",
+                     device->busnum, device->devnum, name, CPU_COUNT (cpus));
+    }
+
+    if (settings->sched_policy != SCHED_OTHER) {
+        struct sched_param param = { 0 };
+
+        param.sched_priority = (settings->sched_priority ?
+                                settings->sched_priority :
+                                sched_get_priority_min (settings->sched_policy));
+        if ((ret = pthread_setschedparam (pthread_self (), settings->sched_policy, &param)) != 0)
+            g_warning ("[%03o,%03o] couldn't set %s thread scheduling policy %s (priority %d): %s",
+                       device->busnum, device->devnum, name,
+                       sched_policy_to_string (settings->sched_policy), param.sched_priority, g_strerror (ret));
+        else
+            g_debug ("[%03o,%03o] %s thread scheduling policy %s (priority %d)",
+                     device->busnum, device->devnum, name,
+                     sched_policy_to_string (settings->sched_policy), param.sched_priority);
+    }
+}
+
+/* Size of each transfer, in both directions. The phone sends up to this much
+ * per write, as announced in the accessory description, so IN transfers of
+ * the same size always end at a write boundary. */
+static gsize
+link_transfer_size (gint speed)
+{
+    switch (speed) {
+    case LIBUSB_SPEED_LOW:
+    case LIBUSB_SPEED_FULL:
+        return 4096;
+    default:
+        return ACC_MAX_TRANSFER_SIZE;
+    }
+}
+
+/* IN transfers kept in flight, so that the phone never waits for the host to
+ * resubmit after each completion */
+static guint
+link_queue_depth (gint speed)
+{
+    switch (speed) {
+    case LIBUSB_SPEED_LOW:
+    case LIBUSB_SPEED_FULL:
+        return 1;
+    case LIBUSB_SPEED_HIGH:
+    case LIBUSB_SPEED_UNKNOWN:
+        return 2;
+    default:
+        /* SuperSpeed and above */
+        return 4;
+    }
+}
+
+static const gchar *
+link_speed_to_string (gint speed)
+{
+    switch (speed) {
+    case LIBUSB_SPEED_LOW:
+        return "low";
+    case LIBUSB_SPEED_FULL:
+        return "full";
+    case LIBUSB_SPEED_HIGH:
+        return "high";
+    case LIBUSB_SPEED_UNKNOWN:
+        return "unknown";
+    default:
+        return "super";
+    }
+}
+
+/* Reads the bulk endpoints of the accessory interface, and sizes transfers
+ * after the negotiated link speed */
+static void
+device_setup_endpoints (Device *device)
+{
+    libusb_device                   *usb_device;
+    struct libusb_config_descriptor *config = NULL;
+    gint                             speed;
+    gint                             ret;
+
+    usb_device = libusb_get_device (device->usb_handle);
+    speed = device->speed = libusb_get_device_speed (usb_device);
+
+    device->ep_in = AOA_ACCESSORY_EP_IN;
+    device->ep_out = AOA_ACCESSORY_EP_OUT;
+    device->max_packet_size = 0;
+
+    if ((ret = libusb_get_active_config_descriptor (usb_device, &config)) < 0)
+        g_warning ("[%03o,%03o] couldn't read configuration descriptor: %s",
+                   device->busnum, device->devnum, libusb_strerror (ret));
+    else {
+        if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+            const struct libusb_interface_descriptor *iface = &config->interface[0].altsetting[0];
+            guint                                     i;
+
+            for (i = 0; i < iface->bNumEndpoints; i++) {
+                const struct libusb_endpoint_descriptor *ep = &iface->endpoint[i];
+
+                if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                    continue;
+                if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+                    device->ep_in = ep->bEndpointAddress;
+                else {
+                    device->ep_out = ep->bEndpointAddress;
+                    device->max_packet_size = ep->wMaxPacketSize & 0x07FF;
+                }
+            }
+        }
+        libusb_free_config_descriptor (config);
+    }
+
+    /* Bulk max packet sizes are fixed for each speed anyway */
+    if (!device->max_packet_size) {
+        if (speed == LIBUSB_SPEED_LOW || speed == LIBUSB_SPEED_FULL)
+            device->max_packet_size = 64;
+        else if (speed == LIBUSB_SPEED_HIGH || speed == LIBUSB_SPEED_UNKNOWN)
+            device->max_packet_size = 512;
+        else
+            device->max_packet_size = 1024;
+    }
+
+    device->transfer_size = link_transfer_size (speed);
+    device->out_transfer_size = device->transfer_size;
+    device->queue_depth = link_queue_depth (speed);
+    device->timeout_ms = ACC_TIMEOUT;
+    device->busy_poll_us = device->settings->busy_poll_us;
+
+    g_message ("[%03o,%03o] accessory endpoints in 0x%02x, out 0x%02x (max packet %u), %s speed: %" G_GSIZE_FORMAT " byte transfers, %d queued",
+               device->busnum, device->devnum, device->ep_in, device->ep_out, device->max_packet_size,
+               link_speed_to_string (speed), device->transfer_size, device->queue_depth);
+}
+
+/* Packet capture. The ring is only created and enabled from the main loop;
+ * the forwarding threads check the flag and take timestamps only while it is
+ * set. */
+
+static gboolean
+device_start_capture (Device   *device,
+                      guint     n_records,
+                      GError  **error)
+{
+    if (!device->capture && !(device->capture = capture_ring_new (n_records, error)))
+        return FALSE;
+    g_atomic_int_set (&device->capturing, TRUE);
+    return TRUE;
+}
+
+static inline gint64
+device_capture_time (Device *device)
+{
+    return g_atomic_int_get (&device->capturing) ? capture_now () : 0;
+}
+
+static CaptureDrop
+capture_drop_from_error (gint error)
+{
+    if (error == 0)
+        return CAPTURE_DROP_NONE;
+    if (error == LIBUSB_ERROR_TIMEOUT)
+        return CAPTURE_DROP_USB_TIMEOUT;
+    return CAPTURE_DROP_USB_ERROR;
+}
+
+static CaptureDrop
+capture_drop_from_status (enum libusb_transfer_status status)
+{
+    if (status == LIBUSB_TRANSFER_COMPLETED)
+        return CAPTURE_DROP_NONE;
+    if (status == LIBUSB_TRANSFER_TIMED_OUT)
+        return CAPTURE_DROP_USB_TIMEOUT;
+    return CAPTURE_DROP_USB_ERROR;
+}
+
+/******************************************************************************/
+/* Bring-up trace */
+
+static void
+device_bringup_mark (Device       *device,
+                     BringupPhase  phase)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    g_mutex_lock (&device->mutex);
+    if (!device->bringup[phase])
+        device->bringup[phase] = now;
+    g_mutex_unlock (&device->mutex);
+}
+
+/* Returns the time the trace starts at, 0 if nothing recorded */
+static gint64
+bringup_start (const gint64 *bringup)
+{
+    guint i;
+
+    for (i = 0; i < BRINGUP_N; i++) {
+        if (bringup[i])
+            return bringup[i];
+    }
+    return 0;
+}
+
+/* Candidates going into accessory mode come back as a new device in the same
+ * sysfs path, which goes on with the trace */
+static void
+device_bringup_save (Device *device)
+{
+    gint64 *bringup;
+
+    bringup = g_new (gint64, BRINGUP_N);
+    memcpy (bringup, device->bringup, sizeof (device->bringup));
+    g_hash_table_replace (device->context->bringups, g_strdup (device->sysfs_path), bringup);
+}
+
+/* Once the first packet from the phone is forwarded */
+static void
+device_bringup_report (Device *device)
+{
+    gint64   bringup[BRINGUP_N];
+    gint64   start;
+    GString *str;
+    guint    i;
+
+    g_mutex_lock (&device->mutex);
+    memcpy (bringup, device->bringup, sizeof (bringup));
+    g_mutex_unlock (&device->mutex);
+
+    start = bringup_start (bringup);
+    str = g_string_new (NULL);
+    for (i = 0; i < BRINGUP_N; i++) {
+        if (bringup[i])
+            g_string_append_printf (str, "%s%s +%" G_GINT64_FORMAT "ms",
+                                    str->len ? ", " : "", bringup_phase_names[i], (bringup[i] - start) / 1000);
+    }
+    g_message ("[%03o,%03o] online after %" G_GINT64_FORMAT "ms: %s",
+               device->busnum, device->devnum, (bringup[BRINGUP_FIRST_IN] - start) / 1000, str->str);
+    g_string_free (str, TRUE);
+}
+
+/******************************************************************************/
+
+/* When bridged, the TAP device carries Ethernet frames. Returns the offset of
+ * the IP packet in the buffer, or -1 if there is none. */
+static gssize
+device_l3_offset (Device       *device,
+                  const guint8 *buffer,
+                  gsize         buffer_len)
+{
+    guint16 ethertype;
+
+    if (!device->context->bridge)
+        return 0;
+    if (buffer_len < ETHER_HDR_LEN)
+        return -1;
+
+    ethertype = (buffer[12] << 8) | buffer[13];
+    return (ethertype == ETHERTYPE_IP || ethertype == ETHERTYPE_IPV6) ? ETHER_HDR_LEN : -1;
+}
+
+/* Locally administered address for bridged phones, kept across reconnections
+ * in the same port so that DHCP leases are reused */
+static void
+device_get_l2_address (Device *device,
+                       guint8  address[ETH_ALEN])
+{
+    guint hash;
+
+    hash = g_str_hash (device->sysfs_path);
+    address[0] = 0x02;
+    address[1] = 0x53;
+    address[2] = (hash >> 24) & 0xff;
+    address[3] = (hash >> 16) & 0xff;
+    address[4] = (hash >> 8) & 0xff;
+    address[5] = hash & 0xff;
+}
+
+/* Records each packet of a batch once its OUT transfer is done */
+static void
+device_capture_out (Device       *device,
+                    const guint8 *buffer,
+                    gsize         buffer_len,
+                    gboolean      framed,
+                    gint64        tun_time,
+                    CaptureDrop   drop)
+{
+    gint64    usb_time;
+    LinkFrame frame;
+
+    usb_time = capture_now ();
+    if (!framed) {
+        capture_ring_add (device->capture, CAPTURE_DIRECTION_OUT, buffer, buffer_len, tun_time, usb_time, drop);
+        return;
+    }
+
+    while (link_frame_next (&buffer, &buffer_len, &frame)) {
+        gssize l3;
+
+        if (frame.type == LINK_FRAME_PACKET ||
+            (frame.type == LINK_FRAME_ETHERNET && (l3 = device_l3_offset (device, frame.payload, frame.payload_len)) >= 0))
+            capture_ring_add (device->capture, CAPTURE_DIRECTION_OUT,
+                              frame.payload + (frame.type == LINK_FRAME_ETHERNET ? l3 : 0),
+                              frame.payload_len - (frame.type == LINK_FRAME_ETHERNET ? l3 : 0),
+                              tun_time, usb_time, drop);
+    }
+}
+
+/* Result of each data transfer, as seen by the watchdog */
+typedef enum {
+    TRANSFER_DONE,
+    TRANSFER_TIMEOUT,
+    TRANSFER_ERROR,
+} TransferResult;
+
+#define TRANSFER_ERROR_BACKOFF_MAX_MS 100
+
+static TransferResult
+transfer_result_from_error (gint error)
+{
+    if (error == 0)
+        return TRANSFER_DONE;
+    if (error == LIBUSB_ERROR_TIMEOUT)
+        return TRANSFER_TIMEOUT;
+    return TRANSFER_ERROR;
+}
+
+static TransferResult
+transfer_result_from_status (enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return TRANSFER_DONE;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_CANCELLED:
+        return TRANSFER_TIMEOUT;
+    default:
+        return TRANSFER_ERROR;
+    }
+}
+
+/* Counts the transfer for the watchdog. After an error, waits a bit longer
+ * each time before the thread retries, so that a failing device isn't
+ * hammered until the watchdog steps in. */
+static void
+device_transfer_result (Device         *device,
+                        gboolean        out,
+                        TransferResult  result)
+{
+    gint errors;
+
+    switch (result) {
+    case TRANSFER_DONE:
+        g_atomic_int_inc (out ? &device->out_done : &device->in_done);
+        g_atomic_int_set (&device->usb_errors, 0);
+        break;
+    case TRANSFER_TIMEOUT:
+        /* Only OUT transfers carry data we know about */
+        if (out)
+            g_atomic_int_inc (&device->out_timeouts);
+        break;
+    case TRANSFER_ERROR:
+        errors = g_atomic_int_add (&device->usb_errors, 1) + 1;
+        g_usleep (MIN (errors, TRANSFER_ERROR_BACKOFF_MAX_MS) * 1000);
+        break;
+    }
+}
+
+/* A read request in the phone only completes when full or on a short packet,
+ * so transfers made of full packets must be terminated with a zero-length
+ * one. Not when they also fill the read request, though, as the phone would
+ * then get an empty read, taken as EOF. */
+static gboolean
+tun_send_needs_zlp (Device *device,
+                    gsize   len)
+{
+    gsize peer_rx_size;
+
+    peer_rx_size = (gsize) g_atomic_int_get (&device->peer_rx_size);
+    return (len % device->max_packet_size == 0 && (peer_rx_size == 0 || len < peer_rx_size));
+}
+
+/* Returns 0 or the libusb error of the data transfer */
+static gint
+tun_send (Device       *device,
+          const guint8 *buffer,
+          gsize         buffer_len)
+{
+    gint ret;
+    gint transferred;
+
+    if ((ret = libusb_bulk_transfer (device->usb_handle,
+                                     device->ep_out,
+                                     (guint8 *) buffer,
+                                     buffer_len,
+                                     &transferred,
+                                     g_atomic_int_get (&device->timeout_ms))) < 0) {
+        if (ret != LIBUSB_ERROR_TIMEOUT)
+            device_log (device, LOG_REASON_USB_OUT, G_LOG_LEVEL_WARNING, "bulk transfer failed: %s", libusb_strerror (ret));
+        return ret;
+    }
+
+    if (tun_send_needs_zlp (device, buffer_len) &&
+        (ret = libusb_bulk_transfer (device->usb_handle,
+                                     device->ep_out,
+                                     (guint8 *) buffer,
+                                     0,
+                                     &transferred,
+                                     g_atomic_int_get (&device->timeout_ms))) < 0 &&
+        ret != LIBUSB_ERROR_TIMEOUT)
+        device_log (device, LOG_REASON_USB_OUT, G_LOG_LEVEL_WARNING, "zero-length transfer failed: %s", libusb_strerror (ret));
+    return 0;
+}
+
+/* Writes the next health probe, if one is due and the phone announced that it
+ * echoes them. Returns the length of the probe, to be sent in a transfer of
+ * its own, or 0 if none. */
+static gsize
+device_probe_put (Device *device,
+                  guint8 *buffer,
+                  gsize   buffer_size)
+{
+    gint64 now;
+
+    if (!device->settings->probe_interval_ms ||
+        !(g_atomic_int_get (&device->peer_caps) & LINK_CAP_PROBE))
+        return 0;
+
+    now = g_get_monotonic_time ();
+    if (now < device->probe_next)
+        return 0;
+    device->probe_next = now + (gint64) device->settings->probe_interval_ms * 1000;
+
+    g_mutex_lock (&device->mutex);
+    device->probe_stats.sent++;
+    g_mutex_unlock (&device->mutex);
+
+    return link_probe_put (buffer, buffer_size, ++device->probe_seq, now);
+}
+
+/* Reads as many packets as are available in the TUN device without blocking,
+ * taking first the ones translated by the userspace NAT. When framed, each
+ * packet is stored as a PACKET frame (ETHERNET when bridged) and reading
+ * continues while there is room for a full packet; otherwise a single raw
+ * packet is read. Returns the amount of data read, 0 on EOF or -1 on error. */
+static gssize
+tun_read_batch (Device  *device,
+                guint8  *buffer,
+                gsize    buffer_size,
+                gboolean framed)
+{
+    gsize  header = framed ? LINK_FRAME_HEADER_SIZE : 0;
+    gsize  len = 0;
+    gint64 now = device->flows ? g_get_monotonic_time () : 0;
+    guint  clamp_mtu = g_atomic_int_get (&device->clamp_mtu);
+
+    /* Ethernet frames are dropped until the phone announces it bridges
+     * them */
+    if (device->context->bridge &&
+        (!framed || !(g_atomic_int_get (&device->peer_caps) & LINK_CAP_ETHERNET))) {
+        while (read (device->tun_fd, buffer, buffer_size) > 0)
+            ;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    do {
+        gssize nread = 0;
+        gssize l3;
+
+        if (device->nat)
+            nread = nat_slice_input (device->nat, &buffer[len + header], buffer_size - len - header);
+        if (!nread)
+            nread = read (device->tun_fd, &buffer[len + header], buffer_size - len - header);
+        if (nread <= 0) {
+            if (len > 0)
+                break;
+            return nread;
+        }
+
+        if ((l3 = device_l3_offset (device, &buffer[len + header], nread)) >= 0) {
+            if (clamp_mtu && mss_clamp (&buffer[len + header + l3], nread - l3, clamp_mtu))
+                g_atomic_int_inc (&device->mss_clamped);
+            if (now)
+                flow_table_add (device->flows, FLOW_DIRECTION_OUT, &buffer[len + header + l3], nread - l3, now);
+        }
+        if (framed)
+            link_frame_put (&buffer[len], buffer_size - len,
+                            device->context->bridge ? LINK_FRAME_ETHERNET : LINK_FRAME_PACKET, NULL, nread);
+        len += header + nread;
+    } while (framed && buffer_size - len >= header + device->tun_mtu);
+
+    if (G_UNLIKELY (!device->bringup_out_done)) {
+        device->bringup_out_done = TRUE;
+        device_bringup_mark (device, BRINGUP_FIRST_OUT);
+    }
+
+    return len;
+}
+
+static void *
+tun_thread_func (Device *device)
+{
+    gssize         nread;
+    guint8         acc_buf[ACC_MAX_TRANSFER_SIZE];
+    guint8         lz4_buf[ACC_MAX_TRANSFER_SIZE];
+    guint8         probe_buf[LINK_FRAME_HEADER_SIZE + LINK_PROBE_PAYLOAD_SIZE];
+    LinkCompressor compressor;
+
+    device_setup_thread (device, "tun");
+
+    link_compressor_init (&compressor, link_rate_from_speed (libusb_get_device_speed (device->usb_device)));
+
+    while (1) {
+        gint           status;
+        fd_set         rfds;
+        struct timeval tv;
+        gboolean       halt_thread;
+        gsize          max_batch;
+        gsize          lz4_len = 0;
+        gint64         tun_time;
+        gint64         delay;
+        gsize          probe_len;
+        gint           ret;
+
+        g_mutex_lock (&device->mutex);
+        halt_thread = device->halt;
+        g_mutex_unlock (&device->mutex);
+
+        if (halt_thread)
+            break;
+
+        /* Probes aren't rate limited, they are checked at least once per
+         * device timeout */
+        if ((probe_len = device_probe_put (device, probe_buf, sizeof (probe_buf))) > 0)
+            device_transfer_result (device, TRUE, transfer_result_from_error (tun_send (device, probe_buf, probe_len)));
+
+        if ((delay = token_bucket_delay (&device->shaper[SHAPER_DOWN])) > 0) {
+            g_usleep (MIN (delay, (gint64) g_atomic_int_get (&device->timeout_ms) * 1000));
+            continue;
+        }
+
+        FD_ZERO (&rfds);
+        FD_SET  (device->tun_fd, &rfds);
+        if (device->nat)
+            FD_SET (nat_slice_get_fd (device->nat), &rfds);
+
+        timeout_to_timeval (g_atomic_int_get (&device->timeout_ms), &tv);
+
+        if ((status = select (MAX (device->tun_fd, device->nat ? nat_slice_get_fd (device->nat) : 0) + 1,
+                              &rfds, NULL, NULL, &tv)) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("[%03o,%03o] waiting to write: %s", device->busnum, device->devnum, g_strerror (errno));
+            break;
+        }
+
+        if (status == 0)
+            continue;
+
+        /* Until the phone announces framing support, send one raw packet
+         * per transfer */
+        max_batch = MIN ((gsize) g_atomic_int_get (&device->out_transfer_size), (gsize) g_atomic_int_get (&device->peer_rx_size));
+        nread = tun_read_batch (device, acc_buf, max_batch ? max_batch : device->transfer_size, max_batch > 0);
+        if (nread > 0) {
+            tun_time = device_capture_time (device);
+
+            if (device->settings->compression == COMPRESSION_LZ4 &&
+                (g_atomic_int_get (&device->peer_caps) & LINK_CAP_LZ4))
+                lz4_len = link_compressor_run (&compressor, acc_buf, nread, lz4_buf, max_batch);
+
+            if (lz4_len > 0)
+                ret = tun_send (device, lz4_buf, lz4_len);
+            else
+                ret = tun_send (device, acc_buf, nread);
+            device_transfer_result (device, TRUE, transfer_result_from_error (ret));
+
+            if (tun_time)
+                device_capture_out (device, acc_buf, nread, max_batch > 0, tun_time, capture_drop_from_error (ret));
+            token_bucket_take (&device->shaper[SHAPER_DOWN], nread);
+            continue;
+        }
+
+        if (nread < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            g_warning ("[%03o,%03o] couldn't read from TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
+            break;
+        }
+
+        /* EOF received */
+        break;
+    }
+
+    if (compressor.n_compressed)
+        g_message ("[%03o,%03o] compressed %" G_GUINT64_FORMAT " batches (%" G_GUINT64_FORMAT " skipped), average ratio %.2f",
+                   device->busnum, device->devnum, compressor.n_compressed, compressor.n_skipped, compressor.ratio);
+
+    g_mutex_lock (&device->mutex);
+    device->halt = TRUE;
+    g_mutex_unlock (&device->mutex);
+    return NULL;
+}
+
+/* usb_time is only given while capturing */
+static gboolean
+tun_write (Device       *device,
+           const guint8 *buffer,
+           gsize         buffer_len,
+           gint64        usb_time)
+{
+    CaptureDrop drop = CAPTURE_DROP_NONE;
+    gboolean    ret = TRUE;
+    guint       clamp_mtu;
+    gssize      l3;
+
+    l3 = device_l3_offset (device, buffer, buffer_len);
+
+    /* Packets point into our own transfer buffers, so they may be rewritten */
+    if (l3 >= 0 &&
+        (clamp_mtu = g_atomic_int_get (&device->clamp_mtu)) != 0 &&
+        mss_clamp ((guint8 *) buffer + l3, buffer_len - l3, clamp_mtu))
+        g_atomic_int_inc (&device->mss_clamped);
+
+    /* Translated packets leave once the whole transfer is processed */
+    if ((!device->nat || !nat_slice_output (device->nat, buffer, buffer_len)) &&
+        write (device->tun_fd, buffer, buffer_len) < 0) {
+        drop = CAPTURE_DROP_TUN_ERROR;
+        if (errno != EAGAIN) {
+            device_log (device, LOG_REASON_TUN_WRITE, G_LOG_LEVEL_WARNING, "couldn't write to TUN device: %s", g_strerror (errno));
+            ret = FALSE;
+        }
+    }
+
+    if (G_UNLIKELY (!device->bringup_in_done)) {
+        device->bringup_in_done = TRUE;
+        device_bringup_mark (device, BRINGUP_FIRST_IN);
+        device_bringup_report (device);
+    }
+
+    if (usb_time && l3 >= 0)
+        capture_ring_add (device->capture, CAPTURE_DIRECTION_IN, buffer + l3, buffer_len - l3, capture_now (), usb_time, drop);
+    if (device->flows && l3 >= 0)
+        flow_table_add (device->flows, FLOW_DIRECTION_IN, buffer + l3, buffer_len - l3, g_get_monotonic_time ());
+    token_bucket_take (&device->shaper[SHAPER_UP], buffer_len);
+    return ret;
+}
+
+static void
+acc_process_hello (Device          *device,
+                   const LinkFrame *frame)
+{
+    guint32 caps;
+    guint16 max_rx_size;
+
+    if (!link_hello_parse (frame, &caps, &max_rx_size) ||
+        max_rx_size < LINK_FRAME_HEADER_SIZE + device->tun_mtu) {
+        device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "invalid HELLO frame received");
+        return;
+    }
+
+    /* Only use what we asked for */
+    if (device->settings->compression != COMPRESSION_LZ4)
+        caps &= ~LINK_CAP_LZ4;
+
+    g_message ("[%03o,%03o] link framing enabled: max transfer %u bytes, compression %s, probes %s",
+               device->busnum, device->devnum, max_rx_size, (caps & LINK_CAP_LZ4) ? "lz4" : "none",
+               (caps & LINK_CAP_PROBE) ? "yes" : "no");
+    if (device->context->bridge && !(caps & LINK_CAP_ETHERNET))
+        g_warning ("[%03o,%03o] phone doesn't support bridging, no traffic will be forwarded",
+                   device->busnum, device->devnum);
+
+    g_atomic_int_set (&device->peer_caps, caps);
+    g_atomic_int_set (&device->peer_rx_size, max_rx_size);
+    device_bringup_mark (device, BRINGUP_HELLO);
+}
+
+static void
+acc_process_reply (Device          *device,
+                   const LinkFrame *frame)
+{
+    guint32 seq;
+    gint64  send_time;
+    gint64  rtt;
+
+    if (!link_reply_parse (frame, &seq, &send_time) ||
+        (rtt = g_get_monotonic_time () - send_time) < 0) {
+        device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "invalid REPLY frame received");
+        return;
+    }
+
+    g_mutex_lock (&device->mutex);
+    link_probe_stats_add (&device->probe_stats, seq, rtt);
+    g_mutex_unlock (&device->mutex);
+}
+
+static gboolean
+acc_process_frames (Device       *device,
+                    const guint8 *buffer,
+                    gsize         buffer_len,
+                    guint8       *scratch,
+                    gsize         scratch_size,
+                    gint64        usb_time)
+{
+    LinkFrame frame;
+    gssize    raw_len;
+
+    while (link_frame_next (&buffer, &buffer_len, &frame)) {
+        switch (frame.type) {
+        case LINK_FRAME_HELLO:
+            acc_process_hello (device, &frame);
+            break;
+        case LINK_FRAME_REPLY:
+            acc_process_reply (device, &frame);
+            break;
+        case LINK_FRAME_PACKET:
+            if (device->context->bridge) {
+                device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "IP packet received while bridged, dropped");
+                break;
+            }
+            if (!tun_write (device, frame.payload, frame.payload_len, usb_time))
+                return FALSE;
+            break;
+        case LINK_FRAME_ETHERNET:
+            if (!device->context->bridge) {
+                device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "Ethernet frame received while not bridged, dropped");
+                break;
+            }
+            if (!tun_write (device, frame.payload, frame.payload_len, usb_time))
+                return FALSE;
+            break;
+        case LINK_FRAME_LZ4:
+            /* Compressed frames may only carry PACKET or ETHERNET frames, so
+             * no scratch buffer is given when processing their contents */
+            if (!scratch || (raw_len = link_decompress (&frame, scratch, scratch_size)) < 0) {
+                device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "invalid compressed frame received");
+                if (usb_time)
+                    capture_ring_add (device->capture, CAPTURE_DIRECTION_IN, frame.payload, frame.payload_len,
+                                      0, usb_time, CAPTURE_DROP_INVALID);
+                break;
+            }
+            if (!acc_process_frames (device, scratch, raw_len, NULL, 0, usb_time))
+                return FALSE;
+            break;
+        default:
+            device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_DEBUG, "unknown frame type received: 0x%02x", frame.type);
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+acc_process_transfer (Device       *device,
+                      const guint8 *buffer,
+                      gsize         buffer_len,
+                      guint8       *scratch,
+                      gsize         scratch_size,
+                      gint64        usb_time)
+{
+    if (link_is_framed (buffer, buffer_len))
+        return acc_process_frames (device, buffer, buffer_len, scratch, scratch_size, usb_time);
+    /* Legacy phones send raw IP packets, which can't be bridged */
+    if (device->context->bridge) {
+        device_log (device, LOG_REASON_FRAME, G_LOG_LEVEL_WARNING, "IP packet received while bridged, dropped");
+        return TRUE;
+    }
+    return tun_write (device, buffer, buffer_len, usb_time);
+}
+
+/* Handles a completed IN transfer. Returns FALSE if forwarding must stop. */
+static gboolean
+acc_transfer_complete (Device                 *device,
+                       struct libusb_transfer *transfer,
+                       guint8                 *scratch,
+                       gsize                   scratch_size)
+{
+    gint64   usb_time;
+    gboolean ret;
+
+    usb_time = device_capture_time (device);
+
+    if (transfer->status != LIBUSB_TRANSFER_NO_DEVICE)
+        device_transfer_result (device, FALSE, transfer_result_from_status (transfer->status));
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        ret = acc_process_transfer (device, transfer->buffer, transfer->actual_length, scratch, scratch_size, usb_time);
+        /* Packets translated from the whole transfer leave at once */
+        if (device->nat)
+            nat_slice_flush (device->nat);
+        return ret;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_CANCELLED:
+        return TRUE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return FALSE;
+    default:
+        device_log (device, LOG_REASON_USB_IN, G_LOG_LEVEL_WARNING, "bulk transfer error: %s", libusb_error_name (transfer->status));
+        if (usb_time)
+            capture_ring_add (device->capture, CAPTURE_DIRECTION_IN, transfer->buffer, 0,
+                              0, usb_time, CAPTURE_DROP_USB_ERROR);
+        return TRUE;
+    }
+}
+
+/* IN transfers queued by the accessory thread, used as a ring. Completions
+ * are handled in submission order, which is also the order in which they
+ * complete, so the queue depth may change at any time. */
+typedef struct {
+    struct libusb_transfer *transfer;
+    gboolean                submitted;
+    gint                    completed;
+    guint8                  buffer[ACC_MAX_TRANSFER_SIZE];
+} AccSlot;
+
+/* May run in either forwarding thread, whichever is handling events */
+static void LIBUSB_CALL
+acc_slot_cb (struct libusb_transfer *transfer)
+{
+    AccSlot *slot = transfer->user_data;
+
+    slot->completed = 1;
+}
+
+static void *
+acc_thread_func (Device *device)
+{
+    AccSlot *slots;
+    guint    head = 0; /* oldest in flight */
+    guint    tail = 0; /* next to submit */
+    guint    i;
+    gint     ret;
+    guint8   lz4_buf[ACC_MAX_TRANSFER_SIZE];
+
+    device_setup_thread (device, "acc");
+
+    slots = g_new0 (AccSlot, ACC_MAX_QUEUE_DEPTH);
+    for (i = 0; i < ACC_MAX_QUEUE_DEPTH; i++) {
+        slots[i].transfer = libusb_alloc_transfer (0);
+        libusb_fill_bulk_transfer (slots[i].transfer,
+                                   device->usb_handle,
+                                   device->ep_in,
+                                   slots[i].buffer,
+                                   device->transfer_size,
+                                   acc_slot_cb,
+                                   &slots[i],
+                                   0);
+    }
+
+    while (1) {
+        AccSlot        *slot;
+        gboolean        halt_thread;
+        struct timeval  tv;
+        gint64          delay;
+
+        g_mutex_lock (&device->mutex);
+        halt_thread = device->halt;
+        g_mutex_unlock (&device->mutex);
+
+        if (halt_thread)
+            break;
+
+        /* Stop reading from the phone while over the limit */
+        if ((delay = token_bucket_delay (&device->shaper[SHAPER_UP])) > 0) {
+            g_usleep (MIN (delay, (gint64) g_atomic_int_get (&device->timeout_ms) * 1000));
+            continue;
+        }
+
+        /* Keep the whole queue submitted; if the depth is reduced, the
+         * transfers already in flight just drain */
+        while (tail - head < (guint) g_atomic_int_get (&device->queue_depth)) {
+            slot = &slots[tail % ACC_MAX_QUEUE_DEPTH];
+            if ((ret = libusb_submit_transfer (slot->transfer)) < 0) {
+                g_warning ("[%03o,%03o] bulk transfer error: %s", device->busnum, device->devnum, libusb_strerror (ret));
+                goto out;
+            }
+            slot->submitted = TRUE;
+            tail++;
+        }
+
+        slot = &slots[head % ACC_MAX_QUEUE_DEPTH];
+        timeout_to_timeval (g_atomic_int_get (&device->timeout_ms), &tv);
+        if ((ret = libusb_handle_events_timeout_completed (device->usb_context, &tv, &slot->completed)) < 0 &&
+            ret != LIBUSB_ERROR_INTERRUPTED) {
+            g_warning ("[%03o,%03o] couldn't handle USB events: %s", device->busnum, device->devnum, libusb_strerror (ret));
+            break;
+        }
+
+        if (!g_atomic_int_get (&slot->completed))
+            continue;
+
+        slot->completed = 0;
+        slot->submitted = FALSE;
+        head++;
+
+        if (!acc_transfer_complete (device, slot->transfer, lz4_buf, sizeof (lz4_buf)))
+            break;
+    }
+
+ out:
+    /* Wait for the cancelled transfers before releasing them */
+    for (i = 0; i < ACC_MAX_QUEUE_DEPTH; i++) {
+        if (slots[i].submitted)
+            libusb_cancel_transfer (slots[i].transfer);
+    }
+    for (i = 0; i < ACC_MAX_QUEUE_DEPTH; i++) {
+        while (slots[i].submitted && !g_atomic_int_get (&slots[i].completed)) {
+            struct timeval tv = { 0, ACC_TIMEOUT * 1000 };
+
+            if (libusb_handle_events_timeout_completed (device->usb_context, &tv, &slots[i].completed) < 0)
+                break;
+        }
+        if (slots[i].submitted && !g_atomic_int_get (&slots[i].completed))
+            break;
+        slots[i].submitted = FALSE;
+        libusb_free_transfer (slots[i].transfer);
+        slots[i].transfer = NULL;
+    }
+    /* Leaked rather than freed while libusb may still use them */
+    if (i == ACC_MAX_QUEUE_DEPTH)
+        g_free (slots);
+
+    g_mutex_lock (&device->mutex);
+    device->halt = TRUE;
+    g_mutex_unlock (&device->mutex);
+    return NULL;
+}
+
+/******************************************************************************/
+/* Busy-poll forwarding
+ *
+ * A single thread per device runs both directions, spinning on non-blocking
+ * TUN reads and on libusb event handling with a zero timeout, so that packets
+ * never wait for a thread wakeup. After the configured idle period without
+ * any traffic it falls back to blocking in poll() on the TUN and libusb file
+ * descriptors, and starts spinning again as soon as anything moves. */
+
+#define BUSY_POLL_MAX_FDS 16
+
+typedef struct {
+    Device                 *device;
+    struct libusb_transfer *in_transfer;
+    struct libusb_transfer *out_transfer;
+    gboolean                in_flight;
+    gboolean                out_flight;
+    gboolean                in_done;
+    gboolean                out_done;
+    gsize                   out_len;      /* uncompressed, for capture */
+    gboolean                out_framed;
+    gint64                  out_tun_time; /* only while capturing */
+    guint8                  in_buf[ACC_MAX_TRANSFER_SIZE];
+    guint8                  out_buf[ACC_MAX_TRANSFER_SIZE];
+    guint8                  lz4_buf[ACC_MAX_TRANSFER_SIZE];
+    guint8                  scratch_buf[ACC_MAX_TRANSFER_SIZE];
+} BusyPoll;
+
+/* Transfer callbacks run from libusb_handle_events*() in the polling thread
+ * itself, so there is nothing to lock */
+static void LIBUSB_CALL
+busy_poll_in_cb (struct libusb_transfer *transfer)
+{
+    ((BusyPoll *) transfer->user_data)->in_done = TRUE;
+}
+
+static void LIBUSB_CALL
+busy_poll_out_cb (struct libusb_transfer *transfer)
+{
+    ((BusyPoll *) transfer->user_data)->out_done = TRUE;
+}
+
+/* Blocks until the TUN device is readable (if asked to) or there are libusb
+ * events to handle, for at most the device timeout so that halt requests are
+ * seen, or until the given delay (if any) is over */
+static void
+busy_poll_block (Device   *device,
+                 gboolean  wait_tun,
+                 gint64    delay)
+{
+    const struct libusb_pollfd **usb_fds;
+    struct pollfd                fds[BUSY_POLL_MAX_FDS];
+    guint                        n_fds = 0;
+    guint                        i;
+    struct timeval               tv;
+    gint                         timeout = g_atomic_int_get (&device->timeout_ms);
+
+    if (wait_tun) {
+        fds[n_fds].fd = device->tun_fd;
+        fds[n_fds].events = POLLIN;
+        n_fds++;
+        if (device->nat) {
+            fds[n_fds].fd = nat_slice_get_fd (device->nat);
+            fds[n_fds].events = POLLIN;
+            n_fds++;
+        }
+    }
+
+    usb_fds = libusb_get_pollfds (device->usb_context);
+    for (i = 0; usb_fds && usb_fds[i] && n_fds < G_N_ELEMENTS (fds); i++) {
+        fds[n_fds].fd = usb_fds[i]->fd;
+        fds[n_fds].events = usb_fds[i]->events;
+        n_fds++;
+    }
+    libusb_free_pollfds (usb_fds);
+
+    if (delay > 0)
+        timeout = MIN (timeout, (gint) ((delay + 999) / 1000));
+
+    /* Only when libusb can't use timerfd */
+    if (libusb_get_next_timeout (device->usb_context, &tv) == 1)
+        timeout = MIN (timeout, (gint) (tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000));
+
+    if (poll (fds, n_fds, timeout) < 0 && errno != EINTR)
+        g_warning ("[%03o,%03o] couldn't wait for events: %s", device->busnum, device->devnum, g_strerror (errno));
+}
+
+/* Reads a batch from the TUN device and submits it. Returns the amount of
+ * data sent, 0 if there was nothing to send or -1 if forwarding must stop. */
+static gssize
+busy_poll_send (BusyPoll       *bp,
+                LinkCompressor *compressor)
+{
+    Device *device = bp->device;
+    gsize   max_batch;
+    gssize  nread;
+    gsize   lz4_len = 0;
+    gint    ret;
+
+    /* Until the phone announces framing support, send one raw packet per
+     * transfer */
+    max_batch = MIN ((gsize) g_atomic_int_get (&device->out_transfer_size), (gsize) g_atomic_int_get (&device->peer_rx_size));
+    nread = tun_read_batch (device, bp->out_buf, max_batch ? max_batch : device->transfer_size, max_batch > 0);
+    if (nread < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        g_warning ("[%03o,%03o] couldn't read from TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
+        return -1;
+    }
+    /* EOF received */
+    if (nread == 0)
+        return -1;
+
+    bp->out_len = nread;
+    bp->out_framed = (max_batch > 0);
+    bp->out_tun_time = device_capture_time (device);
+
+    if (device->settings->compression == COMPRESSION_LZ4 &&
+        (g_atomic_int_get (&device->peer_caps) & LINK_CAP_LZ4))
+        lz4_len = link_compressor_run (compressor, bp->out_buf, nread, bp->lz4_buf, max_batch);
+
+    libusb_fill_bulk_transfer (bp->out_transfer,
+                               device->usb_handle,
+                               device->ep_out,
+                               lz4_len > 0 ? bp->lz4_buf : bp->out_buf,
+                               lz4_len > 0 ? lz4_len : (gsize) nread,
+                               busy_poll_out_cb,
+                               bp,
+                               g_atomic_int_get (&device->timeout_ms));
+    bp->out_transfer->flags = (tun_send_needs_zlp (device, bp->out_transfer->length) ?
+                               LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0);
+    if ((ret = libusb_submit_transfer (bp->out_transfer)) < 0) {
+        g_warning ("[%03o,%03o] bulk transfer failed: %s", device->busnum, device->devnum, libusb_strerror (ret));
+        return -1;
+    }
+    bp->out_flight = TRUE;
+    token_bucket_take (&device->shaper[SHAPER_DOWN], nread);
+    return nread;
+}
+
+/* Submits the next health probe, if due. Returns the length of the probe, 0
+ * if none was due or -1 if forwarding must stop. */
+static gssize
+busy_poll_send_probe (BusyPoll *bp)
+{
+    Device *device = bp->device;
+    gsize   probe_len;
+    gint    ret;
+
+    if (!(probe_len = device_probe_put (device, bp->out_buf, sizeof (bp->out_buf))))
+        return 0;
+
+    bp->out_len = 0;
+    bp->out_framed = TRUE;
+    bp->out_tun_time = 0;
+
+    libusb_fill_bulk_transfer (bp->out_transfer,
+                               device->usb_handle,
+                               device->ep_out,
+                               bp->out_buf,
+                               probe_len,
+                               busy_poll_out_cb,
+                               bp,
+                               g_atomic_int_get (&device->timeout_ms));
+    bp->out_transfer->flags = (tun_send_needs_zlp (device, probe_len) ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0);
+    if ((ret = libusb_submit_transfer (bp->out_transfer)) < 0) {
+        g_warning ("[%03o,%03o] bulk transfer failed: %s", device->busnum, device->devnum, libusb_strerror (ret));
+        return -1;
+    }
+    bp->out_flight = TRUE;
+    return probe_len;
+}
+
+/* Returns FALSE if forwarding must stop */
+static gboolean
+busy_poll_complete (BusyPoll *bp)
+{
+    Device                 *device = bp->device;
+    struct libusb_transfer *transfer;
+
+    if (bp->out_done) {
+        transfer = bp->out_transfer;
+        bp->out_done = FALSE;
+        bp->out_flight = FALSE;
+        if (bp->out_tun_time)
+            device_capture_out (device, bp->out_buf, bp->out_len, bp->out_framed, bp->out_tun_time,
+                                capture_drop_from_status (transfer->status));
+        device_transfer_result (device, TRUE, transfer_result_from_status (transfer->status));
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+            return FALSE;
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+            transfer->status != LIBUSB_TRANSFER_TIMED_OUT &&
+            transfer->status != LIBUSB_TRANSFER_CANCELLED)
+            device_log (device, LOG_REASON_USB_OUT, G_LOG_LEVEL_WARNING, "bulk transfer failed: %s",
+                        libusb_error_name (transfer->status));
+    }
+
+    if (bp->in_done) {
+        bp->in_done = FALSE;
+        bp->in_flight = FALSE;
+        if (!acc_transfer_complete (device, bp->in_transfer, bp->scratch_buf, sizeof (bp->scratch_buf)))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void *
+busy_poll_thread_func (Device *device)
+{
+    BusyPoll       *bp;
+    LinkCompressor  compressor;
+    gint64          last_activity;
+    struct timeval  zero = { 0, 0 };
+    gint            ret;
+
+    device_setup_thread (device, "poll");
+
+    link_compressor_init (&compressor, link_rate_from_speed (libusb_get_device_speed (device->usb_device)));
+
+    bp = g_new0 (BusyPoll, 1);
+    bp->device = device;
+    bp->in_transfer = libusb_alloc_transfer (0);
+    bp->out_transfer = libusb_alloc_transfer (0);
+    libusb_fill_bulk_transfer (bp->in_transfer,
+                               device->usb_handle,
+                               device->ep_in,
+                               bp->in_buf,
+                               device->transfer_size,
+                               busy_poll_in_cb,
+                               bp,
+                               0);
+
+    g_message ("[%03o,%03o] busy-polling, blocking after %dus idle",
+               device->busnum, device->devnum, g_atomic_int_get (&device->busy_poll_us));
+
+    last_activity = g_get_monotonic_time ();
+    while (1) {
+        gboolean halt_thread;
+        gboolean activity = FALSE;
+        gint64   now;
+        gint64   in_delay;
+        gint64   out_delay;
+
+        g_mutex_lock (&device->mutex);
+        halt_thread = device->halt;
+        g_mutex_unlock (&device->mutex);
+
+        if (halt_thread)
+            break;
+
+        /* Directions over their limit just aren't polled */
+        in_delay = token_bucket_delay (&device->shaper[SHAPER_UP]);
+        out_delay = token_bucket_delay (&device->shaper[SHAPER_DOWN]);
+
+        if (!bp->in_flight && !in_delay) {
+            if ((ret = libusb_submit_transfer (bp->in_transfer)) < 0) {
+                g_warning ("[%03o,%03o] bulk transfer error: %s", device->busnum, device->devnum, libusb_strerror (ret));
+                break;
+            }
+            bp->in_flight = TRUE;
+        }
+
+        /* A single OUT transfer in flight; meanwhile packets queue up in the
+         * TUN device and go together in the next batch. Probes aren't rate
+         * limited. */
+        if (!bp->out_flight) {
+            gssize sent;
+
+            if ((sent = busy_poll_send_probe (bp)) == 0 && !out_delay)
+                sent = busy_poll_send (bp, &compressor);
+            if (sent < 0)
+                break;
+            activity = (sent > 0);
+        }
+
+        if ((ret = libusb_handle_events_timeout_completed (device->usb_context, &zero, NULL)) < 0 &&
+            ret != LIBUSB_ERROR_INTERRUPTED) {
+            g_warning ("[%03o,%03o] couldn't handle USB events: %s", device->busnum, device->devnum, libusb_strerror (ret));
+            break;
+        }
+
+        if (bp->in_done || bp->out_done) {
+            activity = TRUE;
+            if (!busy_poll_complete (bp))
+                break;
+        }
+
+        now = g_get_monotonic_time ();
+        if (activity)
+            last_activity = now;
+        else if (now - last_activity >= g_atomic_int_get (&device->busy_poll_us)) {
+            busy_poll_block (device, !bp->out_flight && !out_delay,
+                             (in_delay && out_delay) ? MIN (in_delay, out_delay) : MAX (in_delay, out_delay));
+            last_activity = g_get_monotonic_time ();
+        }
+    }
+
+    /* Wait for the cancelled transfers before releasing them */
+    if (bp->in_flight)
+        libusb_cancel_transfer (bp->in_transfer);
+    if (bp->out_flight)
+        libusb_cancel_transfer (bp->out_transfer);
+    while (bp->in_flight || bp->out_flight) {
+        struct timeval tv = { 0, ACC_TIMEOUT * 1000 };
+
+        if (libusb_handle_events_timeout_completed (device->usb_context, &tv, NULL) < 0)
+            break;
+        if (bp->in_done) {
+            bp->in_done = FALSE;
+            bp->in_flight = FALSE;
+        }
+        if (bp->out_done) {
+            bp->out_done = FALSE;
+            bp->out_flight = FALSE;
+        }
+    }
+
+    /* Leaked rather than freed while libusb may still use them */
+    if (!bp->in_flight && !bp->out_flight) {
+        libusb_free_transfer (bp->in_transfer);
+        libusb_free_transfer (bp->out_transfer);
+        g_free (bp);
+    }
+
+    if (compressor.n_compressed)
+        g_message ("[%03o,%03o] compressed %" G_GUINT64_FORMAT " batches (%" G_GUINT64_FORMAT " skipped), average ratio %.2f",
+                   device->busnum, device->devnum, compressor.n_compressed, compressor.n_skipped, compressor.ratio);
+
+    g_mutex_lock (&device->mutex);
+    device->halt = TRUE;
+    g_mutex_unlock (&device->mutex);
+    return NULL;
+}
+
+/******************************************************************************/
+
+#define IFACE_DEFAULT_MTU 1500
+
+static guint
+iface_get_mtu (const gchar *iface)
+{
+    struct ifreq ifr;
+    gint         fd;
+    guint        mtu = IFACE_DEFAULT_MTU;
+
+    if ((fd = socket (AF_INET, SOCK_DGRAM, 0)) < 0)
+        return mtu;
+
+    memset (&ifr, 0, sizeof (ifr));
+    strncpy (ifr.ifr_name, iface, sizeof (ifr.ifr_name) - 1);
+    if (ioctl (fd, SIOCGIFMTU, (void *) &ifr) == 0 && ifr.ifr_mtu > 0)
+        mtu = ifr.ifr_mtu;
+
+    close (fd);
+    return mtu;
+}
+
+/* MSS clamping. The smallest MTU on the host side of the path is the one of
+ * the TUN device or the one of the uplink (e.g. PPPoE or a VPN); the phone
+ * announces an MSS fitting its own MTU in its SYNs. Both are checked
+ * periodically, as the uplink may change or be reconfigured. */
+
+#define MSS_CHECK_INTERVAL_S 5
+
+static void
+device_update_mss_clamp (Device *device)
+{
+    guint mtu;
+
+    if (!device->settings->clamp_mss)
+        return;
+
+    mtu = iface_get_mtu (device->tun_name);
+    g_mutex_lock (&device->mutex);
+    if (device->uplink)
+        mtu = MIN (mtu, iface_get_mtu (device->uplink->name));
+    g_mutex_unlock (&device->mutex);
+
+    if ((guint) g_atomic_int_get (&device->clamp_mtu) != mtu) {
+        g_message ("[%03o,%03o] clamping TCP MSS to fit MTU %u", device->busnum, device->devnum, mtu);
+        g_atomic_int_set (&device->clamp_mtu, mtu);
+    }
+}
+
+/* Only devices whose connection thread already set up clamping */
+static gboolean
+mss_check_cb (Context *context)
+{
+    GHashTableIter  iter;
+    Device         *device;
+
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        if (device->conn_thread && g_atomic_int_get (&device->clamp_mtu))
+            device_update_mss_clamp (device);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs one of the helper scripts, waiting for it to finish */
+static gboolean
+device_run_script (Device       *device,
+                   const gchar  *script,
+                   gchar       **args)
+{
+    GError *error = NULL;
+    gint    status;
+
+    if (!g_spawn_sync (NULL, /* working_directory */
+                       args,
+                       NULL, /* envp */
+                       G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, /* child_setup */
+                       NULL, /* user_data */
+                       NULL, /* standard_output */
+                       NULL, /* standard_error */
+                       &status,
+                       &error)) {
+        g_critical ("[%03o,%03o] couldn't run %s for %s: %s",
+                    device->busnum, device->devnum, script, device->tun_name, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    if (!g_spawn_check_exit_status (status, &error)) {
+        g_critical ("[%03o,%03o] %s returned error for %s: %s",
+                    device->busnum, device->devnum, script, device->tun_name, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Routes the device through its own table to the selected uplink, again if
+ * the main loop selects a different one meanwhile */
+static gboolean
+device_setup_uplink (Device *device)
+{
+    Uplink   *uplink;
+    Uplink   *previous = NULL;
+    gboolean  done;
+
+    do {
+        gchar    **args;
+        gboolean   ret;
+
+        g_mutex_lock (&device->mutex);
+        uplink = device->uplink;
+        g_mutex_unlock (&device->mutex);
+
+        args = uplink_script_args (device, uplink, previous);
+        ret = device_run_script (device, UPLINK_SCRIPT, args);
+        g_strfreev (args);
+        if (!ret)
+            return FALSE;
+        previous = uplink;
+
+        g_mutex_lock (&device->mutex);
+        done = (device->uplink == uplink);
+        if (done)
+            device->uplink_applied = uplink;
+        g_mutex_unlock (&device->mutex);
+    } while (!done);
+
+    g_message ("[%03o,%03o] routed through uplink %s", device->busnum, device->devnum, uplink->name);
+    return TRUE;
+}
+
+#define CLAIM_MAX_RETRIES    10
+#define CLAIM_RETRY_DELAY_MS 5
+
+static void *
+conn_thread_func (Device *device)
+{
+#define MAX_ARGS 10
+    gchar              *args[MAX_ARGS];
+    guint               iarg = 0;
+    static const gchar *clonedev = "/dev/net/tun";
+    struct ifreq        ifr;
+    gchar              *cmd = NULL;
+    gchar              *network = NULL;
+    gchar              *host_address = NULL;
+    libusb_device      *usb_device;
+    gint                ret;
+    guint               i;
+
+    device->timeout_id = 0;
+
+    if ((device->tun_fd = open (clonedev, O_RDWR)) < 0 ) {
+        g_critical ("[%03o,%03o] couldn't open TUN clone device: %s", device->busnum, device->devnum, g_strerror (errno));
+        goto out;
+    }
+
+    memset(&ifr, 0, sizeof (ifr));
+    ifr.ifr_flags = (device->context->bridge ? IFF_TAP : IFF_TUN) | IFF_NO_PI;
+
+    if (ioctl (device->tun_fd, TUNSETIFF, (void *) &ifr) < 0) {
+        close (device->tun_fd);
+        device->tun_fd = 0;
+        g_critical ("[%03o,%03o] couldn't create TUN device: %s", device->busnum, device->devnum, g_strerror (errno));
+        goto out;
+    }
+
+    strncpy (device->tun_name, ifr.ifr_name, sizeof (device->tun_name) - 1);
+
+    /* Packets are read in batches until the device is drained */
+    if (fcntl (device->tun_fd, F_SETFL, fcntl (device->tun_fd, F_GETFL) | O_NONBLOCK) < 0) {
+        g_critical ("[%03o,%03o] couldn't make TUN device non-blocking: %s", device->busnum, device->devnum, g_strerror (errno));
+        goto out;
+    }
+
+    /* Bridged phones get their address from the LAN, not from us */
+    if (device->context->bridge) {
+        args[iarg++] = BINDIR_PATH "/" BRIDGE_SCRIPT;
+        args[iarg++] = "linux";
+        args[iarg++] = device->tun_name;
+        args[iarg++] = device->context->bridge;
+        args[iarg++] = NULL;
+
+        if (!device_run_script (device, BRIDGE_SCRIPT, args))
+            goto out;
+
+        /* Frames carry the Ethernet header on top of the MTU */
+        device->tun_mtu = iface_get_mtu (device->tun_name) + ETHER_HDR_LEN;
+        device_update_mss_clamp (device);
+        goto usb;
+    }
+
+    network      = g_strdup_printf ("10.11.%u.0", device->subnet);
+    host_address = g_strdup_printf ("10.11.%u.1", device->subnet);
+
+    args[iarg++] = BINDIR_PATH "/" IFACE_UP_SCRIPT;
+    args[iarg++] = "linux";
+    args[iarg++] = device->tun_name;
+    g_mutex_lock (&device->mutex);
+    args[iarg++] = device->uplink->name;
+    g_mutex_unlock (&device->mutex);
+    args[iarg++] = network;
+    args[iarg++] = "30";
+    args[iarg++] = host_address;
+    args[iarg++] = NULL;
+
+    g_assert (iarg <= MAX_ARGS);
+
+    if (!device_run_script (device, IFACE_UP_SCRIPT, args))
+        goto out;
+
+    /* With several uplinks, each device gets its own routing table */
+    if (device->context->uplinks->len > 1 && !device_setup_uplink (device))
+        goto out;
+
+    device->tun_mtu = iface_get_mtu (device->tun_name);
+    device_update_mss_clamp (device);
+
+    if (device->context->nat) {
+        GError *error = NULL;
+        gchar  *phone_address;
+
+        phone_address = g_strdup_printf ("10.11.%u.2", device->subnet);
+        device->nat = nat_slice_attach (device->context->nat, inet_addr (phone_address), device->tun_mtu, &error);
+        if (!device->nat) {
+            g_warning ("[%03o,%03o] userspace NAT unavailable: %s", device->busnum, device->devnum, error->message);
+            g_error_free (error);
+        }
+        g_free (phone_address);
+    }
+
+usb:
+    device_bringup_mark (device, BRINGUP_INTERFACE);
+
+    /* Each connection runs its own libusb context, so that event handling
+     * in the forwarding threads never deals with other devices' transfers */
+    if ((ret = libusb_init (&device->usb_context)) < 0) {
+        g_critical ("[%03o,%03o] couldn't initialize libusb context: %s",
+                    device->busnum, device->devnum, libusb_strerror (ret));
+        goto out;
+    }
+
+    /* Trying to open supplied device */
+    usb_device = find_usb_device (device->usb_context, device->devnode, device->busnum, device->devnum,
+                                  &device->usb_handle, &device->usb_fd);
+    if (!usb_device)
+        goto out;
+    if (!device->usb_handle && (ret = libusb_open (usb_device, &device->usb_handle)) < 0)
+        g_critical ("[%03o,%03o] unable to open device: %s",
+                    device->busnum, device->devnum, libusb_strerror (ret));
+    libusb_unref_device (usb_device);
+    if (!device->usb_handle)
+        goto out;
+
+    /* Claiming first (accessory) interface from the opened device; it may
+     * not be ready right after enumeration, so retry briefly on failure
+     * instead of always waiting up front */
+    for (i = 0; (ret = libusb_claim_interface (device->usb_handle, 0)) < 0; i++) {
+        if (ret == LIBUSB_ERROR_NO_DEVICE || i == CLAIM_MAX_RETRIES) {
+            g_critical ("[%03o,%03o] couldn't claim interface: %s",
+                        device->busnum, device->devnum, libusb_strerror (ret));
+            goto out;
+        }
+        g_usleep (CLAIM_RETRY_DELAY_MS * 1000);
+    }
+    device_bringup_mark (device, BRINGUP_USB_CLAIMED);
+
+    device_setup_endpoints (device);
+
+    if (device->settings->busy_poll_us) {
+        device->poll_thread = g_thread_new (NULL, (GThreadFunc) busy_poll_thread_func, device);
+    } else {
+        device->tun_thread = g_thread_new (NULL, (GThreadFunc) tun_thread_func, device);
+        device->acc_thread = g_thread_new (NULL, (GThreadFunc) acc_thread_func, device);
+    }
+
+    /* Wait for children to exit themselves */
+    g_clear_pointer (&device->tun_thread, g_thread_join);
+    g_clear_pointer (&device->acc_thread, g_thread_join);
+    g_clear_pointer (&device->poll_thread, g_thread_join);
+
+out:
+    g_clear_pointer (&device->nat, nat_slice_detach);
+
+    if (device->tun_fd) {
+        close (device->tun_fd);
+        device->tun_fd = 0;
+    }
+
+    if (device->usb_handle != NULL)
+        libusb_release_interface (device->usb_handle, 0);
+    device_close_usb_handle (device);
+    g_clear_pointer (&device->usb_context, libusb_exit);
+
+    g_free (network);
+    g_free (host_address);
+    g_free (cmd);
+    g_atomic_int_set (&device->conn_done, TRUE);
+    return NULL;
+}
+
+static gboolean
+device_setup_tethering (Device *device)
+{
+    device->settings = select_settings (device->context, device->sysfs_path, device->vid, device->pid);
+    device->subnet = select_subnet (device->context, device->sysfs_path);
+
+    if (!device->topology)
+        device->topology = usb_topology_new (device->sysfs_path);
+    if (device->settings->pin_cpus && !device_get_cpus (device))
+        g_warning ("[%03o,%03o] no CPUs known for the USB controller, forwarding threads not pinned",
+                   device->busnum, device->devnum);
+
+    if (device->settings->uplink && !uplink_lookup (device->context, device->settings->uplink))
+        g_warning ("[%03o,%03o] pinned to unknown uplink: %s", device->busnum, device->devnum, device->settings->uplink);
+    device_set_uplink (device, uplink_select (device->context, device));
+    device_setup_shaping (device);
+
+    if (device->settings->capture_records) {
+        GError *error = NULL;
+
+        if (!device_start_capture (device, device->settings->capture_records, &error)) {
+            g_warning ("[%03o,%03o] couldn't start capture: %s", device->busnum, device->devnum, error->message);
+            g_error_free (error);
+        }
+    }
+
+    if (device->settings->flow_entries && !device->flows) {
+        GError *error = NULL;
+
+        if (!(device->flows = flow_table_new (device->settings->flow_entries, &error))) {
+            g_warning ("[%03o,%03o] couldn't create flow table: %s", device->busnum, device->devnum, error->message);
+            g_error_free (error);
+        }
+    }
+
+    if (device->subnet != 0) {
+        device->tethered_time = g_get_monotonic_time ();
+        device_bringup_mark (device, BRINGUP_TETHERING);
+        device->conn_thread = g_thread_new (NULL, (GThreadFunc) conn_thread_func, device);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************************************************************************/
+/* Control socket commands */
+
+#define CONTROL_DEFAULT_FLOWS 10
+
+static const gchar *control_help =
+    "list\n"
+    "show DEVICE\n"
+    "set DEVICE KEY VALUE\n"
+    "  out-transfer-size  64-" G_STRINGIFY (ACC_MAX_TRANSFER_SIZE) " (bytes)\n"
+    "  queue-depth        1-" G_STRINGIFY (ACC_MAX_QUEUE_DEPTH) " (IN transfers)\n"
+    "  timeout            1-" G_STRINGIFY (ACC_MAX_TIMEOUT) " (ms)\n"
+    "  busy-poll          USECS idle before blocking, if busy-polling\n"
+    "  uplink             IFACE\n"
+    "  rate-down          KBPS to the phone, 0 for unlimited\n"
+    "  rate-up            KBPS from the phone, 0 for unlimited\n"
+    "  weight             1-" G_STRINGIFY (SHAPER_MAX_WEIGHT) " share of the uplink capacity\n"
+    "capture DEVICE on [RECORDS]|off\n"
+    "dump DEVICE FILE     write the captured packets as pcapng\n"
+    "flows DEVICE [COUNT] top flows by bytes, " G_STRINGIFY (CONTROL_DEFAULT_FLOWS) " by default\n"
+    "probes DEVICE        round trip time histogram of the link health probes\n"
+    "proxy                connections and bytes relayed by the TCP proxy\n"
+    "bringup DEVICE       time of each bring-up phase, in ms since the first one\n"
+    "buses                load of the hubs with devices attached, per USB controller\n"
+    "DEVICE is BUS:DEV, the TUN interface or the sysfs path\n";
+
+/* Only devices being tethered, the others have nothing to tune */
+static Device *
+control_lookup_device (Context      *context,
+                       const gchar  *str,
+                       GError      **error)
+{
+    GHashTableIter  iter;
+    Device         *device;
+    guint           busnum = 0;
+    guint           devnum = 0;
+
+    if (sscanf (str, "%u:%u", &busnum, &devnum) != 2)
+        busnum = devnum = 0;
+
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        if (!device->conn_thread)
+            continue;
+        if ((device->busnum == busnum && device->devnum == devnum) ||
+            g_str_equal (device->tun_name, str) ||
+            g_str_equal (device->sysfs_path, str))
+            return device;
+    }
+
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no such device: %s", str);
+    return NULL;
+}
+
+static gboolean
+control_parse_int (const gchar  *str,
+                   gint          min,
+                   gint          max,
+                   gint         *out,
+                   GError      **error)
+{
+    gchar  *end;
+    gint64  value;
+
+    value = g_ascii_strtoll (str, &end, 10);
+    if (end == str || *end != '\0' || value < min || value > max) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                     "invalid value: %s (%d-%d)", str, min, max);
+        return FALSE;
+    }
+    *out = (gint) value;
+    return TRUE;
+}
+
+static void
+control_show_device (Device  *device,
+                     GString *reply)
+{
+    LinkProbeStats probe_stats;
+
+    g_string_append_printf (reply, "device=%u:%u\n", device->busnum, device->devnum);
+    g_string_append_printf (reply, "sysfs-path=%s\n", device->sysfs_path);
+    g_string_append_printf (reply, "interface=%s\n", device->tun_name);
+    if (device->context->bridge) {
+        guint8 l2_address[ETH_ALEN];
+
+        device_get_l2_address (device, l2_address);
+        g_string_append_printf (reply, "l2-address=%02x:%02x:%02x:%02x:%02x:%02x\n",
+                                l2_address[0], l2_address[1], l2_address[2],
+                                l2_address[3], l2_address[4], l2_address[5]);
+    } else
+        g_string_append_printf (reply, "network=10.11.%u.0\n", device->subnet);
+    g_mutex_lock (&device->mutex);
+    g_string_append_printf (reply, "uplink=%s\n", device->uplink ? device->uplink->name : "");
+    g_mutex_unlock (&device->mutex);
+    g_string_append_printf (reply, "speed=%s\n", link_speed_to_string (device->speed));
+    if (device->topology) {
+        const cpu_set_t *cpus;
+        gchar           *str;
+
+        g_string_append_printf (reply, "controller=%s\n", device->topology->controller);
+        g_string_append_printf (reply, "hub=%s\n", device->topology->hubs[0]);
+        g_string_append_printf (reply, "numa-node=%d\n", device->topology->numa_node);
+        g_string_append_printf (reply, "irq=%d\n", device->topology->irq);
+        if ((cpus = device_get_cpus (device)) != NULL) {
+            str = format_cpu_list (cpus);
+            g_string_append_printf (reply, "cpus=%s\n", str);
+            g_free (str);
+        } else
+            g_string_append (reply, "cpus=-\n");
+    }
+    g_string_append_printf (reply, "endpoints=0x%02x,0x%02x\n", device->ep_in, device->ep_out);
+    g_string_append_printf (reply, "max-packet-size=%u\n", device->max_packet_size);
+    g_string_append_printf (reply, "in-transfer-size=%" G_GSIZE_FORMAT "\n", device->transfer_size);
+    g_string_append_printf (reply, "out-transfer-size=%d\n", g_atomic_int_get (&device->out_transfer_size));
+    g_string_append_printf (reply, "queue-depth=%d\n", g_atomic_int_get (&device->queue_depth));
+    g_string_append_printf (reply, "timeout=%d\n", g_atomic_int_get (&device->timeout_ms));
+    g_string_append_printf (reply, "busy-poll=%d\n",
+                            device->settings->busy_poll_us ? g_atomic_int_get (&device->busy_poll_us) : 0);
+    g_string_append_printf (reply, "compression=%s\n",
+                            (g_atomic_int_get (&device->peer_caps) & LINK_CAP_LZ4) ? "lz4" : "none");
+    g_string_append_printf (reply, "peer-rx-size=%d\n", g_atomic_int_get (&device->peer_rx_size));
+    g_string_append_printf (reply, "rate-down=%u/%u\n",
+                            device->limit[SHAPER_DOWN] / 125, token_bucket_get_rate (&device->shaper[SHAPER_DOWN]) / 125);
+    g_string_append_printf (reply, "rate-up=%u/%u\n",
+                            device->limit[SHAPER_UP] / 125, token_bucket_get_rate (&device->shaper[SHAPER_UP]) / 125);
+    g_string_append_printf (reply, "weight=%u\n", device->weight);
+    g_string_append_printf (reply, "capture=%u%s\n",
+                            device->capture ? capture_ring_get_size (device->capture) : 0,
+                            g_atomic_int_get (&device->capturing) ? "" : " (stopped)");
+    if (g_atomic_int_get (&device->clamp_mtu))
+        g_string_append_printf (reply, "clamp-mss=%d (%d rewritten)\n",
+                                g_atomic_int_get (&device->clamp_mtu), g_atomic_int_get (&device->mss_clamped));
+    else
+        g_string_append (reply, "clamp-mss=off\n");
+    if (device->flows)
+        g_string_append_printf (reply, "flows=%u (%" G_GUINT64_FORMAT " evicted)\n",
+                                flow_table_get_size (device->flows), flow_table_get_evictions (device->flows));
+    else
+        g_string_append (reply, "flows=0\n");
+
+    g_mutex_lock (&device->mutex);
+    probe_stats = device->probe_stats;
+    g_mutex_unlock (&device->mutex);
+    g_string_append_printf (reply, "probes=%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "\n",
+                            probe_stats.received, probe_stats.sent);
+    if (probe_stats.received > 0) {
+        g_string_append_printf (reply, "probe-rtt=%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "\n",
+                                probe_stats.last_rtt, probe_stats.min_rtt,
+                                probe_stats.sum_rtt / (gint64) probe_stats.received, probe_stats.max_rtt);
+        g_string_append_printf (reply, "probe-jitter=%.0f\n", probe_stats.jitter);
+    }
+}
+
+static gint
+usb_hub_cmp (const UsbHub *a,
+             const UsbHub *b)
+{
+    return g_strcmp0 (a->path, b->path);
+}
+
+static void
+control_buses (Context *context,
+               GString *reply)
+{
+    GHashTable     *controllers; /* sysfs path -> UsbTopology of a device attached */
+    GHashTableIter  iter;
+    Device         *device;
+    GList          *paths;
+    GList          *hubs;
+    GList          *l;
+    GList          *h;
+
+    controllers = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        if (device->conn_thread && device->topology)
+            g_hash_table_insert (controllers, device->topology->controller, device->topology);
+    }
+
+    paths = g_list_sort (g_hash_table_get_keys (controllers), (GCompareFunc) g_strcmp0);
+    hubs = g_list_sort (g_hash_table_get_values (context->usb_hubs), (GCompareFunc) usb_hub_cmp);
+    for (l = paths; l; l = g_list_next (l)) {
+        UsbTopology *topology;
+        gchar       *irq_cpus;
+        gchar       *node_cpus;
+        gsize        len;
+
+        topology = g_hash_table_lookup (controllers, l->data);
+        irq_cpus = format_cpu_list (&topology->irq_cpus);
+        node_cpus = format_cpu_list (&topology->node_cpus);
+        g_string_append_printf (reply, "%s numa-node=%d irq=%d irq-cpus=%s node-cpus=%s\n",
+                                topology->controller, topology->numa_node, topology->irq, irq_cpus, node_cpus);
+        g_free (irq_cpus);
+        g_free (node_cpus);
+
+        len = strlen (topology->controller);
+        for (h = hubs; h; h = g_list_next (h)) {
+            UsbHub *hub = h->data;
+
+            if (strncmp (hub->path, topology->controller, len) != 0 || hub->path[len] != '/')
+                continue;
+            g_string_append_printf (reply, "  %s speed=%u devices=%u rate=%u load=%u%%%s\n",
+                                    hub->path + len + 1, hub->speed, hub->n_devices,
+                                    (guint) (hub->rate * 8 / 1000), usb_hub_get_load (hub),
+                                    hub->busy ? " (busy)" : "");
+        }
+    }
+    g_list_free (hubs);
+    g_list_free (paths);
+    g_hash_table_unref (controllers);
+}
+
+static void
+control_bringup (Device  *device,
+                 GString *reply)
+{
+    gint64 bringup[BRINGUP_N];
+    gint64 start;
+    guint  i;
+
+    g_mutex_lock (&device->mutex);
+    memcpy (bringup, device->bringup, sizeof (bringup));
+    g_mutex_unlock (&device->mutex);
+
+    start = bringup_start (bringup);
+    for (i = 0; i < BRINGUP_N; i++) {
+        if (bringup[i])
+            g_string_append_printf (reply, "%s=%" G_GINT64_FORMAT "\n", bringup_phase_names[i], (bringup[i] - start) / 1000);
+        else
+            g_string_append_printf (reply, "%s=-\n", bringup_phase_names[i]);
+    }
+}
+
+static void
+control_probes (Device  *device,
+                GString *reply)
+{
+    LinkProbeStats probe_stats;
+    guint          i;
+
+    g_mutex_lock (&device->mutex);
+    probe_stats = device->probe_stats;
+    g_mutex_unlock (&device->mutex);
+
+    for (i = 0; i < LINK_PROBE_BUCKETS; i++) {
+        if (i < LINK_PROBE_BUCKETS - 1)
+            g_string_append_printf (reply, "%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "us %" G_GUINT64_FORMAT "\n",
+                                    link_probe_stats_bucket_start (i), link_probe_stats_bucket_start (i + 1) - 1,
+                                    probe_stats.buckets[i]);
+        else
+            g_string_append_printf (reply, "%" G_GINT64_FORMAT "-us %" G_GUINT64_FORMAT "\n",
+                                    link_probe_stats_bucket_start (i), probe_stats.buckets[i]);
+    }
+}
+
+/* Down is to the phone, up is from it */
+static void
+control_flows (Device  *device,
+               guint    n_flows,
+               GString *reply)
+{
+    GArray *flows;
+    gint64  now;
+    guint   i;
+
+    flows = flow_table_top (device->flows, n_flows);
+    now = g_get_monotonic_time ();
+    for (i = 0; i < flows->len; i++) {
+        FlowInfo *info = &g_array_index (flows, FlowInfo, i);
+        gchar     local[INET_ADDRSTRLEN];
+        gchar     remote[INET_ADDRSTRLEN];
+
+        inet_ntop (AF_INET, &info->key.local_addr, local, sizeof (local));
+        inet_ntop (AF_INET, &info->key.remote_addr, remote, sizeof (remote));
+        g_string_append_printf (reply,
+                                "%s %s:%u %s:%u down=%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT
+                                " up=%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " idle=%" G_GINT64_FORMAT "s\n",
+                                info->key.proto == IPPROTO_TCP ? "tcp" : (info->key.proto == IPPROTO_UDP ? "udp" : "ip"),
+                                local, g_ntohs (info->key.local_port),
+                                remote, g_ntohs (info->key.remote_port),
+                                info->bytes[FLOW_DIRECTION_OUT], info->packets[FLOW_DIRECTION_OUT],
+                                info->bytes[FLOW_DIRECTION_IN], info->packets[FLOW_DIRECTION_IN],
+                                (now - info->last_seen) / G_USEC_PER_SEC);
+    }
+    g_array_unref (flows);
+}
+
+static gboolean
+control_capture (Device       *device,
+                 gchar       **argv,
+                 GError      **error)
+{
+    gint n_records = CAPTURE_DEFAULT_RECORDS;
+
+    if (g_str_equal (argv[0], "off") && !argv[1]) {
+        g_atomic_int_set (&device->capturing, FALSE);
+        g_message ("[%03o,%03o] capture stopped", device->busnum, device->devnum);
+        return TRUE;
+    }
+
+    if (!g_str_equal (argv[0], "on") || (argv[1] && argv[2])) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "invalid command, see 'help'");
+        return FALSE;
+    }
+
+    /* The ring is created once, and kept until the device is gone */
+    if (argv[1]) {
+        if (device->capture) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS, "capture ring already created");
+            return FALSE;
+        }
+        if (!control_parse_int (argv[1], 1, G_MAXINT, &n_records, error))
+            return FALSE;
+    }
+
+    if (!device_start_capture (device, n_records, error))
+        return FALSE;
+    g_message ("[%03o,%03o] capturing the last %u packets",
+               device->busnum, device->devnum, capture_ring_get_size (device->capture));
+    return TRUE;
+}
+
+static gboolean
+control_set (Context      *context,
+             Device       *device,
+             const gchar  *key,
+             const gchar  *value,
+             GError      **error)
+{
+    gint aux;
+
+    if (g_str_equal (key, "out-transfer-size")) {
+        if (!control_parse_int (value, 64, ACC_MAX_TRANSFER_SIZE, &aux, error))
+            return FALSE;
+        g_atomic_int_set (&device->out_transfer_size, aux);
+    } else if (g_str_equal (key, "queue-depth")) {
+        if (!control_parse_int (value, 1, ACC_MAX_QUEUE_DEPTH, &aux, error))
+            return FALSE;
+        g_atomic_int_set (&device->queue_depth, aux);
+    } else if (g_str_equal (key, "timeout")) {
+        if (!control_parse_int (value, 1, ACC_MAX_TIMEOUT, &aux, error))
+            return FALSE;
+        g_atomic_int_set (&device->timeout_ms, aux);
+    } else if (g_str_equal (key, "busy-poll")) {
+        if (!device->settings->busy_poll_us) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "device is not busy-polling");
+            return FALSE;
+        }
+        if (!control_parse_int (value, 1, G_MAXINT, &aux, error))
+            return FALSE;
+        g_atomic_int_set (&device->busy_poll_us, aux);
+    } else if (g_str_equal (key, "uplink")) {
+        Uplink *uplink;
+
+        if (context->uplinks->len < 2) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "only one uplink available");
+            return FALSE;
+        }
+        if (!(uplink = uplink_lookup (context, value))) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no such uplink: %s", value);
+            return FALSE;
+        }
+        device_set_uplink (device, uplink);
+    } else if (g_str_equal (key, "rate-down") || g_str_equal (key, "rate-up")) {
+        guint dir = g_str_equal (key, "rate-down") ? SHAPER_DOWN : SHAPER_UP;
+
+        if (!control_parse_int (value, 0, SHAPER_MAX_KBPS, &aux, error))
+            return FALSE;
+        parse_rate (aux, &device->limit[dir]);
+        device_apply_shaping (device);
+    } else if (g_str_equal (key, "weight")) {
+        if (!control_parse_int (value, 1, SHAPER_MAX_WEIGHT, &aux, error))
+            return FALSE;
+        device->weight = aux;
+    } else {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "unknown key: %s", key);
+        return FALSE;
+    }
+
+    g_message ("[%03o,%03o] %s set to %s", device->busnum, device->devnum, key, value);
+    return TRUE;
+}
+
+static gboolean
+control_command (gchar    **argv,
+                 GString   *reply,
+                 Context   *context,
+                 GError   **error)
+{
+    guint   argc;
+    Device *device;
+
+    argc = g_strv_length (argv);
+
+    if (g_str_equal (argv[0], "help") && argc == 1) {
+        g_string_append (reply, control_help);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "list") && argc == 1) {
+        GHashTableIter iter;
+
+        g_hash_table_iter_init (&iter, context->tracked_devices);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+            g_string_append_printf (reply, "%u:%u %04x:%04x %s %s %s\n",
+                                    device->busnum, device->devnum, device->vid, device->pid,
+                                    device->conn_thread ? "tethering" : (device->aoa ? "accessory" : "candidate"),
+                                    device->conn_thread ? device->tun_name : "-",
+                                    device->sysfs_path);
+        }
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "show") && argc == 2) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        control_show_device (device, reply);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "capture") && argc >= 3) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        return control_capture (device, &argv[2], error);
+    }
+
+    if (g_str_equal (argv[0], "dump") && argc == 3) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        if (!device->capture) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "no capture ring");
+            return FALSE;
+        }
+        return capture_ring_dump (device->capture, argv[2], device->tun_name, error);
+    }
+
+    if (g_str_equal (argv[0], "flows") && (argc == 2 || argc == 3)) {
+        gint n_flows = CONTROL_DEFAULT_FLOWS;
+
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        if (!device->flows) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "no flow table");
+            return FALSE;
+        }
+        if (argc == 3 && !control_parse_int (argv[2], 1, G_MAXINT, &n_flows, error))
+            return FALSE;
+        control_flows (device, n_flows, reply);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "probes") && argc == 2) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        control_probes (device, reply);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "bringup") && argc == 2) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        control_bringup (device, reply);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "buses") && argc == 1) {
+        control_buses (context, reply);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "proxy") && argc == 1) {
+        ProxyStats stats;
+
+        if (!context->proxy) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "no TCP proxy");
+            return FALSE;
+        }
+        proxy_server_get_stats (context->proxy, &stats);
+        g_string_append_printf (reply, "port=%u\n", context->proxy_port);
+        g_string_append_printf (reply, "active=%u\n", stats.active);
+        g_string_append_printf (reply, "accepted=%" G_GUINT64_FORMAT "\n", stats.accepted);
+        g_string_append_printf (reply, "failed=%" G_GUINT64_FORMAT "\n", stats.failed);
+        g_string_append_printf (reply, "bytes-in=%" G_GUINT64_FORMAT "\n", stats.bytes_in);
+        g_string_append_printf (reply, "bytes-out=%" G_GUINT64_FORMAT "\n", stats.bytes_out);
+        return TRUE;
+    }
+
+    if (g_str_equal (argv[0], "set") && argc == 4) {
+        if (!(device = control_lookup_device (context, argv[1], error)))
+            return FALSE;
+        return control_set (context, device, argv[2], argv[3], error);
+    }
+
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "invalid command, see 'help'");
+    return FALSE;
+}
+
+/******************************************************************************/
+/* USB device processing */
+
+/* Failed handshake steps after the protocol probe are retried, as some phones
+ * need a moment before accepting the identification strings. Each step is
+ * retried up to AOA_MAX_RETRIES times, doubling the delay every time. */
+#define AOA_MAX_RETRIES      5
+#define AOA_RETRY_DELAY_MS   5
+
+/* Link options for the phone are appended to the accessory description as
+ * " [key=value ...]", so that phones not knowing about them just show them. */
+static gchar *
+build_accessory_description (Device *device)
+{
+    GString *str;
+    gchar   *host_address;
+
+    str = g_string_new (default_description);
+    /* The accessory comes back at the speed of the candidate device */
+    g_string_append_printf (str, " [batch=%" G_GSIZE_FORMAT,
+                            link_transfer_size (libusb_get_device_speed (device->usb_device)));
+    if (device->settings->compression == COMPRESSION_LZ4)
+        g_string_append_printf (str, " caps=lz4 rate=%" G_GUINT64_FORMAT,
+                                link_rate_from_speed (libusb_get_device_speed (device->usb_device)));
+    if (device->settings->ack_filter && !device->context->bridge)
+        g_string_append (str, " ackfilter=1");
+
+    /* Bridged phones get everything else by DHCP */
+    if (device->context->bridge) {
+        guint8 l2_address[ETH_ALEN];
+
+        device_get_l2_address (device, l2_address);
+        g_string_append_printf (str, " l2=%02x:%02x:%02x:%02x:%02x:%02x]",
+                                l2_address[0], l2_address[1], l2_address[2],
+                                l2_address[3], l2_address[4], l2_address[5]);
+        return g_string_free (str, FALSE);
+    }
+
+    /* Phones fall back to a public DNS server if not given one */
+    host_address = g_strdup_printf ("10.11.%u.1", device->subnet);
+    if (device->context->dns && dns_forwarder_is_listening (device->context->dns, host_address))
+        g_string_append_printf (str, " dns=%s", host_address);
+    g_free (host_address);
+
+    g_string_append_c (str, ']');
+
+    return g_string_free (str, FALSE);
+}
+
+/* AOA handshake
+ *
+ * The protocol probe, the identification strings and the switch request are
+ * sent as a sequence of asynchronous control transfers, handled in the main
+ * loop, so that any number of devices go through it at the same time and a
+ * stuck one doesn't delay the rest. */
+
+#define AOA_CONTROL_TIMEOUT_MS 1000
+
+static const gchar *aoa_step_names[] = {
+    [AOA_STEP_GET_PROTOCOL]      = "protocol probe",
+    [AOA_STEP_SEND_MANUFACTURER] = "manufacturer",
+    [AOA_STEP_SEND_MODEL]        = "model",
+    [AOA_STEP_SEND_DESCRIPTION]  = "description",
+    [AOA_STEP_SEND_VERSION]      = "version",
+    [AOA_STEP_SEND_URL]          = "url",
+    [AOA_STEP_SEND_SERIAL]       = "serial",
+    [AOA_STEP_START]             = "accessory mode switch",
+};
+
+/* Transfer user data; device is cleared if untracked meanwhile, and then the
+ * handle is closed once the transfer is done with it */
+typedef struct {
+    Device *device;
+    gint    usb_fd;
+} AoaRequest;
+
+static void untrack_device (Context     *context,
+                            const gchar *sysfs_path);
+
+static gboolean aoa_step_next (Device *device);
+
+static void LIBUSB_CALL
+aoa_transfer_cb (struct libusb_transfer *transfer)
+{
+    AoaRequest *request = transfer->user_data;
+    Device     *device = request->device;
+
+    if (!device) {
+        libusb_close (transfer->dev_handle);
+        if (request->usb_fd >= 0)
+            close (request->usb_fd);
+        goto out;
+    }
+
+    device->aoa_transfer = NULL;
+    device->aoa_status = transfer->status;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && device->aoa_step == AOA_STEP_GET_PROTOCOL) {
+        guint16 aoa_version;
+
+        if (transfer->actual_length == sizeof (aoa_version)) {
+            memcpy (&aoa_version, libusb_control_transfer_get_data (transfer), sizeof (aoa_version));
+            device->aoa_version = GUINT16_FROM_LE (aoa_version);
+        } else
+            device->aoa_status = LIBUSB_TRANSFER_ERROR;
+    }
+
+    /* Go on from the main loop, outside of libusb event handling */
+    device->timeout_id = g_idle_add ((GSourceFunc) aoa_step_next, device);
+
+out:
+    g_slice_free (AoaRequest, request);
+    libusb_free_transfer (transfer);
+}
+
+static gboolean
+aoa_step_submit (Device *device)
+{
+    struct libusb_transfer *transfer;
+    AoaRequest             *request;
+    guint8                 *buffer;
+    gchar                  *str = NULL;
+    guint8                  request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR;
+    guint8                  request_id = AOA_SEND_IDENT;
+    guint16                 index = 0;
+    gsize                   len = 0;
+    gint                    ret;
+
+    switch (device->aoa_step) {
+    case AOA_STEP_GET_PROTOCOL:
+        request_type = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR;
+        request_id = AOA_GET_PROTOCOL;
+        len = sizeof (guint16);
+        break;
+    case AOA_STEP_SEND_MANUFACTURER:
+        index = AOA_STRING_MAN_ID;
+        str = g_strdup (default_manufacturer);
+        break;
+    case AOA_STEP_SEND_MODEL:
+        index = AOA_STRING_MOD_ID;
+        str = g_strdup (default_model);
+        break;
+    case AOA_STEP_SEND_DESCRIPTION:
+        index = AOA_STRING_DSC_ID;
+        str = build_accessory_description (device);
+        break;
+    case AOA_STEP_SEND_VERSION:
+        index = AOA_STRING_VER_ID;
+        str = g_strdup (default_version);
+        break;
+    case AOA_STEP_SEND_URL:
+        index = AOA_STRING_URL_ID;
+        str = g_strdup (default_url);
+        break;
+    case AOA_STEP_SEND_SERIAL:
+        /* The serial carries the address to use in the phone */
+        index = AOA_STRING_SER_ID;
+        str = g_strdup_printf ("10.11.%u.2", device->subnet);
+        break;
+    case AOA_STEP_START:
+        g_debug ("[%03o,%03o] switching device into accessory mode...", device->busnum, device->devnum);
+        request_id = AOA_START_ACCESSORY;
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+
+    if (str) {
+        g_debug ("[%03o,%03o] sending %s: %s", device->busnum, device->devnum, aoa_step_names[device->aoa_step], str);
+        len = strlen (str) + 1;
+    }
+
+    /* Freed by libusb along with the transfer */
+    if (!(buffer = malloc (LIBUSB_CONTROL_SETUP_SIZE + len))) {
+        g_warning ("[%03o,%03o] couldn't allocate %s request", device->busnum, device->devnum, aoa_step_names[device->aoa_step]);
+        g_free (str);
+        return FALSE;
+    }
+    libusb_fill_control_setup (buffer, request_type, request_id, 0, index, len);
+    if (str)
+        memcpy (&buffer[LIBUSB_CONTROL_SETUP_SIZE], str, len);
+    g_free (str);
+
+    if (!(transfer = libusb_alloc_transfer (0))) {
+        g_warning ("[%03o,%03o] couldn't allocate %s transfer", device->busnum, device->devnum, aoa_step_names[device->aoa_step]);
+        free (buffer);
+        return FALSE;
+    }
+
+    request = g_slice_new0 (AoaRequest);
+    request->device = device;
+    request->usb_fd = -1;
+
+    libusb_fill_control_transfer (transfer, device->usb_handle, buffer, aoa_transfer_cb, request, AOA_CONTROL_TIMEOUT_MS);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    if ((ret = libusb_submit_transfer (transfer)) < 0) {
+        g_warning ("[%03o,%03o] couldn't request %s: %s",
+                   device->busnum, device->devnum, aoa_step_names[device->aoa_step], libusb_strerror (ret));
+        g_slice_free (AoaRequest, request);
+        libusb_free_transfer (transfer);
+        return FALSE;
+    }
+
+    device->aoa_transfer = transfer;
+    return TRUE;
+}
+
+static gboolean
+aoa_step_retry (Device *device)
+{
+    device->timeout_id = 0;
+
+    if (!aoa_step_submit (device)) {
+        device->aoa_step = AOA_STEP_DONE;
+        device_close_usb_handle (device);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+aoa_step_next (Device *device)
+{
+    device->timeout_id = 0;
+
+    if (device->aoa_status != LIBUSB_TRANSFER_COMPLETED) {
+        if (device->aoa_step == AOA_STEP_GET_PROTOCOL) {
+            g_critical ("[%03o,%03o] AOA probing failed: %s",
+                        device->busnum, device->devnum, libusb_error_name (device->aoa_status));
+            untrack_device (device->context, device->sysfs_path);
+            return G_SOURCE_REMOVE;
+        }
+        if (device->aoa_status != LIBUSB_TRANSFER_NO_DEVICE && device->aoa_retries < AOA_MAX_RETRIES) {
+            g_debug ("[%03o,%03o] %s failed: %s, retrying",
+                     device->busnum, device->devnum, aoa_step_names[device->aoa_step], libusb_error_name (device->aoa_status));
+            device->timeout_id = g_timeout_add (AOA_RETRY_DELAY_MS << device->aoa_retries, (GSourceFunc) aoa_step_retry, device);
+            device->aoa_retries++;
+            return G_SOURCE_REMOVE;
+        }
+        g_warning ("[%03o,%03o] accessory initialization failed: %s failed: %s",
+                   device->busnum, device->devnum, aoa_step_names[device->aoa_step], libusb_error_name (device->aoa_status));
+        goto done;
+    }
+
+    /* Each step gets its own retries */
+    device->aoa_retries = 0;
+
+    switch (device->aoa_step) {
+    case AOA_STEP_GET_PROTOCOL:
+        g_message ("[%03o,%03o] device supports AOA %" G_GUINT16_FORMAT, device->busnum, device->devnum, device->aoa_version);
+
+        device->subnet = select_subnet (device->context, device->sysfs_path);
+        if (device->subnet == 0) {
+            g_critical ("[%03o,%03o] subnet allocation failed", device->busnum, device->devnum);
+            goto done;
+        }
+        device->settings = select_settings (device->context, device->sysfs_path, device->vid, device->pid);
+        g_message ("[%03o,%03o] subnet allocated: 10.11.%u.0", device->busnum, device->devnum, device->subnet);
+        device_bringup_mark (device, BRINGUP_AOA_PROBED);
+        break;
+    case AOA_STEP_START:
+        g_debug ("[%03o,%03o] switch requested", device->busnum, device->devnum);
+        device_bringup_mark (device, BRINGUP_AOA_SWITCHED);
+        device_bringup_save (device);
+        goto done;
+    default:
+        break;
+    }
+
+    device->aoa_step++;
+    if (aoa_step_submit (device))
+        return G_SOURCE_REMOVE;
+
+done:
+    device->aoa_step = AOA_STEP_DONE;
+    device_close_usb_handle (device);
+    return G_SOURCE_REMOVE;
+}
+
+/* Gives up on an ongoing handshake, when untracking the device */
+static void
+aoa_handshake_abort (Device *device)
+{
+    AoaRequest *request;
+
+    if (!device->aoa_transfer)
+        return;
+
+    /* The transfer callback closes the handle */
+    request = device->aoa_transfer->user_data;
+    request->device = NULL;
+    request->usb_fd = device->usb_fd;
+    device->usb_handle = NULL;
+    device->usb_fd = -1;
+
+    libusb_cancel_transfer (device->aoa_transfer);
+    device->aoa_transfer = NULL;
+}
+
+static gboolean
+aoa_handshake_start (Device *device)
+{
+    gint ret;
 
     g_debug ("[%03o,%03o] checking AOA support...", device->busnum, device->devnum);
 
-    /* Trying to open supplied device */
-    if ((ret = libusb_open (device->usb_device, &device->usb_handle)) < 0) {
+    /* Trying to open supplied device, unless already done while looking for it */
+    if (!device->usb_handle && (ret = libusb_open (device->usb_device, &device->usb_handle)) < 0) {
         g_critical ("[%03o,%03o] unable to open device: %s", device->busnum, device->devnum, libusb_strerror (ret));
         return FALSE;
     }
@@ -554,99 +4277,164 @@ device_probe_aoa (Device *device)
         g_debug ("[%03o,%03o] kernel driver detached...", device->busnum, device->devnum);
     }
 
-    /* Now ask if device supports AOA protocol */
-    if ((ret = libusb_control_transfer (device->usb_handle,
-                                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-                                        AOA_GET_PROTOCOL,
-                                        0,
-                                        0,
-                                        (uint8_t *) &aoa_version,
-                                        sizeof (aoa_version),
-                                        0)) < 0) {
-        g_critical ("[%03o,%03o] AOA probing failed: %s", device->busnum, device->devnum, libusb_strerror (ret));
-        return FALSE;
-    }
+    device->aoa_step = AOA_STEP_GET_PROTOCOL;
+    return aoa_step_submit (device);
+}
+
+/******************************************************************************/
+/* libusb event handling in the main loop
+ *
+ * Only used for the context running the AOA handshakes; tethering threads
+ * use their own contexts, so that handshake transfer callbacks are always run
+ * in the main thread. */
 
-    aoa_version = GUINT16_FROM_LE (aoa_version);
-    g_message ("[%03o,%03o] device supports AOA %" G_GUINT16_FORMAT, device->busnum, device->devnum, aoa_version);
+typedef struct {
+    GSource         source;
+    libusb_context *usb_context;
+    GHashTable     *fds; /* fd -> tag */
+} UsbSource;
 
-    return TRUE;
+static void
+usb_source_fd_added (gint       fd,
+                     gshort     events,
+                     UsbSource *usb_source)
+{
+    GIOCondition condition = 0;
+    gpointer     tag;
+
+    if (events & POLLIN)
+        condition |= G_IO_IN;
+    if (events & POLLOUT)
+        condition |= G_IO_OUT;
+
+    tag = g_source_add_unix_fd ((GSource *) usb_source, fd, condition | G_IO_ERR | G_IO_HUP);
+    g_hash_table_insert (usb_source->fds, GINT_TO_POINTER (fd), tag);
 }
 
-/******************************************************************************/
-/* Find libusb_device */
+static void
+usb_source_fd_removed (gint       fd,
+                       UsbSource *usb_source)
+{
+    gpointer tag;
 
-static libusb_device *
-find_usb_device (libusb_context *usb_context,
-                 guint           busnum,
-                 guint           devnum)
+    tag = g_hash_table_lookup (usb_source->fds, GINT_TO_POINTER (fd));
+    if (!tag)
+        return;
+
+    g_source_remove_unix_fd ((GSource *) usb_source, tag);
+    g_hash_table_remove (usb_source->fds, GINT_TO_POINTER (fd));
+}
+
+static gboolean
+usb_source_prepare (GSource *source,
+                    gint    *timeout)
 {
-    libusb_device  *found_device = NULL;
-    libusb_device **devices = NULL;
-    ssize_t         n_devices = 0;
-    unsigned int    i;
+    UsbSource      *usb_source = (UsbSource *) source;
+    struct timeval  tv;
 
-    n_devices = libusb_get_device_list (usb_context, &devices);
-    if (!n_devices || !devices) {
-        g_critical ("libusb device enumeration failed");
-        return NULL;
+    /* Only when libusb can't use timerfd */
+    if (libusb_get_next_timeout (usb_source->usb_context, &tv) == 1) {
+        *timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        return (*timeout == 0);
     }
 
-    /* Go over the devices and find the one we want */
-    for (i = 0; !found_device && i < n_devices; i++) {
-        if (libusb_get_bus_number (devices[i]) == busnum &&
-            libusb_get_device_address (devices[i]) == devnum)
-            found_device = libusb_ref_device (devices[i]);
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean
+usb_source_check (GSource *source)
+{
+    UsbSource      *usb_source = (UsbSource *) source;
+    GHashTableIter  iter;
+    gpointer        tag;
+
+    g_hash_table_iter_init (&iter, usb_source->fds);
+    while (g_hash_table_iter_next (&iter, NULL, &tag)) {
+        if (g_source_query_unix_fd (source, tag))
+            return TRUE;
     }
+    return FALSE;
+}
 
-    libusb_free_device_list (devices, 1);
+static gboolean
+usb_source_dispatch (GSource     *source,
+                     GSourceFunc  callback,
+                     gpointer     user_data)
+{
+    UsbSource      *usb_source = (UsbSource *) source;
+    struct timeval  zero = { 0, 0 };
 
-    if (!found_device)
-        g_critical ("libusb device (%03u:%03u) not found", busnum, devnum);
+    libusb_handle_events_timeout_completed (usb_source->usb_context, &zero, NULL);
+    return G_SOURCE_CONTINUE;
+}
 
-    return found_device;
+static void
+usb_source_finalize (GSource *source)
+{
+    UsbSource *usb_source = (UsbSource *) source;
+
+    libusb_set_pollfd_notifiers (usb_source->usb_context, NULL, NULL, NULL);
+    g_hash_table_unref (usb_source->fds);
 }
 
-/******************************************************************************/
-/* Device tracking/untracking */
+static GSourceFuncs usb_source_funcs = {
+    usb_source_prepare,
+    usb_source_check,
+    usb_source_dispatch,
+    usb_source_finalize,
+};
 
-static GList *
-find_device (Context     *context,
-             const gchar *sysfs_path)
+static GSource *
+usb_source_new (libusb_context *usb_context)
 {
-    GList *l;
-
-    for (l = context->tracked_devices; l; l = g_list_next (l)) {
-        if (g_strcmp0 (((Device *) (l->data))->sysfs_path, sysfs_path) == 0) {
-            return l;
-        }
-    }
-    return NULL;
+    UsbSource                  *usb_source;
+    const struct libusb_pollfd **pollfds;
+    guint                        i;
+
+    usb_source = (UsbSource *) g_source_new (&usb_source_funcs, sizeof (UsbSource));
+    usb_source->usb_context = usb_context;
+    usb_source->fds = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    pollfds = libusb_get_pollfds (usb_context);
+    for (i = 0; pollfds && pollfds[i]; i++)
+        usb_source_fd_added (pollfds[i]->fd, pollfds[i]->events, usb_source);
+    libusb_free_pollfds (pollfds);
+
+    libusb_set_pollfd_notifiers (usb_context,
+                                 (libusb_pollfd_added_cb) usb_source_fd_added,
+                                 (libusb_pollfd_removed_cb) usb_source_fd_removed,
+                                 usb_source);
+    return (GSource *) usb_source;
 }
 
+/******************************************************************************/
+/* Device tracking/untracking */
+
 static void
 untrack_device (Context     *context,
                 const gchar *sysfs_path)
 {
-    GList  *l;
     Device *device;
 
-    l = find_device (context, sysfs_path);
-    if (!l)
+    device = g_hash_table_lookup (context->tracked_devices, sysfs_path);
+    if (!device)
         return;
 
-    device = (Device *) (l->data);
     g_message ("device: 0x%04x:0x%04x [%03u:%03u]: untracked (%s)",
                device->vid, device->pid, device->busnum, device->devnum, device->aoa ? "Android Open Accessory" : "candidate");
-    device_free (device);
 
-    context->tracked_devices = g_list_delete_link (context->tracked_devices, l);
+    aoa_handshake_abort (device);
+    g_hash_table_remove (context->tracked_addresses, DEVICE_ADDRESS_KEY (device->busnum, device->devnum));
+    g_hash_table_remove (context->tracked_devices, sysfs_path);
+    device_free (device);
 }
 
 static void
 track_device (Context     *context,
               gboolean     aoa_device,
               const gchar *sysfs_path,
+              const gchar *devnode,
               guint16      vid,
               guint16      pid,
               guint        busnum,
@@ -654,21 +4442,33 @@ track_device (Context     *context,
 {
     Device *device;
 
-    if (find_device (context, sysfs_path)) {
+    if (g_hash_table_contains (context->tracked_devices, sysfs_path)) {
         g_warning ("[%03u:%03u] device already tracked", busnum, devnum);
         return;
     }
 
+    /* Same bus address in a different path: the remove event was missed */
+    device = g_hash_table_lookup (context->tracked_addresses, DEVICE_ADDRESS_KEY (busnum, devnum));
+    if (device) {
+        g_warning ("[%03u:%03u] stale device found at %s", busnum, devnum, device->sysfs_path);
+        untrack_device (context, device->sysfs_path);
+    }
+
     device = g_slice_new0 (Device);
     device->context = context;
     device->sysfs_path = g_strdup (sysfs_path);
+    device->devnode = g_strdup (devnode);
     device->vid = vid;
     device->pid = pid;
     device->busnum = busnum;
     device->devnum = devnum;
     device->aoa = aoa_device;
+    device->usb_fd = -1;
 
-    device->usb_device = find_usb_device (context->usb_context, busnum, devnum);
+    /* Candidates only go through the handshake, run in the main loop */
+    device->usb_device = find_usb_device (aoa_device ? context->usb_context : context->handshake_usb_context,
+                                          devnode, busnum, devnum,
+                                          &device->usb_handle, &device->usb_fd);
     if (!device->usb_device) {
         device_free (device);
         return;
@@ -676,20 +4476,35 @@ track_device (Context     *context,
 
     /* check AOA support before tracking */
     if (!device->aoa) {
-        if (!device_probe_aoa (device)) {
+        device->bringup[BRINGUP_UEVENT] = g_get_monotonic_time ();
+
+        /* Probe and switch to AOA */
+        if (!aoa_handshake_start (device)) {
             device_free (device);
             return;
         }
-
-        /* Schedule switch to AOA */
-        device->timeout_id = g_timeout_add (TIMEOUT_AFTER_PROTOCOL_PROBE_MS, (GSourceFunc) device_setup_aoa, device);
     } else {
-        /* Schedule tethering start */
-        device->timeout_id = g_timeout_add (TIMEOUT_AFTER_PROTOCOL_PROBE_MS, (GSourceFunc) device_setup_tethering, device);
+        gint64 *bringup;
+
+        /* Phases before the switch, if we requested it */
+        bringup = g_hash_table_lookup (context->bringups, sysfs_path);
+        if (bringup &&
+            g_get_monotonic_time () - bringup_start (bringup) < BRINGUP_MAX_SWITCH_S * G_USEC_PER_SEC)
+            memcpy (device->bringup, bringup, sizeof (device->bringup));
+        g_hash_table_remove (context->bringups, sysfs_path);
+        device->bringup[BRINGUP_ACCESSORY] = g_get_monotonic_time ();
+
+        /* The connection thread opens its own handle, in its own context */
+        device_close_usb_handle (device);
+
+        /* Already opened while looking for it, so it's ready: start
+         * tethering right away */
+        device->timeout_id = g_idle_add ((GSourceFunc) device_setup_tethering, device);
     }
 
     /* track */
-    context->tracked_devices = g_list_prepend (context->tracked_devices, device);
+    g_hash_table_insert (context->tracked_devices, device->sysfs_path, device);
+    g_hash_table_insert (context->tracked_addresses, DEVICE_ADDRESS_KEY (busnum, devnum), device);
 
     g_message ("device: 0x%04x:0x%04x [%03u:%03u]: tracked (%s)",
                device->vid, device->pid, device->busnum, device->devnum, device->aoa ? "Android Open Accessory" : "candidate");
@@ -704,6 +4519,8 @@ device_added (Context     *context,
 {
     const gchar *aux;
     const gchar *sysfs_path;
+    const gchar *devnode;
+    gchar       *devnode_fallback = NULL;
     gulong vid = 0, pid = 0, busnum = 0, devnum = 0;
 
     if ((aux = g_udev_device_get_sysfs_attr (device, "idVendor")) != NULL)
@@ -723,109 +4540,509 @@ device_added (Context     *context,
     if ((sysfs_path = g_udev_device_get_sysfs_path (device)) == NULL)
         return;
 
+    if ((devnode = g_udev_device_get_device_file (device)) == NULL)
+        devnode = devnode_fallback = g_strdup_printf ("/dev/bus/usb/%03lu/%03lu", busnum, devnum);
+
     /* Default USB device? */
     if (vid == context->vid && (pid == context->pid || context->pid == 0))
-        track_device (context, FALSE, sysfs_path, vid, pid, busnum, devnum);
+        track_device (context, FALSE, sysfs_path, devnode, vid, pid, busnum, devnum);
+
+    /* AOA device already? */
+    if (vid == AOA_ACCESSORY_VID) {
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (aoa_pids); i++) {
+            if (pid == aoa_pids[i]) {
+                track_device (context, TRUE, sysfs_path, devnode, vid, pid, busnum, devnum);
+                break;
+            }
+        }
+    }
+
+    g_free (devnode_fallback);
+}
+
+static void
+device_removed (Context     *context,
+                GUdevDevice *device)
+{
+    const gchar *sysfs_path;
+
+    sysfs_path = g_udev_device_get_sysfs_path (device);
+    if (!sysfs_path)
+        return;
+
+    untrack_device (context, sysfs_path);
+}
+
+static void
+handle_uevent (GUdevClient *client,
+               const char  *action,
+               GUdevDevice *device,
+               Context     *context)
+{
+    g_debug ("uevent: %s %s", action, g_udev_device_get_sysfs_path (device));
+
+    if (g_strcmp0 (action, "add") == 0) {
+        device_added (context, device);
+        return;
+    }
+
+    if (g_strcmp0 (action, "remove") == 0) {
+        device_removed (context, device);
+        return;
+    }
+}
+
+static void
+initial_list_tethering (Context *context)
+{
+    GList *devices, *l;
+
+    devices = g_udev_client_query_by_subsystem (context->udev, "usb");
+    for (l = devices; l; l = g_list_next (l)) {
+        GUdevDevice *device = G_UDEV_DEVICE (l->data);
+
+        device_added (context, device);
+        g_object_unref (device);
+    }
+}
+
+/******************************************************************************/
+
+static gboolean
+reset_device (guint busnum, guint devnum)
+{
+    gint      fd;
+	gchar    *path;
+    gboolean  reseted = FALSE;
+
+    path = g_strdup_printf ("/dev/bus/usb/%03u/%03u", busnum, devnum);
+
+	fd = open (path, O_WRONLY);
+	if (fd > -1) {
+		if (ioctl (fd, USBDEVFS_RESET, 0) < 0 && errno != ENODEV)
+			g_critical ("[%03u,%03u] failed reseting device: %s", busnum, devnum, g_strerror (errno));
+		else {
+            reseted = TRUE;
+			g_message ("[%03u,%03u] reset device: done", busnum, devnum);
+        }
+		close (fd);
+	} else
+        g_critical ("[%03u,%03u] cannot open %s: %s", busnum, devnum, path, g_strerror (errno));
+
+    g_free (path);
+
+    return reseted;
+}
+
+/******************************************************************************/
+/* Watchdog
+ *
+ * Checks every second that tethered devices still move data: a device whose
+ * OUT transfers keep timing out with nothing going through, or whose
+ * transfers keep failing, is considered stalled. Its forwarding stops right
+ * away, and once a backoff delay (growing with each reset in a row) is over
+ * it is reset, as with --reset. The phone then leaves accessory mode and is
+ * tethered again through hotplug; if it doesn't show up as a new device, it
+ * is probed again. */
+
+#define WATCHDOG_INTERVAL_S      1
+#define WATCHDOG_STALL_S         5
+#define WATCHDOG_MAX_ERRORS      50
+#define WATCHDOG_BACKOFF_MIN_S   1
+#define WATCHDOG_BACKOFF_MAX_S   60
+#define WATCHDOG_HEALTHY_S       60
+#define WATCHDOG_REPROBE_S       5
+
+typedef struct {
+    Context *context;
+    gchar   *sysfs_path;
+    guint    busnum;
+    guint    devnum;
+} WatchdogReset;
+
+static void
+watchdog_reset_free (WatchdogReset *reset)
+{
+    g_free (reset->sysfs_path);
+    g_free (reset);
+}
+
+/* Still the same device, if tracked */
+static Device *
+watchdog_reset_lookup (WatchdogReset *reset)
+{
+    Device *device;
+
+    device = g_hash_table_lookup (reset->context->tracked_devices, reset->sysfs_path);
+    if (!device || device->busnum != reset->busnum || device->devnum != reset->devnum)
+        return NULL;
+    return device;
+}
+
+static gboolean
+watchdog_reprobe_cb (WatchdogReset *reset)
+{
+    Device      *device;
+    GUdevDevice *udev_device;
+
+    /* Only once done with it */
+    device = watchdog_reset_lookup (reset);
+    if (device && g_atomic_int_get (&device->conn_done)) {
+        g_message ("[%03o,%03o] not re-enumerated after reset, probing again", reset->busnum, reset->devnum);
+        untrack_device (reset->context, reset->sysfs_path);
+        udev_device = g_udev_client_query_by_sysfs_path (reset->context->udev, reset->sysfs_path);
+        if (udev_device) {
+            device_added (reset->context, udev_device);
+            g_object_unref (udev_device);
+        }
+    }
+
+    watchdog_reset_free (reset);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+watchdog_reset_thread_func (WatchdogReset *reset)
+{
+    reset_device (reset->busnum, reset->devnum);
+    g_timeout_add_seconds (WATCHDOG_REPROBE_S, (GSourceFunc) watchdog_reprobe_cb, reset);
+    return NULL;
+}
+
+static gboolean
+watchdog_reset_cb (WatchdogReset *reset)
+{
+    /* Unplugged meanwhile */
+    if (!watchdog_reset_lookup (reset)) {
+        watchdog_reset_free (reset);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* The reset may take a while, keep it out of the main loop */
+    g_thread_unref (g_thread_new ("reset", (GThreadFunc) watchdog_reset_thread_func, reset));
+    return G_SOURCE_REMOVE;
+}
+
+static void
+watchdog_fire (Device      *device,
+               const gchar *reason)
+{
+    Context       *context = device->context;
+    WatchdogReset *reset;
+    guint          n_resets;
+    guint          backoff;
+
+    n_resets = GPOINTER_TO_UINT (g_hash_table_lookup (context->watchdog_resets, device->sysfs_path));
+    backoff = MIN (WATCHDOG_BACKOFF_MIN_S << MIN (n_resets, 6), WATCHDOG_BACKOFF_MAX_S);
+    g_hash_table_insert (context->watchdog_resets, g_strdup (device->sysfs_path), GUINT_TO_POINTER (n_resets + 1));
+
+    g_warning ("[%03o,%03o] stalled (%s): resetting in %us", device->busnum, device->devnum, reason, backoff);
+
+    /* Stop forwarding now, instead of retrying on a dead link */
+    device->watchdog_fired = TRUE;
+    g_mutex_lock (&device->mutex);
+    device->halt = TRUE;
+    g_mutex_unlock (&device->mutex);
+
+    reset = g_new0 (WatchdogReset, 1);
+    reset->context = context;
+    reset->sysfs_path = g_strdup (device->sysfs_path);
+    reset->busnum = device->busnum;
+    reset->devnum = device->devnum;
+    g_timeout_add_seconds (backoff, (GSourceFunc) watchdog_reset_cb, reset);
+}
+
+static void
+watchdog_check_device (Device *device,
+                       gint64  now)
+{
+    guint  out_done;
+    guint  out_timeouts;
+    guint  in_done;
+    guint  errors;
+    gchar *reason = NULL;
+
+    out_done = (guint) g_atomic_int_get (&device->out_done);
+    out_timeouts = (guint) g_atomic_int_get (&device->out_timeouts);
+    in_done = (guint) g_atomic_int_get (&device->in_done);
+    errors = (guint) g_atomic_int_get (&device->usb_errors);
+
+    /* OUT timeouts mean there was data for the phone; with nothing going
+     * through since the first one, the link is stalled. If timeouts stop
+     * for longer than a transfer could take, the data was dropped and the
+     * TUN device went idle. */
+    if (out_done != device->last_out_done)
+        device->stall_since = 0;
+    else if (out_timeouts != device->last_out_timeouts) {
+        if (!device->stall_since)
+            device->stall_since = now;
+        device->last_stall_time = now;
+    } else if (device->stall_since &&
+               now - device->last_stall_time > ((gint64) g_atomic_int_get (&device->timeout_ms) + WATCHDOG_INTERVAL_S * 1000) * 1000)
+        device->stall_since = 0;
+
+    /* Backoff starts over once a device works for a while */
+    if ((out_done != device->last_out_done || in_done != device->last_in_done) &&
+        now - device->tethered_time > WATCHDOG_HEALTHY_S * G_USEC_PER_SEC)
+        g_hash_table_remove (device->context->watchdog_resets, device->sysfs_path);
+
+    device->last_out_done = out_done;
+    device->last_out_timeouts = out_timeouts;
+    device->last_in_done = in_done;
+
+    if (device->stall_since && now - device->stall_since >= WATCHDOG_STALL_S * G_USEC_PER_SEC)
+        reason = g_strdup_printf ("no OUT transfer done in %" G_GINT64_FORMAT "s", (now - device->stall_since) / G_USEC_PER_SEC);
+    else if (errors >= WATCHDOG_MAX_ERRORS)
+        reason = g_strdup_printf ("%u USB errors in a row", errors);
+
+    if (reason) {
+        watchdog_fire (device, reason);
+        g_free (reason);
+    }
+}
+
+static gboolean
+watchdog_check_cb (Context *context)
+{
+    GHashTableIter iter;
+    Device        *device;
+    gint64         now;
+
+    now = g_get_monotonic_time ();
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
+        if (device->conn_thread && !device->watchdog_fired && !g_atomic_int_get (&device->conn_done))
+            watchdog_check_device (device, now);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************************************************************************/
+/* Fleet reset
+ *
+ * With --reset, all AOA devices are reset in parallel by a pool of threads, as
+ * each reset blocks until the port is done with it. Each device is then
+ * expected to show up again in the same sysfs path (usually out of accessory
+ * mode) within a deadline counted from its own reset. Resets that don't
+ * return within the same deadline, counted from when their thread started
+ * them (e.g. behind a wedged hub), are given up; their threads are never
+ * waited for. Resets still queued are only given up once the whole pool has
+ * stalled, i.e. no reset has returned within the deadline. */
+
+#define RESET_DEFAULT_PARALLEL   8
+#define RESET_MAX_PARALLEL       64
+#define RESET_DEFAULT_TIMEOUT_S  10
+#define RESET_MAX_TIMEOUT_S      300
+#define RESET_CHECK_INTERVAL_MS  100
+
+typedef enum {
+    RESET_JOB_RESETTING, /* queued or being reset */
+    RESET_JOB_WAITING,   /* reset, waiting for the device to come back */
+    RESET_JOB_BACK,
+    RESET_JOB_FAILED,
+    RESET_JOB_TIMEOUT,
+    RESET_JOB_STUCK,     /* reset not done in time */
+} ResetJobState;
+
+typedef struct _ResetFleet ResetFleet;
+
+typedef struct {
+    ResetFleet    *fleet;
+    gchar         *sysfs_path;
+    guint          busnum;
+    guint          devnum;
+    /* Only set by the pool thread; reset_time may be read once started is
+     * set, reset_ok once it reports back */
+    volatile gint  started;
+    gint64         reset_time;
+    gboolean       reset_ok;
+    /* Only used in the main loop */
+    ResetJobState  state;
+    gboolean       reported;   /* by the pool thread */
+    gboolean       abandoned;  /* left to the pool thread, freed once reported */
+    gboolean       seen_back;  /* may come back before the reset is reported */
+    gint64         back_time;
+    guint16        back_vid;
+    guint16        back_pid;
+} ResetJob;
+
+struct _ResetFleet {
+    GMainLoop *loop;
+    GPtrArray *jobs;
+    guint      n_unresolved;
+    gint64     timeout;        /* us */
+    gint64     last_report;    /* last reset returned, or all queued */
+};
 
-    /* AOA device already? */
-    if (vid == AOA_ACCESSORY_VID) {
-        guint i;
+static const gchar *reset_job_state_names[] = {
+    [RESET_JOB_RESETTING] = "resetting",
+    [RESET_JOB_WAITING]   = "not back",
+    [RESET_JOB_BACK]      = "back",
+    [RESET_JOB_FAILED]    = "reset failed",
+    [RESET_JOB_TIMEOUT]   = "not back",
+    [RESET_JOB_STUCK]     = "not reset",
+};
 
-        for (i = 0; i < G_N_ELEMENTS (aoa_pids); i++) {
-            if (pid == aoa_pids[i]) {
-                track_device (context, TRUE, sysfs_path, vid, pid, busnum, devnum);
-                break;
-            }
-        }
-    }
+static void
+reset_job_free (ResetJob *job)
+{
+    g_free (job->sysfs_path);
+    g_slice_free (ResetJob, job);
 }
 
 static void
-device_removed (Context     *context,
-                GUdevDevice *device)
+reset_job_resolve (ResetJob      *job,
+                   ResetJobState  state)
 {
-    const gchar *sysfs_path;
+    job->state = state;
 
-    sysfs_path = g_udev_device_get_sysfs_path (device);
-    if (!sysfs_path)
-        return;
+    switch (state) {
+    case RESET_JOB_BACK:
+        g_message ("[%03u,%03u] back after %" G_GINT64_FORMAT "ms as %04x:%04x",
+                   job->busnum, job->devnum, (job->back_time - job->reset_time) / 1000, job->back_vid, job->back_pid);
+        break;
+    case RESET_JOB_TIMEOUT:
+        g_warning ("[%03u,%03u] not back after %" G_GINT64_FORMAT "s: %s",
+                   job->busnum, job->devnum, job->fleet->timeout / G_USEC_PER_SEC, job->sysfs_path);
+        break;
+    case RESET_JOB_STUCK:
+        if (g_atomic_int_get (&job->started))
+            g_warning ("[%03u,%03u] not reset after %" G_GINT64_FORMAT "s: %s",
+                       job->busnum, job->devnum, job->fleet->timeout / G_USEC_PER_SEC, job->sysfs_path);
+        else
+            g_warning ("[%03u,%03u] not reset, no reset returned in %" G_GINT64_FORMAT "s: %s",
+                       job->busnum, job->devnum, job->fleet->timeout / G_USEC_PER_SEC, job->sysfs_path);
+        break;
+    default:
+        break;
+    }
 
-    untrack_device (context, sysfs_path);
+    if (--job->fleet->n_unresolved == 0)
+        g_main_loop_quit (job->fleet->loop);
 }
 
-static void
-handle_uevent (GUdevClient *client,
-               const char  *action,
-               GUdevDevice *device,
-               Context     *context)
+/* Reported back to the main loop by the pool thread */
+static gboolean
+reset_job_done_cb (ResetJob *job)
 {
-    g_debug ("uevent: %s %s", action, g_udev_device_get_sysfs_path (device));
+    job->reported = TRUE;
+    job->fleet->last_report = g_get_monotonic_time ();
 
-    if (g_strcmp0 (action, "add") == 0) {
-        device_added (context, device);
-        return;
+    if (job->abandoned) {
+        reset_job_free (job);
+        return G_SOURCE_REMOVE;
     }
 
-    if (g_strcmp0 (action, "remove") == 0) {
-        device_removed (context, device);
-        return;
+    /* Already given up */
+    if (job->state != RESET_JOB_RESETTING)
+        return G_SOURCE_REMOVE;
+
+    if (!job->reset_ok) {
+        reset_job_resolve (job, RESET_JOB_FAILED);
+        return G_SOURCE_REMOVE;
     }
+
+    if (job->seen_back) {
+        reset_job_resolve (job, RESET_JOB_BACK);
+        return G_SOURCE_REMOVE;
+    }
+
+    job->state = RESET_JOB_WAITING;
+    return G_SOURCE_REMOVE;
 }
 
+/* Pool thread */
 static void
-initial_list_tethering (Context *context)
+reset_job_run (ResetJob   *job,
+               ResetFleet *fleet)
 {
-    GList *devices, *l;
+    job->reset_time = g_get_monotonic_time ();
+    g_atomic_int_set (&job->started, TRUE);
+    job->reset_ok = reset_device (job->busnum, job->devnum);
+    g_idle_add ((GSourceFunc) reset_job_done_cb, job);
+}
 
-    devices = g_udev_client_query_by_subsystem (context->udev, "usb");
-    for (l = devices; l; l = g_list_next (l)) {
-        GUdevDevice *device = G_UDEV_DEVICE (l->data);
+static void
+reset_uevent (GUdevClient *client,
+              const char  *action,
+              GUdevDevice *device,
+              ResetFleet  *fleet)
+{
+    const gchar *sysfs_path;
+    const gchar *aux;
+    guint        i;
 
-        device_added (context, device);
-        g_object_unref (device);
+    if (g_strcmp0 (action, "add") != 0 || !(sysfs_path = g_udev_device_get_sysfs_path (device)))
+        return;
+
+    for (i = 0; i < fleet->jobs->len; i++) {
+        ResetJob *job = g_ptr_array_index (fleet->jobs, i);
+
+        if (job->seen_back || !g_str_equal (job->sysfs_path, sysfs_path))
+            continue;
+        if (job->state != RESET_JOB_RESETTING && job->state != RESET_JOB_WAITING)
+            continue;
+
+        job->seen_back = TRUE;
+        job->back_time = g_get_monotonic_time ();
+        if ((aux = g_udev_device_get_sysfs_attr (device, "idVendor")) != NULL)
+            job->back_vid = strtoul (aux, NULL, 16);
+        if ((aux = g_udev_device_get_sysfs_attr (device, "idProduct")) != NULL)
+            job->back_pid = strtoul (aux, NULL, 16);
+
+        /* Otherwise, once the reset is reported */
+        if (job->state == RESET_JOB_WAITING)
+            reset_job_resolve (job, RESET_JOB_BACK);
+        return;
     }
 }
 
-/******************************************************************************/
-
 static gboolean
-reset_device (guint busnum, guint devnum)
+reset_check_cb (ResetFleet *fleet)
 {
-    gint      fd;
-	gchar    *path;
-    gboolean  reseted = FALSE;
-
-    path = g_strdup_printf ("/dev/bus/usb/%03u/%03u", busnum, devnum);
-
-	fd = open (path, O_WRONLY);
-	if (fd > -1) {
-		if (ioctl (fd, USBDEVFS_RESET, 0) < 0 && errno != ENODEV)
-			g_critical ("[%03u,%03u] failed reseting device: %s", busnum, devnum, g_strerror (errno));
-		else {
-            reseted = TRUE;
-			g_message ("[%03u,%03u] reset device: done", busnum, devnum);
-        }
-		close (fd);
-	} else
-        g_critical ("[%03u,%03u] cannot open %s: %s", busnum, devnum, path, g_strerror (errno));
+    gint64 now = g_get_monotonic_time ();
+    guint  i;
 
-    g_free (path);
+    for (i = 0; i < fleet->jobs->len; i++) {
+        ResetJob *job = g_ptr_array_index (fleet->jobs, i);
 
-    return reseted;
+        if (job->state == RESET_JOB_WAITING && now - job->reset_time > fleet->timeout)
+            reset_job_resolve (job, RESET_JOB_TIMEOUT);
+        else if (job->state == RESET_JOB_RESETTING &&
+                 now - (g_atomic_int_get (&job->started) ? job->reset_time : fleet->last_report) > fleet->timeout)
+            reset_job_resolve (job, RESET_JOB_STUCK);
+    }
+    return G_SOURCE_CONTINUE;
 }
 
-static void
-initial_list_reset (Context *context)
+/* Returns TRUE if all the AOA devices were reset and came back */
+static gboolean
+initial_list_reset (Context *context,
+                    guint    n_parallel,
+                    guint    timeout_s)
 {
-    GList *devices, *l;
-    guint n_resets = 0;
+    ResetFleet   fleet = { 0 };
+    GThreadPool *pool;
+    GList       *devices, *l;
+    GError      *error = NULL;
+    gulong       uevent_id;
+    guint        check_id;
+    guint        n_states[RESET_JOB_STUCK + 1] = { 0 };
+    gint64       start;
+    guint        i;
+
+    fleet.jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) reset_job_free);
+    fleet.timeout = (gint64) timeout_s * G_USEC_PER_SEC;
 
     devices = g_udev_client_query_by_subsystem (context->udev, "usb");
     for (l = devices; l; l = g_list_next (l)) {
         GUdevDevice *device = G_UDEV_DEVICE (l->data);
         const gchar *aux;
         gulong vid = 0, pid = 0, busnum = 0, devnum = 0;
-        guint  i;
+        ResetJob *job;
 
         /* Validate AOA VID */
         if ((aux = g_udev_device_get_sysfs_attr (device, "idVendor")) != NULL)
@@ -848,20 +5065,78 @@ initial_list_reset (Context *context)
             busnum = strtoul (aux, NULL, 10);
         if ((aux = g_udev_device_get_sysfs_attr (device, "devnum")) != NULL)
             devnum = strtoul (aux, NULL, 10);
-        if (busnum == 0 || devnum == 0)
+        if (busnum == 0 || devnum == 0 || !g_udev_device_get_sysfs_path (device))
             continue;
 
-        /* Run reset */
-        if (reset_device (busnum, devnum))
-            n_resets++;
-
-        g_object_unref (device);
+        job = g_slice_new0 (ResetJob);
+        job->fleet = &fleet;
+        job->sysfs_path = g_strdup (g_udev_device_get_sysfs_path (device));
+        job->busnum = busnum;
+        job->devnum = devnum;
+        g_ptr_array_add (fleet.jobs, job);
     }
+    g_list_free_full (devices, g_object_unref);
 
-    if (!n_resets)
+    if (!fleet.jobs->len) {
         g_critical ("no AOA devices were reseted");
-    else
-        g_message ("a total of %u AOA devices were reseted", n_resets);
+        g_ptr_array_unref (fleet.jobs);
+        return FALSE;
+    }
+
+    pool = g_thread_pool_new ((GFunc) reset_job_run, &fleet, MIN (n_parallel, fleet.jobs->len), FALSE, &error);
+    if (!pool) {
+        g_critical ("couldn't create reset threads: %s", error->message);
+        g_error_free (error);
+        g_ptr_array_unref (fleet.jobs);
+        return FALSE;
+    }
+
+    g_message ("resetting %u AOA devices, %u at a time", fleet.jobs->len, MIN (n_parallel, fleet.jobs->len));
+
+    /* Watch for devices coming back before the first reset goes out */
+    fleet.loop = g_main_loop_new (NULL, FALSE);
+    uevent_id = g_signal_connect (context->udev, "uevent", G_CALLBACK (reset_uevent), &fleet);
+    check_id = g_timeout_add (RESET_CHECK_INTERVAL_MS, (GSourceFunc) reset_check_cb, &fleet);
+
+    start = g_get_monotonic_time ();
+    fleet.last_report = start;
+    fleet.n_unresolved = fleet.jobs->len;
+    for (i = 0; i < fleet.jobs->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (fleet.jobs, i), NULL);
+
+    g_main_loop_run (fleet.loop);
+
+    /* Queued resets are dropped, and stuck ones not waited for */
+    g_thread_pool_free (pool, TRUE, FALSE);
+    g_source_remove (check_id);
+    g_signal_handler_disconnect (context->udev, uevent_id);
+    g_main_loop_unref (fleet.loop);
+
+    for (i = 0; i < fleet.jobs->len; i++) {
+        ResetJob *job = g_ptr_array_index (fleet.jobs, i);
+
+        n_states[job->state]++;
+        g_message ("[%03u,%03u] %s: %s", job->busnum, job->devnum, job->sysfs_path, reset_job_state_names[job->state]);
+    }
+    g_message ("a total of %u AOA devices were reseted in %" G_GINT64_FORMAT "ms: %u back, %u failed, %u not back, %u not reset",
+               fleet.jobs->len, (g_get_monotonic_time () - start) / 1000,
+               n_states[RESET_JOB_BACK], n_states[RESET_JOB_FAILED], n_states[RESET_JOB_TIMEOUT], n_states[RESET_JOB_STUCK]);
+
+    /* Jobs not reported yet may still be used by their threads; those that
+     * were still queued are just forgotten, as the process is done */
+    g_ptr_array_set_free_func (fleet.jobs, NULL);
+    for (i = 0; i < fleet.jobs->len; i++) {
+        ResetJob *job = g_ptr_array_index (fleet.jobs, i);
+
+        if (job->reported)
+            reset_job_free (job);
+        else
+            job->abandoned = TRUE;
+    }
+
+    i = fleet.jobs->len;
+    g_ptr_array_unref (fleet.jobs);
+    return (n_states[RESET_JOB_BACK] == i);
 }
 
 /******************************************************************************/
@@ -869,8 +5144,33 @@ initial_list_reset (Context *context)
 /* General context */
 static gchar    *vid_str;
 static gchar    *pid_str;
-static gchar    *interface_str;
+static gchar   **interface_strv;
+static gchar    *bridge_str;
+static gchar    *uplink_policy_str;
+static gchar    *compression_str;
+static gchar    *config_str;
+static gchar    *dns_upstream_str;
+static gboolean  no_dns_flag;
+static gboolean  ack_filter_flag;
+static gboolean  clamp_mss_flag;
+static gchar    *cpus_str;
+static gchar    *sched_policy_str;
+static gint      sched_priority_int;
+static gboolean  mlock_flag;
+static gchar    *control_str;
+static gint      busy_poll_int;
+static gint      capture_int;
+static gint      flows_int;
+static gint      probe_interval_int = PROBE_DEFAULT_INTERVAL_MS;
+static gint      rate_down_int;
+static gint      rate_up_int;
+static gchar    *uplink_capacity_str;
+static gboolean  userspace_nat_flag;
+static gint      tcp_proxy_int;
+static gboolean  no_watchdog_flag;
 static gboolean  reset_flag;
+static gint      reset_parallel_int = RESET_DEFAULT_PARALLEL;
+static gint      reset_timeout_int = RESET_DEFAULT_TIMEOUT_S;
 static gboolean  syslog_flag;
 static gboolean  version_flag;
 static gboolean  help_flag;
@@ -878,12 +5178,11 @@ static gboolean  help_flag;
 static gboolean
 quit_cb (Context *context)
 {
-    GList *l;
-
-    for (l = context->tracked_devices; l; l = g_list_next (l)) {
-        Device *device;
+    GHashTableIter iter;
+    Device        *device;
 
-        device = (Device *)(l->data);
+    g_hash_table_iter_init (&iter, context->tracked_devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device)) {
         g_mutex_lock (&device->mutex);
         device->halt = TRUE;
         g_mutex_unlock (&device->mutex);
@@ -903,10 +5202,102 @@ static GOptionEntry tethering_entries[] = {
       "Device USB product ID (optional)",
       "[PID]"
     },
-    { "interface", 'i', 0, G_OPTION_ARG_STRING, &interface_str,
-      "Network interface (mandatory)",
+    { "interface", 'i', 0, G_OPTION_ARG_STRING_ARRAY, &interface_strv,
+      "Network interface (mandatory); repeat or comma-separate for several uplinks",
       "[IFACE]"
     },
+    { "bridge", 0, 0, G_OPTION_ARG_STRING, &bridge_str,
+      "Bridge phones into the LAN through the given bridge, instead of --interface",
+      "[BRIDGE]"
+    },
+    { "uplink-policy", 'u', 0, G_OPTION_ARG_STRING, &uplink_policy_str,
+      "How to spread devices across uplinks (round-robin|least-loaded)",
+      "[POLICY]"
+    },
+    { "compression", 'c', 0, G_OPTION_ARG_STRING, &compression_str,
+      "Link compression, if supported by the phone (none|lz4)",
+      "[METHOD]"
+    },
+    { "ack-filter", 'a', 0, G_OPTION_ARG_NONE, &ack_filter_flag,
+      "Let the phone drop TCP ACKs superseded by newer ones",
+      NULL
+    },
+    { "clamp-mss", 0, 0, G_OPTION_ARG_NONE, &clamp_mss_flag,
+      "Clamp the MSS of TCP connections to fit the TUN and uplink MTUs",
+      NULL
+    },
+    { "config", 'f', 0, G_OPTION_ARG_FILENAME, &config_str,
+      "Per-device settings file",
+      "[FILE]"
+    },
+    { "dns-upstream", 'd', 0, G_OPTION_ARG_STRING, &dns_upstream_str,
+      "Upstream DNS server (default: from /etc/resolv.conf)",
+      "[ADDR]"
+    },
+    { "no-dns", 'n', 0, G_OPTION_ARG_NONE, &no_dns_flag,
+      "Don't run the caching DNS forwarder",
+      NULL
+    },
+    { "userspace-nat", 0, 0, G_OPTION_ARG_NONE, &userspace_nat_flag,
+      "Translate TCP and UDP in the forwarding threads (single Ethernet uplink)",
+      NULL
+    },
+    { "tcp-proxy", 0, 0, G_OPTION_ARG_INT, &tcp_proxy_int,
+      "Terminate TCP connections of the phones in the host, relaying them from the given local port",
+      "[PORT]"
+    },
+    { "no-watchdog", 0, 0, G_OPTION_ARG_NONE, &no_watchdog_flag,
+      "Don't reset devices that stop moving data",
+      NULL
+    },
+    { "control", 'C', 0, G_OPTION_ARG_FILENAME, &control_str,
+      "Listen for control commands in the given unix socket",
+      "[PATH]"
+    },
+    { "cpus", 0, 0, G_OPTION_ARG_STRING, &cpus_str,
+      "Pin forwarding threads to the given CPUs (e.g. 2,3 or 0-1), or to the ones of the USB controller (irq|node)",
+      "[LIST]"
+    },
+    { "sched-policy", 0, 0, G_OPTION_ARG_STRING, &sched_policy_str,
+      "Forwarding threads scheduling policy (other|fifo|rr)",
+      "[POLICY]"
+    },
+    { "sched-priority", 0, 0, G_OPTION_ARG_INT, &sched_priority_int,
+      "Forwarding threads real-time priority (default: policy minimum)",
+      "[PRIO]"
+    },
+    { "busy-poll", 0, 0, G_OPTION_ARG_INT, &busy_poll_int,
+      "Busy-poll in a single forwarding thread, blocking after USECS idle",
+      "[USECS]"
+    },
+    { "rate-down", 0, 0, G_OPTION_ARG_INT, &rate_down_int,
+      "Limit the traffic to each phone, in kbit/s",
+      "[KBPS]"
+    },
+    { "rate-up", 0, 0, G_OPTION_ARG_INT, &rate_up_int,
+      "Limit the traffic from each phone, in kbit/s",
+      "[KBPS]"
+    },
+    { "uplink-capacity", 0, 0, G_OPTION_ARG_STRING, &uplink_capacity_str,
+      "Share the given uplink capacity across active phones, in kbit/s",
+      "[DOWN[/UP]]"
+    },
+    { "capture", 0, 0, G_OPTION_ARG_INT, &capture_int,
+      "Keep the headers of the last RECORDS packets of each device, see --control",
+      "[RECORDS]"
+    },
+    { "flows", 0, 0, G_OPTION_ARG_INT, &flows_int,
+      "Account bytes and packets of up to ENTRIES flows of each device, see --control",
+      "[ENTRIES]"
+    },
+    { "probe-interval", 0, 0, G_OPTION_ARG_INT, &probe_interval_int,
+      "Measure the link round trip time every MS milliseconds, 0 to disable (default: " G_STRINGIFY (PROBE_DEFAULT_INTERVAL_MS) ")",
+      "[MS]"
+    },
+    { "mlock", 0, 0, G_OPTION_ARG_NONE, &mlock_flag,
+      "Lock all process memory, so that forwarding never waits on page faults",
+      NULL
+    },
     { NULL }
 };
 
@@ -915,6 +5306,14 @@ static GOptionEntry reset_entries[] = {
       "Reset AOA devices",
       NULL
     },
+    { "reset-parallel", 0, 0, G_OPTION_ARG_INT, &reset_parallel_int,
+      "Reset up to N devices at a time (default: " G_STRINGIFY (RESET_DEFAULT_PARALLEL) ")",
+      "[N]"
+    },
+    { "reset-timeout", 0, 0, G_OPTION_ARG_INT, &reset_timeout_int,
+      "Wait up to SECS for each device to come back (default: " G_STRINGIFY (RESET_DEFAULT_TIMEOUT_S) ")",
+      "[SECS]"
+    },
     { NULL }
 };
 
@@ -964,6 +5363,7 @@ process_input_args (int argc, char **argv, Context *context)
     GOptionContext *option_context;
     GOptionGroup   *group;
     gulong          aux;
+    guint           i;
 
     /* Setup option context, process it and destroy it */
     option_context = g_option_context_new ("- Reverse tethering");
@@ -991,6 +5391,11 @@ process_input_args (int argc, char **argv, Context *context)
 
     /* Validate options in tethering mode */
     if (context->action == ACTION_TETHERING) {
+        if (reset_parallel_int != RESET_DEFAULT_PARALLEL)
+            g_printerr ("warning: --reset-parallel is ignored without --reset\n");
+        if (reset_timeout_int != RESET_DEFAULT_TIMEOUT_S)
+            g_printerr ("warning: --reset-timeout is ignored without --reset\n");
+
         if (!vid_str) {
             g_printerr ("error: --vid is mandatory\n");
             exit (EXIT_FAILURE);
@@ -1012,21 +5417,226 @@ process_input_args (int argc, char **argv, Context *context)
             context->pid = (guint16) aux;
         }
 
-        if (!interface_str) {
+        if (!interface_strv && !bridge_str) {
             g_printerr ("error: --interface is mandatory\n");
             exit (EXIT_FAILURE);
         }
-        context->interface = g_strdup (interface_str);
+        if (interface_strv && bridge_str) {
+            g_printerr ("error: --interface and --bridge are mutually exclusive\n");
+            exit (EXIT_FAILURE);
+        }
+
+        context->uplinks = g_ptr_array_new_with_free_func ((GDestroyNotify) uplink_free);
+        /* Bridged traffic leaves through the bridge itself */
+        if (bridge_str) {
+            context->bridge = g_strdup (bridge_str);
+            g_ptr_array_add (context->uplinks, uplink_new (bridge_str));
+        }
+        for (i = 0; interface_strv && interface_strv[i]; i++) {
+            gchar **names;
+            guint   j;
+
+            names = g_strsplit (interface_strv[i], ",", -1);
+            for (j = 0; names[j]; j++) {
+                g_strstrip (names[j]);
+                if (!names[j][0])
+                    continue;
+                if (uplink_lookup (context, names[j])) {
+                    g_printerr ("error: --interface given twice: '%s'\n", names[j]);
+                    exit (EXIT_FAILURE);
+                }
+                g_ptr_array_add (context->uplinks, uplink_new (names[j]));
+            }
+            g_strfreev (names);
+        }
+        if (context->uplinks->len == 0) {
+            g_printerr ("error: --interface is mandatory\n");
+            exit (EXIT_FAILURE);
+        }
+
+        if (uplink_policy_str && !parse_uplink_policy (uplink_policy_str, &context->uplink_policy)) {
+            g_printerr ("error: invalid --uplink-policy value given: '%s'\n", uplink_policy_str);
+            exit (EXIT_FAILURE);
+        }
+
+        if (compression_str) {
+            if (!parse_compression (compression_str, &context->default_settings.compression)) {
+                g_printerr ("error: invalid --compression value given: '%s'\n", compression_str);
+                exit (EXIT_FAILURE);
+            }
+            if (context->default_settings.compression == COMPRESSION_LZ4 && !link_lz4_supported ()) {
+                g_printerr ("error: LZ4 compression not supported in this build\n");
+                exit (EXIT_FAILURE);
+            }
+        }
+
+        context->default_settings.ack_filter = ack_filter_flag;
+        context->default_settings.clamp_mss = clamp_mss_flag;
+
+        if (cpus_str) {
+            if (!parse_cpus (cpus_str, &context->default_settings)) {
+                g_printerr ("error: invalid --cpus value given: '%s'\n", cpus_str);
+                exit (EXIT_FAILURE);
+            }
+        }
+
+        context->default_settings.sched_policy = SCHED_OTHER;
+        if (sched_policy_str && !parse_sched_policy (sched_policy_str, &context->default_settings.sched_policy)) {
+            g_printerr ("error: invalid --sched-policy value given: '%s'\n", sched_policy_str);
+            exit (EXIT_FAILURE);
+        }
+
+        if (sched_priority_int) {
+            gint policy = context->default_settings.sched_policy;
+
+            if (policy == SCHED_OTHER) {
+                g_printerr ("error: --sched-priority requires --sched-policy=fifo|rr\n");
+                exit (EXIT_FAILURE);
+            }
+            if (sched_priority_int < sched_get_priority_min (policy) ||
+                sched_priority_int > sched_get_priority_max (policy)) {
+                g_printerr ("error: invalid --sched-priority value given: '%d' (%d-%d)\n",
+                            sched_priority_int, sched_get_priority_min (policy), sched_get_priority_max (policy));
+                exit (EXIT_FAILURE);
+            }
+            context->default_settings.sched_priority = sched_priority_int;
+        }
+
+        if (busy_poll_int < 0) {
+            g_printerr ("error: invalid --busy-poll value given: '%d'\n", busy_poll_int);
+            exit (EXIT_FAILURE);
+        }
+        context->default_settings.busy_poll_us = busy_poll_int;
+
+        if (capture_int < 0) {
+            g_printerr ("error: invalid --capture value given: '%d'\n", capture_int);
+            exit (EXIT_FAILURE);
+        }
+        context->default_settings.capture_records = capture_int;
+
+        if (flows_int < 0) {
+            g_printerr ("error: invalid --flows value given: '%d'\n", flows_int);
+            exit (EXIT_FAILURE);
+        }
+        context->default_settings.flow_entries = flows_int;
+
+        if (probe_interval_int < 0 || probe_interval_int > PROBE_MAX_INTERVAL_MS) {
+            g_printerr ("error: invalid --probe-interval value given: '%d' (0-%d)\n", probe_interval_int, PROBE_MAX_INTERVAL_MS);
+            exit (EXIT_FAILURE);
+        }
+        context->default_settings.probe_interval_ms = probe_interval_int;
+
+        if (!parse_rate (rate_down_int, &context->default_settings.rate[SHAPER_DOWN])) {
+            g_printerr ("error: invalid --rate-down value given: '%d' (0-%d)\n", rate_down_int, SHAPER_MAX_KBPS);
+            exit (EXIT_FAILURE);
+        }
+        if (!parse_rate (rate_up_int, &context->default_settings.rate[SHAPER_UP])) {
+            g_printerr ("error: invalid --rate-up value given: '%d' (0-%d)\n", rate_up_int, SHAPER_MAX_KBPS);
+            exit (EXIT_FAILURE);
+        }
+        context->default_settings.weight = 1;
+
+        if (uplink_capacity_str && !parse_uplink_capacity (uplink_capacity_str, context->capacity)) {
+            g_printerr ("error: invalid --uplink-capacity value given: '%s'\n", uplink_capacity_str);
+            exit (EXIT_FAILURE);
+        }
+
+        if (userspace_nat_flag && bridge_str) {
+            g_printerr ("error: --userspace-nat and --bridge are mutually exclusive\n");
+            exit (EXIT_FAILURE);
+        }
+
+        if (tcp_proxy_int < 0 || tcp_proxy_int > G_MAXUINT16) {
+            g_printerr ("error: invalid --tcp-proxy value given: '%d'\n", tcp_proxy_int);
+            exit (EXIT_FAILURE);
+        }
+        if (tcp_proxy_int && (userspace_nat_flag || bridge_str)) {
+            g_printerr ("error: --tcp-proxy can't be used with --userspace-nat or --bridge\n");
+            exit (EXIT_FAILURE);
+        }
+        context->proxy_port = tcp_proxy_int;
+
+        if (userspace_nat_flag && context->uplinks->len > 1) {
+            g_printerr ("error: --userspace-nat needs a single --interface\n");
+            exit (EXIT_FAILURE);
+        }
+
+        if (dns_upstream_str && no_dns_flag) {
+            g_printerr ("error: --dns-upstream and --no-dns are mutually exclusive\n");
+            exit (EXIT_FAILURE);
+        }
+
+        if (config_str) {
+            GError *error = NULL;
+
+            context->config = g_key_file_new ();
+            if (!g_key_file_load_from_file (context->config, config_str, G_KEY_FILE_NONE, &error)) {
+                g_printerr ("error: couldn't load --config file: %s\n", error->message);
+                exit (EXIT_FAILURE);
+            }
+        }
     }
 
     /* Validate options in reset mode */
     if (context->action == ACTION_RESET) {
+        if (reset_parallel_int < 1 || reset_parallel_int > RESET_MAX_PARALLEL) {
+            g_printerr ("error: invalid --reset-parallel value given: '%d' (1-%d)\n", reset_parallel_int, RESET_MAX_PARALLEL);
+            exit (EXIT_FAILURE);
+        }
+        if (reset_timeout_int < 1 || reset_timeout_int > RESET_MAX_TIMEOUT_S) {
+            g_printerr ("error: invalid --reset-timeout value given: '%d' (1-%d)\n", reset_timeout_int, RESET_MAX_TIMEOUT_S);
+            exit (EXIT_FAILURE);
+        }
         if (vid_str)
             g_printerr ("warning: --vid is ignored when using --reset\n");
         if (pid_str)
             g_printerr ("warning: --pid is ignored when using --reset\n");
-        if (interface_str)
+        if (interface_strv)
             g_printerr ("warning: --interface is ignored when using --reset\n");
+        if (bridge_str)
+            g_printerr ("warning: --bridge is ignored when using --reset\n");
+        if (uplink_policy_str)
+            g_printerr ("warning: --uplink-policy is ignored when using --reset\n");
+        if (compression_str)
+            g_printerr ("warning: --compression is ignored when using --reset\n");
+        if (ack_filter_flag)
+            g_printerr ("warning: --ack-filter is ignored when using --reset\n");
+        if (clamp_mss_flag)
+            g_printerr ("warning: --clamp-mss is ignored when using --reset\n");
+        if (config_str)
+            g_printerr ("warning: --config is ignored when using --reset\n");
+        if (dns_upstream_str)
+            g_printerr ("warning: --dns-upstream is ignored when using --reset\n");
+        if (no_dns_flag)
+            g_printerr ("warning: --no-dns is ignored when using --reset\n");
+        if (userspace_nat_flag)
+            g_printerr ("warning: --userspace-nat is ignored when using --reset\n");
+        if (tcp_proxy_int)
+            g_printerr ("warning: --tcp-proxy is ignored when using --reset\n");
+        if (no_watchdog_flag)
+            g_printerr ("warning: --no-watchdog is ignored when using --reset\n");
+        if (cpus_str)
+            g_printerr ("warning: --cpus is ignored when using --reset\n");
+        if (sched_policy_str)
+            g_printerr ("warning: --sched-policy is ignored when using --reset\n");
+        if (sched_priority_int)
+            g_printerr ("warning: --sched-priority is ignored when using --reset\n");
+        if (busy_poll_int)
+            g_printerr ("warning: --busy-poll is ignored when using --reset\n");
+        if (capture_int)
+            g_printerr ("warning: --capture is ignored when using --reset\n");
+        if (flows_int)
+            g_printerr ("warning: --flows is ignored when using --reset\n");
+        if (probe_interval_int != PROBE_DEFAULT_INTERVAL_MS)
+            g_printerr ("warning: --probe-interval is ignored when using --reset\n");
+        if (rate_down_int || rate_up_int)
+            g_printerr ("warning: --rate-down and --rate-up are ignored when using --reset\n");
+        if (uplink_capacity_str)
+            g_printerr ("warning: --uplink-capacity is ignored when using --reset\n");
+        if (mlock_flag)
+            g_printerr ("warning: --mlock is ignored when using --reset\n");
+        if (control_str)
+            g_printerr ("warning: --control is ignored when using --reset\n");
     }
 
     g_option_context_free (option_context);
@@ -1036,10 +5646,8 @@ process_input_args (int argc, char **argv, Context *context)
 /* Logging */
 
 static void
-log_handler (const gchar    *log_domain,
-             GLogLevelFlags  level,
-             const gchar    *message,
-             gpointer        unused)
+log_output (GLogLevelFlags  level,
+            const gchar    *message)
 {
     gint         syslog_priority;
     gboolean     out_stderr = FALSE;
@@ -1086,9 +5694,19 @@ log_handler (const gchar    *log_domain,
         g_print ("%s %s\n", prefix, message);
 }
 
+static void
+log_handler (const gchar    *log_domain,
+             GLogLevelFlags  level,
+             const gchar    *message,
+             gpointer        unused)
+{
+    log_output (level, message);
+}
+
 static void
 teardown_log (void)
 {
+    log_ring_stop ();
     if (syslog_flag)
         closelog ();
 }
@@ -1100,6 +5718,9 @@ setup_log (void)
         openlog ("g-simple-rt", LOG_CONS | LOG_PID | LOG_PERROR, LOG_DAEMON);
 
     g_log_set_handler (NULL, G_LOG_LEVEL_MASK, log_handler, NULL);
+
+    /* Data path messages go through the logging thread */
+    log_ring_start (log_output);
 }
 
 /******************************************************************************/
@@ -1108,11 +5729,19 @@ int main (int argc, char **argv)
 {
     static const gchar *subsystems[] = { "usb/usb_device", NULL };
     Context             context;
+    gint                status = EXIT_SUCCESS;
 
     /* Setup application context */
     memset (&context, 0, sizeof (context));
     libusb_init (&context.usb_context);
+    libusb_init (&context.handshake_usb_context);
     context.subnets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    context.settings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) device_settings_free);
+    context.tracked_devices = g_hash_table_new (g_str_hash, g_str_equal);
+    context.tracked_addresses = g_hash_table_new (g_direct_hash, g_direct_equal);
+    context.watchdog_resets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    context.bringups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    context.usb_hubs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) usb_hub_free);
     context.next_subnet = 1;
 
     /* Process input options */
@@ -1128,6 +5757,71 @@ int main (int argc, char **argv)
         g_unix_signal_add (SIGTERM, (GSourceFunc) quit_cb, &context);
         g_unix_signal_add (SIGHUP,  (GSourceFunc) quit_cb, &context);
 
+        /* Also covers the stacks of threads created later on */
+        if (mlock_flag && mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+            g_warning ("couldn't lock process memory: %s", g_strerror (errno));
+
+        /* DNS forwarder for all tethered devices; bridged ones use the
+         * one in the LAN */
+        if (!no_dns_flag && !context.bridge) {
+            GError *error = NULL;
+
+            context.dns = dns_forwarder_new (dns_upstream_str, &error);
+            if (!context.dns) {
+                g_critical ("couldn't setup DNS forwarder: %s", error->message);
+                g_error_free (error);
+                return EXIT_FAILURE;
+            }
+            g_message ("DNS forwarder upstream: %s", dns_forwarder_get_upstream (context.dns));
+        }
+
+        if (control_str) {
+            GError *error = NULL;
+
+            context.control = control_server_new (control_str, (ControlCommandFunc) control_command, &context, &error);
+            if (!context.control) {
+                g_critical ("couldn't setup control socket: %s", error->message);
+                g_error_free (error);
+                return EXIT_FAILURE;
+            }
+        }
+
+        /* Uplink state and load, when there are several to choose from */
+        if (context.uplinks->len > 1) {
+            guint i;
+
+            for (i = 0; i < context.uplinks->len; i++) {
+                Uplink *uplink = g_ptr_array_index (context.uplinks, i);
+
+                uplink_update (uplink, 0);
+                g_message ("uplink %s is %s", uplink->name, uplink->up ? "up" : "down");
+            }
+            context.uplink_check_id = g_timeout_add_seconds (UPLINK_CHECK_INTERVAL_S, (GSourceFunc) uplink_check_cb, &context);
+        } else
+            ((Uplink *) g_ptr_array_index (context.uplinks, 0))->up = TRUE;
+
+        if (context.capacity[SHAPER_DOWN] || context.capacity[SHAPER_UP])
+            context.share_check_id = g_timeout_add (SHARE_CHECK_INTERVAL_MS, (GSourceFunc) share_check_cb, &context);
+
+        if (userspace_nat_flag && !nat_setup (&context))
+            return EXIT_FAILURE;
+
+        if (context.proxy_port && !proxy_setup (&context))
+            return EXIT_FAILURE;
+
+        if (!no_watchdog_flag)
+            context.watchdog_check_id = g_timeout_add_seconds (WATCHDOG_INTERVAL_S, (GSourceFunc) watchdog_check_cb, &context);
+
+        context.hub_check_id = g_timeout_add_seconds (HUB_CHECK_INTERVAL_S, (GSourceFunc) hub_check_cb, &context);
+
+        /* Clamping may also be enabled per device in the config file */
+        if (clamp_mss_flag || context.config)
+            context.mss_check_id = g_timeout_add_seconds (MSS_CHECK_INTERVAL_S, (GSourceFunc) mss_check_cb, &context);
+
+        /* AOA handshakes run in the main loop */
+        context.handshake_usb_source = usb_source_new (context.handshake_usb_context);
+        g_source_attach (context.handshake_usb_source, NULL);
+
         /* Setup udev monitoring for any kind of usb device */
         context.udev = g_udev_client_new ((const gchar * const *) subsystems);
         g_signal_connect (context.udev, "uevent", G_CALLBACK (handle_uevent), &context);
@@ -1140,22 +5834,54 @@ int main (int argc, char **argv)
         goto out;
     }
 
-    /* Reset action */
+    /* Reset action; devices are watched while they come back */
     if (context.action == ACTION_RESET) {
-        context.udev = g_udev_client_new (NULL);
-        initial_list_reset (&context);
+        context.udev = g_udev_client_new ((const gchar * const *) subsystems);
+        if (!initial_list_reset (&context, reset_parallel_int, reset_timeout_int))
+            status = EXIT_FAILURE;
         goto out;
     }
 
     g_assert_not_reached ();
 
  out:
-    g_free (context.interface);
+    if (context.uplink_check_id)
+        g_source_remove (context.uplink_check_id);
+    if (context.share_check_id)
+        g_source_remove (context.share_check_id);
+    if (context.nat)
+        nat_teardown (&context);
+    if (context.proxy)
+        proxy_teardown (&context);
+    if (context.watchdog_check_id)
+        g_source_remove (context.watchdog_check_id);
+    if (context.mss_check_id)
+        g_source_remove (context.mss_check_id);
+    if (context.hub_check_id)
+        g_source_remove (context.hub_check_id);
     g_hash_table_unref (context.subnets);
+    g_hash_table_unref (context.settings);
+    g_hash_table_unref (context.tracked_devices);
+    g_hash_table_unref (context.tracked_addresses);
+    g_hash_table_unref (context.watchdog_resets);
+    g_hash_table_unref (context.bringups);
+    g_hash_table_unref (context.usb_hubs);
+    g_free (context.bridge);
+    if (context.config)
+        g_key_file_free (context.config);
+    if (context.dns)
+        dns_forwarder_free (context.dns);
+    if (context.control)
+        control_server_free (context.control);
     g_object_unref (context.udev);
+    if (context.handshake_usb_source) {
+        g_source_destroy (context.handshake_usb_source);
+        g_source_unref (context.handshake_usb_source);
+    }
+    libusb_exit (context.handshake_usb_context);
     libusb_exit (context.usb_context);
 
     teardown_log ();
 
-    return EXIT_SUCCESS;
+    return status;
 }